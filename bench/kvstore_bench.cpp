@@ -0,0 +1,739 @@
+// Function-level benchmarks for the store and the protocol layer. Every
+// benchmark reports allocs/op, counted by the global operator new below.
+#include "concurrent_kvstore.hpp"
+#include "kvstore.hpp"
+#include "repl.hpp"
+#include "resp.hpp"
+#include <algorithm>
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace
+{
+    std::atomic<uint64_t> allocations{0};
+}
+
+// Kept out of line: inlined, GCC pairs malloc with delete and free with
+// new and warns about the mismatch.
+[[gnu::noinline]] void *operator new(std::size_t n)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(n == 0 ? 1 : n))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace
+{
+    // Publishes the allocations made while it is alive, minus excluded
+    // stretches, as an average per iteration.
+    class AllocationCounter
+    {
+    public:
+        explicit AllocationCounter(benchmark::State &state) : state(state), start(allocations.load()) {}
+
+        ~AllocationCounter()
+        {
+            double n = static_cast<double>(allocations.load() - start - excluded);
+            state.counters["allocs/op"] = benchmark::Counter(n, benchmark::Counter::kAvgIterations);
+        }
+
+        // Brackets untimed setup inside the loop, together with PauseTiming.
+        void exclude_begin() { excluded_start = allocations.load(); }
+        void exclude_end() { excluded += allocations.load() - excluded_start; }
+
+    private:
+        benchmark::State &state;
+        uint64_t start;
+        uint64_t excluded = 0;
+        uint64_t excluded_start = 0;
+    };
+
+    const std::string VALUE(64, 'v');
+
+    // Keys in a fixed shuffled order, so lookups don't walk the table in
+    // insertion order.
+    const std::vector<std::string> &keys(std::size_t n, const char *prefix)
+    {
+        static std::map<std::pair<std::size_t, std::string>, std::vector<std::string>> cache;
+        auto &out = cache[{n, prefix}];
+        if (out.empty())
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                out.push_back(prefix + std::to_string(i));
+            }
+            std::shuffle(out.begin(), out.end(), std::mt19937_64(42));
+        }
+        return out;
+    }
+
+    // One populated store per key-space size, shared by the benchmarks that
+    // only read it or overwrite keys in place.
+    tr::KVStore &store(std::size_t n)
+    {
+        static std::map<std::size_t, std::unique_ptr<tr::KVStore>> cache;
+        auto &db = cache[n];
+        if (!db)
+        {
+            db = std::make_unique<tr::KVStore>();
+            for (const std::string &k : keys(n, "key:"))
+            {
+                db->set(k, VALUE);
+            }
+            for (const std::string &k : keys(n, "counter:"))
+            {
+                db->set(k, "0");
+            }
+        }
+        return *db;
+    }
+
+    void key_space_args(benchmark::internal::Benchmark *b)
+    {
+        b->RangeMultiplier(32)->Range(1 << 10, 1 << 20);
+    }
+
+    void BM_Set(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        tr::KVStore &db = store(n);
+        const auto &ks = keys(n, "key:");
+        std::size_t i = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            db.set(ks[i], VALUE);
+            i = i + 1 == n ? 0 : i + 1;
+        }
+    }
+    BENCHMARK(BM_Set)->Apply(key_space_args);
+
+    void BM_Get(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        tr::KVStore &db = store(n);
+        const auto &ks = keys(n, "key:");
+        std::size_t i = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(db.get(ks[i]));
+            i = i + 1 == n ? 0 : i + 1;
+        }
+    }
+    BENCHMARK(BM_Get)->Apply(key_space_args);
+
+    void BM_Read(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        tr::KVStore &db = store(n);
+        const auto &ks = keys(n, "key:");
+        std::size_t i = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            db.read(ks[i], [](std::string_view value) { benchmark::DoNotOptimize(value.data()); });
+            i = i + 1 == n ? 0 : i + 1;
+        }
+    }
+    BENCHMARK(BM_Read)->Apply(key_space_args);
+
+    // MGET of 50 keys; items/s compares with BM_Read's iterations/s.
+    void BM_ReadMany(benchmark::State &state)
+    {
+        constexpr std::size_t BATCH = 50;
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        tr::KVStore &db = store(n);
+        const auto &ks = keys(n, "key:");
+        std::vector<std::string_view> views(ks.begin(), ks.end());
+        std::size_t i = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            db.read_many(std::span(views).subspan(i, BATCH), [](std::optional<std::string_view> value)
+                         { benchmark::DoNotOptimize(value); });
+            i = i + 2 * BATCH > n ? 0 : i + BATCH;
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * BATCH));
+    }
+    BENCHMARK(BM_ReadMany)->Apply(key_space_args);
+
+    void BM_GetMiss(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        tr::KVStore &db = store(n);
+        const auto &ks = keys(n, "missing:");
+        std::size_t i = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(db.get(ks[i]));
+            i = i + 1 == n ? 0 : i + 1;
+        }
+    }
+    BENCHMARK(BM_GetMiss)->Apply(key_space_args);
+
+    // Deletes every key of a private store, refilling it untimed whenever
+    // it runs dry.
+    void BM_Del(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        const auto &ks = keys(n, "key:");
+        tr::KVStore db;
+        for (const std::string &k : ks)
+        {
+            db.set(k, VALUE);
+        }
+        std::size_t i = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(db.del(ks[i]));
+            if (++i == n)
+            {
+                state.PauseTiming();
+                allocs.exclude_begin();
+                for (const std::string &k : ks)
+                {
+                    db.set(k, VALUE);
+                }
+                allocs.exclude_end();
+                state.ResumeTiming();
+                i = 0;
+            }
+        }
+    }
+    BENCHMARK(BM_Del)->Apply(key_space_args);
+
+    // Grows a fresh store to n keys per iteration and reports the slowest
+    // single SET, which is where a table resize would show up.
+    void BM_SetGrowing(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        const auto &ks = keys(n, "key:");
+        std::chrono::steady_clock::duration worst{};
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            tr::KVStore db;
+            for (const std::string &k : ks)
+            {
+                auto start = std::chrono::steady_clock::now();
+                db.set(k, VALUE);
+                worst = std::max(worst, std::chrono::steady_clock::now() - start);
+            }
+        }
+        state.counters["worst_set_us"] = std::chrono::duration<double, std::micro>(worst).count();
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+    BENCHMARK(BM_SetGrowing)->Arg(1 << 20)->Arg(1 << 22)->Unit(benchmark::kMillisecond);
+
+    // SETs of new keys into a store held at maxmemory, so every one evicts.
+    template <tr::EvictionPolicy policy>
+    void BM_SetEvicting(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        const auto &ks = keys(n, "key:");
+        const auto &fresh = keys(n, "fresh:");
+        tr::KVStore db;
+        for (const std::string &k : ks)
+        {
+            db.set(k, VALUE);
+            db.expire(k, 3600);
+        }
+        db.set_maxmemory(db.used_memory(), policy);
+        std::size_t i = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            db.set(fresh[i], VALUE);
+            db.expire(fresh[i], 3600);
+            db.evict();
+            i = i + 1 == n ? 0 : i + 1;
+        }
+    }
+    BENCHMARK(BM_SetEvicting<tr::EvictionPolicy::AllKeysLru>)->Arg(1 << 20);
+    BENCHMARK(BM_SetEvicting<tr::EvictionPolicy::AllKeysLfu>)->Arg(1 << 20);
+    BENCHMARK(BM_SetEvicting<tr::EvictionPolicy::VolatileTtl>)->Arg(1 << 20);
+
+    // Replaces keys with values of mixed sizes, as a cache under churn sees
+    // them, and reports the slab bytes held per byte stored at the end.
+    void BM_SetDelChurn(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        const auto &ks = keys(n, "key:");
+        std::vector<std::string> values;
+        for (std::size_t size = 16; size <= 1024; size += 24)
+        {
+            values.emplace_back(size, 'v');
+        }
+        tr::KVStore db;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            db.set(ks[i], values[i % values.size()]);
+        }
+        std::size_t i = 0, v = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            db.del(ks[i]);
+            db.set(ks[(i + n / 2) % n], values[v]);
+            i = i + 1 == n ? 0 : i + 1;
+            v = v + 7 >= values.size() ? v + 7 - values.size() : v + 7;
+        }
+        const tr::SlabAllocator::Stats &slab = tr::SlabAllocator::local().stats();
+        state.counters["slab_overhead"] = static_cast<double>(slab.reserved) / static_cast<double>(slab.used);
+    }
+    BENCHMARK(BM_SetDelChurn)->Arg(1 << 20);
+
+    void BM_Incrby(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        tr::KVStore &db = store(n);
+        const auto &ks = keys(n, "counter:");
+        std::size_t i = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(db.incrby(ks[i], 1));
+            i = i + 1 == n ? 0 : i + 1;
+        }
+    }
+    BENCHMARK(BM_Incrby)->Apply(key_space_args);
+
+    void BM_Expire(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        tr::KVStore &db = store(n);
+        const auto &ks = keys(n, "key:");
+        std::size_t i = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(db.expire(ks[i], 3600));
+            i = i + 1 == n ? 0 : i + 1;
+        }
+    }
+    BENCHMARK(BM_Expire)->Apply(key_space_args);
+
+    void BM_Ttl(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        tr::KVStore &db = store(n);
+        const auto &ks = keys(n, "key:");
+        for (std::size_t k = 0; k < n; k += 2)
+        {
+            db.expire(ks[k], 3600); // half the keys carry a deadline
+        }
+        std::size_t i = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(db.ttl(ks[i]));
+            i = i + 1 == n ? 0 : i + 1;
+        }
+    }
+    BENCHMARK(BM_Ttl)->Apply(key_space_args);
+
+    // A job queue: RPUSH at the tail and LPOP at the head of a list kept at
+    // the given length, which should not affect the cost of either.
+    void BM_ListQueue(benchmark::State &state)
+    {
+        tr::KVStore db;
+        std::string job(32, 'j');
+        std::vector<std::string_view> push = {job};
+        for (int64_t k = 0; k < state.range(0); ++k)
+        {
+            db.rpush("queue", push);
+        }
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            db.rpush("queue", push);
+            db.lpop("queue", 1, [](std::string_view v) { benchmark::DoNotOptimize(v.data()); });
+        }
+    }
+    BENCHMARK(BM_ListQueue)->Arg(16)->Arg(1 << 16)->Arg(1 << 20);
+
+    // LRANGE of the given length out of the middle of a 100k-entry list.
+    void BM_Lrange(benchmark::State &state)
+    {
+        tr::KVStore db;
+        std::string item(16, 'i');
+        std::vector<std::string_view> push = {item};
+        for (int k = 0; k < 100000; ++k)
+        {
+            db.rpush("list", push);
+        }
+        std::size_t bytes = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            db.lrange("list", 50000, 50000 + state.range(0) - 1, [&](std::string_view v) { bytes += v.size(); });
+        }
+        benchmark::DoNotOptimize(bytes);
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+    BENCHMARK(BM_Lrange)->Arg(10)->Arg(100)->Arg(1000);
+
+    // Two tag sets of integer ids, of the sizes given, drawn from four times
+    // as many ids as the larger has, so about a quarter of the smaller
+    // matches. Sorted, so building the IntSets appends.
+    std::vector<std::set<int64_t>> tag_sets(const benchmark::State &state)
+    {
+        std::minstd_rand rng(1);
+        std::vector<std::set<int64_t>> sets(2);
+        uint64_t range = 4 * static_cast<uint64_t>(std::max(state.range(0), state.range(1)));
+        for (std::size_t i = 0; i < 2; ++i)
+        {
+            while (sets[i].size() < static_cast<std::size_t>(state.range(i)))
+            {
+                sets[i].insert(static_cast<int64_t>(rng() % range));
+            }
+        }
+        return sets;
+    }
+
+    // SINTER of two IntSets: SIMD merges at equal sizes, galloping search
+    // when one is much the larger.
+    void BM_SinterIntSet(benchmark::State &state)
+    {
+        tr::KVStore db;
+        db.set_set_limits({.max_intset_entries = 1 << 20});
+        std::size_t empty = db.used_memory();
+        std::vector<std::string_view> keys = {"tag:a", "tag:b"};
+        auto sets = tag_sets(state);
+        for (std::size_t i = 0; i < 2; ++i)
+        {
+            for (int64_t id : sets[i])
+            {
+                std::string member = std::to_string(id);
+                std::vector<std::string_view> add = {member};
+                db.sadd(keys[i], add);
+            }
+        }
+        std::size_t members = sets[0].size() + sets[1].size();
+        state.counters["bytes/member"] = static_cast<double>(db.used_memory() - empty) / static_cast<double>(members);
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(db.set_op(tr::KVStore::SetOp::Inter, keys)->size());
+        }
+        state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(members));
+    }
+    BENCHMARK(BM_SinterIntSet)->Args({1000, 1000})->Args({100000, 100000})->Args({100, 100000});
+
+    // The same intersection over std::unordered_set<std::string>, probing
+    // the larger set with each member of the smaller.
+    void BM_SinterUnorderedSet(benchmark::State &state)
+    {
+        std::vector<std::unordered_set<std::string>> sets(2);
+        auto ids = tag_sets(state);
+        for (std::size_t i = 0; i < 2; ++i)
+        {
+            for (int64_t id : ids[i])
+            {
+                sets[i].insert(std::to_string(id));
+            }
+        }
+        const auto &small = sets[0].size() <= sets[1].size() ? sets[0] : sets[1];
+        const auto &large = sets[0].size() <= sets[1].size() ? sets[1] : sets[0];
+        std::vector<std::string_view> common;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            common.clear();
+            for (const std::string &member : small)
+            {
+                if (large.count(member) != 0)
+                {
+                    common.push_back(member);
+                }
+            }
+            benchmark::DoNotOptimize(common.data());
+        }
+        state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(ids[0].size() + ids[1].size()));
+    }
+    BENCHMARK(BM_SinterUnorderedSet)->Args({1000, 1000})->Args({100000, 100000})->Args({100, 100000});
+
+    // A leaderboard of the given size: 128 members stay packed, more are
+    // indexed by the hash and skiplist.
+    tr::KVStore &leaderboard(std::size_t n)
+    {
+        static std::map<std::size_t, std::unique_ptr<tr::KVStore>> cache;
+        auto &db = cache[n];
+        if (!db)
+        {
+            db = std::make_unique<tr::KVStore>();
+            std::minstd_rand rng(1);
+            for (const std::string &player : keys(n, "player:"))
+            {
+                std::pair<double, std::string_view> item{static_cast<double>(rng() % 1000000), player};
+                db->zadd("board", std::span(&item, 1), {});
+            }
+        }
+        return *db;
+    }
+
+    void zset_args(benchmark::internal::Benchmark *b)
+    {
+        b->Arg(128)->Arg(1 << 16)->Arg(1 << 20);
+    }
+
+    // ZINCRBY of a random player, which moves it through the order.
+    void BM_Zincrby(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        tr::KVStore &db = leaderboard(n);
+        const auto &players = keys(n, "player:");
+        std::minstd_rand rng(2);
+        tr::ZAddOptions incr;
+        incr.incr = true;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            std::pair<double, std::string_view> item{static_cast<double>(rng() % 1000), players[rng() % n]};
+            benchmark::DoNotOptimize(db.zadd("board", std::span(&item, 1), incr));
+        }
+    }
+    BENCHMARK(BM_Zincrby)->Apply(zset_args);
+
+    // ZREVRANK of a random player, then the ten above it, as a leaderboard
+    // page does.
+    void BM_ZrankAndPage(benchmark::State &state)
+    {
+        std::size_t n = static_cast<std::size_t>(state.range(0));
+        tr::KVStore &db = leaderboard(n);
+        const auto &players = keys(n, "player:");
+        std::minstd_rand rng(3);
+        std::size_t bytes = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            std::size_t rank = *db.zrank("board", players[rng() % n], true);
+            std::size_t first = rank < 10 ? 0 : rank - 10;
+            db.zrange("board", first, rank - first, true, [&](std::string_view m, double) { bytes += m.size(); });
+        }
+        benchmark::DoNotOptimize(bytes);
+    }
+    BENCHMARK(BM_ZrankAndPage)->Apply(zset_args);
+
+    // A 95% GET, 5% SET mix from every thread against one store shared by
+    // all of them: the lock-free ConcurrentKVStore, and for comparison a
+    // KVStore behind a single mutex. Reported per thread, so flat times
+    // mean reads scale with threads.
+    constexpr std::size_t SHARED_KEYS = 1 << 16;
+
+    template <typename Store>
+    Store &shared_store()
+    {
+        static Store *db = []
+        {
+            auto *created = new Store();
+            for (const std::string &k : keys(SHARED_KEYS, "key:"))
+            {
+                created->set(k, VALUE);
+            }
+            return created;
+        }();
+        return *db;
+    }
+
+    struct LockedKVStore
+    {
+        std::mutex lock;
+        tr::KVStore db;
+
+        void set(std::string_view key, std::string_view value)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            db.set(key, value);
+        }
+
+        template <typename F>
+        bool read(std::string_view key, F &&f)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return db.read(key, f);
+        }
+    };
+
+    template <typename Store>
+    void BM_SharedReadMostly(benchmark::State &state)
+    {
+        Store &db = shared_store<Store>();
+        const auto &ks = keys(SHARED_KEYS, "key:");
+        std::size_t i = static_cast<std::size_t>(state.thread_index()) * 7919 % SHARED_KEYS;
+        unsigned op = 0;
+        for (auto _ : state)
+        {
+            if (++op == 20)
+            {
+                op = 0;
+                db.set(ks[i], VALUE);
+            }
+            else
+            {
+                db.read(ks[i], [](std::string_view value) { benchmark::DoNotOptimize(value.data()); });
+            }
+            i = i + 1 == SHARED_KEYS ? 0 : i + 1;
+        }
+    }
+    BENCHMARK(BM_SharedReadMostly<tr::ConcurrentKVStore>)->ThreadRange(1, 8)->UseRealTime();
+    BENCHMARK(BM_SharedReadMostly<LockedKVStore>)->ThreadRange(1, 8)->UseRealTime();
+
+    // `frames` alternating SET/GET commands, back to back as a client would
+    // pipeline them.
+    std::vector<std::string> pipelined_frames(int frames)
+    {
+        std::vector<std::string> out;
+        for (int i = 0; i < frames; ++i)
+        {
+            std::string key = "key:" + std::to_string(i);
+            if (i % 2 == 0)
+            {
+                out.push_back("*3\r\n$3\r\nSET\r\n$" + std::to_string(key.size()) + "\r\n" + key + "\r\n$64\r\n" + VALUE + "\r\n");
+            }
+            else
+            {
+                out.push_back("*2\r\n$3\r\nGET\r\n$" + std::to_string(key.size()) + "\r\n" + key + "\r\n");
+            }
+        }
+        return out;
+    }
+
+    void BM_ParseRespArray(benchmark::State &state)
+    {
+        std::vector<std::string> frames = pipelined_frames(static_cast<int>(state.range(0)));
+        std::vector<std::string> args;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            for (const std::string &frame : frames)
+            {
+                std::size_t consumed = 0;
+                args.clear();
+                benchmark::DoNotOptimize(tr::parse_resp_array(frame, consumed, args));
+            }
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+    BENCHMARK(BM_ParseRespArray)->Arg(1)->Arg(16)->Arg(128);
+
+    // The zero-copy parser the server uses, over the same frames in one
+    // contiguous buffer.
+    void BM_RespParserPipelined(benchmark::State &state)
+    {
+        std::string input;
+        for (const std::string &frame : pipelined_frames(static_cast<int>(state.range(0))))
+        {
+            input += frame;
+        }
+        tr::RespParser parser;
+        std::vector<std::string_view> args;
+        args.reserve(512);
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            std::string_view rest(input);
+            while (!rest.empty())
+            {
+                std::size_t consumed = 0;
+                args.clear();
+                parser.parse(rest, consumed, args);
+                rest.remove_prefix(consumed);
+            }
+            benchmark::DoNotOptimize(args.data());
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+    BENCHMARK(BM_RespParserPipelined)->Arg(1)->Arg(16)->Arg(128);
+
+    void BM_ParseLine(benchmark::State &state)
+    {
+        const std::string line = "SET key:12345 " + VALUE;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(tr::parse_line(line));
+        }
+    }
+    BENCHMARK(BM_ParseLine);
+
+    enum class Reply
+    {
+        Simple,
+        Integer,
+        Bulk,
+        LargeBulk,
+        Error
+    };
+
+    // Encodes one reply per iteration; the buffer is handed to a pretend
+    // socket every 64 replies, as a flush after a pipelined batch would.
+    template <Reply kind>
+    void BM_EncodeReply(benchmark::State &state)
+    {
+        tr::ReplyBuffer out;
+        const std::string large(tr::ReplyBuffer::LARGE_BULK, 'v');
+        int pending = 0;
+        AllocationCounter allocs(state);
+        for (auto _ : state)
+        {
+            switch (kind)
+            {
+            case Reply::Simple:
+                out.simple("OK");
+                break;
+            case Reply::Integer:
+                out.integer(1234567);
+                break;
+            case Reply::Bulk:
+                out.bulk(std::string_view(VALUE));
+                break;
+            case Reply::LargeBulk:
+                out.bulk(std::string(large));
+                break;
+            case Reply::Error:
+                out.error("value is not an integer or out of range");
+                break;
+            }
+            if (++pending == 64)
+            {
+                out.consume(out.size());
+                pending = 0;
+            }
+        }
+    }
+    BENCHMARK(BM_EncodeReply<Reply::Simple>);
+    BENCHMARK(BM_EncodeReply<Reply::Integer>);
+    BENCHMARK(BM_EncodeReply<Reply::Bulk>);
+    BENCHMARK(BM_EncodeReply<Reply::LargeBulk>);
+    BENCHMARK(BM_EncodeReply<Reply::Error>);
+}
+
+BENCHMARK_MAIN();
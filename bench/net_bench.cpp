@@ -0,0 +1,213 @@
+// Compares the server backends on one pipelined SET/GET workload. Each backend
+// runs in a forked child on its own port while this process drives the load.
+#include "server.hpp"
+#include <arpa/inet.h>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        int connections = 50;
+        int pipeline = 32;
+        long requests = 1000000;
+        std::size_t value_size = 64;
+        uint16_t port = 6390;
+    };
+
+    // Counts complete RESP replies in a byte stream that may end mid-reply.
+    class ReplyCounter
+    {
+    public:
+        long feed(const char *data, std::size_t n)
+        {
+            pending.append(data, n);
+            long complete = 0;
+            std::size_t pos = 0;
+            for (;;)
+            {
+                std::size_t crlf = pending.find("\r\n", pos);
+                if (crlf == std::string::npos)
+                    break;
+                std::size_t end = crlf + 2;
+                if (pending[pos] == '$')
+                {
+                    long len = std::stol(pending.substr(pos + 1, crlf - pos - 1));
+                    if (len >= 0)
+                    {
+                        end += static_cast<std::size_t>(len) + 2;
+                        if (end > pending.size())
+                            break;
+                    }
+                }
+                pos = end;
+                ++complete;
+            }
+            pending.erase(0, pos);
+            return complete;
+        }
+
+    private:
+        std::string pending;
+    };
+
+    std::string command(std::initializer_list<std::string> args)
+    {
+        std::string out = "*" + std::to_string(args.size()) + "\r\n";
+        for (const std::string &a : args)
+        {
+            out += "$" + std::to_string(a.size()) + "\r\n" + a + "\r\n";
+        }
+        return out;
+    }
+
+    int connect_to(uint16_t port)
+    {
+        for (int attempt = 0; attempt < 200; ++attempt)
+        {
+            int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            ::inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+            if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0)
+            {
+                int yes = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                return fd;
+            }
+            ::close(fd);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return -1;
+    }
+
+    // Every connection sends a batch of `pipeline` commands, then all replies
+    // are drained before the next round, so both backends see the same traffic.
+    double drive(const Options &opt, uint16_t port)
+    {
+        std::vector<int> fds;
+        for (int i = 0; i < opt.connections; ++i)
+        {
+            int fd = connect_to(port);
+            if (fd < 0)
+            {
+                std::cerr << "could not connect to port " << port << "\n";
+                return 0;
+            }
+            fds.push_back(fd);
+        }
+
+        std::string value(opt.value_size, 'x');
+        std::vector<std::string> batches;
+        for (int c = 0; c < opt.connections; ++c)
+        {
+            std::string batch;
+            for (int i = 0; i < opt.pipeline; ++i)
+            {
+                std::string key = "key:" + std::to_string(c) + ":" + std::to_string(i);
+                batch += (i % 2 == 0) ? command({"SET", key, value}) : command({"GET", key});
+            }
+            batches.push_back(std::move(batch));
+        }
+
+        long per_round = static_cast<long>(opt.connections) * opt.pipeline;
+        long rounds = std::max(1L, opt.requests / per_round);
+        std::vector<ReplyCounter> counters(fds.size());
+        char buf[64 * 1024];
+        auto start = std::chrono::steady_clock::now();
+        for (long r = 0; r < rounds; ++r)
+        {
+            for (std::size_t c = 0; c < fds.size(); ++c)
+            {
+                const std::string &batch = batches[c];
+                std::size_t sent = 0;
+                while (sent < batch.size())
+                {
+                    ssize_t n = ::write(fds[c], batch.data() + sent, batch.size() - sent);
+                    if (n <= 0)
+                        return 0;
+                    sent += static_cast<std::size_t>(n);
+                }
+            }
+            for (std::size_t c = 0; c < fds.size(); ++c)
+            {
+                long got = 0;
+                while (got < opt.pipeline)
+                {
+                    ssize_t n = ::read(fds[c], buf, sizeof(buf));
+                    if (n <= 0)
+                        return 0;
+                    got += counters[c].feed(buf, static_cast<std::size_t>(n));
+                }
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        for (int fd : fds)
+        {
+            ::close(fd);
+        }
+        return static_cast<double>(rounds * per_round) / elapsed.count();
+    }
+
+    double run_backend(const Options &opt, tr::Backend backend, uint16_t port)
+    {
+        pid_t pid = ::fork();
+        if (pid == 0)
+        {
+            // Keep the server's startup chatter out of the report.
+            std::cout.setstate(std::ios::failbit);
+            tr::ServerConfig config;
+            config.port = port;
+            config.backend = backend;
+            ::_exit(tr::run_server(config));
+        }
+        double ops = drive(opt, port);
+        ::kill(pid, SIGTERM);
+        ::waitpid(pid, nullptr, 0);
+        return ops;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+        if (arg == "--connections")
+            opt.connections = std::stoi(argv[i + 1]);
+        else if (arg == "--pipeline")
+            opt.pipeline = std::stoi(argv[i + 1]);
+        else if (arg == "--requests")
+            opt.requests = std::stol(argv[i + 1]);
+        else if (arg == "--value-size")
+            opt.value_size = std::stoul(argv[i + 1]);
+        else if (arg == "--port")
+            opt.port = static_cast<uint16_t>(std::stoi(argv[i + 1]));
+        else
+        {
+            std::cerr << "usage: tinyredis_net_bench [--connections N] [--pipeline N] [--requests N] [--value-size N] [--port N]\n";
+            return 1;
+        }
+    }
+
+    std::cout << opt.connections << " connections, pipeline " << opt.pipeline << ", "
+              << opt.requests << " requests, " << opt.value_size << "-byte values\n";
+    double epoll_ops = run_backend(opt, tr::Backend::Epoll, opt.port);
+    std::cout << "epoll  " << static_cast<long>(epoll_ops) << " ops/sec\n";
+    double uring_ops = run_backend(opt, tr::Backend::Uring, static_cast<uint16_t>(opt.port + 1));
+    std::cout << "uring  " << static_cast<long>(uring_ops) << " ops/sec\n";
+    return 0;
+}
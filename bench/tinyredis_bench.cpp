@@ -0,0 +1,663 @@
+// Load generator for a running tinyredis_server. Connections are spread over
+// a few client threads, each with its own epoll loop, and issue a weighted
+// mix of GET/SET/INCRBY/EXPIRE over a fixed key space.
+//
+// With --rate the load is open-loop: every request has a scheduled start
+// time, and its latency is measured from that time rather than from when it
+// was actually written. A server stall therefore shows up in the percentiles
+// of every request that should have gone out during it, instead of quietly
+// slowing the generator down (coordinated omission).
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    enum Op
+    {
+        OP_GET,
+        OP_SET,
+        OP_INCRBY,
+        OP_EXPIRE,
+        OP_COUNT
+    };
+
+    constexpr std::array<std::string_view, OP_COUNT> OP_NAMES = {"get", "set", "incrby", "expire"};
+
+    struct Options
+    {
+        std::string host = "127.0.0.1";
+        uint16_t port = 6380;
+        int connections = 50;
+        int threads = 1;
+        int pipeline = 1;
+        long requests = 1000000;
+        long keyspace = 100000;
+        std::size_t value_size = 64;
+        double rate = 0; // total requests per second; 0 runs closed-loop
+        bool preload = true;
+        std::array<int, OP_COUNT> weights = {80, 20, 0, 0};
+    };
+
+    uint64_t now_ns()
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                         std::chrono::steady_clock::now().time_since_epoch())
+                                         .count());
+    }
+
+    // Log-linear latency histogram: 64 linear sub-buckets per power of two,
+    // so every recorded value is kept to within about 1.5%.
+    class Histogram
+    {
+    public:
+        void record(uint64_t ns)
+        {
+            ++counts[index(ns)];
+            ++total;
+            sum += ns;
+            max = std::max(max, ns);
+        }
+
+        void merge(const Histogram &other)
+        {
+            for (std::size_t i = 0; i < counts.size(); ++i)
+            {
+                counts[i] += other.counts[i];
+            }
+            total += other.total;
+            sum += other.sum;
+            max = std::max(max, other.max);
+        }
+
+        uint64_t count() const { return total; }
+        uint64_t maximum() const { return max; }
+        double mean() const { return total == 0 ? 0 : static_cast<double>(sum) / static_cast<double>(total); }
+
+        uint64_t percentile(double q) const
+        {
+            if (total == 0)
+            {
+                return 0;
+            }
+            uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q / 100.0 * static_cast<double>(total) + 0.5));
+            uint64_t seen = 0;
+            for (std::size_t i = 0; i < counts.size(); ++i)
+            {
+                seen += counts[i];
+                if (seen >= rank)
+                {
+                    return std::min(highest(i), max);
+                }
+            }
+            return max;
+        }
+
+    private:
+        static std::size_t index(uint64_t v)
+        {
+            if (v < 128)
+            {
+                return static_cast<std::size_t>(v);
+            }
+            int shift = std::bit_width(v) - 7;
+            return static_cast<std::size_t>(64 * shift) + static_cast<std::size_t>(v >> shift);
+        }
+
+        // Largest value that lands in bucket i.
+        static uint64_t highest(std::size_t i)
+        {
+            if (i < 128)
+            {
+                return i;
+            }
+            int shift = static_cast<int>(i / 64) - 1;
+            uint64_t low = static_cast<uint64_t>(i - 64 * static_cast<std::size_t>(shift)) << shift;
+            return low + (uint64_t{1} << shift) - 1;
+        }
+
+        std::array<uint64_t, 64 * 64> counts{};
+        uint64_t total = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+    };
+
+    // Counts complete RESP replies in a byte stream that may end mid-reply.
+    // Every command in the mix answers with a single non-array reply.
+    class ReplyScanner
+    {
+    public:
+        long feed(const char *data, std::size_t n, long &errors)
+        {
+            pending.append(data, n);
+            long complete = 0;
+            std::size_t pos = 0;
+            for (;;)
+            {
+                std::size_t crlf = pending.find("\r\n", pos);
+                if (crlf == std::string::npos)
+                    break;
+                std::size_t end = crlf + 2;
+                if (pending[pos] == '$')
+                {
+                    long long len = 0;
+                    std::from_chars(pending.data() + pos + 1, pending.data() + crlf, len);
+                    if (len >= 0)
+                    {
+                        end += static_cast<std::size_t>(len) + 2;
+                        if (end > pending.size())
+                            break;
+                    }
+                }
+                else if (pending[pos] == '-')
+                {
+                    ++errors;
+                }
+                pos = end;
+                ++complete;
+            }
+            pending.erase(0, pos);
+            return complete;
+        }
+
+    private:
+        std::string pending;
+    };
+
+    void append_command(std::string &out, std::initializer_list<std::string_view> args)
+    {
+        char num[24];
+        out += '*';
+        out.append(num, std::to_chars(num, num + sizeof(num), args.size()).ptr);
+        out += "\r\n";
+        for (std::string_view a : args)
+        {
+            out += '$';
+            out.append(num, std::to_chars(num, num + sizeof(num), a.size()).ptr);
+            out += "\r\n";
+            out.append(a);
+            out += "\r\n";
+        }
+    }
+
+    int connect_to(const Options &opt)
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(opt.port);
+        if (::inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr) <= 0 ||
+            ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+        {
+            std::cerr << "connect to " << opt.host << ":" << opt.port << " failed: " << std::strerror(errno) << "\n";
+            ::close(fd);
+            return -1;
+        }
+        int yes = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        return fd;
+    }
+
+    bool write_fully(int fd, const std::string &bytes)
+    {
+        std::size_t sent = 0;
+        while (sent < bytes.size())
+        {
+            ssize_t n = ::write(fd, bytes.data() + sent, bytes.size() - sent);
+            if (n <= 0)
+                return false;
+            sent += static_cast<std::size_t>(n);
+        }
+        return true;
+    }
+
+    // SETs every key once, in pipelined batches, so GETs hit.
+    bool preload(const Options &opt)
+    {
+        int fd = connect_to(opt);
+        if (fd < 0)
+        {
+            return false;
+        }
+        std::string value(opt.value_size, 'x');
+        ReplyScanner scanner;
+        long errors = 0;
+        char buf[64 * 1024];
+        constexpr long BATCH = 1000;
+        for (long first = 0; first < opt.keyspace; first += BATCH)
+        {
+            long n = std::min(BATCH, opt.keyspace - first);
+            std::string batch;
+            for (long k = first; k < first + n; ++k)
+            {
+                append_command(batch, {"SET", "key:" + std::to_string(k), value});
+            }
+            if (!write_fully(fd, batch))
+            {
+                ::close(fd);
+                return false;
+            }
+            long got = 0;
+            while (got < n)
+            {
+                ssize_t r = ::read(fd, buf, sizeof(buf));
+                if (r <= 0)
+                {
+                    ::close(fd);
+                    return false;
+                }
+                got += scanner.feed(buf, static_cast<std::size_t>(r), errors);
+            }
+        }
+        ::close(fd);
+        return true;
+    }
+
+    struct Client
+    {
+        int fd = -1;
+        std::string out;
+        std::size_t out_pos = 0;
+        ReplyScanner scanner;
+        std::deque<std::pair<uint64_t, Op>> inflight; // start time and command of each unanswered request
+        uint64_t next_due = 0;                        // open-loop only
+        uint64_t interval = 0;
+        long quota = 0;
+        long issued = 0;
+        long answered = 0;
+    };
+
+    struct Result
+    {
+        std::array<Histogram, OP_COUNT> latency;
+        long errors = 0;
+        bool failed = false;
+    };
+
+    class Worker
+    {
+    public:
+        Worker(const Options &opt, int connections, long requests, uint64_t seed)
+            : opt(opt), rng(seed), value(opt.value_size, 'x'), clients(static_cast<std::size_t>(connections))
+        {
+            int total_weight = 0;
+            for (int w : opt.weights)
+            {
+                total_weight += w;
+            }
+            pick_op = std::uniform_int_distribution<int>(0, total_weight - 1);
+            pick_key = std::uniform_int_distribution<long>(0, opt.keyspace - 1);
+            for (std::size_t i = 0; i < clients.size(); ++i)
+            {
+                clients[i].quota = requests / connections + (static_cast<long>(i) < requests % connections ? 1 : 0);
+            }
+        }
+
+        void run(uint64_t start)
+        {
+            int epfd = ::epoll_create1(EPOLL_CLOEXEC);
+            double per_conn_rate = opt.rate / static_cast<double>(opt.connections);
+            for (Client &c : clients)
+            {
+                c.fd = connect_to(opt);
+                if (c.fd < 0)
+                {
+                    result.failed = true;
+                    ::close(epfd);
+                    return;
+                }
+                ::fcntl(c.fd, F_SETFL, ::fcntl(c.fd, F_GETFL, 0) | O_NONBLOCK);
+                epoll_event ev{};
+                ev.events = EPOLLIN;
+                ev.data.ptr = &c;
+                ::epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+                if (opt.rate > 0)
+                {
+                    c.interval = static_cast<uint64_t>(1e9 / per_conn_rate);
+                    // Stagger the connections so their schedules interleave.
+                    c.next_due = start + c.interval * static_cast<uint64_t>(&c - clients.data()) / clients.size();
+                }
+            }
+
+            epoll_event events[256];
+            std::size_t done = static_cast<std::size_t>(std::count_if(clients.begin(), clients.end(), [](const Client &c)
+                                                                      { return c.quota == 0; }));
+            char buf[64 * 1024];
+            while (done < clients.size() && !result.failed)
+            {
+                uint64_t now = now_ns();
+                uint64_t wake = UINT64_MAX;
+                for (Client &c : clients)
+                {
+                    issue(c, now);
+                    if (opt.rate > 0 && c.issued < c.quota && static_cast<int>(c.inflight.size()) < opt.pipeline)
+                    {
+                        wake = std::min(wake, c.next_due);
+                    }
+                    if (!flush(c))
+                    {
+                        result.failed = true;
+                    }
+                }
+
+                timespec timeout{};
+                timespec *timeout_ptr = nullptr;
+                if (wake != UINT64_MAX)
+                {
+                    uint64_t wait = wake > now ? wake - now : 0;
+                    timeout.tv_sec = static_cast<time_t>(wait / 1000000000);
+                    timeout.tv_nsec = static_cast<long>(wait % 1000000000);
+                    timeout_ptr = &timeout;
+                }
+                int ready = ::epoll_pwait2(epfd, events, 256, timeout_ptr, nullptr);
+                if (ready < 0 && errno != EINTR)
+                {
+                    result.failed = true;
+                    break;
+                }
+                for (int i = 0; i < ready; ++i)
+                {
+                    Client &c = *static_cast<Client *>(events[i].data.ptr);
+                    ssize_t n = ::read(c.fd, buf, sizeof(buf));
+                    if (n <= 0)
+                    {
+                        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                        {
+                            std::cerr << "server closed a connection\n";
+                            result.failed = true;
+                        }
+                        continue;
+                    }
+                    uint64_t received = now_ns();
+                    long replies = c.scanner.feed(buf, static_cast<std::size_t>(n), result.errors);
+                    for (long r = 0; r < replies && !c.inflight.empty(); ++r)
+                    {
+                        auto [started, op] = c.inflight.front();
+                        c.inflight.pop_front();
+                        result.latency[op].record(received - started);
+                    }
+                    c.answered += replies;
+                    if (c.answered == c.quota)
+                    {
+                        ++done;
+                    }
+                }
+            }
+            for (Client &c : clients)
+            {
+                ::close(c.fd);
+            }
+            ::close(epfd);
+        }
+
+        Result result;
+
+    private:
+        Op choose()
+        {
+            int roll = pick_op(rng);
+            for (int op = 0; op < OP_COUNT; ++op)
+            {
+                if (roll < opt.weights[op])
+                {
+                    return static_cast<Op>(op);
+                }
+                roll -= opt.weights[op];
+            }
+            return OP_GET;
+        }
+
+        void issue(Client &c, uint64_t now)
+        {
+            while (c.issued < c.quota && static_cast<int>(c.inflight.size()) < opt.pipeline)
+            {
+                uint64_t started = now;
+                if (opt.rate > 0)
+                {
+                    if (c.next_due > now)
+                    {
+                        break;
+                    }
+                    // Charged from when it should have been sent, however late.
+                    started = c.next_due;
+                    c.next_due += c.interval;
+                }
+                Op op = choose();
+                std::string key = std::to_string(pick_key(rng));
+                switch (op)
+                {
+                case OP_GET:
+                    append_command(c.out, {"GET", "key:" + key});
+                    break;
+                case OP_SET:
+                    append_command(c.out, {"SET", "key:" + key, value});
+                    break;
+                case OP_INCRBY:
+                    append_command(c.out, {"INCRBY", "counter:" + key, "1"});
+                    break;
+                default:
+                    append_command(c.out, {"EXPIRE", "key:" + key, "3600"});
+                    break;
+                }
+                c.inflight.emplace_back(started, op);
+                ++c.issued;
+            }
+        }
+
+        bool flush(Client &c)
+        {
+            while (c.out_pos < c.out.size())
+            {
+                ssize_t n = ::write(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos);
+                if (n < 0)
+                {
+                    return errno == EAGAIN || errno == EINTR;
+                }
+                c.out_pos += static_cast<std::size_t>(n);
+            }
+            c.out.clear();
+            c.out_pos = 0;
+            return true;
+        }
+
+        const Options &opt;
+        std::mt19937_64 rng;
+        std::uniform_int_distribution<int> pick_op;
+        std::uniform_int_distribution<long> pick_key;
+        std::string value;
+        std::vector<Client> clients;
+    };
+
+    bool parse_mix(const std::string &spec, std::array<int, OP_COUNT> &weights)
+    {
+        weights.fill(0);
+        std::stringstream in(spec);
+        std::string item;
+        int total = 0;
+        while (std::getline(in, item, ','))
+        {
+            std::size_t eq = item.find('=');
+            if (eq == std::string::npos)
+                return false;
+            auto it = std::find(OP_NAMES.begin(), OP_NAMES.end(), item.substr(0, eq));
+            if (it == OP_NAMES.end())
+                return false;
+            int w = std::stoi(item.substr(eq + 1));
+            if (w < 0)
+                return false;
+            weights[static_cast<std::size_t>(it - OP_NAMES.begin())] = w;
+            total += w;
+        }
+        return total > 0;
+    }
+
+    void print_latency(std::string_view label, const Histogram &h)
+    {
+        auto us = [](uint64_t ns)
+        { return static_cast<double>(ns) / 1000.0; };
+        std::cout << std::left << std::setw(8) << label << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(12) << h.count()
+                  << std::setw(12) << us(static_cast<uint64_t>(h.mean()))
+                  << std::setw(12) << us(h.percentile(50))
+                  << std::setw(12) << us(h.percentile(99))
+                  << std::setw(12) << us(h.percentile(99.9))
+                  << std::setw(12) << us(h.maximum()) << "\n";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    std::string mix = "get=80,set=20";
+    for (int i = 1; i < argc; i += 2)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            std::cerr << "usage: tinyredis_bench [--host ADDR] [--port N] [--connections N] [--threads N]\n"
+                         "                       [--pipeline N] [--requests N] [--keyspace N] [--value-size N]\n"
+                         "                       [--mix get=80,set=20,incrby=0,expire=0] [--rate OPS] [--preload 1|0]\n";
+            return 1;
+        }
+        try
+        {
+            if (arg == "--host")
+                opt.host = argv[i + 1];
+            else if (arg == "--port")
+                opt.port = static_cast<uint16_t>(std::stoi(argv[i + 1]));
+            else if (arg == "--connections")
+                opt.connections = std::stoi(argv[i + 1]);
+            else if (arg == "--threads")
+                opt.threads = std::stoi(argv[i + 1]);
+            else if (arg == "--pipeline")
+                opt.pipeline = std::stoi(argv[i + 1]);
+            else if (arg == "--requests")
+                opt.requests = std::stol(argv[i + 1]);
+            else if (arg == "--keyspace")
+                opt.keyspace = std::stol(argv[i + 1]);
+            else if (arg == "--value-size")
+                opt.value_size = std::stoul(argv[i + 1]);
+            else if (arg == "--rate")
+                opt.rate = std::stod(argv[i + 1]);
+            else if (arg == "--preload")
+                opt.preload = std::stoi(argv[i + 1]) != 0;
+            else if (arg == "--mix")
+                mix = argv[i + 1];
+            else
+            {
+                std::cerr << "unknown option " << arg << "\n";
+                return 1;
+            }
+        }
+        catch (const std::exception &)
+        {
+            std::cerr << "invalid value for " << arg << "\n";
+            return 1;
+        }
+    }
+    if (!parse_mix(mix, opt.weights))
+    {
+        std::cerr << "--mix expects comma-separated name=weight pairs over get, set, incrby and expire\n";
+        return 1;
+    }
+    if (opt.connections < 1 || opt.threads < 1 || opt.pipeline < 1 || opt.requests < 1 || opt.keyspace < 1 || opt.rate < 0)
+    {
+        std::cerr << "--connections, --threads, --pipeline, --requests and --keyspace must be positive\n";
+        return 1;
+    }
+    opt.threads = std::min(opt.threads, opt.connections);
+
+    std::cout << opt.connections << " connections on " << opt.threads << " threads, pipeline " << opt.pipeline
+              << ", " << opt.requests << " requests, keyspace " << opt.keyspace << ", "
+              << opt.value_size << "-byte values, mix " << mix << ", ";
+    if (opt.rate > 0)
+        std::cout << "open-loop at " << static_cast<long>(opt.rate) << " ops/sec\n";
+    else
+        std::cout << "closed-loop\n";
+
+    if (opt.preload && (opt.weights[OP_GET] > 0 || opt.weights[OP_EXPIRE] > 0) && !preload(opt))
+    {
+        std::cerr << "preload failed\n";
+        return 1;
+    }
+
+    // Requests are split over threads in proportion to their connections.
+    std::vector<std::unique_ptr<Worker>> workers;
+    long assigned = 0;
+    for (int t = 0; t < opt.threads; ++t)
+    {
+        int conns = opt.connections / opt.threads + (t < opt.connections % opt.threads ? 1 : 0);
+        long requests = t == opt.threads - 1 ? opt.requests - assigned : opt.requests * conns / opt.connections;
+        assigned += requests;
+        workers.push_back(std::make_unique<Worker>(opt, conns, requests, 0x9e3779b97f4a7c15ULL * static_cast<uint64_t>(t + 1)));
+    }
+
+    uint64_t start = now_ns();
+    std::vector<std::thread> threads;
+    for (auto &w : workers)
+    {
+        threads.emplace_back([&w, start]
+                             { w->run(start); });
+    }
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
+    double elapsed = static_cast<double>(now_ns() - start) / 1e9;
+
+    Histogram all;
+    std::array<Histogram, OP_COUNT> per_op;
+    long errors = 0;
+    for (auto &w : workers)
+    {
+        if (w->result.failed)
+        {
+            std::cerr << "run aborted\n";
+            return 1;
+        }
+        for (int op = 0; op < OP_COUNT; ++op)
+        {
+            per_op[op].merge(w->result.latency[op]);
+            all.merge(w->result.latency[op]);
+        }
+        errors += w->result.errors;
+    }
+
+    std::cout << std::fixed << std::setprecision(2) << all.count() << " requests in " << elapsed << " s, "
+              << std::setprecision(0) << static_cast<double>(all.count()) / elapsed << " ops/sec";
+    if (errors > 0)
+        std::cout << ", " << errors << " error replies";
+    std::cout << "\n";
+    if (opt.rate > 0 && static_cast<double>(all.count()) / elapsed < opt.rate * 0.95)
+        std::cout << "warning: the server did not keep up with the requested rate; latencies include the backlog\n";
+
+    std::cout << "latency (us)   count        mean         p50         p99       p99.9         max\n";
+    for (int op = 0; op < OP_COUNT; ++op)
+    {
+        if (per_op[op].count() > 0)
+            print_latency(OP_NAMES[op], per_op[op]);
+    }
+    print_latency("all", all);
+    return 0;
+}
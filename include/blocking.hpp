@@ -0,0 +1,108 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <map>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "kvstore.hpp"
+
+namespace tr
+{
+    // Whatever a server blocks in BLPOP or BRPOP: a client, or a command
+    // another shard sent. Holds its place in BlockedClients.
+    class Waiter
+    {
+    public:
+        bool blocked() const { return !keys.empty(); }
+
+    private:
+        friend class BlockedClients;
+
+        std::vector<std::string> keys;
+        std::vector<std::list<Waiter *>::iterator> queued; // one per key
+        std::multimap<std::chrono::steady_clock::time_point, Waiter *>::iterator timeout;
+        bool has_timeout = false;
+    };
+
+    // The waiters blocked on each key, oldest first, and their deadlines,
+    // after Redis's blocking_keys. The store flags keys that get pushed to
+    // (see KVStore::watch()), so serving is driven by pushes and the server
+    // only has to call serve() after running commands and expire() when its
+    // wait for events ends.
+    class BlockedClients
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        explicit BlockedClients(KVStore &db) : db(db) {}
+
+        BlockedClients(const BlockedClients &) = delete;
+        BlockedClients &operator=(const BlockedClients &) = delete;
+
+        // Blocks `w` on the keys of `args`, a CMD_BLOCKING command that
+        // dispatch_command() could not serve yet, until its timeout.
+        void block(Waiter &w, std::span<const std::string_view> args);
+
+        // Forgets `w`, as when it is served, times out or goes away.
+        void unblock(Waiter &w);
+
+        bool empty() const { return waiters == 0; }
+
+        // The earliest deadline, or Clock::time_point::max() if there is none.
+        Clock::time_point next_deadline() const
+        {
+            return timeouts.empty() ? Clock::time_point::max() : timeouts.begin()->first;
+        }
+
+        // For each key pushed to since the last call, offers it to its
+        // waiters, oldest first: retry(w) runs w's command again and
+        // returns false if there was still nothing to serve, which leaves
+        // the key's later waiters blocked too. Waiters it serves are
+        // unblocked.
+        template <typename F>
+        void serve(F &&retry)
+        {
+            while (db.has_ready_keys())
+            {
+                db.take_ready_keys(ready);
+                for (const std::string &key : ready)
+                {
+                    for (auto it = queues.find(key); it != queues.end(); it = queues.find(key))
+                    {
+                        Waiter &w = *it->second.front();
+                        if (!retry(w))
+                        {
+                            break;
+                        }
+                        unblock(w);
+                    }
+                }
+            }
+        }
+
+        // Calls timed_out(w) for every waiter whose deadline is at or
+        // before `now`, then unblocks it.
+        template <typename F>
+        void expire(Clock::time_point now, F &&timed_out)
+        {
+            while (!timeouts.empty() && timeouts.begin()->first <= now)
+            {
+                Waiter &w = *timeouts.begin()->second;
+                timed_out(w);
+                unblock(w);
+            }
+        }
+
+    private:
+        KVStore &db;
+        std::unordered_map<std::string, std::list<Waiter *>> queues;
+        std::multimap<Clock::time_point, Waiter *> timeouts;
+        std::vector<std::string> ready;
+        std::vector<std::size_t> key_indexes;
+        std::size_t waiters = 0;
+    };
+}
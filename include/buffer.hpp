@@ -0,0 +1,62 @@
+#pragma once
+#include <cstddef>
+#include <string_view>
+
+namespace tr
+{
+    // Free list of fixed-size chunks that input buffers start out in. Each
+    // thread keeps a short list of its own and trades batches of chunks
+    // with the others through a shared lock-free depot of up to MAX_CACHED,
+    // so chunks that I/O threads read into and the executing thread frees
+    // find their way back to the I/O threads.
+    class BufferPool
+    {
+    public:
+        static constexpr std::size_t CHUNK_SIZE = 16 * 1024;
+        static constexpr std::size_t MAX_CACHED = 1024;
+
+        static char *acquire();
+        static void release(char *chunk);
+        // Chunks in the calling thread's own list.
+        static std::size_t cached();
+    };
+
+    // Per-connection input buffer. Bytes are read directly into the free
+    // space at the end and consumed from the front by moving an offset; the
+    // unread tail is only slid back to the start when room is needed and no
+    // parsed argument still points into the consumed part.
+    class InputBuffer
+    {
+    public:
+        InputBuffer() = default;
+        InputBuffer(const InputBuffer &) = delete;
+        InputBuffer &operator=(const InputBuffer &) = delete;
+        ~InputBuffer();
+
+        std::string_view unread() const { return {storage + rpos, wpos - rpos}; }
+        const char *base() const { return storage; }
+        std::size_t capacity() const { return cap; }
+
+        char *write_ptr() { return storage + wpos; }
+        std::size_t writable() const { return cap - wpos; }
+        void commit(std::size_t n) { wpos += n; }
+        void consume(std::size_t n) { rpos += n; }
+
+        // Guarantees writable() >= n. With may_compact the unread bytes may be
+        // slid to the front; otherwise everything stays at its offset. Either
+        // way base() can change, so callers re-point views they hold.
+        void reserve(std::size_t n, bool may_compact);
+
+        // Rewinds an empty buffer and hands pooled storage back, so idle
+        // connections hold no input memory.
+        void release_if_empty();
+
+    private:
+        void free_storage();
+
+        char *storage = nullptr;
+        std::size_t cap = 0;
+        std::size_t rpos = 0;
+        std::size_t wpos = 0;
+    };
+}
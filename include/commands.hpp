@@ -0,0 +1,89 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <string_view>
+#include <vector>
+#include "kvstore.hpp"
+#include "resp.hpp"
+
+namespace tr
+{
+    enum CommandFlags : uint32_t
+    {
+        CMD_READONLY = 1u << 0, // never modifies the keyspace
+        CMD_WRITE = 1u << 1,    // may modify the keyspace
+        CMD_FAST = 1u << 2,     // O(1) or O(log n)
+        CMD_DENYOOM = 1u << 3,  // may grow memory; refused when over maxmemory
+        CMD_SPLIT_SUM = 1u << 4, // replies with a count over its keys; may be split and summed
+        CMD_BLOCKING = 1u << 5,  // may find nothing to serve and block; see dispatch_command()
+        CMD_SPLIT_OK = 1u << 6,  // replies +OK whatever its keys; may be split
+        CMD_SPLIT_GATHER = 1u << 7, // replies with one element per key; may be split and put back in order
+        CMD_ALL_SHARDS = 1u << 8    // describes the whole store; runs on every shard, see merge_info()
+    };
+
+    using CommandHandler = void (*)(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out);
+
+    struct Command
+    {
+        std::string_view name; // lowercase
+        // Redis convention: n > 0 requires exactly n arguments including the
+        // command name, n < 0 requires at least -n.
+        int arity;
+        uint32_t flags;
+        CommandHandler handler;
+        // Redis's legacy key spec: keys sit at first_key, first_key +
+        // key_step, ... up to last_key, which counts from the end when
+        // negative. first_key 0 means the command takes no keys.
+        int first_key = 0;
+        int last_key = 0;
+        int key_step = 0;
+    };
+
+    // Case-insensitive lookup that neither copies nor lowercases `name`.
+    // Returns nullptr for unknown commands.
+    const Command *lookup_command(std::string_view name);
+
+    // Appends to `out` the indexes into `args` of the keys `cmd` touches.
+    // Appends nothing if `args` fails the command's arity check.
+    void command_keys(const Command &cmd, std::span<const std::string_view> args, std::vector<std::size_t> &out);
+
+    // Which of `shards` owns `key`. Taken from the top bits of the hash,
+    // which a shard's table hardly uses, so keys stay evenly spread in it.
+    // As in Redis Cluster, a key with a non-empty {hash tag} is placed by the
+    // tag alone, so "{user1}:a" and "{user1}:b" always share a shard.
+    inline std::size_t shard_of(std::string_view key, std::size_t shards)
+    {
+        std::size_t open = key.find('{');
+        if (open != std::string_view::npos)
+        {
+            std::size_t close = key.find('}', open + 1);
+            if (close != std::string_view::npos && close > open + 1)
+            {
+                key = key.substr(open + 1, close - open - 1);
+            }
+        }
+        uint64_t hash = std::hash<std::string_view>{}(key);
+        return static_cast<std::size_t>(((hash >> 32) * shards) >> 32);
+    }
+
+    // Looks up args[0], checks its arity and runs it, writing a RESP reply to
+    // `out`. Unknown commands and bad arity produce error replies. Returns
+    // false, having written nothing, when a CMD_BLOCKING command found
+    // nothing to serve: the caller blocks it on its keys (see
+    // BlockedClients) and runs it again once one is pushed to, or answers
+    // it with a null array as if it had timed out.
+    bool dispatch_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out);
+
+    // INFO for the shards of one server, from each shard's INFO reply to the
+    // same arguments: counters are added up, ratios worked out again from the
+    // totals, and process-wide fields such as used_memory_rss taken from the
+    // first. A reply that is not INFO text, an error, is passed on instead.
+    void merge_info(std::span<const std::string> replies, ReplyBuffer &out);
+
+    // The timeout of a CMD_BLOCKING command dispatch_command() accepted:
+    // its last argument, in seconds. Zero means it waits for ever.
+    std::chrono::milliseconds blocking_timeout(std::span<const std::string_view> args);
+}
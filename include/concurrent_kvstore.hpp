@@ -0,0 +1,140 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include "epoch.hpp"
+
+namespace tr
+{
+    // A KVStore for commands executed on many threads at once. Reads take
+    // no lock and write nothing shared: GET, EXISTS and TTL pin an Epoch
+    // and walk the table, so readers never contend with each other or wait
+    // for writers. Writes lock one of STRIPES stripes, picked by the top
+    // bits of the key's hash, so writers only queue behind writers of the
+    // same stripe.
+    //
+    // Each stripe is a chained hash table whose nodes are never modified
+    // once published. A write links in a fresh node in place of the old
+    // one and retires the old one to the Epoch, which frees it once no
+    // reader can still hold it; growing a stripe copies its chains into a
+    // new bucket array the same way. A value therefore always reads back
+    // whole, as it was set.
+    //
+    // Unlike KVStore there is no maxmemory or background resize, and keys
+    // past their deadline are only removed when written to or by
+    // purge_expired().
+    class ConcurrentKVStore
+    {
+    public:
+        static constexpr std::size_t STRIPES = 64;
+
+        ConcurrentKVStore();
+        ~ConcurrentKVStore();
+        ConcurrentKVStore(const ConcurrentKVStore &) = delete;
+        ConcurrentKVStore &operator=(const ConcurrentKVStore &) = delete;
+
+        void set(std::string_view key, std::string_view value);
+
+        std::optional<std::string> get(std::string_view key);
+
+        // Calls `f` with a view of the value of `key` and returns true, or
+        // returns false if there is no such key. The view is only valid
+        // during the call, which holds the thread pinned.
+        template <typename F>
+        bool read(std::string_view key, F &&f)
+        {
+            Epoch::Guard guard;
+            const Node *node = find(key);
+            if (node == nullptr)
+            {
+                return false;
+            }
+            f(node->value());
+            return true;
+        }
+
+        bool del(std::string_view key);
+
+        int exists(std::span<const std::string_view> keys);
+
+        int exists(std::initializer_list<std::string_view> keys) { return exists(std::span(keys.begin(), keys.size())); }
+
+        bool expire(std::string_view key, long long seconds);
+
+        long long ttl(std::string_view key);
+
+        std::optional<long long> incrby(std::string_view key, long long delta);
+
+        // Removes every key whose deadline has passed. Returns how many.
+        std::size_t purge_expired();
+
+        std::size_t size() const;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+        static constexpr Clock::time_point NO_DEADLINE = Clock::time_point::max();
+
+        // Header of one allocation that also holds the key and value bytes.
+        struct Node
+        {
+            std::atomic<Node *> next{nullptr};
+            uint64_t hash = 0;
+            Clock::time_point deadline = NO_DEADLINE;
+            uint32_t key_len = 0;
+            uint32_t value_len = 0;
+
+            std::string_view key() const { return {reinterpret_cast<const char *>(this + 1), key_len}; }
+            std::string_view value() const { return {reinterpret_cast<const char *>(this + 1) + key_len, value_len}; }
+            bool live(Clock::time_point now) const { return deadline > now; }
+        };
+
+        struct Table
+        {
+            explicit Table(std::size_t buckets) : mask(buckets - 1), heads(new std::atomic<Node *>[buckets]()) {}
+
+            std::atomic<Node *> &head(uint64_t hash) { return heads[hash & mask]; }
+
+            const std::size_t mask;
+            const std::unique_ptr<std::atomic<Node *>[]> heads;
+        };
+
+        struct alignas(64) Stripe
+        {
+            mutable std::mutex lock;
+            std::atomic<Table *> table{nullptr};
+            std::size_t count = 0; // written under lock
+        };
+
+        static uint64_t hash_key(std::string_view key);
+        static Node *make_node(std::string_view key, std::string_view value, uint64_t hash, Clock::time_point deadline);
+        static void free_node(void *node);
+        static void free_table(void *table);
+
+        Stripe &stripe_of(uint64_t hash) { return stripes[hash >> 58]; }
+
+        // Under a guard.
+        const Node *find(std::string_view key);
+
+        // Under the stripe's lock: the link that points at the node for
+        // `key`, or nullptr if there is none, expired or not.
+        std::atomic<Node *> *locate(Table &table, std::string_view key, uint64_t hash);
+
+        // Under the stripe's lock: puts `node` in place of the node `link`
+        // points at, or at the head of its bucket when `link` is nullptr.
+        void publish(Stripe &stripe, std::atomic<Node *> *link, Node *node);
+
+        void unlink(Stripe &stripe, std::atomic<Node *> *link);
+
+        void grow(Stripe &stripe);
+
+        static_assert(STRIPES == 64, "stripe_of() takes the top 6 bits");
+        Stripe stripes[STRIPES];
+    };
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <string_view>
+#include <vector>
+#include "blocking.hpp"
+#include "buffer.hpp"
+#include "kvstore.hpp"
+#include "resp.hpp"
+
+namespace tr
+{
+    constexpr std::size_t DEFAULT_QUERY_LIMIT = 1024ULL * 1024 * 1024;
+
+    // Caps on the replies a client has not read yet, after Redis's
+    // client-output-buffer-limit. 0 disables a limit.
+    struct OutputLimits
+    {
+        std::size_t hard = 256ULL * 1024 * 1024; // dropped as soon as it is exceeded
+        std::size_t soft = 64ULL * 1024 * 1024;  // dropped after soft_seconds above it
+        int soft_seconds = 60;
+        // Stop executing and reading for a client once this much output is
+        // unsent, and resume when all of it has been written.
+        std::size_t pause = 1024 * 1024;
+    };
+
+    // A parsed command waiting for the executing thread: a run of
+    // Connection::args, which point into Connection::in.
+    struct Request
+    {
+        std::size_t first = 0;
+        std::size_t argc = 0;
+        bool inline_cmd = false; // plain-text line, answered in REPL format
+    };
+
+    // Per-connection state owned by the event loop. While blocked() in
+    // BLPOP or BRPOP, that request stays first in `requests` and nothing
+    // after it runs.
+    struct Connection : Waiter
+    {
+        int fd = -1;
+        InputBuffer in;
+        std::size_t query_limit = DEFAULT_QUERY_LIMIT;
+        RespParser parser;
+        ReplyBuffer out; // replies the socket has not accepted yet
+        std::vector<std::string_view> args;
+        std::vector<Request> requests;
+        bool eof = false;    // peer closed or sent EXIT; close once replies are flushed
+        bool failed = false; // I/O or protocol error; close without flushing
+        bool closing = false;
+        bool read_more = false; // stopped reading before EAGAIN; input is still queued
+        OutputLimits limits;
+        bool paused = false;    // output backed up; neither read nor execute until it drains
+        bool over_soft = false; // output has been above limits.soft since soft_since
+        std::chrono::steady_clock::time_point soft_since;
+    };
+
+    // Splits every complete frame in conn.in into conn.requests. Returns
+    // false on a protocol error or when the unparsed tail grows too large.
+    bool parse_requests(Connection &conn);
+
+    // Appends freshly received bytes to conn.in and parses them.
+    bool consume_input(Connection &conn, const char *data, std::size_t n);
+
+    // Drains a readable, non-blocking socket straight into conn.in and parses
+    // every complete frame into conn.requests. Stops early, setting
+    // conn.read_more, when the buffer is full and requests are waiting to run.
+    // Touches nothing but conn, so I/O threads may call it.
+    bool read_requests(Connection &conn);
+
+    // Runs one of conn.requests against the store and appends its reply to
+    // `out`. A blocking command with nothing to serve blocks conn in
+    // `blocked`, replying nothing, or without one gets a null array.
+    // Returns false when the client asked to disconnect.
+    bool execute_request(Connection &conn, KVStore &db, const Request &req, ReplyBuffer &out,
+                         BlockedClients *blocked = nullptr);
+
+    // Runs conn.requests against the store, appends the replies to
+    // conn.out and drops the consumed input. Stops early, keeping the rest
+    // of conn.requests queued, once conn.out reaches the pause threshold or
+    // a request blocks. Returns false when the client asked to disconnect.
+    bool execute_requests(Connection &conn, KVStore &db, BlockedClients *blocked = nullptr);
+
+    // Serves the clients blocked on keys pushed to since the last call and
+    // answers those whose timeout is at or before `now` with a null array,
+    // appending each to `woken`. Their remaining requests are left queued
+    // for execute_requests().
+    void wake_blocked(BlockedClients &blocked, KVStore &db, std::chrono::steady_clock::time_point now,
+                      std::vector<Connection *> &woken);
+
+    // Writes as much of conn.out as the socket accepts with writev. Returns
+    // false on a hard error; a short write leaves the rest queued for the
+    // next EPOLLOUT.
+    bool flush_output(Connection &conn);
+
+    // Applies conn.limits to `pending` unsent reply bytes and updates
+    // conn.paused. Returns false when the client must be disconnected.
+    bool check_output_limits(Connection &conn, std::size_t pending, std::chrono::steady_clock::time_point now);
+}
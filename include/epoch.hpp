@@ -0,0 +1,91 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+namespace tr
+{
+    // Epoch-based reclamation, after Fraser and crossbeam-epoch. A reader
+    // pins the current global epoch for as long as it holds pointers into
+    // a shared structure; a writer that unlinks an object retires it
+    // instead of freeing it. Retired objects are collected in bags stamped
+    // with the global epoch, and a bag is freed once the epoch has moved
+    // two steps past its stamp: by then every reader that could have seen
+    // its objects has unpinned. The epoch only advances when every pinned
+    // thread has caught up with it, so pinning costs one full barrier,
+    // and readers never write anything another reader touches.
+    class Epoch
+    {
+        struct Record;
+
+    public:
+        using Deleter = void (*)(void *);
+
+        // Pins the calling thread for its lifetime. Guards nest.
+        class Guard
+        {
+        public:
+            Guard();
+            ~Guard();
+            Guard(const Guard &) = delete;
+            Guard &operator=(const Guard &) = delete;
+
+        private:
+            Record &record;
+        };
+
+        // Frees `p` with `deleter` once no pinned reader can still see it.
+        // The caller must already have made it unreachable.
+        static void retire(void *p, Deleter deleter);
+
+        // Seals the calling thread's retired objects into a bag, tries to
+        // advance the epoch, and frees every bag that has become safe.
+        static void collect();
+
+        static uint64_t current() { return global.load(std::memory_order_relaxed); }
+
+    private:
+        // Objects retired between seals, and sealed bags, per thread.
+        static constexpr std::size_t BAG_SIZE = 64;
+
+        struct Retired
+        {
+            void *p;
+            Deleter deleter;
+        };
+
+        struct Bag
+        {
+            uint64_t epoch;
+            std::vector<Retired> items;
+        };
+
+        // One per thread that has ever pinned, reused after the thread
+        // exits, together with whatever it had not freed yet.
+        struct alignas(64) Record
+        {
+            std::atomic<uint64_t> state{0}; // epoch * 2 + 1 while pinned, 0 otherwise
+            std::atomic<bool> in_use{true};
+            Record *next = nullptr;
+            unsigned depth = 0;
+            std::vector<Retired> pending;
+            std::deque<Bag> bags;
+        };
+
+        struct Handle
+        {
+            Record *record;
+            Handle();
+            ~Handle();
+        };
+
+        static Record &local();
+        static void seal(Record &record);
+        static bool try_advance();
+
+        static std::atomic<uint64_t> global;
+        static std::atomic<Record *> records;
+    };
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include "listpack.hpp"
+#include "slab.hpp"
+#include "swiss_table.hpp"
+
+namespace tr
+{
+    // The value of a hash key. As in Redis, a small hash is one Listpack of
+    // alternating fields and values, searched linearly, which costs a few
+    // bytes per field where a node-based map costs a node, a hash slot and
+    // two strings. Once it has more than `max_entries` fields, or a field or
+    // value longer than `max_value` bytes, it is converted for good to a
+    // SwissTable keyed by field.
+    class HashObject
+    {
+    public:
+        struct Limits
+        {
+            std::size_t max_entries = 128; // hash-max-listpack-entries
+            std::size_t max_value = 64;    // hash-max-listpack-value
+        };
+
+        std::size_t size() const { return table ? table->size() : packed.size() / 2; }
+
+        bool is_packed() const { return !table; }
+
+        // Sets `field` to `value`. Returns true if the field is new.
+        bool set(std::string_view field, std::string_view value, const Limits &limits);
+
+        // A view of the value of `field`, valid until the hash changes.
+        std::optional<std::string_view> get(std::string_view field);
+
+        bool del(std::string_view field);
+
+        // Calls f(field, value) for every field, in no particular order.
+        template <typename F>
+        void for_each(F &&f)
+        {
+            if (table)
+            {
+                table->for_each([&](const Field &field) { f(field.key.view(), field.value.view()); });
+                return;
+            }
+            for (std::size_t pos = 0; pos < packed.bytes(); pos = packed.next(packed.next(pos)))
+            {
+                f(packed.get(pos), packed.get(packed.next(pos)));
+            }
+        }
+
+        // Bytes held, this object included.
+        std::size_t heap() const;
+
+        // Moves its chunks out of sparse slab pages. Returns how many moved.
+        std::size_t defrag();
+
+    private:
+        struct Field
+        {
+            SlabString key;
+            SlabString value;
+        };
+
+        void convert();
+
+        Listpack packed;
+        std::unique_ptr<SwissTable<Field>> table;
+        std::size_t table_strings = 0; // slab bytes behind the table's fields
+    };
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace tr
+{
+    // A sorted array of distinct integers packed at the narrowest of 2, 4 or
+    // 8 bytes that holds them all, after Redis's intset. A member that needs
+    // more bytes widens every member in one pass; nothing ever narrows it
+    // again. The array sits in one slab chunk, so a set of small ids costs
+    // two bytes per member where a node-based set of strings costs a node, a
+    // bucket and a string each. Lookups are binary searches.
+    class IntSet
+    {
+    public:
+        // Past this ratio of sizes, intersect() probes the larger set with
+        // a galloping search for each member of the smaller rather than
+        // merging the two.
+        static constexpr std::size_t GALLOP_RATIO = 32;
+
+        IntSet() = default;
+        IntSet(const IntSet &) = delete;
+        IntSet &operator=(const IntSet &) = delete;
+        IntSet(IntSet &&other) noexcept;
+        IntSet &operator=(IntSet &&other) noexcept;
+        ~IntSet();
+
+        std::size_t size() const { return count; }
+
+        bool empty() const { return count == 0; }
+
+        // Bytes per member: 2, 4 or 8.
+        std::size_t width() const { return bytes; }
+
+        // The member at `i`, in ascending order.
+        int64_t at(std::size_t i) const
+        {
+            switch (bytes)
+            {
+            case 2:
+                return load<int16_t>(i);
+            case 4:
+                return load<int32_t>(i);
+            default:
+                return load<int64_t>(i);
+            }
+        }
+
+        bool contains(int64_t v) const;
+
+        // Returns true if `v` is new.
+        bool insert(int64_t v);
+
+        // Returns true if `v` was there.
+        bool erase(int64_t v);
+
+        // Calls f(member) in ascending order.
+        template <typename F>
+        void for_each(F &&f) const
+        {
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                f(at(i));
+            }
+        }
+
+        // The members `a` and `b` share, at the narrower of their widths.
+        // Sets of the same width are merged a vector of members at a time
+        // where SSE2 is available; see GALLOP_RATIO for the other strategy.
+        static IntSet intersect(const IntSet &a, const IntSet &b);
+
+        // Slab bytes held.
+        std::size_t heap() const { return cap; }
+
+        // Moves the array out of a sparse slab page. Returns true if it moved.
+        bool defrag();
+
+    private:
+        template <typename T>
+        T load(std::size_t i) const
+        {
+            T v;
+            std::memcpy(&v, data + i * sizeof(T), sizeof(T));
+            return v;
+        }
+
+        static std::size_t width_of(int64_t v);
+
+        // The index of the first member not below `v`.
+        std::size_t lower_bound(int64_t v) const;
+
+        void store(std::size_t i, int64_t v);
+
+        // Makes room for `n` members, and gives the chunk back once it is
+        // less than half used.
+        void reserve(std::size_t n);
+
+        void release();
+
+        // Rewrites every member at `to` bytes and adds `v`, which needs
+        // them and so sorts before or after every current member.
+        void widen(std::size_t to, int64_t v);
+
+        unsigned char *data = nullptr;
+        std::size_t count = 0;
+        std::size_t cap = 0;
+        unsigned char bytes = 2;
+    };
+}
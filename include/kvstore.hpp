@@ -1,35 +1,641 @@
 #pragma once
 #include <string>
-#include <unordered_map>
+#include <charconv>
+#include <initializer_list>
+#include <memory>
 #include <optional>
+#include <span>
 #include <chrono>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
+#include "hash_object.hpp"
+#include "list_object.hpp"
+#include "set_object.hpp"
+#include "zset_object.hpp"
+#include "slab.hpp"
+#include "swiss_table.hpp"
 // using namespace std;
 
 namespace tr
 {
+    // What to do when a write would take the store past its maxmemory.
+    enum class EvictionPolicy
+    {
+        NoEviction,  // refuse the write
+        AllKeysLru,  // evict the least recently used key
+        AllKeysLfu,  // evict the least frequently used key
+        VolatileTtl  // evict the key with a deadline that is due soonest
+    };
+
+    // Parses a Redis policy name such as "allkeys-lru".
+    std::optional<EvictionPolicy> parse_eviction_policy(std::string_view name);
+
+    std::string_view eviction_policy_name(EvictionPolicy policy);
+
+    // Whether `s` is the canonical spelling of a 64-bit integer: no sign but
+    // a leading '-', no leading zeros, no "-0". Only such values are stored
+    // as integers, since anything else must read back verbatim.
+    bool as_canonical_integer(std::string_view s, long long &out);
+
+    // Thrown by an operation that expects a key to hold a given type when it
+    // holds another; dispatch_command() turns it into a WRONGTYPE error.
+    struct WrongType : std::runtime_error
+    {
+        WrongType() : std::runtime_error("Operation against a key holding the wrong kind of value") {}
+    };
+
+    // The conditions and expiry of SET.
+    struct SetOptions
+    {
+        enum class When : uint8_t
+        {
+            Always,
+            IfMissing, // NX
+            IfExists   // XX
+        };
+
+        When when = When::Always;
+        bool keep_ttl = false; // otherwise any deadline is cleared or replaced
+        long long ttl_ms = 0;  // > 0 sets a deadline
+    };
+
+    // The conditions of ZADD.
+    struct ZAddOptions
+    {
+        enum class Scores : uint8_t
+        {
+            Any,
+            Greater, // GT: only raise the scores of existing members
+            Less     // LT: only lower them
+        };
+
+        SetOptions::When when = SetOptions::When::Always; // NX adds only, XX updates only
+        Scores scores = Scores::Any;
+        bool incr = false; // INCR: add to the current score
+    };
+
+    // What ZADD did.
+    struct ZAddResult
+    {
+        std::size_t added = 0;
+        std::size_t changed = 0; // existing members moved to a new score
+        // With INCR, the new score, or std::nullopt if the conditions ruled
+        // it out.
+        std::optional<double> score;
+        bool nan = false; // INCR came to NaN, as inf + -inf does; nothing changed
+    };
+
     class KVStore
     {
     public:
-        bool expire(const std::string &key, long long seconds);
+        // Gives `key` a deadline `seconds` (or `ms`) from now; a duration of
+        // zero or less deletes it. Returns false if there is no such key.
+        bool expire(std::string_view key, long long seconds);
+
+        bool pexpire(std::string_view key, long long ms);
+
+        // Removes the deadline of `key`. Returns false if it had none or
+        // there is no such key.
+        bool persist(std::string_view key);
+
+        // Seconds (or ms) left before `key` expires, -1 if it has no
+        // deadline, -2 if there is no such key.
+        long long ttl(std::string_view key);
+
+        long long pttl(std::string_view key);
+
+        void set(std::string_view key, std::string_view value);
+
+        // Returns false, changing nothing, when options.when does not hold.
+        bool set(std::string_view key, std::string_view value, const SetOptions &options);
+
+        // A copy of the value; read() avoids it. Like every operation that
+        // expects a type, throws WrongType if the key holds another.
+        std::optional<std::string> get(std::string_view key);
+
+        // Calls `f` with a view of the value of `key` and returns true, or
+        // returns false if there is no such key. The view points into the
+        // store, or at digits formatted on the stack for an integer, and is
+        // only valid during the call.
+        template <typename F>
+        bool read(std::string_view key, F &&f)
+        {
+            Entry *entry = lookup(key);
+            if (entry == nullptr)
+            {
+                return false;
+            }
+            if (!entry->is_string())
+            {
+                throw WrongType();
+            }
+            view_value(*entry, f);
+            return true;
+        }
+
+        // MGET: calls `f` once per key, in order, with a view of its value
+        // as read() gives it, or std::nullopt if there is no such key or it
+        // does not hold a string.
+        template <typename F>
+        void read_many(std::span<const std::string_view> keys, F &&f)
+        {
+            for_each_hashed(keys, 1, [&](std::size_t i, std::size_t hash)
+                            {
+                Entry *entry = lookup(keys[i], hash);
+                if (entry == nullptr || !entry->is_string())
+                {
+                    f(std::optional<std::string_view>());
+                    return;
+                }
+                view_value(*entry, [&](std::string_view value) { f(std::optional<std::string_view>(value)); }); });
+        }
+
+        // MSET: `pairs` alternates keys and values. Like set(), clears any
+        // deadline the keys had.
+        void mset(std::span<const std::string_view> pairs);
+
+        // MSETNX: sets every pair only if none of the keys exists.
+        bool msetnx(std::span<const std::string_view> pairs);
+
+        bool del(std::string_view key);
+
+        std::optional<long long> incrby(std::string_view key, long long delta);
+
+        int exists(std::span<const std::string_view> keys);
+
+        int exists(std::initializer_list<std::string_view> keys) { return exists(std::span(keys.begin(), keys.size())); }
+
+        // HSET: `pairs` alternates fields and values. Returns how many of
+        // the fields are new.
+        std::size_t hset(std::string_view key, std::span<const std::string_view> pairs);
+
+        // HGET: as read(), for one field of a hash.
+        template <typename F>
+        bool hread(std::string_view key, std::string_view field, F &&f)
+        {
+            HashObject *hash = find_hash(key);
+            std::optional<std::string_view> value = hash != nullptr ? hash->get(field) : std::nullopt;
+            if (value)
+            {
+                f(*value);
+            }
+            return value.has_value();
+        }
+
+        // HMGET: calls `f` once per field, in order, with a view of its
+        // value or std::nullopt.
+        template <typename F>
+        void hread_many(std::string_view key, std::span<const std::string_view> fields, F &&f)
+        {
+            HashObject *hash = find_hash(key);
+            for (std::string_view field : fields)
+            {
+                f(hash != nullptr ? hash->get(field) : std::nullopt);
+            }
+        }
+
+        // HGETALL: calls f(field, value) for every field of the hash.
+        template <typename F>
+        void hread_all(std::string_view key, F &&f)
+        {
+            if (HashObject *hash = find_hash(key))
+            {
+                hash->for_each(f);
+            }
+        }
+
+        // Removes the fields, and the key once no field is left. Returns how
+        // many fields there were.
+        std::size_t hdel(std::string_view key, std::span<const std::string_view> fields);
+
+        // std::nullopt if the field does not hold an integer or would
+        // overflow.
+        std::optional<long long> hincrby(std::string_view key, std::string_view field, long long delta);
+
+        std::size_t hlen(std::string_view key);
+
+        // When hashes switch from the packed to the table encoding. Only
+        // hashes written to afterwards are affected.
+        void set_hash_limits(const HashObject::Limits &limits) { hash_limits = limits; }
+
+        // LPUSH (RPUSH): pushes `values` in order onto the head (tail) of
+        // the list, creating it. Returns its new length.
+        std::size_t lpush(std::string_view key, std::span<const std::string_view> values) { return push(key, values, true); }
+
+        std::size_t rpush(std::string_view key, std::span<const std::string_view> values) { return push(key, values, false); }
+
+        // LPOP (RPOP): removes up to `n` entries from the head (tail) of the
+        // list, calling `f` with a view of each just before it goes, and the
+        // key once the list is empty. Returns how many were removed.
+        template <typename F>
+        std::size_t lpop(std::string_view key, std::size_t n, F &&f) { return pop(key, n, true, f); }
+
+        template <typename F>
+        std::size_t rpop(std::string_view key, std::size_t n, F &&f) { return pop(key, n, false, f); }
+
+        std::size_t llen(std::string_view key);
 
-        long long ttl(const std::string &key);
+        // LINDEX: as read(), for the entry at `index`, which counts from the
+        // end when negative.
+        template <typename F>
+        bool lindex(std::string_view key, long long index, F &&f)
+        {
+            ListObject *list = find_list(key);
+            long long size = list != nullptr ? static_cast<long long>(list->size()) : 0;
+            if (index < 0)
+            {
+                index += size;
+            }
+            if (index < 0 || index >= size)
+            {
+                return false;
+            }
+            f(list->at(static_cast<std::size_t>(index)));
+            return true;
+        }
 
-        void set(const std::string &key, const std::string &value);
+        // LRANGE: calls `f` with a view of each entry list_range() selects.
+        template <typename F>
+        void lrange(std::string_view key, long long start, long long stop, F &&f)
+        {
+            if (ListObject *list = find_list(key))
+            {
+                auto [first, n] = list_range(start, stop, list->size());
+                list->range(first, n, f);
+            }
+        }
 
-        std::optional<std::string> get(const std::string &key);
+        // LTRIM: keeps the entries list_range() selects, removing the key if
+        // there are none.
+        void ltrim(std::string_view key, long long start, long long stop);
 
-        bool del(const std::string &key);
+        // Nodes of lists written to afterwards hold this much; see
+        // ListObject::DEFAULT_FILL.
+        void set_list_fill(int fill) { list_fill = fill; }
 
-        std::optional<long long> incrby(const std::string &key, long long delta);
+        // SADD: adds the members, creating the set. Returns how many are new.
+        std::size_t sadd(std::string_view key, std::span<const std::string_view> members);
 
-        int exists(const std::vector<std::string> &keys);
+        // SREM: removes the members, and the key once none is left. Returns
+        // how many there were.
+        std::size_t srem(std::string_view key, std::span<const std::string_view> members);
+
+        bool sismember(std::string_view key, std::string_view member);
+
+        std::size_t scard(std::string_view key);
+
+        // SMEMBERS: calls `f` with a view of each member, valid only for
+        // the call.
+        template <typename F>
+        void smembers(std::string_view key, F &&f)
+        {
+            if (SetObject *set = find_set(key))
+            {
+                set->for_each(f);
+            }
+        }
+
+        enum class SetOp
+        {
+            Inter,
+            Union,
+            Diff
+        };
+
+        // SINTER, SUNION and SDIFF: `op` over the sets at `keys`, in order,
+        // a missing key counting as an empty set. Intersections start from
+        // the smallest set, and two IntSets are intersected directly.
+        std::unique_ptr<SetObject> set_op(SetOp op, std::span<const std::string_view> keys);
+
+        // The STORE forms: replaces `dst`, clearing any TTL, with the
+        // result, or removes it if the result is empty. Returns its size.
+        std::size_t set_op_store(SetOp op, std::string_view dst, std::span<const std::string_view> keys);
+
+        // When sets switch from the IntSet to the table encoding. Only sets
+        // written to afterwards are affected.
+        void set_set_limits(const SetObject::Limits &limits) { set_limits = limits; }
+
+        // ZADD and ZINCRBY: gives each member its paired score, or with
+        // INCR adds it to the member's score, as the options allow.
+        ZAddResult zadd(std::string_view key, std::span<const std::pair<double, std::string_view>> items,
+                        const ZAddOptions &options);
+
+        std::optional<double> zscore(std::string_view key, std::string_view member);
+
+        // ZRANK (ZREVRANK): the 0-based rank of `member` by ascending
+        // (descending) score.
+        std::optional<std::size_t> zrank(std::string_view key, std::string_view member, bool reverse);
+
+        // Removes the members, and the key once none is left. Returns how
+        // many there were.
+        std::size_t zrem(std::string_view key, std::span<const std::string_view> members);
+
+        std::size_t zcard(std::string_view key);
+
+        // ZRANGE BYSCORE and ZRANGEBYSCORE: the rank of the first member
+        // with a score in `range`, ascending or with `reverse` descending,
+        // and how many have one.
+        std::pair<std::size_t, std::size_t> zranks_in(std::string_view key, const ScoreRange &range, bool reverse);
+
+        // ZRANGE: calls f(member, score) for each of the `n` members from
+        // rank `first` on, ascending or with `reverse` descending. Member
+        // views are valid until the set changes.
+        template <typename F>
+        void zrange(std::string_view key, std::size_t first, std::size_t n, bool reverse, F &&f)
+        {
+            if (ZSetObject *zset = find_zset(key))
+            {
+                zset->range(first, n, reverse, f);
+            }
+        }
+
+        // When sorted sets switch from the packed to the indexed encoding.
+        // Only sorted sets written to afterwards are affected.
+        void set_zset_limits(const ZSetObject::Limits &limits) { zset_limits = limits; }
+
+        // Keys clients are blocked on in BLPOP or BRPOP, kept by
+        // BlockedClients. A push to one of them queues it for
+        // take_ready_keys(), as Redis signals its ready keys, so the server
+        // serves the waiters after the pushing command instead of polling.
+        void watch(std::string_view key);
+
+        void unwatch(std::string_view key);
+
+        bool has_ready_keys() const { return !ready_keys.empty(); }
+
+        // Replaces `out` with the watched keys pushed to since the last
+        // call, each once.
+        void take_ready_keys(std::vector<std::string> &out);
+
+        // One active expiry cycle: walks the table from where the previous
+        // cycle stopped, removing keys whose deadline is at or before `now`,
+        // for at most `budget`. Like Redis it keeps going only while samples
+        // keep turning up expired keys. Returns true if it ran out of time
+        // with expired keys still showing up, so the caller should come back
+        // soon rather than at its regular tick.
+        bool active_expire(std::chrono::microseconds budget,
+                           std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+        // Moves keys from the old table of a running resize to the new one
+        // for at most `budget`. Returns true if the resize is not done yet.
+        bool migrate(std::chrono::microseconds budget);
+
+        bool resizing() const { return table.resizing(); }
+
+        // One slice of active defragmentation, as in Redis: walks the table
+        // from where the previous slice stopped, moving keys and values out
+        // of sparse slab pages so those pages can be released, for at most
+        // `budget` or until a full pass. A pass that moves nothing is not
+        // repeated until the slabs have changed. Returns true if it ran out
+        // of time with the slabs still fragmented.
+        bool defrag(std::chrono::microseconds budget);
+
+        std::size_t size() const { return table.size(); }
+
+        // Keys that currently carry a deadline.
+        std::size_t volatile_keys() const { return volatile_count; }
+
+        // Keys removed because their deadline passed, lazily or actively.
+        std::size_t expired_keys() const { return expired_count; }
+
+        // 0 means unlimited.
+        void set_maxmemory(std::size_t bytes, EvictionPolicy policy);
+
+        std::size_t maxmemory() const { return max_memory; }
+
+        EvictionPolicy maxmemory_policy() const { return policy; }
+
+        // Bytes held by the keys: each entry's slot and control byte plus
+        // the slab chunks behind its key and value. Free slots are not counted, so
+        // evicting a key always brings this down.
+        std::size_t used_memory() const { return table.size() * ENTRY_OVERHEAD + heap_bytes; }
+
+        // Bytes behind the table's arrays, free slots included.
+        std::size_t table_bytes() const { return table.footprint(); }
+
+        // Evicts keys under the policy until used_memory() is within
+        // maxmemory. Returns false if that is not possible, e.g. under
+        // noeviction, in which case writes should be refused.
+        bool evict();
+
+        std::size_t evicted_keys() const { return evicted_count; }
+
+        // Fixes the time that expiry checks and new deadlines use until the
+        // next call, as Redis caches its clock for a whole event-loop
+        // iteration: the server reads the clock once per batch instead of
+        // once or twice per command. Until it is first called, the store
+        // reads the clock itself.
+        void set_clock(std::chrono::steady_clock::time_point now);
+
+        // Advances the coarse clock LRU and LFU ages are measured against.
+        // The server calls it from its background cycle, as Redis refreshes
+        // its LRU clock in serverCron, so the GET path never reads the time.
+        void tick(std::chrono::steady_clock::time_point now);
 
     private:
-        std::unordered_map<std::string, std::string> memory;
+        using Clock = std::chrono::steady_clock;
+        // Deadlines are milliseconds on Clock, like Redis's mstime.
+        static constexpr int64_t NO_DEADLINE = INT64_MAX;
+
+        enum class Encoding : uint8_t
+        {
+            Int, // `num`: the value is the canonical spelling of an integer
+            Raw,  // `str`: any other string
+            Hash, // `hash`
+            List, // `list`
+            Set,  // `set`
+            ZSet  // `zset`
+        };
+
+        // Key, value and expiry share one slot, so a lookup is a single probe.
+        // As in Redis, a value that reads back as a 64-bit integer is kept as
+        // that integer, so counters need no string at all. Short keys and
+        // values sit inline; longer ones come from the SlabAllocator.
+        struct Entry
+        {
+            Entry() : num(0) {}
+            Entry(Entry &&other) noexcept;
+            Entry &operator=(Entry &&) = delete;
+            ~Entry();
+
+            void set_int(long long n);
+            void set_str(std::string_view s);
+            // Replaces the value with an empty hash.
+            void set_hash();
+            void set_list();
+            // Replaces the value with `members`.
+            void set_set(std::unique_ptr<SetObject> members);
+            void set_zset();
+            std::string value() const;
+            std::size_t value_heap() const;
+            bool is_string() const { return encoding <= Encoding::Raw; }
+
+            SlabString key;
+            union
+            {
+                long long num;
+                SlabString str;
+                HashObject *hash;
+                ListObject *list;
+                SetObject *set;
+                ZSetObject *zset;
+            };
+            int64_t deadline = NO_DEADLINE;
+            // Under allkeys-lru the tick() second of the last access; under
+            // allkeys-lfu the tick() minute of the last decay in the upper
+            // 24 bits and a logarithmic access counter in the low 8.
+            uint32_t access = 0;
+            Encoding encoding = Encoding::Int;
+        };
+
+        static constexpr std::size_t ENTRY_OVERHEAD = sizeof(Entry) + 1;
+
+        // Keys hashed and prefetched ahead of probing in a batched command:
+        // about as many misses as a core keeps in flight.
+        static constexpr std::size_t PREFETCH_BATCH = 16;
+
+        // A sampled eviction candidate; higher scores are evicted first.
+        struct Candidate
+        {
+            uint64_t score = 0;
+            std::string key;
+        };
+
+        SwissTable<Entry> table;
+        std::size_t volatile_count = 0;
+        std::size_t expired_count = 0;
+        std::size_t expire_cursor = 0;
+        std::size_t defrag_cursor = 0;
+        std::size_t defrag_moved = 0;      // in the current pass
+        std::size_t defrag_stalled_at = 0; // slab reserved bytes after a fruitless pass
+
+        std::size_t max_memory = 0;
+        EvictionPolicy policy = EvictionPolicy::NoEviction;
+        std::size_t heap_bytes = 0;
+        std::size_t evicted_count = 0;
+        Clock::time_point clock_epoch = Clock::now();
+        uint32_t clock_seconds = 0;
+        int64_t cached_ms = -1; // set_clock(), or -1 to read Clock
+        HashObject::Limits hash_limits;
+        int list_fill = ListObject::DEFAULT_FILL;
+        SetObject::Limits set_limits;
+        ZSetObject::Limits zset_limits;
+        // Watched keys, and whether each is already in ready_keys.
+        std::unordered_map<std::string, bool> watched;
+        std::vector<std::string> ready_keys;
+        std::vector<Candidate> pool; // best candidates seen so far, by score
+        std::minstd_rand rng;
+
+        // Finds a live entry, erasing it first if its deadline has passed.
+        Entry *lookup(std::string_view key) { return lookup(key, SwissTable<Entry>::hash_of(key)); }
+        Entry *lookup(std::string_view key, std::size_t hash);
+
+        template <typename F>
+        static void view_value(const Entry &entry, F &&f)
+        {
+            if (entry.encoding == Encoding::Int)
+            {
+                char digits[20];
+                char *end = std::to_chars(digits, digits + sizeof(digits), entry.num).ptr;
+                f(std::string_view(digits, static_cast<std::size_t>(end - digits)));
+            }
+            else
+            {
+                f(entry.str.view());
+            }
+        }
+
+        // Calls f(i, hash) for the keys at args[0], args[step], ... in
+        // order, hashing and prefetching PREFETCH_BATCH of them at a time:
+        // all their control groups, then all their slots.
+        template <typename F>
+        void for_each_hashed(std::span<const std::string_view> args, std::size_t step, F &&f)
+        {
+            std::size_t hashes[PREFETCH_BATCH];
+            for (std::size_t base = 0; base < args.size(); base += PREFETCH_BATCH * step)
+            {
+                std::size_t n = std::min(PREFETCH_BATCH, (args.size() - base + step - 1) / step);
+                for (std::size_t k = 0; k < n; ++k)
+                {
+                    hashes[k] = SwissTable<Entry>::hash_of(args[base + k * step]);
+                    table.prefetch(hashes[k]);
+                }
+                for (std::size_t k = 0; k < n; ++k)
+                {
+                    table.prefetch_slot(hashes[k]);
+                }
+                for (std::size_t k = 0; k < n; ++k)
+                {
+                    f(base + k * step, hashes[k]);
+                }
+            }
+        }
+
+        static int64_t to_ms(Clock::time_point t);
+        int64_t now_ms() const { return cached_ms >= 0 ? cached_ms : to_ms(Clock::now()); }
+        // `ms` from now, saturating short of NO_DEADLINE.
+        int64_t deadline_in(long long ms) const;
+
+        void set_deadline(Entry *entry, int64_t deadline);
+        // The hash at `key`, or nullptr if there is no such key.
+        HashObject *find_hash(std::string_view key);
+        // The entry of the list at `key`, or nullptr likewise.
+        Entry *find_list_entry(std::string_view key);
+        ListObject *find_list(std::string_view key)
+        {
+            Entry *entry = find_list_entry(key);
+            return entry != nullptr ? entry->list : nullptr;
+        }
+        std::size_t push(std::string_view key, std::span<const std::string_view> values, bool front);
+        // The set at `key`, or nullptr if there is no such key.
+        SetObject *find_set(std::string_view key);
+        // The sorted set at `key`, or nullptr likewise.
+        ZSetObject *find_zset(std::string_view key);
 
-        std::unordered_map<std::string, std::chrono::steady_clock::time_point> expiry;
+        template <typename F>
+        std::size_t pop(std::string_view key, std::size_t n, bool front, F &f)
+        {
+            Entry *entry = find_list_entry(key);
+            if (entry == nullptr)
+            {
+                return 0;
+            }
+            ListObject *list = entry->list;
+            n = std::min(n, list->size());
+            heap_bytes -= entry->value_heap();
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                if (front)
+                {
+                    list->pop_front(f);
+                }
+                else
+                {
+                    list->pop_back(f);
+                }
+            }
+            heap_bytes += entry->value_heap();
+            if (list->size() == 0)
+            {
+                remove(entry);
+            }
+            return n;
+        }
+        // Finds or inserts `key`, ignoring any deadline, and records the access.
+        Entry *insert(std::string_view key) { return insert(key, SwissTable<Entry>::hash_of(key)); }
+        Entry *insert(std::string_view key, std::size_t hash);
+        void set_value(Entry *entry, std::string_view value);
+        void set_value(Entry *entry, long long value);
+        void remove(Entry *entry);
+        void remove_expired(Entry *entry);
 
-        bool purge_if_expired(const std::string &key);
+        // Records an access for the LRU/LFU policies; a no-op otherwise.
+        void touch(Entry *entry, bool created = false);
+        uint64_t eviction_score(const Entry &entry) const;
+        bool evict_one();
     };
 }
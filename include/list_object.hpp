@@ -0,0 +1,96 @@
+#pragma once
+#include <cstddef>
+#include <deque>
+#include <string_view>
+#include <utility>
+#include "listpack.hpp"
+
+namespace tr
+{
+    // The entries LRANGE and LTRIM select out of a list of `size`: `start`
+    // to `stop` inclusive, counting from the end when negative, clamped to
+    // the list. Returns the first and how many.
+    std::pair<std::size_t, std::size_t> list_range(long long start, long long stop, std::size_t size);
+
+    // The value of a list key, after Redis's quicklist: a run of Listpack
+    // nodes of a few KB each rather than a heap node per entry. Pushes and
+    // pops touch one end node, and a range is a walk through packed bytes
+    // that hops nodes rarely. The nodes sit in a deque, which gives the same
+    // end operations as quicklist's doubly linked list; nothing is ever
+    // inserted in the middle.
+    class ListObject
+    {
+    public:
+        // list-max-listpack-size: a positive fill caps the entries of a node,
+        // a negative one its bytes, -1 to -5 meaning 4, 8, 16, 32 or 64 KB.
+        static constexpr int DEFAULT_FILL = -2;
+
+        std::size_t size() const { return count; }
+
+        void push_front(std::string_view value, int fill);
+
+        void push_back(std::string_view value, int fill);
+
+        // Calls `f` with a view of the first (last) entry, then removes it.
+        // The list must not be empty.
+        template <typename F>
+        void pop_front(F &&f)
+        {
+            Listpack &node = nodes.front();
+            f(node.get(0));
+            erase_from(nodes.begin(), 0);
+        }
+
+        template <typename F>
+        void pop_back(F &&f)
+        {
+            Listpack &node = nodes.back();
+            std::size_t pos = node.last();
+            f(node.get(pos));
+            erase_from(nodes.end() - 1, pos);
+        }
+
+        // The entry at `index`, which must be below size(), found from the
+        // nearer end a node at a time.
+        std::string_view at(std::size_t index) const;
+
+        // Calls `f` with a view of each of the `n` entries from `first` on.
+        template <typename F>
+        void range(std::size_t first, std::size_t n, F &&f) const
+        {
+            auto [node, pos] = locate(first);
+            for (; n > 0; ++node, pos = 0)
+            {
+                for (; pos < node->bytes() && n > 0; pos = node->next(pos), --n)
+                {
+                    f(node->get(pos));
+                }
+            }
+        }
+
+        // Keeps the `n` entries from `first` on, dropping whole nodes before
+        // cutting into the end ones.
+        void trim(std::size_t first, std::size_t n);
+
+        // Bytes held, this object included.
+        std::size_t heap() const { return sizeof(ListObject) + nodes.size() * sizeof(Listpack) + node_bytes; }
+
+        // Moves its nodes out of sparse slab pages. Returns how many moved.
+        std::size_t defrag();
+
+    private:
+        using Nodes = std::deque<Listpack>;
+
+        static bool fits(const Listpack &node, std::size_t value_size, int fill);
+
+        // The node holding entry `index` and the entry's offset in it.
+        std::pair<Nodes::const_iterator, std::size_t> locate(std::size_t index) const;
+
+        // Erases the entry at `pos` of `node`, and the node once empty.
+        void erase_from(Nodes::iterator node, std::size_t pos);
+
+        Nodes nodes;
+        std::size_t count = 0;
+        std::size_t node_bytes = 0; // slab bytes behind the nodes
+    };
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace tr
+{
+    // A sequence of strings packed into one slab chunk, after Redis's
+    // listpack: the compact encoding of small hashes, and of the chunks of
+    // larger structures. Each entry is its length, its bytes, and its length
+    // again, so the sequence can be walked from either end without a
+    // pointer per entry:
+    //
+    //     len < 128:  [len] bytes [len]
+    //     otherwise:  [0x80][len, 4 bytes] bytes [len, 4 bytes][0x80]
+    //
+    // Entries are addressed by byte offset: 0 is the first one and bytes()
+    // is the end. Inserting or erasing shifts the entries after it, which is
+    // cheap only because a listpack is kept small. Like SlabString, must be
+    // destroyed on the thread that filled it.
+    class Listpack
+    {
+    public:
+        Listpack() = default;
+        Listpack(const Listpack &) = delete;
+        Listpack &operator=(const Listpack &) = delete;
+        Listpack(Listpack &&other) noexcept;
+        Listpack &operator=(Listpack &&other) noexcept;
+        ~Listpack();
+
+        // Entries.
+        std::size_t size() const { return count; }
+
+        bool empty() const { return count == 0; }
+
+        // Bytes the entries take; also the end offset.
+        std::size_t bytes() const { return used; }
+
+        // Bytes held from the slab, the unused tail included.
+        std::size_t heap() const { return cap; }
+
+        // Bytes an entry of `n` bytes takes.
+        static std::size_t entry_size(std::size_t n) { return n + 2 * header_size(n); }
+
+        std::string_view get(std::size_t pos) const;
+
+        std::size_t next(std::size_t pos) const;
+
+        // The entry before `pos`, which must not be 0.
+        std::size_t prev(std::size_t pos) const;
+
+        // Offset of the last entry; the listpack must not be empty.
+        std::size_t last() const { return prev(used); }
+
+        // Offset of the first entry among the ones at 0, step, 2 * step, ...
+        // equal to `s`, or bytes() if there is none.
+        std::size_t find(std::string_view s, std::size_t step = 1) const;
+
+        // Inserts `s` before the entry at `pos`, or appends at bytes().
+        void insert(std::size_t pos, std::string_view s);
+
+        void push_back(std::string_view s) { insert(used, s); }
+
+        // Overwrites the entry at `pos`.
+        void replace(std::size_t pos, std::string_view s);
+
+        // Erases `n` entries starting at `pos`.
+        void erase(std::size_t pos, std::size_t n = 1);
+
+        void clear();
+
+        // Moves the bytes to a new chunk when the allocator finds the
+        // current one sparse(). Returns whether they moved.
+        bool defrag();
+
+    private:
+        static constexpr unsigned char LONG = 0x80;
+
+        static std::size_t header_size(std::size_t n) { return n < LONG ? 1 : 5; }
+
+        // Makes room for `grow` more bytes at `pos`, or closes a gap when
+        // negative, keeping the bytes after it.
+        void resize_at(std::size_t pos, std::ptrdiff_t grow);
+
+        static void write_entry(unsigned char *p, std::string_view s);
+
+        unsigned char *data = nullptr;
+        std::size_t used = 0;
+        std::size_t cap = 0;
+        std::size_t count = 0;
+    };
+}
@@ -1,20 +1,25 @@
 #pragma once
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 #include "kvstore.hpp"
+#include "resp.hpp"
 
 namespace tr
 {
     std::vector<std::string> parse_line(const std::string &line);
 
+    // Runs one command through the shared command table and renders the reply
+    // the way redis-cli would print it.
+    std::string eval_command(KVStore &db, std::span<const std::string_view> args);
+
     std::string eval_command(KVStore &db, const std::vector<std::string> &args);
 
-    enum class RespParseStatus
-    {
-        NeedMore,
-        Ok,
-        Error
-    };
+    // Renders the first reply in `out` as eval_command() does.
+    std::string render_reply(const ReplyBuffer &out);
 
+    // Parses one frame from the start of `in` into owned strings. The server
+    // uses RespParser directly; this is the simple one-shot form.
     RespParseStatus parse_resp_array(const std::string &in, std::size_t &consumed, std::vector<std::string> &out);
 }
\ No newline at end of file
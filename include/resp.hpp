@@ -0,0 +1,133 @@
+#pragma once
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+#include <utility>
+#include <vector>
+
+namespace tr
+{
+    enum class RespParseStatus
+    {
+        NeedMore,
+        Ok,
+        Error
+    };
+
+    // Parses a base-10 signed integer that must span the whole of `s`.
+    bool parse_integer(std::string_view s, long long &out);
+
+    // Incremental parser for RESP arrays of bulk strings. Progress through a
+    // partially received frame is kept between calls, so every byte is
+    // examined once no matter how many reads the frame arrives in.
+    class RespParser
+    {
+    public:
+        static constexpr long long MAX_ARRAY_LEN = 1024 * 1024;
+        static constexpr long long DEFAULT_MAX_BULK_LEN = 512LL * 1024 * 1024;
+
+        // `in` starts at the first byte of the frame being parsed. While the
+        // parser reports NeedMore, each call must pass the same bytes plus
+        // whatever has arrived since. On Ok the arguments are appended to `out`
+        // as views into `in` and `consumed` is the frame's length.
+        RespParseStatus parse(std::string_view in, std::size_t &consumed, std::vector<std::string_view> &out);
+
+        // Length of the bulk string the parser is waiting on, or -1 when it is
+        // not in the middle of one.
+        long long pending_bulk_len() const;
+
+        // Offset, relative to the frame start, where the pending bulk string's
+        // bytes begin. Only meaningful when pending_bulk_len() >= 0.
+        std::size_t pending_bulk_offset() const { return pos; }
+
+        void reset();
+
+        // Bulk strings longer than this are a protocol error.
+        void set_max_bulk_len(long long n) { max_bulk_len = n; }
+
+    private:
+        enum class State
+        {
+            ArrayLen,
+            BulkLen,
+            BulkData
+        };
+
+        // Finds the CRLF ending the header line at `pos`, scanning only bytes
+        // not seen by an earlier call.
+        bool find_line_end(std::string_view in, std::size_t &crlf);
+
+        State state = State::ArrayLen;
+        long long remaining = 0;
+        long long bulk_len = 0;
+        std::size_t pos = 0;  // first byte of the element being parsed
+        std::size_t scan = 0; // next byte to search for CRLF
+        long long max_bulk_len = DEFAULT_MAX_BULK_LEN;
+        std::vector<std::pair<std::size_t, std::size_t>> spans;
+    };
+
+    // Encoded replies waiting to be written to one client. Small replies are
+    // packed into a contiguous buffer; bulk payloads of at least LARGE_BULK
+    // bytes become their own exactly sized segment, and go out through
+    // writev without being copied again if the caller hands them over by
+    // value.
+    class ReplyBuffer
+    {
+    public:
+        static constexpr std::size_t LARGE_BULK = 16 * 1024;
+        static constexpr int MAX_IOV = 64;
+
+        void simple(std::string_view s);
+        void error(std::string_view msg, std::string_view code = "ERR");
+        void integer(long long n);
+        void bulk(std::string_view s);
+        void bulk(std::string &&s);
+        void null_bulk();
+        void array_header(std::size_t n);
+        void null_array();
+        void raw(std::string_view bytes);
+
+        // Queues everything pending in `other` after this buffer's replies,
+        // moving large segments instead of copying them, and empties it.
+        void append(ReplyBuffer &&other);
+
+        bool empty() const { return pending == 0; }
+        std::size_t size() const { return pending; }
+
+        // Fills `iov` with up to `max` pending segments and returns how many.
+        int gather(iovec *iov, int max) const;
+
+        // Calls f(bytes) for every pending segment in order, however many.
+        template <typename F>
+        void for_each_segment(F &&f) const
+        {
+            std::size_t offset = head_offset;
+            for (const std::string &seg : segments)
+            {
+                if (seg.size() > offset)
+                {
+                    f(std::string_view(seg).substr(offset));
+                }
+                offset = 0;
+            }
+        }
+
+        // Drops `n` bytes from the front after they were written.
+        void consume(std::size_t n);
+
+        // Writes as much as the socket accepts. Returns false on a hard error;
+        // EAGAIN leaves the remainder queued.
+        bool flush(int fd);
+
+        void swap(ReplyBuffer &other) noexcept;
+
+    private:
+        std::string &tail();
+
+        std::deque<std::string> segments;
+        std::size_t head_offset = 0; // bytes of segments.front() already written
+        std::size_t pending = 0;
+    };
+}
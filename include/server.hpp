@@ -1,13 +1,78 @@
 #pragma once
+#include <chrono>
 #include <cstdint>
-#include "kvstore.hpp"
-#include "repl.hpp"
+#include <string>
+#include "connection.hpp"
 
 namespace tr
 {
+    enum class Backend
+    {
+        Epoll,
+        Uring
+    };
+
+    struct ServerConfig
+    {
+        uint16_t port = 6380;
+        Backend backend = Backend::Epoll;
+        // Threads that read, parse and write sockets. Commands always run on
+        // the event-loop thread, so 1 means fully single-threaded.
+        int io_threads = 1;
+        // Threads that each own a private slice of the keyspace, chosen by
+        // key hash, and their own listener on the port. Commands on another
+        // shard's keys are forwarded to it. 1 means a single store.
+        int shards = 1;
+        // Longest bulk string a client may send.
+        std::size_t max_bulk_len = RespParser::DEFAULT_MAX_BULK_LEN;
+        // Most unparsed input a connection may hold before it is dropped.
+        std::size_t max_query_buffer = DEFAULT_QUERY_LIMIT;
+        OutputLimits output;
+        // Background cycles per second while keys carry a deadline, the
+        // keyspace is being resized, or maxmemory is set.
+        int hz = 10;
+        // 0 means unlimited.
+        std::size_t maxmemory = 0;
+        EvictionPolicy maxmemory_policy = EvictionPolicy::NoEviction;
+        // Largest hashes kept in the packed encoding.
+        HashObject::Limits hash_limits;
+        // list-max-listpack-size; see ListObject::DEFAULT_FILL.
+        int list_fill = ListObject::DEFAULT_FILL;
+        // Largest sets kept as IntSets.
+        SetObject::Limits set_limits;
+        // Largest sorted sets kept in the packed encoding.
+        ZSetObject::Limits zset_limits;
+    };
+
+    // Prepares a freshly accepted connection with the configured limits.
+    void init_connection(Connection &conn, int fd, const ServerConfig &config);
+
+    // Applies the store-wide settings of `config` to `db`.
+    void init_store(KVStore &db, const ServerConfig &config);
+
+    // Whether the loop must wake up for background_cycle().
+    bool background_work(const KVStore &db);
+
+    // Advances the store's LRU/LFU clock, runs one active expiry cycle, and
+    // moves a slice of a running table resize and of a defrag pass when the
+    // slabs are fragmented, then returns when the next cycle is due: a
+    // regular tick away, or sooner if work is left over.
+    std::chrono::steady_clock::time_point background_cycle(KVStore &db, const ServerConfig &config,
+                                                           std::chrono::steady_clock::time_point now);
+
     int run_server(const uint16_t port);
 
-    void handle_client(int client_fd, KVStore &db);
+    int run_server(const ServerConfig &config);
+
+    // io_uring event loop: multishot accept, multishot receives into a
+    // provided-buffer ring, and all sends of a batch submitted together.
+    int run_uring_server(const ServerConfig &config);
+
+    // Shard-per-thread event loops: see ServerConfig::shards.
+    int run_sharded_server(const ServerConfig &config);
+
+    // Creates the bound, non-blocking listening socket, or returns -1.
+    int open_listener(const ServerConfig &config);
 
     bool write_all(int fd, const std::string &s);
-}
\ No newline at end of file
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <charconv>
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include "intset.hpp"
+#include "slab.hpp"
+#include "swiss_table.hpp"
+
+namespace tr
+{
+    // The value of a set key. As in Redis, a set whose members all read
+    // back as integers is an IntSet, a couple of bytes per member and
+    // intersected with SIMD merges. A member that is not an integer, or
+    // growing past `max_intset_entries`, converts it for good to a
+    // SwissTable keyed by member.
+    class SetObject
+    {
+    public:
+        struct Limits
+        {
+            std::size_t max_intset_entries = 512; // set-max-intset-entries
+        };
+
+        SetObject() = default;
+        explicit SetObject(IntSet members) : ints(std::move(members)) {}
+
+        std::size_t size() const { return table ? table->size() : ints.size(); }
+
+        // The members, while the set is an IntSet; nullptr otherwise.
+        const IntSet *int_members() const { return table ? nullptr : &ints; }
+
+        // Returns true if `member` is new.
+        bool add(std::string_view member, const Limits &limits);
+
+        // Returns true if `member` was there.
+        bool remove(std::string_view member);
+
+        bool contains(std::string_view member);
+
+        // Calls f(member) for every member, in no particular order.
+        // Integers are formatted on the stack, so the views last only for
+        // the call.
+        template <typename F>
+        void for_each(F &&f)
+        {
+            if (table)
+            {
+                table->for_each([&](const Member &member) { f(member.key.view()); });
+                return;
+            }
+            ints.for_each([&](int64_t n)
+                          {
+                char digits[20];
+                char *end = std::to_chars(digits, digits + sizeof(digits), n).ptr;
+                f(std::string_view(digits, static_cast<std::size_t>(end - digits))); });
+        }
+
+        // Bytes held, this object included.
+        std::size_t heap() const;
+
+        // Moves its chunks out of sparse slab pages. Returns how many moved.
+        std::size_t defrag();
+
+    private:
+        struct Member
+        {
+            SlabString key;
+        };
+
+        void convert();
+
+        IntSet ints;
+        std::unique_ptr<SwissTable<Member>> table;
+        std::size_t table_strings = 0; // slab bytes behind the table's members
+    };
+}
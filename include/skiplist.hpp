@@ -0,0 +1,122 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include "slab.hpp"
+
+namespace tr
+{
+    // The scores ZRANGEBYSCORE selects: `min` to `max`, each bound
+    // excluded if so marked, as "(1.5" is in Redis.
+    struct ScoreRange
+    {
+        double min = 0;
+        double max = 0;
+        bool min_exclusive = false;
+        bool max_exclusive = false;
+
+        bool above_min(double score) const { return min_exclusive ? score > min : score >= min; }
+        bool below_max(double score) const { return max_exclusive ? score < max : score <= max; }
+    };
+
+    // Redis's zskiplist: members ordered by score, then bytewise by member,
+    // in a linked list with express lanes. Each node is promoted to the
+    // next lane with probability 1/4, and every link records how many nodes
+    // it skips, so the rank of a member and the member at a rank both take
+    // O(log n) steps, as does finding where a score range starts. Nodes
+    // come from the SlabAllocator, sized to their height.
+    class SkipList
+    {
+    public:
+        static constexpr int MAX_LEVEL = 32;
+
+        struct Node;
+
+        struct Level
+        {
+            Node *forward;
+            std::size_t span; // nodes from this one to `forward`
+        };
+
+        struct Node
+        {
+            Node(double score, std::string_view member, int height)
+                : score(score), member(member), height(static_cast<uint32_t>(height))
+            {
+            }
+
+            Level *levels() { return reinterpret_cast<Level *>(this + 1); }
+            const Level *levels() const { return reinterpret_cast<const Level *>(this + 1); }
+
+            const Node *next() const { return levels()[0].forward; }
+            const Node *prev() const { return backward; }
+
+            double score;
+            SlabString member;
+            Node *backward = nullptr;
+            uint32_t height;
+        };
+
+        SkipList();
+        SkipList(const SkipList &) = delete;
+        SkipList &operator=(const SkipList &) = delete;
+        ~SkipList();
+
+        std::size_t size() const { return length; }
+
+        // `member` must not be in the list yet.
+        void insert(double score, std::string_view member);
+
+        // Returns true if `member` was there with `score`.
+        bool erase(double score, std::string_view member);
+
+        // Moves `member` from `score` to `to`, in place when its neighbours
+        // allow.
+        void update(double score, std::string_view member, double to);
+
+        // The 0-based rank of `member`, which must be there with `score`.
+        std::size_t rank(double score, std::string_view member) const;
+
+        // The node at 0-based rank `index`, which must be below size().
+        const Node *at(std::size_t index) const;
+
+        const Node *last() const { return tail; }
+
+        // The rank of the first member with a score in `range`, and how many
+        // have one.
+        std::pair<std::size_t, std::size_t> ranks_in(const ScoreRange &range) const;
+
+        // Bytes held by the nodes and their members.
+        std::size_t heap() const { return node_bytes; }
+
+        // Moves nodes out of sparse slab pages. Returns how many moved.
+        std::size_t defrag();
+
+    private:
+        static std::size_t node_size(int height) { return sizeof(Node) + static_cast<std::size_t>(height) * sizeof(Level); }
+
+        static bool before(const Node *node, double score, std::string_view member)
+        {
+            return node->score < score || (node->score == score && node->member.view() < member);
+        }
+
+        int random_level();
+
+        Node *make_node(int height, double score, std::string_view member);
+
+        void free_node(Node *node);
+
+        // Fills update[i] with the last node on level i before (score, member).
+        void find_update(double score, std::string_view member, Node **update) const;
+
+        void unlink(Node *node, Node **update);
+
+        Node *header = nullptr;
+        Node *tail = nullptr;
+        std::size_t length = 0;
+        int level = 1;
+        uint64_t seed = 0x9E3779B97F4A7C15ull;
+        std::size_t node_bytes = 0;
+    };
+}
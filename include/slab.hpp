@@ -0,0 +1,226 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+namespace tr
+{
+    // Size-class allocator for the store's keys and values, in the style of
+    // memcached's slabs. Chunks of one class are carved from PAGE_SIZE pages
+    // aligned to their size, so a chunk finds its page by masking its
+    // address, and a page whose chunks are all free again is handed back to
+    // the system, keeping one spare per class. Larger requests go straight to
+    // operator new. Like BufferPool there is one per thread, not locked.
+    class SlabAllocator
+    {
+    public:
+        static constexpr std::size_t PAGE_SIZE = 256 * 1024;
+        static constexpr std::size_t MAX_CHUNK = 16 * 1024;
+
+        struct Stats
+        {
+            std::size_t used = 0;      // bytes asked for
+            std::size_t allocated = 0; // bytes in the chunks handed out
+            std::size_t reserved = 0;  // bytes held from the system
+        };
+
+        static SlabAllocator &local();
+
+        // Bytes actually set aside for a request of `n`.
+        static std::size_t chunk_size(std::size_t n) { return n > MAX_CHUNK ? n : CLASSES.sizes[class_of(n)]; }
+
+        SlabAllocator();
+        SlabAllocator(const SlabAllocator &) = delete;
+        SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+        void *allocate(std::size_t n);
+
+        // `n` must be the size `p` was allocated with.
+        void deallocate(void *p, std::size_t n);
+
+        // Records that a chunk allocated for `from` bytes now holds `to`,
+        // which chunk_size() maps to the same chunk.
+        void resized(std::size_t from, std::size_t to) { totals.used += to - from; }
+
+        const Stats &stats() const { return totals; }
+
+        // Whether moving the chunk at `p` would help empty its page: like
+        // jemalloc's defrag hint, the page is not full but no more used than
+        // the average one of its class, and is not the one new chunks come
+        // from.
+        bool sparse(const void *p) const;
+
+        // Whether pages hold enough free chunks that a defrag pass is worth
+        // its cost. Like Redis's active-defrag thresholds: over 10% of the
+        // reserved bytes, and more than DEFRAG_MIN_BYTES.
+        bool fragmented() const;
+
+    private:
+        static constexpr std::size_t DEFRAG_MIN_BYTES = 32 << 20;
+        static constexpr std::size_t REGION_PAGES = 64;
+
+        struct Page;
+
+        struct SizeClass
+        {
+            uint32_t size = 0;
+            uint32_t empty_pages = 0;
+            Page *partial = nullptr; // pages with a free or never-used chunk
+            std::size_t pages = 0;
+            std::size_t live = 0;
+        };
+
+        static constexpr std::size_t GRANULE = 16;
+        static constexpr std::size_t MAX_CLASSES = 64;
+
+        // Multiples of 16 up to 128 bytes, then about 25% apart, so no chunk
+        // wastes more than a fifth of itself.
+        struct ClassTable
+        {
+            std::array<uint32_t, MAX_CLASSES> sizes{};
+            std::size_t count = 0;
+            // Class of each request size, in GRANULE steps.
+            std::array<uint8_t, MAX_CHUNK / GRANULE + 1> lookup{};
+
+            constexpr ClassTable()
+            {
+                std::size_t size = GRANULE;
+                for (;;)
+                {
+                    sizes[count++] = static_cast<uint32_t>(size);
+                    if (size == MAX_CHUNK)
+                    {
+                        break;
+                    }
+                    std::size_t next = size < 128 ? size + GRANULE : (size + size / 4 + GRANULE - 1) / GRANULE * GRANULE;
+                    size = std::min(next, MAX_CHUNK);
+                }
+                std::size_t cls = 0;
+                for (std::size_t g = 0; g < lookup.size(); ++g)
+                {
+                    while (sizes[cls] < g * GRANULE)
+                    {
+                        ++cls;
+                    }
+                    lookup[g] = static_cast<uint8_t>(cls);
+                }
+            }
+        };
+
+        static const ClassTable CLASSES;
+
+        static std::size_t class_of(std::size_t n) { return CLASSES.lookup[(n + GRANULE - 1) / GRANULE]; }
+        static void unlink(SizeClass &cls, Page *page);
+        void *take_page();
+        void give_back(void *page);
+
+        SizeClass classes[MAX_CLASSES];
+        Stats totals;
+        std::vector<void *> free_pages; // released, ready for any class
+        char *region_next = nullptr;
+        std::size_t region_left = 0;
+    };
+
+    inline constexpr SlabAllocator::ClassTable SlabAllocator::CLASSES{};
+
+    // Keeps up to 15 bytes inline and longer strings, up to 4 GB, in a chunk
+    // from the thread's SlabAllocator, all in 16 bytes. Must be destroyed on
+    // the thread that filled it.
+    class SlabString
+    {
+    public:
+        static constexpr std::size_t INLINE = 15;
+
+        SlabString() { bytes[INLINE] = 0; }
+        explicit SlabString(std::string_view s) : SlabString() { assign(s); }
+        SlabString(const SlabString &) = delete;
+        SlabString &operator=(const SlabString &) = delete;
+
+        SlabString(SlabString &&other) noexcept
+        {
+            std::memcpy(bytes, other.bytes, sizeof(bytes));
+            other.bytes[INLINE] = 0;
+        }
+
+        SlabString &operator=(SlabString &&other) noexcept
+        {
+            if (this != &other)
+            {
+                release();
+                std::memcpy(bytes, other.bytes, sizeof(bytes));
+                other.bytes[INLINE] = 0;
+            }
+            return *this;
+        }
+
+        SlabString &operator=(std::string_view s)
+        {
+            assign(s);
+            return *this;
+        }
+
+        ~SlabString() { release(); }
+
+        void assign(std::string_view s)
+        {
+            // The common overwrite, same length as before, stays inline here.
+            if (on_heap() && s.size() == size())
+            {
+                std::memmove(const_cast<char *>(data()), s.data(), s.size());
+                return;
+            }
+            reassign(s);
+        }
+
+        std::size_t size() const
+        {
+            if (!on_heap())
+            {
+                return static_cast<unsigned char>(bytes[INLINE]);
+            }
+            uint32_t n;
+            std::memcpy(&n, bytes + sizeof(char *), sizeof(n));
+            return n;
+        }
+
+        const char *data() const
+        {
+            if (!on_heap())
+            {
+                return bytes;
+            }
+            char *p;
+            std::memcpy(&p, bytes, sizeof(p));
+            return p;
+        }
+
+        // Moves the bytes to a new chunk when the allocator finds the
+        // current one sparse(). Returns whether they moved.
+        bool defrag();
+
+        std::string_view view() const { return {data(), size()}; }
+        operator std::string_view() const { return view(); }
+
+        // Bytes held outside the object: its chunk, or 0 when inline.
+        std::size_t heap() const { return on_heap() ? SlabAllocator::chunk_size(size()) : 0; }
+
+        friend bool operator==(const SlabString &a, std::string_view b) { return a.view() == b; }
+
+    private:
+        // Marks the heap layout in the last byte; inline strings keep their
+        // length there, which is at most INLINE.
+        static constexpr unsigned char HEAP = 0xff;
+
+        bool on_heap() const { return static_cast<unsigned char>(bytes[INLINE]) == HEAP; }
+        void reassign(std::string_view s);
+        void release();
+
+        // Inline: the characters, then the length. On the heap: the chunk
+        // pointer, the 32-bit length, then HEAP.
+        alignas(8) char bytes[16];
+    };
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace tr
+{
+    // Bounded single-producer single-consumer ring. One thread pushes and
+    // one thread pops, with no locks: each side owns one index and only
+    // reads the other's, and the two live on separate cache lines so they
+    // do not bounce between cores on every operation.
+    template <typename T>
+    class SpscQueue
+    {
+    public:
+        // `capacity` must be a power of two.
+        explicit SpscQueue(std::size_t capacity) : mask(capacity - 1), slots(new T[capacity]) {}
+
+        SpscQueue(const SpscQueue &) = delete;
+        SpscQueue &operator=(const SpscQueue &) = delete;
+
+        // Producer side. Moves from `value` only if there is room.
+        bool try_push(T &&value)
+        {
+            std::size_t t = tail.load(std::memory_order_relaxed);
+            if (t - cached_head > mask)
+            {
+                cached_head = head.load(std::memory_order_acquire);
+                if (t - cached_head > mask)
+                {
+                    return false;
+                }
+            }
+            slots[t & mask] = std::move(value);
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side.
+        bool try_pop(T &out)
+        {
+            std::size_t h = head.load(std::memory_order_relaxed);
+            if (h == cached_tail)
+            {
+                cached_tail = tail.load(std::memory_order_acquire);
+                if (h == cached_tail)
+                {
+                    return false;
+                }
+            }
+            out = std::move(slots[h & mask]);
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Either side; only a hint while the other side is running.
+        bool empty() const
+        {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+        }
+
+    private:
+        static constexpr std::size_t LINE = 64;
+
+        const std::size_t mask;
+        const std::unique_ptr<T[]> slots;
+        alignas(LINE) std::atomic<std::size_t> head{0}; // written by the consumer
+        std::size_t cached_tail = 0;                     // consumer's last view of tail
+        alignas(LINE) std::atomic<std::size_t> tail{0}; // written by the producer
+        std::size_t cached_head = 0;                     // producer's last view of head
+    };
+}
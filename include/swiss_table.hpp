@@ -0,0 +1,510 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <new>
+#include <string_view>
+#include <utility>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace tr
+{
+    // Open-addressing hash table in the style of Abseil's Swiss tables. Next
+    // to the slots sits one control byte per slot: EMPTY, DELETED, or the top
+    // bit plus the low 7 bits of the key's hash. A lookup compares 16 control bytes at once
+    // and only looks at slots whose byte matches, so a miss rarely touches a
+    // slot and a hit usually touches exactly one.
+    //
+    // Resizing is incremental, as in Redis's dict: a resize allocates new
+    // arrays but keeps the old ones, and every find, insert or erase by key
+    // moves the next MIGRATE_STEP old slots across, so no single call pays
+    // for rehashing the whole table. Lookups check both while that runs.
+    // Large arrays are mapped directly: fresh pages are already all EMPTY,
+    // and the old slots are unmapped piece by piece as they drain, so
+    // neither setting up nor tearing down a big table stalls one call.
+    //
+    // Slot must be default-constructible, movable, and have a `key` that
+    // compares equal to a std::string_view. Slots live inline in one array;
+    // pointers to them are invalidated by any find, insert or erase by key.
+    template <typename Slot>
+    class SwissTable
+    {
+    public:
+        static constexpr std::size_t MIGRATE_STEP = 16;
+
+        SwissTable() = default;
+        SwissTable(const SwissTable &) = delete;
+        SwissTable &operator=(const SwissTable &) = delete;
+
+        ~SwissTable()
+        {
+            release(main);
+            release(old);
+        }
+
+        std::size_t size() const { return main.count + old.count; }
+
+        // Slots in the current arrays, the ones a resize moves into.
+        std::size_t capacity() const { return main.cap; }
+
+        bool resizing() const { return old.cap != 0; }
+
+        Slot *find(std::string_view key) { return find(key, hash_key(key)); }
+
+        // Batched lookups hash every key first and prefetch() each, then
+        // prefetch_slot() each, then probe with the hashes they already
+        // have, so the cache misses of the whole batch overlap instead of
+        // queueing one behind the other.
+        static std::size_t hash_of(std::string_view key) { return hash_key(key); }
+
+        // Pulls in the first control group `hash` probes.
+        void prefetch(std::size_t hash) const
+        {
+            for (const Arrays *t : {&main, &old})
+            {
+                if (t->cap != 0)
+                {
+                    __builtin_prefetch(t->ctrl + ((hash >> 7) & (t->cap - 1)));
+                }
+            }
+        }
+
+        // Pulls in the first slot of that group whose control byte matches,
+        // once prefetch() has brought the group in.
+        void prefetch_slot(std::size_t hash) const
+        {
+            for (const Arrays *t : {&main, &old})
+            {
+                if (t->cap != 0)
+                {
+                    std::size_t pos = (hash >> 7) & (t->cap - 1);
+                    uint32_t bits = Group(t->ctrl + pos).match(full_ctrl(hash));
+                    if (bits != 0)
+                    {
+                        __builtin_prefetch(t->slots + ((pos + static_cast<std::size_t>(std::countr_zero(bits))) & (t->cap - 1)));
+                    }
+                }
+            }
+        }
+
+        Slot *find(std::string_view key, std::size_t hash)
+        {
+            if (resizing())
+            {
+                migrate(MIGRATE_STEP);
+            }
+            if (Slot *slot = find_in(main, key, hash))
+            {
+                return slot;
+            }
+            return resizing() ? find_in(old, key, hash) : nullptr;
+        }
+
+        // Returns the slot for `key`, default-constructing one with that key
+        // if it was absent. The bool is true when the slot is new.
+        std::pair<Slot *, bool> insert(std::string_view key) { return insert(key, hash_key(key)); }
+
+        std::pair<Slot *, bool> insert(std::string_view key, std::size_t hash)
+        {
+            if (Slot *found = find(key, hash))
+            {
+                return {found, false};
+            }
+            if (main.count + main.tombstones + 1 > max_load(main.cap))
+            {
+                migrate(old.cap); // inserts outran a resize; finish it first
+                // Mostly tombstones: clean them out at the same size.
+                start_resize(main.cap != 0 && main.count + 1 <= max_load(main.cap) / 2 ? main.cap : grow_to(main.cap));
+            }
+            Slot *slot = new (claim(main, hash)) Slot();
+            slot->key = key;
+            return {slot, true};
+        }
+
+        // Moves nothing, so `f` in scan() may call it.
+        void erase(Slot *slot)
+        {
+            Arrays &t = owns(old, slot) ? old : main;
+            std::size_t i = static_cast<std::size_t>(slot - t.slots);
+            slot->~Slot();
+            --t.count;
+            if (never_full_window(t, i))
+            {
+                set_ctrl(t, i, EMPTY);
+                return;
+            }
+            set_ctrl(t, i, DELETED);
+            ++t.tombstones;
+        }
+
+        bool erase(std::string_view key)
+        {
+            Slot *slot = find(key);
+            if (slot == nullptr)
+            {
+                return false;
+            }
+            erase(slot);
+            return true;
+        }
+
+        // Moves up to `n` old slots into the new arrays, so an idle caller
+        // can finish a resize. Returns true while one is still running.
+        bool migrate(std::size_t n)
+        {
+            std::size_t end = std::min(old.cap, migrate_pos + n);
+            for (; migrate_pos < end; ++migrate_pos)
+            {
+                if (old.ctrl[migrate_pos] < 0)
+                {
+                    Slot &from = old.slots[migrate_pos];
+                    new (claim(main, hash_key(from.key))) Slot(std::move(from));
+                    from.~Slot();
+                    // Still a tombstone, so probes for the rest carry on past it.
+                    set_ctrl(old, migrate_pos, DELETED);
+                    --old.count;
+                }
+            }
+            if (!resizing())
+            {
+                return false;
+            }
+            if (migrate_pos == old.cap)
+            {
+                deallocate(old);
+                old = Arrays{};
+                migrate_pos = 0;
+                return false;
+            }
+            if (old.mapped)
+            {
+                std::byte *drained = page_floor(reinterpret_cast<std::byte *>(old.slots + migrate_pos));
+                if (drained >= old.unmapped + UNMAP_CHUNK)
+                {
+                    ::munmap(old.unmapped, static_cast<std::size_t>(drained - old.unmapped));
+                    old.unmapped = drained;
+                }
+            }
+            return true;
+        }
+
+        template <typename F>
+        void for_each(F &&f)
+        {
+            for (Arrays *t : {&old, &main})
+            {
+                for (std::size_t i = 0; i < t->cap; ++i)
+                {
+                    if (t->ctrl[i] < 0)
+                    {
+                        f(t->slots[i]);
+                    }
+                }
+            }
+        }
+
+        // Indexes scan() walks: the old slots of a running resize, then the
+        // current ones. They shift when a resize starts or ends, so a scan
+        // may then skip or revisit some slots.
+        std::size_t scan_extent() const { return old.cap + main.cap; }
+
+        // Visits the full slots among the `limit` indexes starting at
+        // `cursor`, until `f` returns false, and returns the index to resume
+        // from; 0 once the end is reached. `f` may erase the slot it is given.
+        template <typename F>
+        std::size_t scan(std::size_t cursor, std::size_t limit, F &&f)
+        {
+            std::size_t extent = scan_extent();
+            if (cursor >= extent)
+            {
+                cursor = 0;
+            }
+            std::size_t end = std::min(extent, cursor + limit);
+            for (std::size_t i = cursor; i < end; ++i)
+            {
+                Arrays &t = i < old.cap ? old : main;
+                std::size_t j = i < old.cap ? i : i - old.cap;
+                if (t.ctrl[j] < 0 && !f(t.slots[j]))
+                {
+                    return i + 1 == extent ? 0 : i + 1;
+                }
+            }
+            return end == extent ? 0 : end;
+        }
+
+        // Bytes held by the control and slot arrays, excluding anything the
+        // slots themselves point to.
+        std::size_t footprint() const { return bytes(main.cap) + bytes(old.cap); }
+
+    private:
+        static constexpr std::size_t GROUP_WIDTH = 16;
+        static constexpr int8_t EMPTY = 0;
+        static constexpr int8_t DELETED = 1;
+        // Below this many bytes, arrays come from operator new.
+        static constexpr std::size_t MAP_THRESHOLD = 1 << 20;
+        // Drained old slots are unmapped once this many bytes have piled up.
+        static constexpr std::size_t UNMAP_CHUNK = 2 << 20;
+
+        // One allocation: the control bytes, then the slots.
+        struct Arrays
+        {
+            std::byte *memory = nullptr;
+            int8_t *ctrl = nullptr;
+            Slot *slots = nullptr;
+            std::size_t cap = 0;
+            std::size_t count = 0;
+            std::size_t tombstones = 0;
+            bool mapped = false;
+            // Mapped arrays only: pages of drained old slots below this are
+            // already unmapped.
+            std::byte *unmapped = nullptr;
+        };
+
+        // 16 control bytes. Full slots have the top bit set, so "empty or
+        // deleted" is simply "not negative".
+        struct Group
+        {
+#ifdef __SSE2__
+            explicit Group(const int8_t *p) : bytes(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))) {}
+
+            uint32_t match(int8_t h) const
+            {
+                return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(h))));
+            }
+
+            uint32_t match_free() const
+            {
+                return static_cast<uint32_t>(~_mm_movemask_epi8(bytes)) & 0xffff;
+            }
+
+            __m128i bytes;
+#else
+            explicit Group(const int8_t *p) { std::memcpy(bytes, p, GROUP_WIDTH); }
+
+            uint32_t match(int8_t h) const
+            {
+                uint32_t bits = 0;
+                for (std::size_t i = 0; i < GROUP_WIDTH; ++i)
+                {
+                    bits |= static_cast<uint32_t>(bytes[i] == h) << i;
+                }
+                return bits;
+            }
+
+            uint32_t match_free() const
+            {
+                uint32_t bits = 0;
+                for (std::size_t i = 0; i < GROUP_WIDTH; ++i)
+                {
+                    bits |= static_cast<uint32_t>(bytes[i] >= 0) << i;
+                }
+                return bits;
+            }
+
+            int8_t bytes[GROUP_WIDTH];
+#endif
+        };
+
+        static std::size_t hash_key(std::string_view key) { return std::hash<std::string_view>{}(key); }
+
+        static int8_t full_ctrl(std::size_t hash) { return static_cast<int8_t>(0x80 | (hash & 0x7f)); }
+
+        static std::size_t max_load(std::size_t capacity) { return capacity - capacity / 8; }
+
+        static std::size_t grow_to(std::size_t capacity) { return capacity == 0 ? GROUP_WIDTH : capacity * 2; }
+
+        // The control array is followed by a copy of its first GROUP_WIDTH
+        // bytes, so a group can be loaded at any position without wrapping.
+        static std::size_t slots_offset(std::size_t capacity)
+        {
+            std::size_t bytes = capacity + GROUP_WIDTH;
+            return (bytes + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+        }
+
+        static std::size_t bytes(std::size_t capacity) { return capacity == 0 ? 0 : slots_offset(capacity) + capacity * sizeof(Slot); }
+
+        static bool owns(const Arrays &t, const Slot *slot)
+        {
+            return t.cap != 0 && !std::less<const Slot *>{}(slot, t.slots) && std::less<const Slot *>{}(slot, t.slots + t.cap);
+        }
+
+        static Slot *find_in(Arrays &t, std::string_view key, std::size_t hash)
+        {
+            if (t.cap == 0)
+            {
+                return nullptr;
+            }
+            int8_t h2 = full_ctrl(hash);
+            std::size_t pos = (hash >> 7) & (t.cap - 1);
+            for (std::size_t step = GROUP_WIDTH;; step += GROUP_WIDTH)
+            {
+                Group group(t.ctrl + pos);
+                for (uint32_t bits = group.match(h2); bits != 0; bits &= bits - 1)
+                {
+                    std::size_t i = (pos + static_cast<std::size_t>(std::countr_zero(bits))) & (t.cap - 1);
+                    if (t.slots[i].key == key)
+                    {
+                        return &t.slots[i];
+                    }
+                }
+                if (group.match(EMPTY) != 0)
+                {
+                    return nullptr;
+                }
+                pos = (pos + step) & (t.cap - 1);
+            }
+        }
+
+        static void set_ctrl(Arrays &t, std::size_t i, int8_t h)
+        {
+            t.ctrl[i] = h;
+            if (i < GROUP_WIDTH)
+            {
+                t.ctrl[t.cap + i] = h;
+            }
+        }
+
+        // True when every 16-byte window covering slot i has an empty byte.
+        // No probe can then have walked past i, so it may become EMPTY
+        // rather than a tombstone.
+        static bool never_full_window(const Arrays &t, std::size_t i)
+        {
+            uint32_t before = Group(t.ctrl + ((i - GROUP_WIDTH) & (t.cap - 1))).match(EMPTY);
+            uint32_t after = Group(t.ctrl + i).match(EMPTY);
+            return before != 0 && after != 0 &&
+                   static_cast<std::size_t>(std::countr_zero(after) + std::countl_zero(static_cast<uint16_t>(before))) < GROUP_WIDTH;
+        }
+
+        // Marks the first free slot on `hash`'s probe sequence full and
+        // returns its storage, for the caller to construct a Slot in.
+        static void *claim(Arrays &t, std::size_t hash)
+        {
+            std::size_t pos = (hash >> 7) & (t.cap - 1);
+            for (std::size_t step = GROUP_WIDTH;; step += GROUP_WIDTH)
+            {
+                uint32_t bits = Group(t.ctrl + pos).match_free();
+                if (bits != 0)
+                {
+                    std::size_t i = (pos + static_cast<std::size_t>(std::countr_zero(bits))) & (t.cap - 1);
+                    if (t.ctrl[i] == DELETED)
+                    {
+                        --t.tombstones;
+                    }
+                    set_ctrl(t, i, full_ctrl(hash));
+                    ++t.count;
+                    return &t.slots[i];
+                }
+                pos = (pos + step) & (t.cap - 1);
+            }
+        }
+
+        static std::size_t page_size()
+        {
+            static const std::size_t size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+            return size;
+        }
+
+        static std::byte *page_floor(std::byte *p)
+        {
+            return reinterpret_cast<std::byte *>(reinterpret_cast<uintptr_t>(p) & ~(page_size() - 1));
+        }
+
+        static std::byte *page_ceil(std::byte *p) { return page_floor(p + page_size() - 1); }
+
+        static Arrays allocate(std::size_t cap)
+        {
+            Arrays t;
+            std::size_t n = bytes(cap);
+            if (n >= MAP_THRESHOLD)
+            {
+                void *p = ::mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p == MAP_FAILED)
+                {
+                    throw std::bad_alloc();
+                }
+                t.memory = static_cast<std::byte *>(p);
+                t.mapped = true;
+            }
+            else
+            {
+                t.memory = static_cast<std::byte *>(::operator new(n));
+                std::memset(t.memory, EMPTY, cap + GROUP_WIDTH);
+            }
+            t.ctrl = reinterpret_cast<int8_t *>(t.memory);
+            t.slots = reinterpret_cast<Slot *>(t.memory + slots_offset(cap));
+            t.cap = cap;
+            t.unmapped = page_ceil(reinterpret_cast<std::byte *>(t.slots));
+            return t;
+        }
+
+        // Frees the memory only; the slots must already be destroyed.
+        static void deallocate(Arrays &t)
+        {
+            if (!t.mapped)
+            {
+                ::operator delete(t.memory);
+                return;
+            }
+            std::byte *end = t.memory + bytes(t.cap);
+            std::byte *kept = page_ceil(reinterpret_cast<std::byte *>(t.slots));
+            if (t.unmapped > kept)
+            {
+                // The middle is gone; unmap what is left on either side.
+                ::munmap(t.memory, static_cast<std::size_t>(kept - t.memory));
+                if (end > t.unmapped)
+                {
+                    ::munmap(t.unmapped, static_cast<std::size_t>(end - t.unmapped));
+                }
+                return;
+            }
+            ::munmap(t.memory, bytes(t.cap));
+        }
+
+        // The current arrays become the old ones, to be drained by migrate().
+        // At MIGRATE_STEP slots per insert they are empty long before the new
+        // arrays could fill up.
+        void start_resize(std::size_t new_cap)
+        {
+            old = main;
+            migrate_pos = 0;
+            main = allocate(new_cap);
+            if (old.count == 0)
+            {
+                if (old.cap != 0)
+                {
+                    deallocate(old);
+                }
+                old = Arrays{};
+            }
+        }
+
+        static void release(Arrays &t)
+        {
+            if (t.cap == 0)
+            {
+                return;
+            }
+            for (std::size_t i = 0; i < t.cap; ++i)
+            {
+                if (t.ctrl[i] < 0)
+                {
+                    t.slots[i].~Slot();
+                }
+            }
+            deallocate(t);
+            t = Arrays{};
+        }
+
+        Arrays main;
+        Arrays old; // what a running resize is moving out of
+        std::size_t migrate_pos = 0;
+    };
+}
@@ -0,0 +1,120 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include "listpack.hpp"
+#include "skiplist.hpp"
+#include "slab.hpp"
+#include "swiss_table.hpp"
+
+namespace tr
+{
+    // The value of a sorted set key. As in Redis, a small one is a Listpack
+    // of members each followed by its score, kept in order, so ranges are
+    // walks through packed bytes. Unlike Redis, the score is stored as the
+    // eight bytes of the double rather than as text, so walks that compare
+    // scores do not parse them. Past `max_entries` members, or a member
+    // longer than `max_value` bytes, it is converted for good to a
+    // SwissTable from member to score, for ZSCORE and for finding a
+    // member's score to update, beside a SkipList in (score, member) order
+    // for ranks and ranges. Each holds its own copy of the member.
+    class ZSetObject
+    {
+    public:
+        struct Limits
+        {
+            std::size_t max_entries = 128; // zset-max-listpack-entries
+            std::size_t max_value = 64;    // zset-max-listpack-value
+        };
+
+        std::size_t size() const { return index ? index->order.size() : packed.size() / 2; }
+
+        bool is_packed() const { return !index; }
+
+        std::optional<double> score(std::string_view member);
+
+        // Adds `member` with `score`, or moves it there. Returns true if it
+        // is new.
+        bool set(std::string_view member, double score, const Limits &limits);
+
+        bool remove(std::string_view member);
+
+        // The 0-based rank of `member` by ascending score.
+        std::optional<std::size_t> rank(std::string_view member);
+
+        // The ascending rank of the first member with a score in `range`,
+        // and how many have one.
+        std::pair<std::size_t, std::size_t> ranks_in(const ScoreRange &range);
+
+        // Calls f(member, score) for each of the `n` members from rank
+        // `first` on, by ascending score, or descending with `reverse`,
+        // which also counts `first` from the highest.
+        template <typename F>
+        void range(std::size_t first, std::size_t n, bool reverse, F &&f)
+        {
+            if (n == 0)
+            {
+                return;
+            }
+            if (index)
+            {
+                const SkipList::Node *node = index->order.at(reverse ? size() - 1 - first : first);
+                for (; n > 0; --n, node = reverse ? node->prev() : node->next())
+                {
+                    f(node->member.view(), node->score);
+                }
+                return;
+            }
+            std::size_t pos = pair_at(reverse ? size() - 1 - first : first);
+            for (; n > 0; --n)
+            {
+                f(packed.get(pos), packed_score(pos));
+                if (n > 1)
+                {
+                    pos = reverse ? packed.prev(packed.prev(pos)) : packed.next(packed.next(pos));
+                }
+            }
+        }
+
+        // Bytes held, this object included.
+        std::size_t heap() const;
+
+        // Moves its chunks out of sparse slab pages. Returns how many moved.
+        std::size_t defrag();
+
+    private:
+        struct Member
+        {
+            SlabString key;
+            double score = 0;
+        };
+
+        struct Index
+        {
+            SwissTable<Member> scores;
+            SkipList order;
+        };
+
+        // The score of the member at `pos`.
+        double packed_score(std::size_t pos) const
+        {
+            double score;
+            std::memcpy(&score, packed.get(packed.next(pos)).data(), sizeof(score));
+            return score;
+        }
+
+        // The offset of the member of rank `i`.
+        std::size_t pair_at(std::size_t i) const;
+
+        void packed_insert(std::string_view member, double score);
+
+        void convert();
+
+        Listpack packed;
+        std::unique_ptr<Index> index;
+        std::size_t table_strings = 0; // slab bytes behind the table's members
+    };
+}
@@ -0,0 +1,50 @@
+#include "blocking.hpp"
+#include "commands.hpp"
+
+namespace tr
+{
+    void BlockedClients::block(Waiter &w, std::span<const std::string_view> args)
+    {
+        key_indexes.clear();
+        command_keys(*lookup_command(args[0]), args, key_indexes);
+        for (std::size_t i : key_indexes)
+        {
+            auto [it, created] = queues.try_emplace(std::string(args[i]));
+            if (created)
+            {
+                db.watch(args[i]);
+            }
+            w.keys.emplace_back(args[i]);
+            w.queued.push_back(it->second.insert(it->second.end(), &w));
+        }
+        auto timeout = blocking_timeout(args);
+        if (timeout.count() > 0)
+        {
+            w.timeout = timeouts.emplace(Clock::now() + timeout, &w);
+            w.has_timeout = true;
+        }
+        ++waiters;
+    }
+
+    void BlockedClients::unblock(Waiter &w)
+    {
+        for (std::size_t i = 0; i < w.keys.size(); ++i)
+        {
+            auto it = queues.find(w.keys[i]);
+            it->second.erase(w.queued[i]);
+            if (it->second.empty())
+            {
+                db.unwatch(w.keys[i]);
+                queues.erase(it);
+            }
+        }
+        if (w.has_timeout)
+        {
+            timeouts.erase(w.timeout);
+            w.has_timeout = false;
+        }
+        w.keys.clear();
+        w.queued.clear();
+        --waiters;
+    }
+}
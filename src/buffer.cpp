@@ -0,0 +1,208 @@
+#include "buffer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+namespace tr
+{
+    namespace
+    {
+        // Chunks move between threads BATCH at a time, linked through their
+        // first bytes. Each depot slot holds one batch or nothing: a batch is
+        // parked with a compare-and-swap from null and taken with an
+        // exchange, so the depot needs no lock and has no ABA problem.
+        constexpr std::size_t BATCH = 32;
+        constexpr std::size_t DEPOT_SLOTS = BufferPool::MAX_CACHED / BATCH;
+
+        std::atomic<char *> depot[DEPOT_SLOTS];
+
+        void link(char *chunk, char *next)
+        {
+            std::memcpy(chunk, &next, sizeof(next));
+        }
+
+        char *linked(const char *chunk)
+        {
+            char *next;
+            std::memcpy(&next, chunk, sizeof(next));
+            return next;
+        }
+
+        struct ChunkCache
+        {
+            std::vector<char *> chunks;
+
+            ~ChunkCache()
+            {
+                for (char *chunk : chunks)
+                {
+                    delete[] chunk;
+                }
+            }
+
+            // Refills from the depot. Returns false when it is empty.
+            bool take_batch()
+            {
+                for (std::atomic<char *> &slot : depot)
+                {
+                    if (slot.load(std::memory_order_relaxed) == nullptr)
+                    {
+                        continue;
+                    }
+                    for (char *chunk = slot.exchange(nullptr, std::memory_order_acquire); chunk != nullptr;)
+                    {
+                        char *next = linked(chunk);
+                        chunks.push_back(chunk);
+                        chunk = next;
+                    }
+                    if (!chunks.empty())
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // Parks the last BATCH chunks in the depot, or frees them if it is full.
+            void give_batch()
+            {
+                char *batch = nullptr;
+                for (std::size_t i = 0; i < BATCH; ++i)
+                {
+                    link(chunks.back(), batch);
+                    batch = chunks.back();
+                    chunks.pop_back();
+                }
+                for (std::atomic<char *> &slot : depot)
+                {
+                    char *empty = nullptr;
+                    if (slot.load(std::memory_order_relaxed) == nullptr &&
+                        slot.compare_exchange_strong(empty, batch, std::memory_order_release, std::memory_order_relaxed))
+                    {
+                        return;
+                    }
+                }
+                while (batch != nullptr)
+                {
+                    char *next = linked(batch);
+                    delete[] batch;
+                    batch = next;
+                }
+            }
+        };
+
+        ChunkCache &local_cache()
+        {
+            thread_local ChunkCache cache;
+            return cache;
+        }
+    }
+
+    char *BufferPool::acquire()
+    {
+        ChunkCache &cache = local_cache();
+        if (cache.chunks.empty() && !cache.take_batch())
+        {
+            return new char[CHUNK_SIZE];
+        }
+        char *chunk = cache.chunks.back();
+        cache.chunks.pop_back();
+        return chunk;
+    }
+
+    void BufferPool::release(char *chunk)
+    {
+        ChunkCache &cache = local_cache();
+        cache.chunks.push_back(chunk);
+        if (cache.chunks.size() >= 2 * BATCH)
+        {
+            cache.give_batch();
+        }
+    }
+
+    std::size_t BufferPool::cached()
+    {
+        return local_cache().chunks.size();
+    }
+
+    InputBuffer::~InputBuffer()
+    {
+        free_storage();
+    }
+
+    void InputBuffer::free_storage()
+    {
+        if (storage == nullptr)
+        {
+            return;
+        }
+        if (cap == BufferPool::CHUNK_SIZE)
+        {
+            BufferPool::release(storage);
+        }
+        else
+        {
+            delete[] storage;
+        }
+        storage = nullptr;
+        cap = 0;
+    }
+
+    void InputBuffer::reserve(std::size_t n, bool may_compact)
+    {
+        if (cap - wpos >= n)
+        {
+            return;
+        }
+        std::size_t keep_from = may_compact ? rpos : 0;
+        std::size_t live = wpos - keep_from;
+        std::size_t want = live + n;
+        // A large buffer whose leftover fits in a chunk goes back to the pool
+        // rather than being compacted in place.
+        bool shrink = want <= BufferPool::CHUNK_SIZE && cap > BufferPool::CHUNK_SIZE;
+        if (keep_from > 0 && cap - live >= n && !shrink)
+        {
+            std::memmove(storage, storage + keep_from, live);
+            rpos -= keep_from;
+            wpos -= keep_from;
+            return;
+        }
+
+        char *next;
+        std::size_t next_cap;
+        if (want <= BufferPool::CHUNK_SIZE)
+        {
+            next = BufferPool::acquire();
+            next_cap = BufferPool::CHUNK_SIZE;
+        }
+        else
+        {
+            // Grow geometrically so a long run of small frames is not copied
+            // once per read; a reservation for one big bulk payload is already
+            // larger than twice what is live and gets exactly what it asked for.
+            next_cap = std::max(want, live * 2);
+            next = new char[next_cap];
+        }
+        if (live > 0)
+        {
+            std::memcpy(next, storage + keep_from, live);
+        }
+        free_storage();
+        storage = next;
+        cap = next_cap;
+        rpos -= keep_from;
+        wpos = live;
+    }
+
+    void InputBuffer::release_if_empty()
+    {
+        if (rpos != wpos)
+        {
+            return;
+        }
+        rpos = 0;
+        wpos = 0;
+        free_storage();
+    }
+}
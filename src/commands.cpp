@@ -0,0 +1,1181 @@
+#include "commands.hpp"
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <tuple>
+#include <unistd.h>
+
+namespace tr
+{
+    namespace
+    {
+        constexpr char fold(char c)
+        {
+            return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+        }
+
+        // FNV-1a over ASCII-lowercased bytes.
+        constexpr uint32_t fold_hash(std::string_view s)
+        {
+            uint32_t h = 2166136261u;
+            for (char c : s)
+            {
+                h ^= static_cast<unsigned char>(fold(c));
+                h *= 16777619u;
+            }
+            return h;
+        }
+
+        bool equals_folded(std::string_view input, std::string_view lower)
+        {
+            if (input.size() != lower.size())
+            {
+                return false;
+            }
+            for (std::size_t i = 0; i < input.size(); ++i)
+            {
+                if (fold(input[i]) != lower[i])
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool arity_ok(const Command &cmd, int argc)
+        {
+            return cmd.arity > 0 ? argc == cmd.arity : argc >= -cmd.arity;
+        }
+
+        void wrong_integer(ReplyBuffer &out)
+        {
+            out.error("value is not an integer or out of range");
+        }
+
+        void ping_command(KVStore &, std::span<const std::string_view>, ReplyBuffer &out)
+        {
+            out.simple("PONG");
+        }
+
+        void get_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            if (!db.read(args[1], [&](std::string_view value) { out.bulk(value); }))
+            {
+                out.null_bulk();
+            }
+        }
+
+        void syntax_error(ReplyBuffer &out)
+        {
+            out.error("syntax error");
+        }
+
+        // Parses the argument after EX or PX at `args[i]` into milliseconds.
+        bool parse_expire(std::span<const std::string_view> args, std::size_t i, bool seconds, long long &ms)
+        {
+            long long value = 0;
+            if (!parse_integer(args[i], value) || value <= 0 || (seconds && value > LLONG_MAX / 1000))
+            {
+                return false;
+            }
+            ms = seconds ? value * 1000 : value;
+            return true;
+        }
+
+        void set_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            if (args.size() == 3)
+            {
+                db.set(args[1], args[2]);
+                out.simple("OK");
+                return;
+            }
+            SetOptions options;
+            bool expiry = false;
+            for (std::size_t i = 3; i < args.size(); ++i)
+            {
+                bool ex = equals_folded(args[i], "ex");
+                if (ex || equals_folded(args[i], "px"))
+                {
+                    if (expiry || options.keep_ttl || i + 1 == args.size())
+                    {
+                        syntax_error(out);
+                        return;
+                    }
+                    if (!parse_expire(args, ++i, ex, options.ttl_ms))
+                    {
+                        out.error("invalid expire time in 'set' command");
+                        return;
+                    }
+                    expiry = true;
+                }
+                else if (equals_folded(args[i], "keepttl") && !expiry)
+                {
+                    options.keep_ttl = true;
+                }
+                else if (equals_folded(args[i], "nx") && options.when != SetOptions::When::IfExists)
+                {
+                    options.when = SetOptions::When::IfMissing;
+                }
+                else if (equals_folded(args[i], "xx") && options.when != SetOptions::When::IfMissing)
+                {
+                    options.when = SetOptions::When::IfExists;
+                }
+                else
+                {
+                    syntax_error(out);
+                    return;
+                }
+            }
+            if (db.set(args[1], args[2], options))
+            {
+                out.simple("OK");
+            }
+            else
+            {
+                out.null_bulk();
+            }
+        }
+
+        void mget_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.array_header(args.size() - 1);
+            db.read_many(args.subspan(1), [&](std::optional<std::string_view> value)
+                         {
+                if (value)
+                {
+                    out.bulk(*value);
+                }
+                else
+                {
+                    out.null_bulk();
+                } });
+        }
+
+        void mset_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            if (args.size() % 2 == 0)
+            {
+                out.error("wrong number of arguments for 'mset'");
+                return;
+            }
+            db.mset(args.subspan(1));
+            out.simple("OK");
+        }
+
+        void msetnx_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            if (args.size() % 2 == 0)
+            {
+                out.error("wrong number of arguments for 'msetnx'");
+                return;
+            }
+            out.integer(db.msetnx(args.subspan(1)) ? 1 : 0);
+        }
+
+        void del_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            long long total = 0;
+            for (std::size_t i = 1; i < args.size(); ++i)
+            {
+                total += db.del(args[i]) ? 1 : 0;
+            }
+            out.integer(total);
+        }
+
+        void expire_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            long long seconds = 0;
+            if (!parse_integer(args[2], seconds))
+            {
+                wrong_integer(out);
+                return;
+            }
+            out.integer(db.expire(args[1], seconds) ? 1 : 0);
+        }
+
+        void pexpire_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            long long ms = 0;
+            if (!parse_integer(args[2], ms))
+            {
+                wrong_integer(out);
+                return;
+            }
+            out.integer(db.pexpire(args[1], ms) ? 1 : 0);
+        }
+
+        void ttl_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(db.ttl(args[1]));
+        }
+
+        void pttl_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(db.pttl(args[1]));
+        }
+
+        // GETEX key [EX seconds | PX milliseconds | PERSIST]
+        void getex_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            long long ms = 0;
+            bool persist = false;
+            if (args.size() == 3 && equals_folded(args[2], "persist"))
+            {
+                persist = true;
+            }
+            else if (args.size() == 4 && (equals_folded(args[2], "ex") || equals_folded(args[2], "px")))
+            {
+                if (!parse_expire(args, 3, equals_folded(args[2], "ex"), ms))
+                {
+                    out.error("invalid expire time in 'getex' command");
+                    return;
+                }
+            }
+            else if (args.size() != 2)
+            {
+                syntax_error(out);
+                return;
+            }
+            if (!db.read(args[1], [&](std::string_view value) { out.bulk(value); }))
+            {
+                out.null_bulk();
+                return;
+            }
+            if (persist)
+            {
+                db.persist(args[1]);
+            }
+            else if (ms > 0)
+            {
+                db.pexpire(args[1], ms);
+            }
+        }
+
+        void incr_common(KVStore &db, std::string_view key, long long delta, ReplyBuffer &out)
+        {
+            auto result = db.incrby(key, delta);
+            if (result)
+            {
+                out.integer(*result);
+            }
+            else
+            {
+                wrong_integer(out);
+            }
+        }
+
+        void incrby_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            long long delta = 0;
+            if (!parse_integer(args[2], delta))
+            {
+                wrong_integer(out);
+                return;
+            }
+            incr_common(db, args[1], delta, out);
+        }
+
+        void decrby_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            long long delta = 0;
+            if (!parse_integer(args[2], delta) || delta == LLONG_MIN)
+            {
+                wrong_integer(out);
+                return;
+            }
+            incr_common(db, args[1], -delta, out);
+        }
+
+        void exists_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(db.exists(args.subspan(1)));
+        }
+
+        void hset_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            if (args.size() % 2 == 1)
+            {
+                out.error("wrong number of arguments for 'hset'");
+                return;
+            }
+            out.integer(static_cast<long long>(db.hset(args[1], args.subspan(2))));
+        }
+
+        void hget_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            if (!db.hread(args[1], args[2], [&](std::string_view value) { out.bulk(value); }))
+            {
+                out.null_bulk();
+            }
+        }
+
+        void hmget_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            // The header waits for the first field, by when the key is known
+            // not to hold another type.
+            bool started = false;
+            db.hread_many(args[1], args.subspan(2), [&](std::optional<std::string_view> value)
+                          {
+                if (!started)
+                {
+                    out.array_header(args.size() - 2);
+                    started = true;
+                }
+                if (value)
+                {
+                    out.bulk(*value);
+                }
+                else
+                {
+                    out.null_bulk();
+                } });
+        }
+
+        void hdel_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.hdel(args[1], args.subspan(2))));
+        }
+
+        void hgetall_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.array_header(2 * db.hlen(args[1]));
+            db.hread_all(args[1], [&](std::string_view field, std::string_view value)
+                         {
+                out.bulk(field);
+                out.bulk(value); });
+        }
+
+        void hincrby_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            long long delta = 0;
+            if (!parse_integer(args[3], delta))
+            {
+                wrong_integer(out);
+                return;
+            }
+            auto result = db.hincrby(args[1], args[2], delta);
+            if (result)
+            {
+                out.integer(*result);
+            }
+            else
+            {
+                out.error("hash value is not an integer or out of range");
+            }
+        }
+
+        void hlen_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.hlen(args[1])));
+        }
+
+        void lpush_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.lpush(args[1], args.subspan(2))));
+        }
+
+        void rpush_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.rpush(args[1], args.subspan(2))));
+        }
+
+        // LPOP and RPOP: one entry as a bulk string, or with a count an
+        // array of up to that many.
+        void pop_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out, bool front)
+        {
+            auto bulk = [&](std::string_view value) { out.bulk(value); };
+            auto pop = [&](std::size_t n)
+            { return front ? db.lpop(args[1], n, bulk) : db.rpop(args[1], n, bulk); };
+            if (args.size() == 2)
+            {
+                if (pop(1) == 0)
+                {
+                    out.null_bulk();
+                }
+                return;
+            }
+            if (args.size() > 3)
+            {
+                syntax_error(out);
+                return;
+            }
+            long long count = 0;
+            if (!parse_integer(args[2], count) || count < 0)
+            {
+                out.error("value is out of range, must be positive");
+                return;
+            }
+            std::size_t len = db.llen(args[1]);
+            if (len == 0)
+            {
+                out.null_array();
+                return;
+            }
+            std::size_t n = std::min(static_cast<std::size_t>(count), len);
+            out.array_header(n);
+            pop(n);
+        }
+
+        void lpop_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            pop_command(db, args, out, true);
+        }
+
+        void rpop_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            pop_command(db, args, out, false);
+        }
+
+        void llen_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.llen(args[1])));
+        }
+
+        void lindex_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            long long index = 0;
+            if (!parse_integer(args[2], index))
+            {
+                wrong_integer(out);
+                return;
+            }
+            if (!db.lindex(args[1], index, [&](std::string_view value) { out.bulk(value); }))
+            {
+                out.null_bulk();
+            }
+        }
+
+        void lrange_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            long long start = 0, stop = 0;
+            if (!parse_integer(args[2], start) || !parse_integer(args[3], stop))
+            {
+                wrong_integer(out);
+                return;
+            }
+            out.array_header(list_range(start, stop, db.llen(args[1])).second);
+            db.lrange(args[1], start, stop, [&](std::string_view value) { out.bulk(value); });
+        }
+
+        void ltrim_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            long long start = 0, stop = 0;
+            if (!parse_integer(args[2], start) || !parse_integer(args[3], stop))
+            {
+                wrong_integer(out);
+                return;
+            }
+            db.ltrim(args[1], start, stop);
+            out.simple("OK");
+        }
+
+        void sadd_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.sadd(args[1], args.subspan(2))));
+        }
+
+        void srem_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.srem(args[1], args.subspan(2))));
+        }
+
+        void sismember_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(db.sismember(args[1], args[2]) ? 1 : 0);
+        }
+
+        void scard_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.scard(args[1])));
+        }
+
+        void smembers_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.array_header(db.scard(args[1]));
+            db.smembers(args[1], [&](std::string_view member) { out.bulk(member); });
+        }
+
+        void set_op_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out, KVStore::SetOp op)
+        {
+            std::unique_ptr<SetObject> result = db.set_op(op, args.subspan(1));
+            out.array_header(result->size());
+            result->for_each([&](std::string_view member) { out.bulk(member); });
+        }
+
+        void sinter_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            set_op_command(db, args, out, KVStore::SetOp::Inter);
+        }
+
+        void sunion_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            set_op_command(db, args, out, KVStore::SetOp::Union);
+        }
+
+        void sdiff_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            set_op_command(db, args, out, KVStore::SetOp::Diff);
+        }
+
+        void sinterstore_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.set_op_store(KVStore::SetOp::Inter, args[1], args.subspan(2))));
+        }
+
+        void sunionstore_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.set_op_store(KVStore::SetOp::Union, args[1], args.subspan(2))));
+        }
+
+        void sdiffstore_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.set_op_store(KVStore::SetOp::Diff, args[1], args.subspan(2))));
+        }
+
+        // A score as Redis reads one: any float, "inf" and "+inf" included,
+        // but not NaN.
+        bool parse_score(std::string_view s, double &score)
+        {
+            if (s.size() > 1 && s[0] == '+' && s[1] != '-')
+            {
+                s.remove_prefix(1);
+            }
+            auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), score);
+            return ec == std::errc() && end == s.data() + s.size() && !std::isnan(score);
+        }
+
+        // A bound of ZRANGEBYSCORE: a score, excluded if it follows "(".
+        bool parse_score_bound(std::string_view s, double &score, bool &exclusive)
+        {
+            exclusive = !s.empty() && s[0] == '(';
+            return parse_score(exclusive ? s.substr(1) : s, score);
+        }
+
+        // Scores go out in the fewest digits that read back exactly, and as
+        // "inf" and "-inf".
+        void bulk_score(ReplyBuffer &out, double score)
+        {
+            char digits[32];
+            char *end = std::to_chars(digits, digits + sizeof(digits), score).ptr;
+            out.bulk(std::string_view(digits, static_cast<std::size_t>(end - digits)));
+        }
+
+        void zadd_reply(const ZAddResult &result, const ZAddOptions &options, bool changed, ReplyBuffer &out)
+        {
+            if (!options.incr)
+            {
+                out.integer(static_cast<long long>(result.added + (changed ? result.changed : 0)));
+            }
+            else if (result.nan)
+            {
+                out.error("resulting score is not a number (NaN)");
+            }
+            else if (result.score)
+            {
+                bulk_score(out, *result.score);
+            }
+            else
+            {
+                out.null_bulk();
+            }
+        }
+
+        void zadd_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            ZAddOptions options;
+            bool nx = false, xx = false, gt = false, lt = false, ch = false;
+            std::size_t i = 2;
+            for (; i < args.size(); ++i)
+            {
+                if (equals_folded(args[i], "nx"))
+                {
+                    nx = true;
+                }
+                else if (equals_folded(args[i], "xx"))
+                {
+                    xx = true;
+                }
+                else if (equals_folded(args[i], "gt"))
+                {
+                    gt = true;
+                }
+                else if (equals_folded(args[i], "lt"))
+                {
+                    lt = true;
+                }
+                else if (equals_folded(args[i], "ch"))
+                {
+                    ch = true;
+                }
+                else if (equals_folded(args[i], "incr"))
+                {
+                    options.incr = true;
+                }
+                else
+                {
+                    break;
+                }
+            }
+            std::size_t n = args.size() - i;
+            if (n == 0 || n % 2 != 0)
+            {
+                syntax_error(out);
+                return;
+            }
+            if (nx && xx)
+            {
+                out.error("XX and NX options at the same time are not compatible");
+                return;
+            }
+            if ((gt && lt) || ((gt || lt) && nx))
+            {
+                out.error("GT, LT, and/or NX options at the same time are not compatible");
+                return;
+            }
+            if (options.incr && n != 2)
+            {
+                out.error("INCR option supports a single increment-element pair");
+                return;
+            }
+            options.when = nx ? SetOptions::When::IfMissing : xx ? SetOptions::When::IfExists : SetOptions::When::Always;
+            options.scores = gt ? ZAddOptions::Scores::Greater : lt ? ZAddOptions::Scores::Less : ZAddOptions::Scores::Any;
+            std::vector<std::pair<double, std::string_view>> items(n / 2);
+            for (std::size_t k = 0; k < items.size(); ++k)
+            {
+                if (!parse_score(args[i + 2 * k], items[k].first))
+                {
+                    out.error("value is not a valid float");
+                    return;
+                }
+                items[k].second = args[i + 2 * k + 1];
+            }
+            zadd_reply(db.zadd(args[1], items, options), options, ch, out);
+        }
+
+        void zincrby_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            std::pair<double, std::string_view> item{0, args[3]};
+            if (!parse_score(args[2], item.first))
+            {
+                out.error("value is not a valid float");
+                return;
+            }
+            ZAddOptions options;
+            options.incr = true;
+            zadd_reply(db.zadd(args[1], std::span(&item, 1), options), options, false, out);
+        }
+
+        void zscore_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            if (std::optional<double> score = db.zscore(args[1], args[2]))
+            {
+                bulk_score(out, *score);
+            }
+            else
+            {
+                out.null_bulk();
+            }
+        }
+
+        void rank_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out, bool reverse)
+        {
+            if (std::optional<std::size_t> rank = db.zrank(args[1], args[2], reverse))
+            {
+                out.integer(static_cast<long long>(*rank));
+            }
+            else
+            {
+                out.null_bulk();
+            }
+        }
+
+        void zrank_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            rank_command(db, args, out, false);
+        }
+
+        void zrevrank_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            rank_command(db, args, out, true);
+        }
+
+        void zrem_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.zrem(args[1], args.subspan(2))));
+        }
+
+        void zcard_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            out.integer(static_cast<long long>(db.zcard(args[1])));
+        }
+
+        // ZRANGE key start stop [BYSCORE] [REV] [LIMIT offset count]
+        // [WITHSCORES], and with `by_score` ZRANGEBYSCORE, which is ZRANGE
+        // BYSCORE without the BYSCORE and REV options.
+        void range_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out, bool by_score)
+        {
+            bool zrange = !by_score;
+            bool reverse = false, with_scores = false, limit = false;
+            long long offset = 0, count = -1;
+            for (std::size_t i = 4; i < args.size(); ++i)
+            {
+                if (zrange && equals_folded(args[i], "byscore"))
+                {
+                    by_score = true;
+                }
+                else if (zrange && equals_folded(args[i], "rev"))
+                {
+                    reverse = true;
+                }
+                else if (equals_folded(args[i], "withscores"))
+                {
+                    with_scores = true;
+                }
+                else if (equals_folded(args[i], "limit") && i + 2 < args.size())
+                {
+                    if (!parse_integer(args[i + 1], offset) || !parse_integer(args[i + 2], count))
+                    {
+                        wrong_integer(out);
+                        return;
+                    }
+                    limit = true;
+                    i += 2;
+                }
+                else
+                {
+                    syntax_error(out);
+                    return;
+                }
+            }
+            if (limit && !by_score)
+            {
+                out.error("syntax error, LIMIT is only supported in combination with BYSCORE");
+                return;
+            }
+            std::size_t first = 0, n = 0;
+            if (by_score)
+            {
+                // Reversed, the range is given highest first.
+                ScoreRange range;
+                if (!parse_score_bound(args[reverse ? 3 : 2], range.min, range.min_exclusive) ||
+                    !parse_score_bound(args[reverse ? 2 : 3], range.max, range.max_exclusive))
+                {
+                    out.error("min or max is not a float");
+                    return;
+                }
+                std::tie(first, n) = db.zranks_in(args[1], range, reverse);
+                std::size_t skip = offset < 0 ? n : std::min(static_cast<std::size_t>(offset), n);
+                first += skip;
+                n -= skip;
+                if (count >= 0)
+                {
+                    n = std::min(n, static_cast<std::size_t>(count));
+                }
+            }
+            else
+            {
+                long long start = 0, stop = 0;
+                if (!parse_integer(args[2], start) || !parse_integer(args[3], stop))
+                {
+                    wrong_integer(out);
+                    return;
+                }
+                std::tie(first, n) = list_range(start, stop, db.zcard(args[1]));
+            }
+            out.array_header(with_scores ? 2 * n : n);
+            db.zrange(args[1], first, n, reverse, [&](std::string_view member, double score)
+                      {
+                out.bulk(member);
+                if (with_scores)
+                {
+                    bulk_score(out, score);
+                } });
+        }
+
+        void zrange_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            range_command(db, args, out, false);
+        }
+
+        void zrangebyscore_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            range_command(db, args, out, true);
+        }
+
+        // Longer timeouts wait for ever rather than overflow the clock.
+        constexpr double MAX_TIMEOUT_SECONDS = 100.0 * 365 * 24 * 3600;
+
+        // Fractional seconds, as Redis takes them, to milliseconds rounded
+        // up, so only an explicit 0 waits for ever. Returns the error to
+        // reply with, or nullptr.
+        const char *parse_timeout(std::string_view s, long long &ms)
+        {
+            double seconds = 0;
+            auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), seconds);
+            if (ec != std::errc() || end != s.data() + s.size() || !std::isfinite(seconds))
+            {
+                return "timeout is not a float or out of range";
+            }
+            if (seconds < 0)
+            {
+                return "timeout is negative";
+            }
+            ms = seconds > MAX_TIMEOUT_SECONDS ? 0 : static_cast<long long>(std::ceil(seconds * 1000));
+            return nullptr;
+        }
+
+        // BLPOP and BRPOP: pops from the first of the keys that holds a
+        // non-empty list, and otherwise writes nothing, so that
+        // dispatch_command() reports it would block.
+        void blocking_pop_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out, bool front)
+        {
+            long long ms = 0;
+            if (const char *error = parse_timeout(args.back(), ms))
+            {
+                out.error(error);
+                return;
+            }
+            for (std::string_view key : args.subspan(1, args.size() - 2))
+            {
+                if (db.llen(key) == 0)
+                {
+                    continue;
+                }
+                out.array_header(2);
+                out.bulk(key);
+                auto bulk = [&](std::string_view value) { out.bulk(value); };
+                front ? db.lpop(key, 1, bulk) : db.rpop(key, 1, bulk);
+                return;
+            }
+        }
+
+        void blpop_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            blocking_pop_command(db, args, out, true);
+        }
+
+        void brpop_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            blocking_pop_command(db, args, out, false);
+        }
+
+        // Resident set size from /proc, or 0 where that is not available.
+        std::size_t resident_bytes()
+        {
+            std::ifstream statm("/proc/self/statm");
+            std::size_t pages = 0, resident = 0;
+            if (!(statm >> pages >> resident))
+            {
+                return 0;
+            }
+            return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        }
+
+        std::string ratio(std::size_t num, std::size_t den)
+        {
+            char buf[32];
+            std::snprintf(buf, sizeof(buf), "%.2f", den == 0 ? 0.0 : double(num) / double(den));
+            return buf;
+        }
+
+        // A subset of Redis's INFO: the memory, stats and keyspace sections,
+        // with the slab allocator's counters alongside Redis's own fields.
+        void info_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+        {
+            auto wants = [&](std::string_view section)
+            {
+                return args.size() < 2 || equals_folded(args[1], "all") || equals_folded(args[1], section);
+            };
+            std::string text;
+            auto field = [&](std::string_view name, const std::string &value)
+            {
+                text.append(name).append(":").append(value).append("\r\n");
+            };
+            if (wants("memory"))
+            {
+                const SlabAllocator::Stats &slab = SlabAllocator::local().stats();
+                std::size_t rss = resident_bytes();
+                text.append("# Memory\r\n");
+                field("used_memory", std::to_string(db.used_memory()));
+                field("used_memory_rss", std::to_string(rss));
+                field("used_memory_table", std::to_string(db.table_bytes()));
+                field("slab_used_bytes", std::to_string(slab.used));
+                field("slab_allocated_bytes", std::to_string(slab.allocated));
+                field("slab_reserved_bytes", std::to_string(slab.reserved));
+                field("slab_fragmentation_bytes", std::to_string(slab.reserved - slab.used));
+                field("slab_fragmentation_ratio", ratio(slab.reserved, slab.used));
+                field("mem_fragmentation_ratio", ratio(rss, db.used_memory()));
+                field("maxmemory", std::to_string(db.maxmemory()));
+                field("maxmemory_policy", std::string(eviction_policy_name(db.maxmemory_policy())));
+            }
+            if (wants("stats"))
+            {
+                text.append(text.empty() ? "" : "\r\n").append("# Stats\r\n");
+                field("expired_keys", std::to_string(db.expired_keys()));
+                field("evicted_keys", std::to_string(db.evicted_keys()));
+            }
+            if (wants("keyspace"))
+            {
+                text.append(text.empty() ? "" : "\r\n").append("# Keyspace\r\n");
+                field("db0", "keys=" + std::to_string(db.size()) + ",expires=" + std::to_string(db.volatile_keys()));
+            }
+            out.bulk(std::move(text));
+        }
+
+        // The value of field `name` in INFO text, or "" if it is missing.
+        std::string_view info_field(std::string_view text, std::string_view name)
+        {
+            for (std::size_t pos = 0; pos < text.size();)
+            {
+                std::size_t eol = std::min(text.find("\r\n", pos), text.size());
+                std::string_view line = text.substr(pos, eol - pos);
+                if (line.size() > name.size() && line.substr(0, name.size()) == name && line[name.size()] == ':')
+                {
+                    return line.substr(name.size() + 1);
+                }
+                pos = eol + 2;
+            }
+            return {};
+        }
+
+        // The number after `label` in `value` ("keys=" in "keys=3,expires=1"),
+        // or at its start when `label` is empty; 0 if there is none.
+        std::size_t info_count(std::string_view value, std::string_view label = {})
+        {
+            std::size_t at = value.find(label);
+            std::size_t n = 0;
+            if (at != std::string_view::npos)
+            {
+                value.remove_prefix(at + label.size());
+                std::from_chars(value.data(), value.data() + value.size(), n);
+            }
+            return n;
+        }
+
+        constexpr Command COMMANDS[] = {
+            {"ping", 1, CMD_FAST, ping_command},
+            {"get", 2, CMD_READONLY | CMD_FAST, get_command, 1, 1, 1},
+            {"set", -3, CMD_WRITE | CMD_DENYOOM, set_command, 1, 1, 1},
+            {"mget", -2, CMD_READONLY | CMD_FAST | CMD_SPLIT_GATHER, mget_command, 1, -1, 1},
+            {"mset", -3, CMD_WRITE | CMD_DENYOOM | CMD_SPLIT_OK, mset_command, 1, -1, 2},
+            {"msetnx", -3, CMD_WRITE | CMD_DENYOOM, msetnx_command, 1, -1, 2},
+            {"del", -2, CMD_WRITE | CMD_SPLIT_SUM, del_command, 1, -1, 1},
+            {"expire", 3, CMD_WRITE | CMD_FAST, expire_command, 1, 1, 1},
+            {"pexpire", 3, CMD_WRITE | CMD_FAST, pexpire_command, 1, 1, 1},
+            {"ttl", 2, CMD_READONLY | CMD_FAST, ttl_command, 1, 1, 1},
+            {"pttl", 2, CMD_READONLY | CMD_FAST, pttl_command, 1, 1, 1},
+            {"getex", -2, CMD_WRITE | CMD_FAST, getex_command, 1, 1, 1},
+            {"incrby", 3, CMD_WRITE | CMD_DENYOOM | CMD_FAST, incrby_command, 1, 1, 1},
+            {"decrby", 3, CMD_WRITE | CMD_DENYOOM | CMD_FAST, decrby_command, 1, 1, 1},
+            {"exists", -2, CMD_READONLY | CMD_FAST | CMD_SPLIT_SUM, exists_command, 1, -1, 1},
+            {"hset", -4, CMD_WRITE | CMD_DENYOOM | CMD_FAST, hset_command, 1, 1, 1},
+            {"hget", 3, CMD_READONLY | CMD_FAST, hget_command, 1, 1, 1},
+            {"hmget", -3, CMD_READONLY | CMD_FAST, hmget_command, 1, 1, 1},
+            {"hdel", -3, CMD_WRITE | CMD_FAST, hdel_command, 1, 1, 1},
+            {"hgetall", 2, CMD_READONLY, hgetall_command, 1, 1, 1},
+            {"hincrby", 4, CMD_WRITE | CMD_DENYOOM | CMD_FAST, hincrby_command, 1, 1, 1},
+            {"hlen", 2, CMD_READONLY | CMD_FAST, hlen_command, 1, 1, 1},
+            {"lpush", -3, CMD_WRITE | CMD_DENYOOM | CMD_FAST, lpush_command, 1, 1, 1},
+            {"rpush", -3, CMD_WRITE | CMD_DENYOOM | CMD_FAST, rpush_command, 1, 1, 1},
+            {"lpop", -2, CMD_WRITE | CMD_FAST, lpop_command, 1, 1, 1},
+            {"rpop", -2, CMD_WRITE | CMD_FAST, rpop_command, 1, 1, 1},
+            {"llen", 2, CMD_READONLY | CMD_FAST, llen_command, 1, 1, 1},
+            {"lindex", 3, CMD_READONLY, lindex_command, 1, 1, 1},
+            {"lrange", 4, CMD_READONLY, lrange_command, 1, 1, 1},
+            {"ltrim", 4, CMD_WRITE, ltrim_command, 1, 1, 1},
+            {"blpop", -3, CMD_WRITE | CMD_BLOCKING, blpop_command, 1, -2, 1},
+            {"brpop", -3, CMD_WRITE | CMD_BLOCKING, brpop_command, 1, -2, 1},
+            {"sadd", -3, CMD_WRITE | CMD_DENYOOM | CMD_FAST, sadd_command, 1, 1, 1},
+            {"srem", -3, CMD_WRITE | CMD_FAST, srem_command, 1, 1, 1},
+            {"sismember", 3, CMD_READONLY | CMD_FAST, sismember_command, 1, 1, 1},
+            {"scard", 2, CMD_READONLY | CMD_FAST, scard_command, 1, 1, 1},
+            {"smembers", 2, CMD_READONLY, smembers_command, 1, 1, 1},
+            {"sinter", -2, CMD_READONLY, sinter_command, 1, -1, 1},
+            {"sunion", -2, CMD_READONLY, sunion_command, 1, -1, 1},
+            {"sdiff", -2, CMD_READONLY, sdiff_command, 1, -1, 1},
+            {"sinterstore", -3, CMD_WRITE | CMD_DENYOOM, sinterstore_command, 1, -1, 1},
+            {"sunionstore", -3, CMD_WRITE | CMD_DENYOOM, sunionstore_command, 1, -1, 1},
+            {"sdiffstore", -3, CMD_WRITE | CMD_DENYOOM, sdiffstore_command, 1, -1, 1},
+            {"zadd", -4, CMD_WRITE | CMD_DENYOOM | CMD_FAST, zadd_command, 1, 1, 1},
+            {"zincrby", 4, CMD_WRITE | CMD_DENYOOM | CMD_FAST, zincrby_command, 1, 1, 1},
+            {"zscore", 3, CMD_READONLY | CMD_FAST, zscore_command, 1, 1, 1},
+            {"zrank", 3, CMD_READONLY | CMD_FAST, zrank_command, 1, 1, 1},
+            {"zrevrank", 3, CMD_READONLY | CMD_FAST, zrevrank_command, 1, 1, 1},
+            {"zrem", -3, CMD_WRITE | CMD_FAST, zrem_command, 1, 1, 1},
+            {"zcard", 2, CMD_READONLY | CMD_FAST, zcard_command, 1, 1, 1},
+            {"zrange", -4, CMD_READONLY, zrange_command, 1, 1, 1},
+            {"zrangebyscore", -4, CMD_READONLY, zrangebyscore_command, 1, 1, 1},
+            {"info", -1, CMD_ALL_SHARDS, info_command},
+        };
+
+        // Open-addressed index over COMMANDS, kept at most a quarter full so a
+        // lookup is one hash of the name plus, almost always, one comparison.
+        class CommandIndex
+        {
+        public:
+            static constexpr std::size_t SLOTS = 256;
+
+            CommandIndex()
+            {
+                static_assert(std::size(COMMANDS) * 4 <= SLOTS, "grow CommandIndex::SLOTS");
+                for (const Command &cmd : COMMANDS)
+                {
+                    std::size_t i = fold_hash(cmd.name) & (SLOTS - 1);
+                    while (slots[i] != nullptr)
+                    {
+                        i = (i + 1) & (SLOTS - 1);
+                    }
+                    slots[i] = &cmd;
+                }
+            }
+
+            const Command *find(std::string_view name) const
+            {
+                std::size_t i = fold_hash(name) & (SLOTS - 1);
+                while (slots[i] != nullptr)
+                {
+                    if (equals_folded(name, slots[i]->name))
+                    {
+                        return slots[i];
+                    }
+                    i = (i + 1) & (SLOTS - 1);
+                }
+                return nullptr;
+            }
+
+        private:
+            std::array<const Command *, SLOTS> slots{};
+        };
+    }
+
+    const Command *lookup_command(std::string_view name)
+    {
+        static const CommandIndex index;
+        return index.find(name);
+    }
+
+    void command_keys(const Command &cmd, std::span<const std::string_view> args, std::vector<std::size_t> &out)
+    {
+        int argc = static_cast<int>(args.size());
+        if (cmd.first_key == 0 || !arity_ok(cmd, argc))
+        {
+            return;
+        }
+        int last = cmd.last_key < 0 ? argc + cmd.last_key : cmd.last_key;
+        for (int i = cmd.first_key; i <= last && i < argc; i += cmd.key_step)
+        {
+            out.push_back(static_cast<std::size_t>(i));
+        }
+    }
+
+    void merge_info(std::span<const std::string> replies, ReplyBuffer &out)
+    {
+        std::vector<std::string_view> texts;
+        for (const std::string &reply : replies)
+        {
+            std::size_t start = reply.find("\r\n") + 2;
+            if (reply.empty() || reply[0] != '$' || reply.size() < start + 2)
+            {
+                out.raw(reply);
+                return;
+            }
+            texts.push_back(std::string_view(reply).substr(start, reply.size() - start - 2));
+        }
+        auto total = [&](std::string_view name, std::string_view label = {})
+        {
+            std::size_t sum = 0;
+            for (std::string_view text : texts)
+            {
+                sum += info_count(info_field(text, name), label);
+            }
+            return sum;
+        };
+
+        // Laid out like the first reply.
+        std::string text;
+        std::string_view first = texts.empty() ? std::string_view() : texts[0];
+        for (std::size_t pos = 0; pos < first.size();)
+        {
+            std::size_t eol = std::min(first.find("\r\n", pos), first.size());
+            std::string_view line = first.substr(pos, eol - pos);
+            pos = eol + 2;
+            std::size_t colon = line.find(':');
+            std::string_view name = line.substr(0, colon);
+            if (colon == std::string_view::npos || name == "used_memory_rss" || name == "maxmemory_policy")
+            {
+                text.append(line).append("\r\n");
+                continue;
+            }
+            std::string merged;
+            if (name == "slab_fragmentation_ratio")
+            {
+                merged = ratio(total("slab_reserved_bytes"), total("slab_used_bytes"));
+            }
+            else if (name == "mem_fragmentation_ratio")
+            {
+                merged = ratio(info_count(info_field(first, "used_memory_rss")), total("used_memory"));
+            }
+            else if (name == "db0")
+            {
+                merged = "keys=" + std::to_string(total(name, "keys=")) + ",expires=" + std::to_string(total(name, "expires="));
+            }
+            else
+            {
+                merged = std::to_string(total(name));
+            }
+            text.append(name).append(":").append(merged).append("\r\n");
+        }
+        out.bulk(std::move(text));
+    }
+
+    std::chrono::milliseconds blocking_timeout(std::span<const std::string_view> args)
+    {
+        long long ms = 0;
+        parse_timeout(args.back(), ms);
+        return std::chrono::milliseconds(ms);
+    }
+
+    bool dispatch_command(KVStore &db, std::span<const std::string_view> args, ReplyBuffer &out)
+    {
+        const Command *cmd = lookup_command(args[0]);
+        if (cmd == nullptr)
+        {
+            std::string name(args[0]);
+            for (char &c : name)
+            {
+                c = fold(c);
+            }
+            out.error("unknown command '" + name + "'");
+            return true;
+        }
+        if (!arity_ok(*cmd, static_cast<int>(args.size())))
+        {
+            out.error("wrong number of arguments for '" + std::string(cmd->name) + "'");
+            return true;
+        }
+        // As in Redis, every command first evicts down to maxmemory, and
+        // commands that could grow memory are refused if that fails.
+        if (db.maxmemory() != 0 && !db.evict() && (cmd->flags & CMD_DENYOOM))
+        {
+            out.error("command not allowed when used memory > 'maxmemory'.", "OOM");
+            return true;
+        }
+        // Handlers check the type of a key before writing any reply.
+        std::size_t before = out.size();
+        try
+        {
+            cmd->handler(db, args, out);
+        }
+        catch (const WrongType &e)
+        {
+            out.error(e.what(), "WRONGTYPE");
+        }
+        return !(cmd->flags & CMD_BLOCKING) || out.size() != before;
+    }
+}
@@ -0,0 +1,322 @@
+#include "concurrent_kvstore.hpp"
+#include "kvstore.hpp"
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <stdexcept>
+
+namespace tr
+{
+    namespace
+    {
+        constexpr std::size_t INITIAL_BUCKETS = 16;
+    }
+
+    ConcurrentKVStore::ConcurrentKVStore()
+    {
+        for (Stripe &stripe : stripes)
+        {
+            stripe.table.store(new Table(INITIAL_BUCKETS), std::memory_order_relaxed);
+        }
+    }
+
+    ConcurrentKVStore::~ConcurrentKVStore()
+    {
+        for (Stripe &stripe : stripes)
+        {
+            Table *table = stripe.table.load(std::memory_order_relaxed);
+            for (std::size_t i = 0; i <= table->mask; ++i)
+            {
+                Node *node = table->heads[i].load(std::memory_order_relaxed);
+                while (node != nullptr)
+                {
+                    Node *next = node->next.load(std::memory_order_relaxed);
+                    free_node(node);
+                    node = next;
+                }
+            }
+            delete table;
+        }
+    }
+
+    uint64_t ConcurrentKVStore::hash_key(std::string_view key)
+    {
+        return std::hash<std::string_view>{}(key);
+    }
+
+    ConcurrentKVStore::Node *ConcurrentKVStore::make_node(std::string_view key, std::string_view value, uint64_t hash,
+                                                          Clock::time_point deadline)
+    {
+        if (key.size() > UINT32_MAX || value.size() > UINT32_MAX)
+        {
+            throw std::length_error("ConcurrentKVStore keys and values are limited to 4 GB");
+        }
+        void *memory = ::operator new(sizeof(Node) + key.size() + value.size());
+        Node *node = new (memory) Node();
+        node->hash = hash;
+        node->deadline = deadline;
+        node->key_len = static_cast<uint32_t>(key.size());
+        node->value_len = static_cast<uint32_t>(value.size());
+        char *bytes = reinterpret_cast<char *>(node + 1);
+        std::memcpy(bytes, key.data(), key.size());
+        std::memcpy(bytes + key.size(), value.data(), value.size());
+        return node;
+    }
+
+    void ConcurrentKVStore::free_node(void *node)
+    {
+        static_cast<Node *>(node)->~Node();
+        ::operator delete(node);
+    }
+
+    void ConcurrentKVStore::free_table(void *table)
+    {
+        delete static_cast<Table *>(table);
+    }
+
+    const ConcurrentKVStore::Node *ConcurrentKVStore::find(std::string_view key)
+    {
+        uint64_t hash = hash_key(key);
+        Table *table = stripe_of(hash).table.load(std::memory_order_acquire);
+        for (const Node *node = table->head(hash).load(std::memory_order_acquire); node != nullptr;
+             node = node->next.load(std::memory_order_acquire))
+        {
+            if (node->hash == hash && node->key() == key)
+            {
+                if (node->deadline != NO_DEADLINE && !node->live(Clock::now()))
+                {
+                    return nullptr;
+                }
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    std::atomic<ConcurrentKVStore::Node *> *ConcurrentKVStore::locate(Table &table, std::string_view key, uint64_t hash)
+    {
+        std::atomic<Node *> *link = &table.head(hash);
+        for (Node *node = link->load(std::memory_order_relaxed); node != nullptr; node = link->load(std::memory_order_relaxed))
+        {
+            if (node->hash == hash && node->key() == key)
+            {
+                return link;
+            }
+            link = &node->next;
+        }
+        return nullptr;
+    }
+
+    void ConcurrentKVStore::publish(Stripe &stripe, std::atomic<Node *> *link, Node *node)
+    {
+        if (link != nullptr)
+        {
+            Node *old = link->load(std::memory_order_relaxed);
+            node->next.store(old->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            link->store(node, std::memory_order_release);
+            Epoch::retire(old, free_node);
+            return;
+        }
+        Table *table = stripe.table.load(std::memory_order_relaxed);
+        std::atomic<Node *> &head = table->head(node->hash);
+        node->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        head.store(node, std::memory_order_release);
+        if (++stripe.count > table->mask + 1)
+        {
+            grow(stripe);
+        }
+    }
+
+    void ConcurrentKVStore::unlink(Stripe &stripe, std::atomic<Node *> *link)
+    {
+        Node *old = link->load(std::memory_order_relaxed);
+        link->store(old->next.load(std::memory_order_relaxed), std::memory_order_release);
+        --stripe.count;
+        Epoch::retire(old, free_node);
+    }
+
+    // Readers may be walking the old chains, so nothing in them changes:
+    // the new table gets copies of the nodes, and the old table and nodes
+    // are retired once it is published.
+    void ConcurrentKVStore::grow(Stripe &stripe)
+    {
+        Table *old = stripe.table.load(std::memory_order_relaxed);
+        Table *table = new Table((old->mask + 1) * 2);
+        for (std::size_t i = 0; i <= old->mask; ++i)
+        {
+            for (Node *node = old->heads[i].load(std::memory_order_relaxed); node != nullptr;
+                 node = node->next.load(std::memory_order_relaxed))
+            {
+                Node *copy = make_node(node->key(), node->value(), node->hash, node->deadline);
+                std::atomic<Node *> &head = table->head(node->hash);
+                copy->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                head.store(copy, std::memory_order_relaxed);
+            }
+        }
+        stripe.table.store(table, std::memory_order_release);
+        for (std::size_t i = 0; i <= old->mask; ++i)
+        {
+            Node *node = old->heads[i].load(std::memory_order_relaxed);
+            while (node != nullptr)
+            {
+                Node *next = node->next.load(std::memory_order_relaxed);
+                Epoch::retire(node, free_node);
+                node = next;
+            }
+        }
+        Epoch::retire(old, free_table);
+    }
+
+    void ConcurrentKVStore::set(std::string_view key, std::string_view value)
+    {
+        uint64_t hash = hash_key(key);
+        Node *node = make_node(key, value, hash, NO_DEADLINE);
+        Stripe &stripe = stripe_of(hash);
+        std::lock_guard<std::mutex> lock(stripe.lock);
+        publish(stripe, locate(*stripe.table.load(std::memory_order_relaxed), key, hash), node);
+    }
+
+    std::optional<std::string> ConcurrentKVStore::get(std::string_view key)
+    {
+        std::optional<std::string> value;
+        read(key, [&](std::string_view v)
+             { value.emplace(v); });
+        return value;
+    }
+
+    bool ConcurrentKVStore::del(std::string_view key)
+    {
+        uint64_t hash = hash_key(key);
+        Stripe &stripe = stripe_of(hash);
+        std::lock_guard<std::mutex> lock(stripe.lock);
+        std::atomic<Node *> *link = locate(*stripe.table.load(std::memory_order_relaxed), key, hash);
+        if (link == nullptr)
+        {
+            return false;
+        }
+        bool live = link->load(std::memory_order_relaxed)->live(Clock::now());
+        unlink(stripe, link);
+        return live;
+    }
+
+    int ConcurrentKVStore::exists(std::span<const std::string_view> keys)
+    {
+        Epoch::Guard guard;
+        int count = 0;
+        for (std::string_view key : keys)
+        {
+            if (find(key) != nullptr)
+            {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    bool ConcurrentKVStore::expire(std::string_view key, long long seconds)
+    {
+        uint64_t hash = hash_key(key);
+        Stripe &stripe = stripe_of(hash);
+        std::lock_guard<std::mutex> lock(stripe.lock);
+        std::atomic<Node *> *link = locate(*stripe.table.load(std::memory_order_relaxed), key, hash);
+        if (link == nullptr)
+        {
+            return false;
+        }
+        const Node *old = link->load(std::memory_order_relaxed);
+        Clock::time_point now = Clock::now();
+        if (!old->live(now) || seconds <= 0)
+        {
+            bool live = old->live(now);
+            unlink(stripe, link);
+            return live;
+        }
+        publish(stripe, link, make_node(old->key(), old->value(), hash, now + std::chrono::seconds(seconds)));
+        return true;
+    }
+
+    long long ConcurrentKVStore::ttl(std::string_view key)
+    {
+        Epoch::Guard guard;
+        const Node *node = find(key);
+        if (node == nullptr)
+        {
+            return -2;
+        }
+        if (node->deadline == NO_DEADLINE)
+        {
+            return -1;
+        }
+        return std::chrono::duration_cast<std::chrono::seconds>(node->deadline - Clock::now()).count();
+    }
+
+    std::optional<long long> ConcurrentKVStore::incrby(std::string_view key, long long delta)
+    {
+        uint64_t hash = hash_key(key);
+        Stripe &stripe = stripe_of(hash);
+        std::lock_guard<std::mutex> lock(stripe.lock);
+        std::atomic<Node *> *link = locate(*stripe.table.load(std::memory_order_relaxed), key, hash);
+        const Node *old = link != nullptr ? link->load(std::memory_order_relaxed) : nullptr;
+        if (old != nullptr && !old->live(Clock::now()))
+        {
+            unlink(stripe, link);
+            link = nullptr;
+            old = nullptr;
+        }
+        long long current = 0;
+        if (old != nullptr && !as_canonical_integer(old->value(), current))
+        {
+            return std::nullopt;
+        }
+        if (delta > 0 && current > LLONG_MAX - delta)
+            return std::nullopt;
+        if (delta < 0 && current < LLONG_MIN - delta)
+            return std::nullopt;
+        long long next = current + delta;
+        char digits[20];
+        char *end = std::to_chars(digits, digits + sizeof(digits), next).ptr;
+        // An existing deadline is kept, as in Redis.
+        Clock::time_point deadline = old != nullptr ? old->deadline : NO_DEADLINE;
+        publish(stripe, link, make_node(key, std::string_view(digits, static_cast<std::size_t>(end - digits)), hash, deadline));
+        return next;
+    }
+
+    std::size_t ConcurrentKVStore::purge_expired()
+    {
+        std::size_t purged = 0;
+        for (Stripe &stripe : stripes)
+        {
+            std::lock_guard<std::mutex> lock(stripe.lock);
+            Clock::time_point now = Clock::now();
+            Table *table = stripe.table.load(std::memory_order_relaxed);
+            for (std::size_t i = 0; i <= table->mask; ++i)
+            {
+                std::atomic<Node *> *link = &table->heads[i];
+                while (Node *node = link->load(std::memory_order_relaxed))
+                {
+                    if (node->live(now))
+                    {
+                        link = &node->next;
+                        continue;
+                    }
+                    unlink(stripe, link);
+                    ++purged;
+                }
+            }
+        }
+        return purged;
+    }
+
+    std::size_t ConcurrentKVStore::size() const
+    {
+        std::size_t total = 0;
+        for (const Stripe &stripe : stripes)
+        {
+            std::lock_guard<std::mutex> lock(stripe.lock);
+            total += stripe.count;
+        }
+        return total;
+    }
+}
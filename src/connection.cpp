@@ -0,0 +1,295 @@
+#include "connection.hpp"
+#include "commands.hpp"
+#include "repl.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <span>
+#include <unistd.h>
+
+namespace tr
+{
+    bool flush_output(Connection &conn)
+    {
+        return conn.out.flush(conn.fd);
+    }
+
+    bool parse_requests(Connection &conn)
+    {
+        for (;;)
+        {
+            std::string_view rest = conn.in.unread();
+            if (rest.empty())
+                break;
+
+            if (rest[0] == '*')
+            {
+                std::size_t consumed = 0;
+                std::size_t first = conn.args.size();
+                auto st = conn.parser.parse(rest, consumed, conn.args);
+
+                if (st == tr::RespParseStatus::NeedMore)
+                {
+                    break; // wait for more bytes from ::read
+                }
+                if (st == tr::RespParseStatus::Error)
+                {
+                    return false;
+                }
+
+                conn.in.consume(consumed);
+                if (conn.args.size() == first)
+                    continue;
+                conn.requests.push_back(Request{first, conn.args.size() - first, false});
+                continue;
+            }
+
+            std::size_t lf = rest.find('\n');
+            if (lf == std::string_view::npos)
+                break;
+
+            std::string_view line = rest.substr(0, lf);
+            conn.in.consume(lf + 1);
+            if (!line.empty() && (line.back() == '\r'))
+            {
+                line.remove_suffix(1);
+            }
+
+            std::size_t first = conn.args.size();
+            std::size_t i = 0;
+            while (i < line.size())
+            {
+                while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i])))
+                    ++i;
+                std::size_t start = i;
+                while (i < line.size() && !std::isspace(static_cast<unsigned char>(line[i])))
+                    ++i;
+                if (i > start)
+                    conn.args.push_back(line.substr(start, i - start));
+            }
+            if (conn.args.size() == first)
+                continue;
+            conn.requests.push_back(Request{first, conn.args.size() - first, true});
+        }
+        return conn.in.unread().size() <= conn.query_limit;
+    }
+
+    // Makes room for at least n more input bytes. Inside a large bulk argument
+    // the rest of the frame is reserved in one go, so the payload is received
+    // into its final place instead of being copied each time the buffer grows.
+    static void make_room(Connection &conn, std::size_t n)
+    {
+        long long bulk = conn.parser.pending_bulk_len();
+        if (bulk >= static_cast<long long>(BufferPool::CHUNK_SIZE))
+        {
+            std::size_t frame_end = conn.parser.pending_bulk_offset() + static_cast<std::size_t>(bulk) + 2;
+            std::size_t have = conn.in.unread().size();
+            if (frame_end > have)
+            {
+                n = std::max(n, frame_end - have);
+            }
+        }
+
+        const char *old_base = conn.in.base();
+        // Parsed arguments only exist while requests are queued, so with none
+        // queued the unread bytes are free to move.
+        conn.in.reserve(n, conn.requests.empty());
+        const char *new_base = conn.in.base();
+        if (new_base != old_base && old_base != nullptr)
+        {
+            // The buffer moved; re-point the arguments parsed from it so far.
+            for (std::string_view &arg : conn.args)
+            {
+                arg = std::string_view(new_base + (arg.data() - old_base), arg.size());
+            }
+        }
+    }
+
+    bool consume_input(Connection &conn, const char *data, std::size_t n)
+    {
+        make_room(conn, n);
+        std::memcpy(conn.in.write_ptr(), data, n);
+        conn.in.commit(n);
+        return parse_requests(conn);
+    }
+
+    bool read_requests(Connection &conn)
+    {
+        conn.read_more = false;
+
+        // Edge-triggered: keep reading until the kernel reports EAGAIN.
+        for (;;)
+        {
+            if (conn.in.writable() == 0)
+            {
+                if (!conn.requests.empty())
+                {
+                    // Growing now would copy every queued frame; run them
+                    // first and come back for the rest of the socket.
+                    conn.read_more = true;
+                    return true;
+                }
+                make_room(conn, 1);
+            }
+            else if (conn.requests.empty() && conn.parser.pending_bulk_len() >= static_cast<long long>(BufferPool::CHUNK_SIZE))
+            {
+                make_room(conn, conn.in.writable());
+            }
+
+            ssize_t n = ::read(conn.fd, conn.in.write_ptr(), conn.in.writable());
+            if (n > 0)
+            {
+                conn.in.commit(static_cast<std::size_t>(n));
+                if (!parse_requests(conn))
+                {
+                    return false;
+                }
+            }
+            else if (n == 0)
+            {
+                conn.eof = true;
+                return true;
+            }
+            else
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return true;
+                }
+                else
+                {
+                    std::cout << std::strerror(errno) << "\n";
+                    return false;
+                }
+            }
+        }
+    }
+
+    bool execute_request(Connection &conn, KVStore &db, const Request &req, ReplyBuffer &out,
+                         BlockedClients *blocked)
+    {
+        std::span<const std::string_view> args(conn.args.data() + req.first, req.argc);
+        if (!req.inline_cmd)
+        {
+            if (!dispatch_command(db, args, out))
+            {
+                if (blocked != nullptr)
+                {
+                    blocked->block(conn, args);
+                }
+                else
+                {
+                    out.null_array();
+                }
+            }
+            return true;
+        }
+        if (args[0] == "EXIT" || args[0] == "exit")
+        {
+            return false;
+        }
+        std::string result = tr::eval_command(db, args);
+        if (!result.empty())
+        {
+            out.raw(result);
+            out.raw("\n");
+        }
+        return true;
+    }
+
+    bool execute_requests(Connection &conn, KVStore &db, BlockedClients *blocked)
+    {
+        bool keep = true;
+        std::size_t done = 0;
+        for (; done < conn.requests.size(); ++done)
+        {
+            if (conn.blocked() || (conn.limits.pause > 0 && conn.out.size() >= conn.limits.pause))
+            {
+                // The arguments of the rest stay valid: input is never moved
+                // while requests are queued.
+                conn.requests.erase(conn.requests.begin(), conn.requests.begin() + static_cast<std::ptrdiff_t>(done));
+                return true;
+            }
+            if (!execute_request(conn, db, conn.requests[done], conn.out, blocked))
+            {
+                keep = false;
+                break;
+            }
+            if (conn.blocked())
+            {
+                // Stays first in line, to run again once served.
+                conn.requests.erase(conn.requests.begin(), conn.requests.begin() + static_cast<std::ptrdiff_t>(done));
+                return true;
+            }
+        }
+        conn.requests.clear();
+        conn.args.clear();
+        // Nothing points into the input any more; an idle connection hands its
+        // chunk back to the pool.
+        conn.in.release_if_empty();
+        return keep;
+    }
+
+    void wake_blocked(BlockedClients &blocked, KVStore &db, std::chrono::steady_clock::time_point now,
+                      std::vector<Connection *> &woken)
+    {
+        blocked.serve([&](Waiter &w)
+                      {
+            Connection &conn = static_cast<Connection &>(w);
+            const Request &req = conn.requests.front();
+            if (!dispatch_command(db, std::span<const std::string_view>(conn.args.data() + req.first, req.argc), conn.out))
+            {
+                return false;
+            }
+            conn.requests.erase(conn.requests.begin());
+            woken.push_back(&conn);
+            return true; });
+        blocked.expire(now, [&](Waiter &w)
+                       {
+            Connection &conn = static_cast<Connection &>(w);
+            conn.out.null_array();
+            conn.requests.erase(conn.requests.begin());
+            woken.push_back(&conn); });
+    }
+
+    bool check_output_limits(Connection &conn, std::size_t pending, std::chrono::steady_clock::time_point now)
+    {
+        const OutputLimits &limits = conn.limits;
+        if (limits.pause > 0 && pending >= limits.pause)
+        {
+            conn.paused = true;
+        }
+        else if (pending == 0)
+        {
+            conn.paused = false;
+        }
+
+        if (limits.hard > 0 && pending > limits.hard)
+        {
+            return false;
+        }
+        if (limits.soft > 0 && pending > limits.soft)
+        {
+            if (!conn.over_soft)
+            {
+                conn.over_soft = true;
+                conn.soft_since = now;
+            }
+            else if (now - conn.soft_since >= std::chrono::seconds(limits.soft_seconds))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            conn.over_soft = false;
+        }
+        return true;
+    }
+}
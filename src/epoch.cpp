@@ -0,0 +1,123 @@
+#include "epoch.hpp"
+
+namespace tr
+{
+    std::atomic<uint64_t> Epoch::global{1};
+    std::atomic<Epoch::Record *> Epoch::records{nullptr};
+
+    Epoch::Handle::Handle()
+    {
+        for (Record *r = records.load(std::memory_order_acquire); r != nullptr; r = r->next)
+        {
+            bool idle = false;
+            if (r->in_use.compare_exchange_strong(idle, true, std::memory_order_acquire))
+            {
+                record = r;
+                return;
+            }
+        }
+        // Records are never freed: another thread may be scanning them.
+        record = new Record();
+        record->next = records.load(std::memory_order_relaxed);
+        while (!records.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    Epoch::Handle::~Handle()
+    {
+        seal(*record);
+        record->in_use.store(false, std::memory_order_release);
+    }
+
+    Epoch::Record &Epoch::local()
+    {
+        thread_local Handle handle;
+        return *handle.record;
+    }
+
+    Epoch::Guard::Guard() : record(local())
+    {
+        if (record.depth++ == 0)
+        {
+            uint64_t epoch = global.load(std::memory_order_relaxed);
+            // The announcement must be ordered before every load the reader
+            // makes under the guard; pairs with the fence in try_advance().
+            // On x86 a locked exchange is that full barrier, and cheaper
+            // than mfence.
+#if defined(__x86_64__) || defined(__i386__)
+            record.state.exchange(epoch * 2 + 1, std::memory_order_seq_cst);
+#else
+            record.state.store(epoch * 2 + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+        }
+    }
+
+    Epoch::Guard::~Guard()
+    {
+        if (--record.depth == 0)
+        {
+            record.state.store(0, std::memory_order_release);
+        }
+    }
+
+    void Epoch::retire(void *p, Deleter deleter)
+    {
+        Record &record = local();
+        record.pending.push_back(Retired{p, deleter});
+        if (record.pending.size() >= BAG_SIZE)
+        {
+            collect();
+        }
+    }
+
+    void Epoch::seal(Record &record)
+    {
+        if (record.pending.empty())
+        {
+            return;
+        }
+        // Stamped after the fence, so a reader that could still reach the
+        // objects is pinned at this epoch or later and holds back the two
+        // advances the bag waits for.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t epoch = global.load(std::memory_order_relaxed);
+        record.bags.push_back(Bag{epoch, std::move(record.pending)});
+        record.pending.clear();
+    }
+
+    bool Epoch::try_advance()
+    {
+        uint64_t epoch = global.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (Record *r = records.load(std::memory_order_acquire); r != nullptr; r = r->next)
+        {
+            // Acquire: whatever a reader did before unpinning happens before
+            // anything freed once the epoch has moved on.
+            uint64_t state = r->state.load(std::memory_order_acquire);
+            if (state != 0 && state != epoch * 2 + 1)
+            {
+                return false; // still pinned at an older epoch
+            }
+        }
+        return global.compare_exchange_strong(epoch, epoch + 1, std::memory_order_release, std::memory_order_relaxed);
+    }
+
+    void Epoch::collect()
+    {
+        Record &record = local();
+        seal(record);
+        try_advance();
+        uint64_t epoch = global.load(std::memory_order_acquire);
+        while (!record.bags.empty() && epoch - record.bags.front().epoch >= 2)
+        {
+            Bag bag = std::move(record.bags.front());
+            record.bags.pop_front();
+            for (const Retired &item : bag.items)
+            {
+                item.deleter(item.p);
+            }
+        }
+    }
+}
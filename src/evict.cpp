@@ -0,0 +1,185 @@
+#include "kvstore.hpp"
+#include <algorithm>
+#include <limits>
+
+namespace tr
+{
+    namespace
+    {
+        // Redis's defaults: maxmemory-samples, the eviction pool size, and
+        // the LFU counter's starting value, log factor and decay period.
+        constexpr std::size_t SAMPLES = 5;
+        constexpr std::size_t POOL_SIZE = 16;
+        constexpr std::size_t MAX_SAMPLE_SLOTS = 512;
+        constexpr int MAX_ROUNDS = 16;
+        constexpr uint32_t LFU_INIT = 5;
+        constexpr uint32_t LFU_LOG_FACTOR = 10;
+        constexpr uint32_t LFU_DECAY_MINUTES = 1;
+        constexpr uint32_t MINUTE_MASK = 0xffffff;
+
+        uint32_t lfu_counter(uint32_t access, uint32_t minutes)
+        {
+            uint32_t counter = access & 0xff;
+            uint32_t idle = (minutes - (access >> 8)) & MINUTE_MASK;
+            uint32_t periods = idle / LFU_DECAY_MINUTES;
+            return periods >= counter ? 0 : counter - periods;
+        }
+    }
+
+    std::optional<EvictionPolicy> parse_eviction_policy(std::string_view name)
+    {
+        if (name == "noeviction")
+        {
+            return EvictionPolicy::NoEviction;
+        }
+        if (name == "allkeys-lru")
+        {
+            return EvictionPolicy::AllKeysLru;
+        }
+        if (name == "allkeys-lfu")
+        {
+            return EvictionPolicy::AllKeysLfu;
+        }
+        if (name == "volatile-ttl")
+        {
+            return EvictionPolicy::VolatileTtl;
+        }
+        return std::nullopt;
+    }
+
+    std::string_view eviction_policy_name(EvictionPolicy policy)
+    {
+        switch (policy)
+        {
+        case EvictionPolicy::AllKeysLru:
+            return "allkeys-lru";
+        case EvictionPolicy::AllKeysLfu:
+            return "allkeys-lfu";
+        case EvictionPolicy::VolatileTtl:
+            return "volatile-ttl";
+        case EvictionPolicy::NoEviction:
+            break;
+        }
+        return "noeviction";
+    }
+
+    void KVStore::set_maxmemory(std::size_t bytes, EvictionPolicy next)
+    {
+        max_memory = bytes;
+        policy = next;
+        pool.clear();
+    }
+
+    void KVStore::tick(Clock::time_point now)
+    {
+        clock_seconds = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(now - clock_epoch).count());
+    }
+
+    void KVStore::touch(Entry *entry, bool created)
+    {
+        if (policy == EvictionPolicy::AllKeysLru)
+        {
+            entry->access = clock_seconds;
+        }
+        else if (policy == EvictionPolicy::AllKeysLfu)
+        {
+            uint32_t minutes = (clock_seconds / 60) & MINUTE_MASK;
+            uint32_t counter = created ? LFU_INIT : lfu_counter(entry->access, minutes);
+            // Logarithmic: the higher the counter, the less likely a hit
+            // bumps it, so 255 stands for around a million accesses.
+            if (!created && counter < 255)
+            {
+                uint32_t base = counter > LFU_INIT ? counter - LFU_INIT : 0;
+                if (std::uniform_int_distribution<uint32_t>(0, base * LFU_LOG_FACTOR)(rng) == 0)
+                {
+                    ++counter;
+                }
+            }
+            entry->access = minutes << 8 | counter;
+        }
+    }
+
+    uint64_t KVStore::eviction_score(const Entry &entry) const
+    {
+        switch (policy)
+        {
+        case EvictionPolicy::AllKeysLru:
+            return clock_seconds - entry.access; // seconds idle
+        case EvictionPolicy::AllKeysLfu:
+            return 255 - lfu_counter(entry.access, (clock_seconds / 60) & MINUTE_MASK);
+        case EvictionPolicy::VolatileTtl:
+            return std::numeric_limits<uint64_t>::max() - static_cast<uint64_t>(entry.deadline);
+        case EvictionPolicy::NoEviction:
+            break;
+        }
+        return 0;
+    }
+
+    // Redis's approximated eviction: sample a few keys from a random spot,
+    // merge them into a small pool of the best candidates seen so far, and
+    // evict the best one that still exists.
+    bool KVStore::evict_one()
+    {
+        if (policy == EvictionPolicy::NoEviction || table.size() == 0)
+        {
+            return false;
+        }
+        bool volatile_only = policy == EvictionPolicy::VolatileTtl;
+        if (volatile_only && volatile_count == 0)
+        {
+            return false;
+        }
+        for (int round = 0; round < MAX_ROUNDS; ++round)
+        {
+            std::size_t cursor = std::uniform_int_distribution<std::size_t>(0, table.scan_extent() - 1)(rng);
+            std::size_t sampled = 0;
+            table.scan(cursor, MAX_SAMPLE_SLOTS, [&](Entry &entry)
+                       {
+                if (volatile_only && entry.deadline == NO_DEADLINE)
+                {
+                    return true;
+                }
+                ++sampled;
+                uint64_t score = eviction_score(entry);
+                if (pool.size() == POOL_SIZE && score <= pool.front().score)
+                {
+                    return sampled < SAMPLES;
+                }
+                auto at = std::upper_bound(pool.begin(), pool.end(), score,
+                                           [](uint64_t s, const Candidate &c) { return s < c.score; });
+                pool.insert(at, Candidate{score, std::string(entry.key.view())});
+                if (pool.size() > POOL_SIZE)
+                {
+                    pool.erase(pool.begin());
+                }
+                return sampled < SAMPLES; });
+
+            while (!pool.empty())
+            {
+                Entry *entry = table.find(pool.back().key);
+                pool.pop_back();
+                // Candidates may have been deleted or rewritten since they
+                // were sampled.
+                if (entry != nullptr && (!volatile_only || entry->deadline != NO_DEADLINE))
+                {
+                    remove(entry);
+                    ++evicted_count;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool KVStore::evict()
+    {
+        while (max_memory != 0 && used_memory() > max_memory)
+        {
+            if (!evict_one())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+}
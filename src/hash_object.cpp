@@ -0,0 +1,101 @@
+#include "hash_object.hpp"
+
+namespace tr
+{
+    bool HashObject::set(std::string_view field, std::string_view value, const Limits &limits)
+    {
+        if (!table)
+        {
+            std::size_t pos = packed.find(field, 2);
+            bool found = pos != packed.bytes();
+            if (field.size() <= limits.max_value && value.size() <= limits.max_value &&
+                (found || size() < limits.max_entries))
+            {
+                if (found)
+                {
+                    packed.replace(packed.next(pos), value);
+                }
+                else
+                {
+                    packed.push_back(field);
+                    packed.push_back(value);
+                }
+                return !found;
+            }
+            convert();
+        }
+        auto [slot, inserted] = table->insert(field);
+        table_strings -= slot->value.heap();
+        slot->value = value;
+        table_strings += slot->value.heap() + (inserted ? slot->key.heap() : 0);
+        return inserted;
+    }
+
+    std::optional<std::string_view> HashObject::get(std::string_view field)
+    {
+        if (table)
+        {
+            const Field *slot = table->find(field);
+            return slot != nullptr ? std::optional(slot->value.view()) : std::nullopt;
+        }
+        std::size_t pos = packed.find(field, 2);
+        return pos != packed.bytes() ? std::optional(packed.get(packed.next(pos))) : std::nullopt;
+    }
+
+    bool HashObject::del(std::string_view field)
+    {
+        if (table)
+        {
+            Field *slot = table->find(field);
+            if (slot == nullptr)
+            {
+                return false;
+            }
+            table_strings -= slot->key.heap() + slot->value.heap();
+            table->erase(slot);
+            return true;
+        }
+        std::size_t pos = packed.find(field, 2);
+        if (pos == packed.bytes())
+        {
+            return false;
+        }
+        packed.erase(pos, 2);
+        return true;
+    }
+
+    void HashObject::convert()
+    {
+        auto fields = std::make_unique<SwissTable<Field>>();
+        for (std::size_t pos = 0; pos < packed.bytes(); pos = packed.next(packed.next(pos)))
+        {
+            Field *slot = fields->insert(packed.get(pos)).first;
+            slot->value = packed.get(packed.next(pos));
+            table_strings += slot->key.heap() + slot->value.heap();
+        }
+        table = std::move(fields);
+        packed.clear();
+    }
+
+    std::size_t HashObject::heap() const
+    {
+        std::size_t bytes = sizeof(HashObject) + packed.heap();
+        if (table)
+        {
+            bytes += sizeof(*table) + table->footprint() + table_strings;
+        }
+        return bytes;
+    }
+
+    std::size_t HashObject::defrag()
+    {
+        if (!table)
+        {
+            return packed.defrag();
+        }
+        std::size_t moved = 0;
+        table->for_each([&](Field &field)
+                        { moved += field.key.defrag() + field.value.defrag(); });
+        return moved;
+    }
+}
@@ -0,0 +1,405 @@
+#include "intset.hpp"
+#include "slab.hpp"
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace tr
+{
+    namespace
+    {
+        std::size_t capacity_for(std::size_t n)
+        {
+            return n > SlabAllocator::MAX_CHUNK ? n + n / 4 : SlabAllocator::chunk_size(n);
+        }
+
+        template <typename T>
+        T load(const unsigned char *p, std::size_t i)
+        {
+            T v;
+            std::memcpy(&v, p + i * sizeof(T), sizeof(T));
+            return v;
+        }
+
+        template <typename T>
+        void put(unsigned char *p, std::size_t i, T v)
+        {
+            std::memcpy(p + i * sizeof(T), &v, sizeof(T));
+        }
+
+        // Calls f(T{}) with T the integer type `bytes` wide.
+        template <typename F>
+        void with_type(std::size_t bytes, F &&f)
+        {
+            switch (bytes)
+            {
+            case 2:
+                f(int16_t{});
+                break;
+            case 4:
+                f(int32_t{});
+                break;
+            default:
+                f(int64_t{});
+                break;
+            }
+        }
+
+        // Both intersection kernels read two sorted runs, `a` of A and `b`
+        // of B, and append the common members to `out` as U. They return
+        // how many members `out` holds after.
+        template <typename A, typename B, typename U>
+        std::size_t merge(const unsigned char *a, std::size_t i, std::size_t na, const unsigned char *b, std::size_t j,
+                          std::size_t nb, unsigned char *out, std::size_t n)
+        {
+            while (i < na && j < nb)
+            {
+                A x = load<A>(a, i);
+                B y = load<B>(b, j);
+                if (x < y)
+                {
+                    ++i;
+                }
+                else if (y < x)
+                {
+                    ++j;
+                }
+                else
+                {
+                    put<U>(out, n++, static_cast<U>(x));
+                    ++i;
+                    ++j;
+                }
+            }
+            return n;
+        }
+
+        // For each member of the small run, doubles its step through the
+        // large one from where the last search ended until it passes the
+        // member, then binary searches the last step: O(m log(n / m)) for
+        // m members against n.
+        template <typename A, typename B, typename U>
+        std::size_t gallop(const unsigned char *a, std::size_t na, const unsigned char *b, std::size_t nb,
+                           unsigned char *out)
+        {
+            std::size_t n = 0;
+            std::size_t lo = 0;
+            for (std::size_t i = 0; i < na && lo < nb; ++i)
+            {
+                A x = load<A>(a, i);
+                std::size_t hi = lo;
+                for (std::size_t step = 1; hi < nb && load<B>(b, hi) < x; step *= 2)
+                {
+                    lo = hi + 1;
+                    hi = lo + step;
+                }
+                for (std::size_t end = std::min(hi, nb); lo < end;)
+                {
+                    std::size_t mid = lo + (end - lo) / 2;
+                    if (load<B>(b, mid) < x)
+                    {
+                        lo = mid + 1;
+                    }
+                    else
+                    {
+                        end = mid;
+                    }
+                }
+                if (lo < nb && load<B>(b, lo) == x)
+                {
+                    put<U>(out, n++, static_cast<U>(x));
+                    ++lo;
+                }
+            }
+            return n;
+        }
+
+#ifdef __SSE2__
+        template <typename T>
+        __m128i equal_lanes(__m128i a, __m128i b)
+        {
+            if constexpr (sizeof(T) == 2)
+            {
+                return _mm_cmpeq_epi16(a, b);
+            }
+            else if constexpr (sizeof(T) == 4)
+            {
+                return _mm_cmpeq_epi32(a, b);
+            }
+            else
+            {
+                // SSE2 has no 64-bit compare: both halves must match.
+                __m128i eq = _mm_cmpeq_epi32(a, b);
+                return _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+            }
+        }
+
+        template <int Bytes>
+        __m128i rotate(__m128i v)
+        {
+            if constexpr (Bytes == 0)
+            {
+                return v;
+            }
+            else
+            {
+                return _mm_or_si128(_mm_srli_si128(v, Bytes), _mm_slli_si128(v, 16 - Bytes));
+            }
+        }
+
+        // The lanes of `a` equal to some lane of `b`, as a byte mask:
+        // compares `a` against every rotation of `b`.
+        template <typename T, std::size_t... R>
+        unsigned match_mask(__m128i a, __m128i b, std::index_sequence<R...>)
+        {
+            __m128i eq = _mm_setzero_si128();
+            ((eq = _mm_or_si128(eq, equal_lanes<T>(a, rotate<static_cast<int>(R * sizeof(T))>(b)))), ...);
+            return static_cast<unsigned>(_mm_movemask_epi8(eq));
+        }
+
+        // The block merge of Schlegel et al. and Lemire's SIMD
+        // intersections: compares a vector of each run all-against-all,
+        // keeps the matches of `a`'s, and advances whichever vector ends
+        // with the smaller member, or both. The tails merge one at a time.
+        template <typename T>
+        std::size_t merge_simd(const unsigned char *a, std::size_t na, const unsigned char *b, std::size_t nb,
+                               unsigned char *out)
+        {
+            constexpr std::size_t LANES = 16 / sizeof(T);
+            constexpr unsigned LANE_BITS = (1u << sizeof(T)) - 1;
+            std::size_t i = 0, j = 0, n = 0;
+            while (i + LANES <= na && j + LANES <= nb)
+            {
+                __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i * sizeof(T)));
+                __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + j * sizeof(T)));
+                for (unsigned mask = match_mask<T>(va, vb, std::make_index_sequence<LANES>()); mask != 0;)
+                {
+                    std::size_t lane = static_cast<std::size_t>(__builtin_ctz(mask)) / sizeof(T);
+                    put<T>(out, n++, load<T>(a, i + lane));
+                    mask &= ~(LANE_BITS << (lane * sizeof(T)));
+                }
+                T last_a = load<T>(a, i + LANES - 1);
+                T last_b = load<T>(b, j + LANES - 1);
+                i += last_a <= last_b ? LANES : 0;
+                j += last_b <= last_a ? LANES : 0;
+            }
+            return merge<T, T, T>(a, i, na, b, j, nb, out, n);
+        }
+#endif
+    }
+
+    IntSet::IntSet(IntSet &&other) noexcept
+        : data(std::exchange(other.data, nullptr)), count(std::exchange(other.count, 0)),
+          cap(std::exchange(other.cap, 0)), bytes(std::exchange(other.bytes, 2))
+    {
+    }
+
+    IntSet &IntSet::operator=(IntSet &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            data = std::exchange(other.data, nullptr);
+            count = std::exchange(other.count, 0);
+            cap = std::exchange(other.cap, 0);
+            bytes = std::exchange(other.bytes, 2);
+        }
+        return *this;
+    }
+
+    IntSet::~IntSet()
+    {
+        release();
+    }
+
+    void IntSet::release()
+    {
+        if (data != nullptr)
+        {
+            SlabAllocator::local().deallocate(data, cap);
+        }
+        data = nullptr;
+        count = cap = 0;
+    }
+
+    std::size_t IntSet::width_of(int64_t v)
+    {
+        if (v >= INT16_MIN && v <= INT16_MAX)
+        {
+            return 2;
+        }
+        return v >= INT32_MIN && v <= INT32_MAX ? 4 : 8;
+    }
+
+    std::size_t IntSet::lower_bound(int64_t v) const
+    {
+        std::size_t lo = 0, hi = count;
+        with_type(bytes, [&](auto tag)
+                  {
+            using T = decltype(tag);
+            while (lo < hi)
+            {
+                std::size_t mid = lo + (hi - lo) / 2;
+                if (load<T>(mid) < v)
+                {
+                    lo = mid + 1;
+                }
+                else
+                {
+                    hi = mid;
+                }
+            } });
+        return lo;
+    }
+
+    void IntSet::store(std::size_t i, int64_t v)
+    {
+        with_type(bytes, [&](auto tag)
+                  { put(data, i, static_cast<decltype(tag)>(v)); });
+    }
+
+    void IntSet::reserve(std::size_t n)
+    {
+        std::size_t need = n * bytes;
+        if (need == 0)
+        {
+            release();
+            return;
+        }
+        if (need > cap || (need < cap / 2 && capacity_for(need) < cap))
+        {
+            SlabAllocator &slab = SlabAllocator::local();
+            std::size_t fresh_cap = capacity_for(need);
+            auto *fresh = static_cast<unsigned char *>(slab.allocate(fresh_cap));
+            if (data != nullptr)
+            {
+                std::memcpy(fresh, data, std::min(count * bytes, need));
+                slab.deallocate(data, cap);
+            }
+            data = fresh;
+            cap = fresh_cap;
+        }
+    }
+
+    void IntSet::widen(std::size_t to, int64_t v)
+    {
+        SlabAllocator &slab = SlabAllocator::local();
+        std::size_t fresh_cap = capacity_for((count + 1) * to);
+        auto *fresh = static_cast<unsigned char *>(slab.allocate(fresh_cap));
+        std::size_t first = v < 0 ? 1 : 0;
+        with_type(to, [&](auto tag)
+                  {
+            using T = decltype(tag);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                put(fresh, first + i, static_cast<T>(at(i)));
+            }
+            put(fresh, v < 0 ? 0 : count, static_cast<T>(v)); });
+        if (data != nullptr)
+        {
+            slab.deallocate(data, cap);
+        }
+        data = fresh;
+        cap = fresh_cap;
+        bytes = static_cast<unsigned char>(to);
+        ++count;
+    }
+
+    bool IntSet::contains(int64_t v) const
+    {
+        if (width_of(v) > bytes)
+        {
+            return false;
+        }
+        std::size_t i = lower_bound(v);
+        return i < count && at(i) == v;
+    }
+
+    bool IntSet::insert(int64_t v)
+    {
+        std::size_t to = width_of(v);
+        if (to > bytes)
+        {
+            widen(to, v);
+            return true;
+        }
+        std::size_t i = lower_bound(v);
+        if (i < count && at(i) == v)
+        {
+            return false;
+        }
+        reserve(count + 1);
+        std::memmove(data + (i + 1) * bytes, data + i * bytes, (count - i) * bytes);
+        store(i, v);
+        ++count;
+        return true;
+    }
+
+    bool IntSet::erase(int64_t v)
+    {
+        if (width_of(v) > bytes)
+        {
+            return false;
+        }
+        std::size_t i = lower_bound(v);
+        if (i == count || at(i) != v)
+        {
+            return false;
+        }
+        std::memmove(data + i * bytes, data + (i + 1) * bytes, (count - i - 1) * bytes);
+        --count;
+        reserve(count);
+        return true;
+    }
+
+    IntSet IntSet::intersect(const IntSet &a, const IntSet &b)
+    {
+        const IntSet &small = a.count <= b.count ? a : b;
+        const IntSet &large = a.count <= b.count ? b : a;
+        IntSet out;
+        if (small.count == 0)
+        {
+            return out;
+        }
+        out.bytes = std::min(a.bytes, b.bytes);
+        out.reserve(small.count);
+        with_type(small.bytes, [&](auto small_tag)
+                  { with_type(large.bytes, [&](auto large_tag)
+                              {
+            using A = decltype(small_tag);
+            using B = decltype(large_tag);
+            using U = std::conditional_t<(sizeof(A) < sizeof(B)), A, B>;
+            if (large.count / small.count >= GALLOP_RATIO)
+            {
+                out.count = gallop<A, B, U>(small.data, small.count, large.data, large.count, out.data);
+                return;
+            }
+#ifdef __SSE2__
+            if constexpr (std::is_same_v<A, B>)
+            {
+                out.count = merge_simd<A>(small.data, small.count, large.data, large.count, out.data);
+                return;
+            }
+#endif
+            out.count = merge<A, B, U>(small.data, 0, small.count, large.data, 0, large.count, out.data, 0); }); });
+        out.reserve(out.count);
+        return out;
+    }
+
+    bool IntSet::defrag()
+    {
+        if (data == nullptr || cap > SlabAllocator::MAX_CHUNK || !SlabAllocator::local().sparse(data))
+        {
+            return false;
+        }
+        SlabAllocator &slab = SlabAllocator::local();
+        auto *fresh = static_cast<unsigned char *>(slab.allocate(cap));
+        std::memcpy(fresh, data, count * bytes);
+        slab.deallocate(data, cap);
+        data = fresh;
+        return true;
+    }
+}
@@ -1,150 +1,1021 @@
 #include "kvstore.hpp"
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cmath>
 
 namespace tr
 {
-    bool KVStore::purge_if_expired(const std::string &key)
+    bool as_canonical_integer(std::string_view s, long long &out)
     {
-        auto it = expiry.find(key);
-        if (it == expiry.end())
+        if (s.empty() || s.size() > 20)
         {
             return false;
         }
-        std::chrono::steady_clock::time_point deadline = it->second;
-        if (deadline <= std::chrono::steady_clock::now())
+        auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+        if (ec != std::errc() || end != s.data() + s.size())
         {
-            memory.erase(key);
-            expiry.erase(key);
-            return true;
+            return false;
+        }
+        std::size_t first = s[0] == '-' ? 1 : 0;
+        return s[first] != '0' || s.size() == 1;
+    }
+
+    KVStore::Entry::Entry(Entry &&other) noexcept
+        : key(std::move(other.key)), deadline(other.deadline), access(other.access), encoding(other.encoding)
+    {
+        switch (encoding)
+        {
+        case Encoding::Int:
+            num = other.num;
+            break;
+        case Encoding::Raw:
+            new (&str) SlabString(std::move(other.str));
+            break;
+        case Encoding::Hash:
+            hash = other.hash;
+            other.encoding = Encoding::Int; // so it does not free the hash
+            break;
+        case Encoding::List:
+            list = other.list;
+            other.encoding = Encoding::Int;
+            break;
+        case Encoding::Set:
+            set = other.set;
+            other.encoding = Encoding::Int;
+            break;
+        case Encoding::ZSet:
+            zset = other.zset;
+            other.encoding = Encoding::Int;
+            break;
+        }
+    }
+
+    KVStore::Entry::~Entry()
+    {
+        set_int(0);
+    }
+
+    void KVStore::Entry::set_int(long long n)
+    {
+        if (encoding == Encoding::Raw)
+        {
+            str.~SlabString();
+        }
+        else if (encoding == Encoding::Hash)
+        {
+            delete hash;
+        }
+        else if (encoding == Encoding::List)
+        {
+            delete list;
+        }
+        else if (encoding == Encoding::Set)
+        {
+            delete set;
+        }
+        else if (encoding == Encoding::ZSet)
+        {
+            delete zset;
+        }
+        encoding = Encoding::Int;
+        num = n;
+    }
+
+    void KVStore::Entry::set_str(std::string_view s)
+    {
+        if (encoding != Encoding::Raw)
+        {
+            set_int(0);
+            new (&str) SlabString(s);
+            encoding = Encoding::Raw;
+            return;
+        }
+        str.assign(s);
+    }
+
+    void KVStore::Entry::set_hash()
+    {
+        set_int(0);
+        hash = new HashObject();
+        encoding = Encoding::Hash;
+    }
+
+    void KVStore::Entry::set_list()
+    {
+        set_int(0);
+        list = new ListObject();
+        encoding = Encoding::List;
+    }
+
+    void KVStore::Entry::set_set(std::unique_ptr<SetObject> members)
+    {
+        set_int(0);
+        set = members.release();
+        encoding = Encoding::Set;
+    }
+
+    void KVStore::Entry::set_zset()
+    {
+        set_int(0);
+        zset = new ZSetObject();
+        encoding = Encoding::ZSet;
+    }
+
+    std::string KVStore::Entry::value() const
+    {
+        return encoding == Encoding::Int ? std::to_string(num) : std::string(str.view());
+    }
+
+    std::size_t KVStore::Entry::value_heap() const
+    {
+        switch (encoding)
+        {
+        case Encoding::Raw:
+            return str.heap();
+        case Encoding::Hash:
+            return hash->heap();
+        case Encoding::List:
+            return list->heap();
+        case Encoding::Set:
+            return set->heap();
+        case Encoding::ZSet:
+            return zset->heap();
+        default:
+            return 0;
+        }
+    }
+
+    KVStore::Entry *KVStore::lookup(std::string_view key, std::size_t hash)
+    {
+        Entry *entry = table.find(key, hash);
+        if (entry == nullptr)
+        {
+            return nullptr;
+        }
+        // Only keys with a deadline pay for reading the clock.
+        if (entry->deadline != NO_DEADLINE && entry->deadline <= now_ms())
+        {
+            remove_expired(entry);
+            return nullptr;
+        }
+        touch(entry);
+        return entry;
+    }
+
+    KVStore::Entry *KVStore::insert(std::string_view key, std::size_t hash)
+    {
+        auto [entry, inserted] = table.insert(key, hash);
+        if (inserted)
+        {
+            heap_bytes += entry->key.heap();
+        }
+        touch(entry, inserted);
+        return entry;
+    }
+
+    void KVStore::set_value(Entry *entry, std::string_view value)
+    {
+        long long n = 0;
+        if (as_canonical_integer(value, n))
+        {
+            set_value(entry, n);
+            return;
+        }
+        heap_bytes -= entry->value_heap();
+        entry->set_str(value);
+        heap_bytes += entry->value_heap();
+    }
+
+    void KVStore::set_value(Entry *entry, long long value)
+    {
+        heap_bytes -= entry->value_heap();
+        entry->set_int(value);
+    }
+
+    int64_t KVStore::to_ms(Clock::time_point t)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+    }
+
+    int64_t KVStore::deadline_in(long long ms) const
+    {
+        int64_t now = now_ms();
+        return ms >= NO_DEADLINE - 1 - now ? NO_DEADLINE - 1 : now + ms;
+    }
+
+    void KVStore::set_clock(Clock::time_point now)
+    {
+        cached_ms = to_ms(now);
+    }
+
+    void KVStore::set_deadline(Entry *entry, int64_t deadline)
+    {
+        volatile_count += (deadline != NO_DEADLINE) - (entry->deadline != NO_DEADLINE);
+        entry->deadline = deadline;
+    }
+
+    void KVStore::remove(Entry *entry)
+    {
+        if (entry->deadline != NO_DEADLINE)
+        {
+            --volatile_count;
+        }
+        heap_bytes -= entry->key.heap() + entry->value_heap();
+        table.erase(entry);
+    }
+
+    void KVStore::remove_expired(Entry *entry)
+    {
+        ++expired_count;
+        remove(entry);
+    }
+
+    bool KVStore::active_expire(std::chrono::microseconds budget, Clock::time_point now)
+    {
+        // A round stops after this many keys with a deadline, or this many
+        // slots, whichever comes first.
+        constexpr std::size_t SAMPLE = 20;
+        constexpr std::size_t MAX_SLOTS = 400;
+
+        Clock::time_point stop_at = Clock::now() + budget;
+        int64_t now_ms = to_ms(now);
+        std::size_t visited = 0;
+        while (volatile_count > 0)
+        {
+            std::size_t sampled = 0;
+            std::size_t expired = 0;
+            std::size_t from = expire_cursor < table.scan_extent() ? expire_cursor : 0;
+            expire_cursor = table.scan(from, MAX_SLOTS, [&](Entry &entry)
+                                       {
+                if (entry.deadline == NO_DEADLINE)
+                {
+                    return true;
+                }
+                ++sampled;
+                if (entry.deadline <= now_ms)
+                {
+                    remove_expired(&entry);
+                    ++expired;
+                }
+                return sampled < SAMPLE; });
+            visited += (expire_cursor == 0 ? table.scan_extent() : expire_cursor) - from;
+
+            // Under a quarter of the sample was stale: the rest can wait for
+            // the next cycle or a lazy lookup.
+            if (sampled > 0 && expired * 4 < sampled)
+            {
+                return false;
+            }
+            // A full lap has seen every key.
+            if (visited >= table.scan_extent())
+            {
+                return false;
+            }
+            if (Clock::now() >= stop_at)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool KVStore::migrate(std::chrono::microseconds budget)
+    {
+        // Checking the clock every slot would cost more than moving it.
+        constexpr std::size_t BATCH = 1024;
+        Clock::time_point stop_at = Clock::now() + budget;
+        while (table.migrate(BATCH))
+        {
+            if (Clock::now() >= stop_at)
+            {
+                return true;
+            }
         }
         return false;
     }
 
-    bool KVStore::expire(const std::string &key, long long seconds)
+    bool KVStore::defrag(std::chrono::microseconds budget)
     {
-        purge_if_expired(key);
-        if (memory.find(key) == memory.end())
+        constexpr std::size_t BATCH = 1024;
+        SlabAllocator &slab = SlabAllocator::local();
+        if (slab.stats().reserved == defrag_stalled_at)
         {
             return false;
         }
+        defrag_stalled_at = 0;
+        Clock::time_point stop_at = Clock::now() + budget;
+        while (slab.fragmented())
+        {
+            defrag_cursor = table.scan(defrag_cursor, BATCH, [this](Entry &entry)
+                                       {
+                defrag_moved += entry.key.defrag();
+                if (entry.encoding == Encoding::Raw)
+                {
+                    defrag_moved += entry.str.defrag();
+                }
+                else if (entry.encoding == Encoding::Hash)
+                {
+                    defrag_moved += entry.hash->defrag();
+                }
+                else if (entry.encoding == Encoding::List)
+                {
+                    defrag_moved += entry.list->defrag();
+                }
+                else if (entry.encoding == Encoding::Set)
+                {
+                    defrag_moved += entry.set->defrag();
+                }
+                else if (entry.encoding == Encoding::ZSet)
+                {
+                    defrag_moved += entry.zset->defrag();
+                }
+                return true; });
+            if (defrag_cursor == 0)
+            {
+                if (defrag_moved == 0)
+                {
+                    defrag_stalled_at = slab.stats().reserved;
+                }
+                defrag_moved = 0;
+                return false;
+            }
+            if (Clock::now() >= stop_at)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool KVStore::expire(std::string_view key, long long seconds)
+    {
+        constexpr long long MAX_SECONDS = LLONG_MAX / 1000;
         if (seconds <= 0)
         {
-            memory.erase(key);
-            expiry.erase(key);
+            return pexpire(key, 0); // any non-positive time deletes; * 1000 could overflow
+        }
+        return pexpire(key, seconds > MAX_SECONDS ? LLONG_MAX : seconds * 1000);
+    }
+
+    bool KVStore::pexpire(std::string_view key, long long ms)
+    {
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
+        {
+            return false;
+        }
+        if (ms <= 0)
+        {
+            remove(entry);
             return true;
         }
-        auto now = std::chrono::steady_clock::now();
-        expiry[key] = now + std::chrono::seconds(seconds);
+        set_deadline(entry, deadline_in(ms));
         return true;
     }
 
-    long long KVStore::ttl(const std::string &key)
+    bool KVStore::persist(std::string_view key)
     {
-        purge_if_expired(key);
-        auto it = memory.find(key);
-        if (it == memory.end())
+        Entry *entry = lookup(key);
+        if (entry == nullptr || entry->deadline == NO_DEADLINE)
+        {
+            return false;
+        }
+        set_deadline(entry, NO_DEADLINE);
+        return true;
+    }
+
+    long long KVStore::ttl(std::string_view key)
+    {
+        long long ms = pttl(key);
+        return ms < 0 ? ms : ms / 1000;
+    }
+
+    long long KVStore::pttl(std::string_view key)
+    {
+        // lookup() has already removed the key if its deadline passed.
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
         {
             return -2;
         }
-        auto it2 = expiry.find(key);
-        if (it2 == expiry.end())
+        if (entry->deadline == NO_DEADLINE)
         {
             return -1;
         }
-        std::chrono::steady_clock::time_point deadline = it2->second;
-        std::chrono::steady_clock::duration remaining = deadline - std::chrono::steady_clock::now();
-        if (remaining <= std::chrono::steady_clock::duration::zero())
+        return entry->deadline - now_ms();
+    }
+
+    void KVStore::set(std::string_view key, std::string_view value)
+    {
+        Entry *entry = insert(key);
+        set_value(entry, value);
+        set_deadline(entry, NO_DEADLINE);
+    }
+
+    bool KVStore::set(std::string_view key, std::string_view value, const SetOptions &options)
+    {
+        if (options.when != SetOptions::When::Always)
         {
-            memory.erase(it);
-            expiry.erase(it2);
-            return -2;
+            bool present = lookup(key) != nullptr;
+            if (present != (options.when == SetOptions::When::IfExists))
+            {
+                return false;
+            }
         }
+        else if (options.keep_ttl)
+        {
+            lookup(key); // an expired key's deadline must not carry over
+        }
+        Entry *entry = insert(key);
+        set_value(entry, value);
+        if (options.ttl_ms > 0)
+        {
+            set_deadline(entry, deadline_in(options.ttl_ms));
+        }
+        else if (!options.keep_ttl)
+        {
+            set_deadline(entry, NO_DEADLINE);
+        }
+        return true;
+    }
 
-        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(remaining);
-        return seconds.count();
+    void KVStore::mset(std::span<const std::string_view> pairs)
+    {
+        for_each_hashed(pairs, 2, [&](std::size_t i, std::size_t hash)
+                        {
+            Entry *entry = insert(pairs[i], hash);
+            set_value(entry, pairs[i + 1]);
+            set_deadline(entry, NO_DEADLINE); });
     }
 
-    void KVStore::set(const std::string &key, const std::string &value)
+    bool KVStore::msetnx(std::span<const std::string_view> pairs)
     {
-        purge_if_expired(key);
-        memory[key] = value;
-        auto it = expiry.find(key);
-        if (it != expiry.end())
+        bool any = false;
+        for_each_hashed(pairs, 2, [&](std::size_t i, std::size_t hash)
+                        { any = any || lookup(pairs[i], hash) != nullptr; });
+        if (any)
         {
-            expiry.erase(it);
+            return false;
         }
+        mset(pairs);
+        return true;
     }
 
-    std::optional<std::string> KVStore::get(const std::string &key)
+    std::optional<std::string> KVStore::get(std::string_view key)
     {
-        purge_if_expired(key);
-        auto it = memory.find(key);
-        if (it != memory.end())
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
         {
-            return it->second;
+            return std::nullopt;
         }
-        return std::nullopt;
+        if (!entry->is_string())
+        {
+            throw WrongType();
+        }
+        return entry->value();
     }
 
-    bool KVStore::del(const std::string &key)
+    bool KVStore::del(std::string_view key)
     {
-        purge_if_expired(key);
-        auto it = memory.find(key);
-        if (it != memory.end())
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
         {
-            bool removed = memory.erase(key) > 0;
-            expiry.erase(key);
-            return removed;
+            return false;
         }
-        return false;
+        remove(entry);
+        return true;
     }
 
-    std::optional<long long> KVStore::incrby(const std::string &key, long long delta)
+    std::optional<long long> KVStore::incrby(std::string_view key, long long delta)
     {
-        purge_if_expired(key);
-        auto it = memory.find(key);
-        long long current;
-        std::size_t pos = 0;
-        if (it != memory.end())
+        Entry *entry = lookup(key);
+        long long current = 0;
+        if (entry != nullptr)
         {
-            try
+            if (!entry->is_string())
             {
-                const std::string &s = it->second;
-                current = std::stoll(s, &pos);
-                if (s.size() != pos)
-                {
-                    return std::nullopt;
-                }
+                throw WrongType();
             }
-            catch (const std::exception &)
+            // Any value that parses as an integer is stored as one.
+            if (entry->encoding != Encoding::Int)
             {
                 return std::nullopt;
             }
-        }
-        else
-        {
-            current = 0;
+            current = entry->num;
         }
         if (delta > 0 && current > LLONG_MAX - delta)
             return std::nullopt;
         if (delta < 0 && current < LLONG_MIN - delta)
             return std::nullopt;
         long long next = current + delta;
-        memory[key] = std::to_string(next);
+        if (entry == nullptr)
+        {
+            entry = insert(key);
+        }
+        // An existing deadline is kept, as in Redis.
+        set_value(entry, next);
         return next;
     }
 
-    int KVStore::exists(const std::vector<std::string> &keys)
+    int KVStore::exists(std::span<const std::string_view> keys)
     {
         int count = 0;
-        for (const auto &key : keys)
+        for (std::string_view key : keys)
         {
-            purge_if_expired(key);
-            auto it = memory.find(key);
-            if (it != memory.end())
+            if (lookup(key) != nullptr)
             {
                 count++;
             }
         }
         return count;
     }
-}
\ No newline at end of file
+
+    HashObject *KVStore::find_hash(std::string_view key)
+    {
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
+        {
+            return nullptr;
+        }
+        if (entry->encoding != Encoding::Hash)
+        {
+            throw WrongType();
+        }
+        return entry->hash;
+    }
+
+    std::size_t KVStore::hset(std::string_view key, std::span<const std::string_view> pairs)
+    {
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
+        {
+            entry = insert(key);
+            entry->set_hash();
+            heap_bytes += entry->value_heap();
+        }
+        else if (entry->encoding != Encoding::Hash)
+        {
+            throw WrongType();
+        }
+        heap_bytes -= entry->value_heap();
+        std::size_t added = 0;
+        for (std::size_t i = 0; i + 1 < pairs.size(); i += 2)
+        {
+            added += entry->hash->set(pairs[i], pairs[i + 1], hash_limits);
+        }
+        heap_bytes += entry->value_heap();
+        return added;
+    }
+
+    std::size_t KVStore::hdel(std::string_view key, std::span<const std::string_view> fields)
+    {
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
+        {
+            return 0;
+        }
+        if (entry->encoding != Encoding::Hash)
+        {
+            throw WrongType();
+        }
+        heap_bytes -= entry->value_heap();
+        std::size_t removed = 0;
+        for (std::string_view field : fields)
+        {
+            removed += entry->hash->del(field);
+        }
+        heap_bytes += entry->value_heap();
+        if (entry->hash->size() == 0)
+        {
+            remove(entry);
+        }
+        return removed;
+    }
+
+    std::optional<long long> KVStore::hincrby(std::string_view key, std::string_view field, long long delta)
+    {
+        HashObject *hash = find_hash(key);
+        long long current = 0;
+        if (hash != nullptr)
+        {
+            std::optional<std::string_view> value = hash->get(field);
+            if (value && !as_canonical_integer(*value, current))
+            {
+                return std::nullopt;
+            }
+        }
+        if (delta > 0 && current > LLONG_MAX - delta)
+            return std::nullopt;
+        if (delta < 0 && current < LLONG_MIN - delta)
+            return std::nullopt;
+        long long next = current + delta;
+        char digits[20];
+        char *end = std::to_chars(digits, digits + sizeof(digits), next).ptr;
+        std::string_view pair[] = {field, std::string_view(digits, static_cast<std::size_t>(end - digits))};
+        hset(key, pair);
+        return next;
+    }
+
+    std::size_t KVStore::hlen(std::string_view key)
+    {
+        HashObject *hash = find_hash(key);
+        return hash != nullptr ? hash->size() : 0;
+    }
+
+    KVStore::Entry *KVStore::find_list_entry(std::string_view key)
+    {
+        Entry *entry = lookup(key);
+        if (entry != nullptr && entry->encoding != Encoding::List)
+        {
+            throw WrongType();
+        }
+        return entry;
+    }
+
+    std::size_t KVStore::push(std::string_view key, std::span<const std::string_view> values, bool front)
+    {
+        Entry *entry = find_list_entry(key);
+        if (entry == nullptr)
+        {
+            entry = insert(key);
+            entry->set_list();
+            heap_bytes += entry->value_heap();
+        }
+        ListObject *list = entry->list;
+        heap_bytes -= entry->value_heap();
+        for (std::string_view value : values)
+        {
+            if (front)
+            {
+                list->push_front(value, list_fill);
+            }
+            else
+            {
+                list->push_back(value, list_fill);
+            }
+        }
+        heap_bytes += entry->value_heap();
+        if (!watched.empty())
+        {
+            auto it = watched.find(std::string(key));
+            if (it != watched.end() && !it->second)
+            {
+                it->second = true;
+                ready_keys.emplace_back(key);
+            }
+        }
+        return list->size();
+    }
+
+    std::size_t KVStore::llen(std::string_view key)
+    {
+        ListObject *list = find_list(key);
+        return list != nullptr ? list->size() : 0;
+    }
+
+    void KVStore::ltrim(std::string_view key, long long start, long long stop)
+    {
+        Entry *entry = find_list_entry(key);
+        if (entry == nullptr)
+        {
+            return;
+        }
+        auto [first, n] = list_range(start, stop, entry->list->size());
+        if (n == 0)
+        {
+            remove(entry);
+            return;
+        }
+        heap_bytes -= entry->value_heap();
+        entry->list->trim(first, n);
+        heap_bytes += entry->value_heap();
+    }
+
+    SetObject *KVStore::find_set(std::string_view key)
+    {
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
+        {
+            return nullptr;
+        }
+        if (entry->encoding != Encoding::Set)
+        {
+            throw WrongType();
+        }
+        return entry->set;
+    }
+
+    std::size_t KVStore::sadd(std::string_view key, std::span<const std::string_view> members)
+    {
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
+        {
+            entry = insert(key);
+            entry->set_set(std::make_unique<SetObject>());
+            heap_bytes += entry->value_heap();
+        }
+        else if (entry->encoding != Encoding::Set)
+        {
+            throw WrongType();
+        }
+        heap_bytes -= entry->value_heap();
+        std::size_t added = 0;
+        for (std::string_view member : members)
+        {
+            added += entry->set->add(member, set_limits);
+        }
+        heap_bytes += entry->value_heap();
+        return added;
+    }
+
+    std::size_t KVStore::srem(std::string_view key, std::span<const std::string_view> members)
+    {
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
+        {
+            return 0;
+        }
+        if (entry->encoding != Encoding::Set)
+        {
+            throw WrongType();
+        }
+        heap_bytes -= entry->value_heap();
+        std::size_t removed = 0;
+        for (std::string_view member : members)
+        {
+            removed += entry->set->remove(member);
+        }
+        heap_bytes += entry->value_heap();
+        if (entry->set->size() == 0)
+        {
+            remove(entry);
+        }
+        return removed;
+    }
+
+    bool KVStore::sismember(std::string_view key, std::string_view member)
+    {
+        SetObject *set = find_set(key);
+        return set != nullptr && set->contains(member);
+    }
+
+    std::size_t KVStore::scard(std::string_view key)
+    {
+        SetObject *set = find_set(key);
+        return set != nullptr ? set->size() : 0;
+    }
+
+    std::unique_ptr<SetObject> KVStore::set_op(SetOp op, std::span<const std::string_view> keys)
+    {
+        // Every key is type-checked before anything is computed.
+        std::vector<SetObject *> sets;
+        sets.reserve(keys.size());
+        for (std::string_view key : keys)
+        {
+            sets.push_back(find_set(key));
+        }
+        auto result = std::make_unique<SetObject>();
+        auto add = [&](std::string_view member) { result->add(member, set_limits); };
+        if (op == SetOp::Union)
+        {
+            for (SetObject *set : sets)
+            {
+                if (set != nullptr)
+                {
+                    set->for_each(add);
+                }
+            }
+            return result;
+        }
+        if (sets[0] == nullptr)
+        {
+            return result;
+        }
+        if (op == SetOp::Diff)
+        {
+            sets[0]->for_each([&](std::string_view member)
+                              {
+                for (std::size_t i = 1; i < sets.size(); ++i)
+                {
+                    if (sets[i] != nullptr && sets[i]->contains(member))
+                    {
+                        return;
+                    }
+                }
+                add(member); });
+            return result;
+        }
+        if (std::find(sets.begin(), sets.end(), nullptr) != sets.end())
+        {
+            return result;
+        }
+        // Smallest first, as in Redis, so every step shrinks the candidates.
+        std::sort(sets.begin(), sets.end(), [](SetObject *a, SetObject *b) { return a->size() < b->size(); });
+        if (sets.size() == 1)
+        {
+            sets[0]->for_each(add);
+            return result;
+        }
+        SetObject *left = sets[0];
+        for (std::size_t i = 1; i < sets.size() && left->size() != 0; ++i)
+        {
+            const IntSet *a = left->int_members();
+            const IntSet *b = sets[i]->int_members();
+            SetObject next = a != nullptr && b != nullptr ? SetObject(IntSet::intersect(*a, *b)) : SetObject();
+            if (a == nullptr || b == nullptr)
+            {
+                left->for_each([&](std::string_view member)
+                               {
+                    if (sets[i]->contains(member))
+                    {
+                        next.add(member, set_limits);
+                    } });
+            }
+            *result = std::move(next);
+            left = result.get();
+        }
+        return result;
+    }
+
+    std::size_t KVStore::set_op_store(SetOp op, std::string_view dst, std::span<const std::string_view> keys)
+    {
+        std::unique_ptr<SetObject> result = set_op(op, keys);
+        std::size_t size = result->size();
+        Entry *entry = lookup(dst);
+        if (size == 0)
+        {
+            if (entry != nullptr)
+            {
+                remove(entry);
+            }
+            return 0;
+        }
+        if (entry == nullptr)
+        {
+            entry = insert(dst);
+        }
+        heap_bytes -= entry->value_heap();
+        entry->set_set(std::move(result));
+        heap_bytes += entry->value_heap();
+        set_deadline(entry, NO_DEADLINE);
+        return size;
+    }
+
+    ZSetObject *KVStore::find_zset(std::string_view key)
+    {
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
+        {
+            return nullptr;
+        }
+        if (entry->encoding != Encoding::ZSet)
+        {
+            throw WrongType();
+        }
+        return entry->zset;
+    }
+
+    ZAddResult KVStore::zadd(std::string_view key, std::span<const std::pair<double, std::string_view>> items,
+                             const ZAddOptions &options)
+    {
+        ZAddResult result;
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
+        {
+            if (options.when == SetOptions::When::IfExists)
+            {
+                return result;
+            }
+            entry = insert(key);
+            entry->set_zset();
+            heap_bytes += entry->value_heap();
+        }
+        else if (entry->encoding != Encoding::ZSet)
+        {
+            throw WrongType();
+        }
+        ZSetObject *zset = entry->zset;
+        heap_bytes -= entry->value_heap();
+        for (auto [score, member] : items)
+        {
+            std::optional<double> current = zset->score(member);
+            if (current ? options.when == SetOptions::When::IfMissing : options.when == SetOptions::When::IfExists)
+            {
+                continue;
+            }
+            if (options.incr && current)
+            {
+                score += *current;
+                if (std::isnan(score))
+                {
+                    result.nan = true;
+                    break;
+                }
+            }
+            if (current && ((options.scores == ZAddOptions::Scores::Greater && score <= *current) ||
+                            (options.scores == ZAddOptions::Scores::Less && score >= *current)))
+            {
+                continue;
+            }
+            if (zset->set(member, score, zset_limits))
+            {
+                ++result.added;
+            }
+            else if (score != *current)
+            {
+                ++result.changed;
+            }
+            result.score = score;
+        }
+        heap_bytes += entry->value_heap();
+        if (zset->size() == 0)
+        {
+            remove(entry);
+        }
+        return result;
+    }
+
+    std::optional<double> KVStore::zscore(std::string_view key, std::string_view member)
+    {
+        ZSetObject *zset = find_zset(key);
+        return zset != nullptr ? zset->score(member) : std::nullopt;
+    }
+
+    std::optional<std::size_t> KVStore::zrank(std::string_view key, std::string_view member, bool reverse)
+    {
+        ZSetObject *zset = find_zset(key);
+        std::optional<std::size_t> rank = zset != nullptr ? zset->rank(member) : std::nullopt;
+        if (rank && reverse)
+        {
+            *rank = zset->size() - 1 - *rank;
+        }
+        return rank;
+    }
+
+    std::size_t KVStore::zrem(std::string_view key, std::span<const std::string_view> members)
+    {
+        Entry *entry = lookup(key);
+        if (entry == nullptr)
+        {
+            return 0;
+        }
+        if (entry->encoding != Encoding::ZSet)
+        {
+            throw WrongType();
+        }
+        heap_bytes -= entry->value_heap();
+        std::size_t removed = 0;
+        for (std::string_view member : members)
+        {
+            removed += entry->zset->remove(member);
+        }
+        heap_bytes += entry->value_heap();
+        if (entry->zset->size() == 0)
+        {
+            remove(entry);
+        }
+        return removed;
+    }
+
+    std::size_t KVStore::zcard(std::string_view key)
+    {
+        ZSetObject *zset = find_zset(key);
+        return zset != nullptr ? zset->size() : 0;
+    }
+
+    std::pair<std::size_t, std::size_t> KVStore::zranks_in(std::string_view key, const ScoreRange &range, bool reverse)
+    {
+        ZSetObject *zset = find_zset(key);
+        if (zset == nullptr)
+        {
+            return {0, 0};
+        }
+        auto [first, n] = zset->ranks_in(range);
+        return {reverse ? zset->size() - first - n : first, n};
+    }
+
+    void KVStore::watch(std::string_view key)
+    {
+        watched.try_emplace(std::string(key), false);
+    }
+
+    void KVStore::unwatch(std::string_view key)
+    {
+        watched.erase(std::string(key));
+    }
+
+    void KVStore::take_ready_keys(std::vector<std::string> &out)
+    {
+        out.clear();
+        out.swap(ready_keys);
+        for (const std::string &key : out)
+        {
+            auto it = watched.find(key);
+            if (it != watched.end())
+            {
+                it->second = false;
+            }
+        }
+    }
+}
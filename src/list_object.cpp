@@ -0,0 +1,161 @@
+#include "list_object.hpp"
+#include <algorithm>
+
+namespace tr
+{
+    std::pair<std::size_t, std::size_t> list_range(long long start, long long stop, std::size_t size)
+    {
+        long long n = static_cast<long long>(size);
+        if (start < 0)
+        {
+            start = std::max(start + n, 0LL);
+        }
+        if (stop < 0)
+        {
+            stop += n;
+        }
+        stop = std::min(stop, n - 1);
+        if (start > stop)
+        {
+            return {0, 0};
+        }
+        return {static_cast<std::size_t>(start), static_cast<std::size_t>(stop - start + 1)};
+    }
+
+    bool ListObject::fits(const Listpack &node, std::size_t value_size, int fill)
+    {
+        if (fill > 0)
+        {
+            return node.size() < static_cast<std::size_t>(fill);
+        }
+        std::size_t limit = std::size_t{4096} << (std::clamp(-fill, 1, 5) - 1);
+        // An entry too large for any node gets one to itself.
+        return node.empty() || node.bytes() + Listpack::entry_size(value_size) <= limit;
+    }
+
+    void ListObject::push_front(std::string_view value, int fill)
+    {
+        if (nodes.empty() || !fits(nodes.front(), value.size(), fill))
+        {
+            nodes.emplace_front();
+        }
+        Listpack &node = nodes.front();
+        node_bytes -= node.heap();
+        node.insert(0, value);
+        node_bytes += node.heap();
+        ++count;
+    }
+
+    void ListObject::push_back(std::string_view value, int fill)
+    {
+        if (nodes.empty() || !fits(nodes.back(), value.size(), fill))
+        {
+            nodes.emplace_back();
+        }
+        Listpack &node = nodes.back();
+        node_bytes -= node.heap();
+        node.push_back(value);
+        node_bytes += node.heap();
+        ++count;
+    }
+
+    void ListObject::erase_from(Nodes::iterator node, std::size_t pos)
+    {
+        node_bytes -= node->heap();
+        node->erase(pos);
+        node_bytes += node->heap();
+        --count;
+        if (node->empty())
+        {
+            nodes.erase(node);
+        }
+    }
+
+    std::pair<ListObject::Nodes::const_iterator, std::size_t> ListObject::locate(std::size_t index) const
+    {
+        if (index < count / 2)
+        {
+            auto node = nodes.begin();
+            for (; index >= node->size(); ++node)
+            {
+                index -= node->size();
+            }
+            std::size_t pos = 0;
+            for (; index > 0; --index)
+            {
+                pos = node->next(pos);
+            }
+            return {node, pos};
+        }
+        std::size_t from_end = count - 1 - index;
+        auto node = nodes.end() - 1;
+        for (; from_end >= node->size(); --node)
+        {
+            from_end -= node->size();
+        }
+        std::size_t pos = node->last();
+        for (; from_end > 0; --from_end)
+        {
+            pos = node->prev(pos);
+        }
+        return {node, pos};
+    }
+
+    std::string_view ListObject::at(std::size_t index) const
+    {
+        auto [node, pos] = locate(index);
+        return node->get(pos);
+    }
+
+    void ListObject::trim(std::size_t first, std::size_t n)
+    {
+        std::size_t drop = first;
+        while (drop > 0 && drop >= nodes.front().size())
+        {
+            drop -= nodes.front().size();
+            count -= nodes.front().size();
+            node_bytes -= nodes.front().heap();
+            nodes.pop_front();
+        }
+        if (drop > 0)
+        {
+            Listpack &node = nodes.front();
+            node_bytes -= node.heap();
+            node.erase(0, drop);
+            node_bytes += node.heap();
+            count -= drop;
+        }
+
+        drop = count - n;
+        while (drop > 0 && drop >= nodes.back().size())
+        {
+            drop -= nodes.back().size();
+            count -= nodes.back().size();
+            node_bytes -= nodes.back().heap();
+            nodes.pop_back();
+        }
+        if (drop > 0)
+        {
+            Listpack &node = nodes.back();
+            std::size_t pos = node.bytes();
+            for (std::size_t i = 0; i < drop; ++i)
+            {
+                pos = node.prev(pos);
+            }
+            node_bytes -= node.heap();
+            node.erase(pos, drop);
+            node_bytes += node.heap();
+            count -= drop;
+        }
+    }
+
+    std::size_t ListObject::defrag()
+    {
+        std::size_t moved = 0;
+        for (Listpack &node : nodes)
+        {
+            moved += node.defrag();
+        }
+        return moved;
+    }
+}
@@ -0,0 +1,195 @@
+#include "listpack.hpp"
+#include "slab.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+namespace tr
+{
+    namespace
+    {
+        uint32_t load32(const unsigned char *p)
+        {
+            uint32_t n;
+            std::memcpy(&n, p, sizeof(n));
+            return n;
+        }
+
+        // Chunks grow through the slab's size classes, which are about 25%
+        // apart, and past the largest class by a quarter at a time.
+        std::size_t capacity_for(std::size_t n)
+        {
+            return n > SlabAllocator::MAX_CHUNK ? n + n / 4 : SlabAllocator::chunk_size(n);
+        }
+    }
+
+    Listpack::Listpack(Listpack &&other) noexcept
+        : data(std::exchange(other.data, nullptr)), used(std::exchange(other.used, 0)), cap(std::exchange(other.cap, 0)),
+          count(std::exchange(other.count, 0))
+    {
+    }
+
+    Listpack &Listpack::operator=(Listpack &&other) noexcept
+    {
+        if (this != &other)
+        {
+            clear();
+            data = std::exchange(other.data, nullptr);
+            used = std::exchange(other.used, 0);
+            cap = std::exchange(other.cap, 0);
+            count = std::exchange(other.count, 0);
+        }
+        return *this;
+    }
+
+    Listpack::~Listpack()
+    {
+        clear();
+    }
+
+    void Listpack::clear()
+    {
+        if (data != nullptr)
+        {
+            SlabAllocator::local().deallocate(data, cap);
+        }
+        data = nullptr;
+        used = cap = count = 0;
+    }
+
+    std::string_view Listpack::get(std::size_t pos) const
+    {
+        const unsigned char *p = data + pos;
+        if (*p < LONG)
+        {
+            return {reinterpret_cast<const char *>(p + 1), *p};
+        }
+        return {reinterpret_cast<const char *>(p + 5), load32(p + 1)};
+    }
+
+    std::size_t Listpack::next(std::size_t pos) const
+    {
+        const unsigned char *p = data + pos;
+        return pos + (*p < LONG ? *p + 2u : load32(p + 1) + 10u);
+    }
+
+    std::size_t Listpack::prev(std::size_t pos) const
+    {
+        const unsigned char *p = data + pos;
+        return pos - (p[-1] < LONG ? p[-1] + 2u : load32(p - 5) + 10u);
+    }
+
+    std::size_t Listpack::find(std::string_view s, std::size_t step) const
+    {
+        std::size_t i = 0;
+        for (std::size_t pos = 0; pos < used; pos = next(pos), ++i)
+        {
+            if (i % step == 0 && get(pos) == s)
+            {
+                return pos;
+            }
+        }
+        return used;
+    }
+
+    void Listpack::write_entry(unsigned char *p, std::string_view s)
+    {
+        if (s.size() < LONG)
+        {
+            p[0] = static_cast<unsigned char>(s.size());
+            std::memcpy(p + 1, s.data(), s.size());
+            p[1 + s.size()] = p[0];
+            return;
+        }
+        uint32_t n = static_cast<uint32_t>(s.size());
+        p[0] = LONG;
+        std::memcpy(p + 1, &n, sizeof(n));
+        std::memcpy(p + 5, s.data(), s.size());
+        std::memcpy(p + 5 + s.size(), &n, sizeof(n));
+        p[9 + s.size()] = LONG;
+    }
+
+    void Listpack::resize_at(std::size_t pos, std::ptrdiff_t grow)
+    {
+        std::size_t need = used + static_cast<std::size_t>(grow);
+        std::size_t target = pos + static_cast<std::size_t>(grow);
+        if (need == 0)
+        {
+            clear(); // only erase() empties it, having counted down to 0
+            return;
+        }
+        // Shrinks give the chunk back once it is less than half used.
+        if (need > cap || (need < cap / 2 && capacity_for(need) < cap))
+        {
+            SlabAllocator &slab = SlabAllocator::local();
+            std::size_t fresh_cap = capacity_for(need);
+            auto *fresh = static_cast<unsigned char *>(slab.allocate(fresh_cap));
+            if (data != nullptr)
+            {
+                std::memcpy(fresh, data, std::min(pos, target));
+                std::memcpy(fresh + target, data + pos, used - pos);
+                slab.deallocate(data, cap);
+            }
+            data = fresh;
+            cap = fresh_cap;
+        }
+        else if (used > pos)
+        {
+            std::memmove(data + target, data + pos, used - pos);
+        }
+        used = need;
+    }
+
+    void Listpack::insert(std::size_t pos, std::string_view s)
+    {
+        if (s.size() > UINT32_MAX)
+        {
+            throw std::length_error("Listpack entries are limited to 4 GB");
+        }
+        std::size_t n = entry_size(s.size());
+        resize_at(pos, static_cast<std::ptrdiff_t>(n));
+        write_entry(data + pos, s);
+        ++count;
+    }
+
+    void Listpack::replace(std::size_t pos, std::string_view s)
+    {
+        if (s.size() > UINT32_MAX)
+        {
+            throw std::length_error("Listpack entries are limited to 4 GB");
+        }
+        std::size_t end = next(pos);
+        std::ptrdiff_t grow = static_cast<std::ptrdiff_t>(entry_size(s.size())) - static_cast<std::ptrdiff_t>(end - pos);
+        if (grow != 0)
+        {
+            resize_at(end, grow);
+        }
+        write_entry(data + pos, s);
+    }
+
+    void Listpack::erase(std::size_t pos, std::size_t n)
+    {
+        std::size_t end = pos;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            end = next(end);
+        }
+        count -= n;
+        resize_at(end, -static_cast<std::ptrdiff_t>(end - pos));
+    }
+
+    bool Listpack::defrag()
+    {
+        if (data == nullptr || cap > SlabAllocator::MAX_CHUNK || !SlabAllocator::local().sparse(data))
+        {
+            return false;
+        }
+        SlabAllocator &slab = SlabAllocator::local();
+        auto *fresh = static_cast<unsigned char *>(slab.allocate(cap));
+        std::memcpy(fresh, data, used);
+        slab.deallocate(data, cap);
+        data = fresh;
+        return true;
+    }
+}
@@ -1,8 +1,7 @@
 #include "repl.hpp"
-#include <sstream>
+#include "commands.hpp"
 #include <algorithm>
-#include <cctype>
-#include <span>
+#include <sstream>
 
 namespace tr
 {
@@ -25,254 +24,102 @@ namespace tr
         consumed = 0;
         out.clear();
 
-        if (in.empty())
-            return RespParseStatus::NeedMore;
-
-        if (in[0] != '*')
-            return RespParseStatus::Error;
-
-        std::size_t crlf = in.find("\r\n");
-        if (crlf == std::string::npos)
-            return RespParseStatus::NeedMore;
-
-        if (crlf <= 1)
-            return RespParseStatus::Error;
-        std::string len_str = in.substr(1, crlf - 1);
-        std::size_t pos = 0;
-        long long n = 0;
-        try
-        {
-            n = std::stoll(len_str, &pos);
-        }
-        catch (...)
-        {
-            return RespParseStatus::Error;
-        }
-        if (pos != len_str.size() || n < 0)
-            return RespParseStatus::Error;
-
-        std::size_t cursor = crlf + 2;
-
-        for (long long i = 0; i < n; ++i)
+        RespParser parser;
+        std::vector<std::string_view> views;
+        RespParseStatus st = parser.parse(in, consumed, views);
+        if (st == RespParseStatus::Ok)
         {
-            if (cursor >= in.size())
-                return RespParseStatus::NeedMore;
-
-            if (in[cursor] != '$')
-                return RespParseStatus::Error;
-
-            std::size_t crlf2 = in.find("\r\n", cursor + 1);
-            if (crlf2 == std::string::npos)
-                return RespParseStatus::NeedMore;
-
-            const std::string len2_str = in.substr(cursor + 1, crlf2 - (cursor + 1));
-            std::size_t pos2 = 0;
-            long long len = 0;
-            try
-            {
-                len = std::stoll(len2_str, &pos2, 10);
-            }
-            catch (...)
-            {
-                return RespParseStatus::Error;
-            }
-            if (pos2 != len2_str.size() || len < 0)
-                return RespParseStatus::Error;
-
-            std::size_t data_start = crlf2 + 2;
-            std::size_t need = data_start + static_cast<std::size_t>(len) + 2;
-            if (in.size() < need)
-                return RespParseStatus::NeedMore;
-
-            // 6) Slice out the argument bytes
-
-            // 7) Verify trailing "\r\n"
-            std::size_t data_end = data_start + static_cast<std::size_t>(len);
-            if (in[data_end] != '\r' || in[data_end + 1] != '\n')
-                return RespParseStatus::Error;
-
-            out.emplace_back(in.substr(data_start, static_cast<std::size_t>(len)));
-
-            // 8) Advance cursor to the next element
-            cursor = data_end + 2;
+            out.assign(views.begin(), views.end());
         }
-        consumed = cursor;
-        return RespParseStatus::Ok;
+        return st;
     }
 
-    std::string eval_command(KVStore &db, const std::vector<std::string> &args)
+    namespace
     {
-        if (args.empty())
-        {
-            return "";
-        }
-        std::string cmd = args[0];
-        std::transform(cmd.begin(), cmd.end(), cmd.begin(), [](unsigned char c)
-                       { return static_cast<char>(std::tolower(c)); });
-
-        if (cmd == "ping" && args.size() == 1)
-        {
-            return "PONG";
-        }
-        else if (cmd == "ping" && args.size() != 1)
-        {
-            return "(error) ERR wrong number of arguments for 'ping'";
-        }
-        else if (cmd == "set")
-        {
-            if (args.size() != 3)
-            {
-                return "(error) ERR wrong number of arguments for 'set'";
-            }
-            else
-            {
-                db.set(args[1], args[2]);
-                return "OK";
-            }
-        }
-        else if (cmd == "get")
-        {
-            if (args.size() != 2)
-            {
-                return "(error) ERR wrong number of arguments for 'get'";
-            }
-            else
-            {
-                std::optional<std::string> value = db.get(args[1]);
-                if (value.has_value())
-                {
-                    return value.value();
-                }
-                else
+        // Turns one RESP reply starting at `pos` into the text the REPL prints.
+        // A reply cut short renders as far as it goes.
+        std::string render_reply(std::string_view resp, std::size_t &pos)
+        {
+            std::size_t crlf = resp.find("\r\n", pos);
+            if (crlf == std::string_view::npos)
+            {
+                pos = resp.size();
+                return "";
+            }
+            char type = resp[pos];
+            std::string_view line = resp.substr(pos + 1, crlf - pos - 1);
+            pos = crlf + 2;
+            long long n = 0;
+            switch (type)
+            {
+            case '+':
+            case ':':
+                return std::string(line);
+            case '-':
+                return "(error) " + std::string(line);
+            case '$':
+                parse_integer(line, n);
+                if (n < 0)
                 {
                     return "(nil)";
                 }
-            }
-        }
-        else if (cmd == "del")
-        {
-            if (args.size() < 2)
+                pos = std::min(resp.size(), pos + static_cast<std::size_t>(n) + 2);
+                return std::string(resp.substr(crlf + 2, static_cast<std::size_t>(n)));
+            case '*':
             {
-                return "(error) ERR wrong number of arguments for 'del'";
-            }
-            else
-            {
-                int total = 0;
-
-                for (size_t i = 1; i < args.size(); ++i)
+                parse_integer(line, n);
+                if (n < 0)
                 {
-                    total += db.del(args[i]) ? 1 : 0;
-                }
-
-                return std::to_string(total);
-            }
-        }
-        else if (cmd == "expire")
-        {
-            if (args.size() != 3)
-            {
-                return "(error) ERR wrong number of arguments for 'expire'";
-            }
-            else
-            {
-                try
-                {
-                    bool res = db.expire(args[1], std::stoll(args[2]));
-                    return std::to_string(res);
+                    return "(nil)";
                 }
-                catch (...)
+                if (n == 0)
                 {
-                    return "(error) ERR value is not an integer or out of range";
+                    return "(empty array)";
                 }
-            }
-        }
-        else if (cmd == "ttl")
-        {
-            if (args.size() != 2)
-            {
-                return "(error) ERR wrong number of arguments for 'ttl'";
-            }
-            else
-            {
-                long long res = db.ttl(args[1]);
-                return std::to_string(res);
-            }
-        }
-        else if (cmd == "incrby")
-        {
-            if (args.size() != 3)
-            {
-                return "(error) ERR wrong number of arguments for 'incrby'";
-            }
-            else
-            {
-                try
+                std::string text;
+                for (long long i = 0; i < n && pos < resp.size(); ++i)
                 {
-                    long long delta = std::stoll(args[2]);
-                    std::optional<long long> res = db.incrby(args[1], delta);
-
-                    if (res.has_value())
-                    {
-                        return std::to_string(res.value());
-                    }
-                    else
+                    if (i > 0)
                     {
-                        return "(error) ERR value is not an integer or out of range";
+                        text += "\n";
                     }
+                    text += std::to_string(i + 1) + ") " + render_reply(resp, pos);
                 }
-                catch (const std::exception &)
-                {
-                    return "(error) ERR value is not an integer or out of range";
-                }
+                return text;
             }
-        }
-        else if (cmd == "decrby")
-        {
-            if (args.size() != 3)
-            {
-                return "(error) ERR wrong number of arguments for 'decrby'";
-            }
-            else
-            {
-                try
-                {
-                    long long delta = -std::stoll(args[2]);
-                    std::optional<long long> res = db.incrby(args[1], delta);
-
-                    if (res.has_value())
-                    {
-                        return std::to_string(res.value());
-                    }
-                    else
-                    {
-                        return "(error) ERR value is not an integer or out of range";
-                    }
-                }
-                catch (const std::exception &)
-                {
-                    return "(error) ERR value is not an integer or out of range";
-                }
+            default:
+                return std::string(line);
             }
         }
-        else if (cmd == "exists")
-        {
-            if (args.size() < 2)
-            {
-                return "(error) ERR wrong number of arguments for 'exists'";
-            }
-            else
-            {
-                std::vector<std::string> keys(args.begin() + 1, args.end());
-
-                int res = db.exists(keys);
+    }
 
-                return std::to_string(res);
-            }
+    std::string eval_command(KVStore &db, std::span<const std::string_view> args)
+    {
+        if (args.empty())
+        {
+            return "";
         }
-        else
+        ReplyBuffer out;
+        if (!dispatch_command(db, args, out))
         {
-            return "(error) ERR unknown command '" + cmd + "'";
+            out.null_array(); // nothing else could push while the REPL waits
         }
+        return render_reply(out);
     }
 
-}
\ No newline at end of file
+    std::string render_reply(const ReplyBuffer &out)
+    {
+        std::string resp;
+        resp.reserve(out.size());
+        out.for_each_segment([&](std::string_view bytes)
+                             { resp.append(bytes); });
+        std::size_t pos = 0;
+        return render_reply(resp, pos);
+    }
+
+    std::string eval_command(KVStore &db, const std::vector<std::string> &args)
+    {
+        std::vector<std::string_view> views(args.begin(), args.end());
+        return eval_command(db, views);
+    }
+}
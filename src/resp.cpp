@@ -0,0 +1,379 @@
+#include "resp.hpp"
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <unistd.h>
+
+namespace tr
+{
+    bool parse_integer(std::string_view s, long long &out)
+    {
+        std::size_t i = 0;
+        bool negative = false;
+        if (!s.empty() && (s[0] == '-' || s[0] == '+'))
+        {
+            negative = s[0] == '-';
+            i = 1;
+        }
+        if (i == s.size())
+        {
+            return false;
+        }
+        // Accumulate as a negative number so LLONG_MIN is representable.
+        long long value = 0;
+        for (; i < s.size(); ++i)
+        {
+            char c = s[i];
+            if (c < '0' || c > '9')
+            {
+                return false;
+            }
+            int digit = c - '0';
+            if (value < (LLONG_MIN + digit) / 10)
+            {
+                return false;
+            }
+            value = value * 10 - digit;
+        }
+        if (!negative)
+        {
+            if (value == LLONG_MIN)
+            {
+                return false;
+            }
+            value = -value;
+        }
+        out = value;
+        return true;
+    }
+
+    void RespParser::reset()
+    {
+        state = State::ArrayLen;
+        remaining = 0;
+        bulk_len = 0;
+        pos = 0;
+        scan = 0;
+        spans.clear();
+    }
+
+    long long RespParser::pending_bulk_len() const
+    {
+        return state == State::BulkData ? bulk_len : -1;
+    }
+
+    bool RespParser::find_line_end(std::string_view in, std::size_t &crlf)
+    {
+        std::size_t from = scan > pos + 1 ? scan : pos + 1;
+        while (from < in.size())
+        {
+            const void *hit = std::memchr(in.data() + from, '\r', in.size() - from);
+            if (hit == nullptr)
+            {
+                break;
+            }
+            std::size_t cr = static_cast<const char *>(hit) - in.data();
+            if (cr + 1 >= in.size())
+            {
+                scan = cr; // the '\n' may still be in flight
+                return false;
+            }
+            if (in[cr + 1] == '\n')
+            {
+                crlf = cr;
+                return true;
+            }
+            from = cr + 1;
+        }
+        scan = in.size();
+        return false;
+    }
+
+    RespParseStatus RespParser::parse(std::string_view in, std::size_t &consumed, std::vector<std::string_view> &out)
+    {
+        consumed = 0;
+        for (;;)
+        {
+            if (state != State::BulkData && pos >= in.size())
+            {
+                return RespParseStatus::NeedMore;
+            }
+
+            if (state == State::ArrayLen || state == State::BulkLen)
+            {
+                char prefix = state == State::ArrayLen ? '*' : '$';
+                if (in[pos] != prefix)
+                {
+                    reset();
+                    return RespParseStatus::Error;
+                }
+                std::size_t crlf = 0;
+                if (!find_line_end(in, crlf))
+                {
+                    return RespParseStatus::NeedMore;
+                }
+                long long n = 0;
+                long long limit = state == State::ArrayLen ? MAX_ARRAY_LEN : max_bulk_len;
+                if (!parse_integer(in.substr(pos + 1, crlf - pos - 1), n) || n < 0 || n > limit)
+                {
+                    reset();
+                    return RespParseStatus::Error;
+                }
+                pos = crlf + 2;
+                scan = pos;
+                if (state == State::ArrayLen)
+                {
+                    remaining = n;
+                    spans.clear();
+                    state = State::BulkLen;
+                }
+                else
+                {
+                    bulk_len = n;
+                    state = State::BulkData;
+                }
+            }
+            else
+            {
+                std::size_t len = static_cast<std::size_t>(bulk_len);
+                if (in.size() < pos + len + 2)
+                {
+                    return RespParseStatus::NeedMore;
+                }
+                if (in[pos + len] != '\r' || in[pos + len + 1] != '\n')
+                {
+                    reset();
+                    return RespParseStatus::Error;
+                }
+                spans.emplace_back(pos, len);
+                pos += len + 2;
+                scan = pos;
+                --remaining;
+                state = State::BulkLen;
+            }
+
+            if (state == State::BulkLen && remaining == 0)
+            {
+                for (const auto &span : spans)
+                {
+                    out.emplace_back(in.data() + span.first, span.second);
+                }
+                consumed = pos;
+                reset();
+                return RespParseStatus::Ok;
+            }
+        }
+    }
+
+    std::string &ReplyBuffer::tail()
+    {
+        if (segments.empty())
+        {
+            segments.emplace_back();
+        }
+        return segments.back();
+    }
+
+    void ReplyBuffer::simple(std::string_view s)
+    {
+        std::string &out = tail();
+        out.push_back('+');
+        out.append(s);
+        out.append("\r\n");
+        pending += s.size() + 3;
+    }
+
+    void ReplyBuffer::error(std::string_view msg, std::string_view code)
+    {
+        std::string &out = tail();
+        out.push_back('-');
+        out.append(code);
+        out.push_back(' ');
+        out.append(msg);
+        out.append("\r\n");
+        pending += code.size() + msg.size() + 4;
+    }
+
+    void ReplyBuffer::integer(long long n)
+    {
+        char buf[24];
+        buf[0] = ':';
+        char *end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, n).ptr;
+        *end++ = '\r';
+        *end++ = '\n';
+        raw(std::string_view(buf, static_cast<std::size_t>(end - buf)));
+    }
+
+    void ReplyBuffer::array_header(std::size_t n)
+    {
+        char buf[24];
+        buf[0] = '*';
+        char *end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, n).ptr;
+        *end++ = '\r';
+        *end++ = '\n';
+        raw(std::string_view(buf, static_cast<std::size_t>(end - buf)));
+    }
+
+    void ReplyBuffer::bulk(std::string_view s)
+    {
+        if (s.size() >= LARGE_BULK)
+        {
+            bulk(std::string(s));
+            return;
+        }
+        char buf[24];
+        buf[0] = '$';
+        char *end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, s.size()).ptr;
+        *end++ = '\r';
+        *end++ = '\n';
+        std::string &out = tail();
+        out.append(buf, static_cast<std::size_t>(end - buf));
+        out.append(s);
+        out.append("\r\n");
+        pending += static_cast<std::size_t>(end - buf) + s.size() + 2;
+    }
+
+    void ReplyBuffer::bulk(std::string &&s)
+    {
+        if (s.size() < LARGE_BULK)
+        {
+            bulk(std::string_view(s));
+            return;
+        }
+        char buf[24];
+        buf[0] = '$';
+        char *end = std::to_chars(buf + 1, buf + sizeof(buf) - 2, s.size()).ptr;
+        *end++ = '\r';
+        *end++ = '\n';
+        raw(std::string_view(buf, static_cast<std::size_t>(end - buf)));
+        pending += s.size();
+        segments.push_back(std::move(s));
+        segments.emplace_back("\r\n");
+        pending += 2;
+    }
+
+    void ReplyBuffer::null_bulk()
+    {
+        raw("$-1\r\n");
+    }
+
+    void ReplyBuffer::null_array()
+    {
+        raw("*-1\r\n");
+    }
+
+    void ReplyBuffer::raw(std::string_view bytes)
+    {
+        tail().append(bytes);
+        pending += bytes.size();
+    }
+
+    void ReplyBuffer::append(ReplyBuffer &&other)
+    {
+        std::size_t offset = other.head_offset;
+        for (std::string &seg : other.segments)
+        {
+            std::string_view bytes = std::string_view(seg).substr(offset);
+            offset = 0;
+            if (bytes.size() < LARGE_BULK)
+            {
+                raw(bytes);
+                continue;
+            }
+            pending += bytes.size();
+            seg.erase(0, seg.size() - bytes.size());
+            segments.push_back(std::move(seg));
+            segments.emplace_back(); // later replies must not grow it
+        }
+        other.segments.clear();
+        other.head_offset = 0;
+        other.pending = 0;
+    }
+
+    int ReplyBuffer::gather(iovec *iov, int max) const
+    {
+        int count = 0;
+        std::size_t offset = head_offset;
+        for (const std::string &seg : segments)
+        {
+            if (count == max)
+                break;
+            if (seg.size() > offset)
+            {
+                iov[count].iov_base = const_cast<char *>(seg.data() + offset);
+                iov[count].iov_len = seg.size() - offset;
+                ++count;
+            }
+            offset = 0;
+        }
+        return count;
+    }
+
+    void ReplyBuffer::consume(std::size_t n)
+    {
+        pending -= n;
+        while (n > 0)
+        {
+            std::string &front = segments.front();
+            std::size_t left = front.size() - head_offset;
+            if (n < left)
+            {
+                head_offset += n;
+                return;
+            }
+            n -= left;
+            head_offset = 0;
+            if (segments.size() == 1)
+            {
+                front.clear(); // keep the capacity for the next batch
+            }
+            else
+            {
+                segments.pop_front();
+            }
+        }
+        if (pending == 0 && !segments.empty())
+        {
+            // Drop leftover empty segments but keep the first buffer's capacity.
+            while (segments.size() > 1)
+            {
+                segments.pop_back();
+            }
+            segments.front().clear();
+            head_offset = 0;
+        }
+    }
+
+    bool ReplyBuffer::flush(int fd)
+    {
+        iovec iov[MAX_IOV];
+        while (pending > 0)
+        {
+            int count = gather(iov, MAX_IOV);
+            ssize_t n = ::writev(fd, iov, count);
+            if (n > 0)
+            {
+                consume(static_cast<std::size_t>(n));
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                return true; // resumed on the next EPOLLOUT edge
+            }
+            return false;
+        }
+        return true;
+    }
+
+    void ReplyBuffer::swap(ReplyBuffer &other) noexcept
+    {
+        segments.swap(other.segments);
+        std::swap(head_offset, other.head_offset);
+        std::swap(pending, other.pending);
+    }
+}
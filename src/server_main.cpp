@@ -1,6 +1,156 @@
 #include "server.hpp"
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <string>
 
-int main()
+int main(int argc, char **argv)
 {
-    return tr::run_server(6380);
-}
\ No newline at end of file
+    tr::ServerConfig config;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            std::cerr << "usage: tinyredis_server [--port N] [--backend epoll|uring] [--io-threads N] [--shards N]\n"
+                         "                        [--proto-max-bulk-len BYTES] [--client-query-buffer-limit BYTES]\n"
+                         "                        [--client-output-buffer-limit \"HARD SOFT SECONDS\"] [--hz N]\n"
+                         "                        [--maxmemory BYTES] [--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu|volatile-ttl]\n"
+                         "                        [--hash-max-listpack-entries N] [--hash-max-listpack-value BYTES]\n"
+                         "                        [--list-max-listpack-size N] [--set-max-intset-entries N]\n"
+                         "                        [--zset-max-listpack-entries N] [--zset-max-listpack-value BYTES]\n";
+            return 1;
+        }
+        try
+        {
+            if (arg == "--port")
+            {
+                config.port = static_cast<uint16_t>(std::stoi(argv[++i]));
+            }
+            else if (arg == "--backend")
+            {
+                std::string name = argv[++i];
+                if (name == "epoll")
+                {
+                    config.backend = tr::Backend::Epoll;
+                }
+                else if (name == "uring")
+                {
+                    config.backend = tr::Backend::Uring;
+                }
+                else
+                {
+                    std::cerr << "unknown backend " << name << " (expected epoll or uring)\n";
+                    return 1;
+                }
+            }
+            else if (arg == "--io-threads")
+            {
+                config.io_threads = std::stoi(argv[++i]);
+            }
+            else if (arg == "--shards")
+            {
+                config.shards = std::stoi(argv[++i]);
+            }
+            else if (arg == "--proto-max-bulk-len")
+            {
+                config.max_bulk_len = std::stoull(argv[++i]);
+            }
+            else if (arg == "--client-query-buffer-limit")
+            {
+                config.max_query_buffer = std::stoull(argv[++i]);
+            }
+            else if (arg == "--client-output-buffer-limit")
+            {
+                std::istringstream limits(argv[++i]);
+                if (!(limits >> config.output.hard >> config.output.soft >> config.output.soft_seconds) || config.output.soft_seconds < 0)
+                {
+                    std::cerr << "--client-output-buffer-limit expects \"HARD SOFT SECONDS\"\n";
+                    return 1;
+                }
+            }
+            else if (arg == "--maxmemory")
+            {
+                config.maxmemory = std::stoull(argv[++i]);
+            }
+            else if (arg == "--maxmemory-policy")
+            {
+                std::string name = argv[++i];
+                auto policy = tr::parse_eviction_policy(name);
+                if (!policy)
+                {
+                    std::cerr << "unknown maxmemory policy " << name << "\n";
+                    return 1;
+                }
+                config.maxmemory_policy = *policy;
+            }
+            else if (arg == "--hash-max-listpack-entries")
+            {
+                config.hash_limits.max_entries = std::stoull(argv[++i]);
+            }
+            else if (arg == "--hash-max-listpack-value")
+            {
+                config.hash_limits.max_value = std::stoull(argv[++i]);
+            }
+            else if (arg == "--list-max-listpack-size")
+            {
+                config.list_fill = std::stoi(argv[++i]);
+            }
+            else if (arg == "--set-max-intset-entries")
+            {
+                config.set_limits.max_intset_entries = std::stoull(argv[++i]);
+            }
+            else if (arg == "--zset-max-listpack-entries")
+            {
+                config.zset_limits.max_entries = std::stoull(argv[++i]);
+            }
+            else if (arg == "--zset-max-listpack-value")
+            {
+                config.zset_limits.max_value = std::stoull(argv[++i]);
+            }
+            else if (arg == "--hz")
+            {
+                config.hz = std::stoi(argv[++i]);
+            }
+            else
+            {
+                std::cerr << "unknown option " << arg << "\n";
+                return 1;
+            }
+        }
+        catch (const std::exception &)
+        {
+            std::cerr << "invalid value for " << arg << "\n";
+            return 1;
+        }
+    }
+    if (config.io_threads < 1)
+    {
+        std::cerr << "--io-threads must be at least 1\n";
+        return 1;
+    }
+    if (config.shards < 1)
+    {
+        std::cerr << "--shards must be at least 1\n";
+        return 1;
+    }
+    if (config.shards > 1 && (config.backend != tr::Backend::Epoll || config.io_threads != 1))
+    {
+        std::cerr << "--shards needs the epoll backend and one I/O thread per shard\n";
+        return 1;
+    }
+    // Each shard enforces its share of the limit.
+    config.maxmemory /= static_cast<std::size_t>(config.shards);
+    if (config.hz < 1 || config.hz > 500)
+    {
+        std::cerr << "--hz must be between 1 and 500\n";
+        return 1;
+    }
+    // Stored strings carry a 32-bit length.
+    if (config.max_bulk_len == 0 || config.max_bulk_len > UINT32_MAX)
+    {
+        std::cerr << "--proto-max-bulk-len is out of range\n";
+        return 1;
+    }
+    return tr::run_server(config);
+}
@@ -0,0 +1,88 @@
+#include "set_object.hpp"
+#include "kvstore.hpp"
+
+namespace tr
+{
+    bool SetObject::add(std::string_view member, const Limits &limits)
+    {
+        if (!table)
+        {
+            long long n = 0;
+            if (as_canonical_integer(member, n))
+            {
+                if (ints.contains(n))
+                {
+                    return false;
+                }
+                if (ints.size() < limits.max_intset_entries)
+                {
+                    return ints.insert(n);
+                }
+            }
+            convert();
+        }
+        auto [slot, inserted] = table->insert(member);
+        if (inserted)
+        {
+            table_strings += slot->key.heap();
+        }
+        return inserted;
+    }
+
+    bool SetObject::remove(std::string_view member)
+    {
+        if (table)
+        {
+            Member *slot = table->find(member);
+            if (slot == nullptr)
+            {
+                return false;
+            }
+            table_strings -= slot->key.heap();
+            table->erase(slot);
+            return true;
+        }
+        long long n = 0;
+        return as_canonical_integer(member, n) && ints.erase(n);
+    }
+
+    bool SetObject::contains(std::string_view member)
+    {
+        if (table)
+        {
+            return table->find(member) != nullptr;
+        }
+        long long n = 0;
+        return as_canonical_integer(member, n) && ints.contains(n);
+    }
+
+    void SetObject::convert()
+    {
+        auto members = std::make_unique<SwissTable<Member>>();
+        for_each([&](std::string_view member)
+                 { table_strings += members->insert(member).first->key.heap(); });
+        table = std::move(members);
+        ints = IntSet();
+    }
+
+    std::size_t SetObject::heap() const
+    {
+        std::size_t bytes = sizeof(SetObject) + ints.heap();
+        if (table)
+        {
+            bytes += sizeof(*table) + table->footprint() + table_strings;
+        }
+        return bytes;
+    }
+
+    std::size_t SetObject::defrag()
+    {
+        if (!table)
+        {
+            return ints.defrag();
+        }
+        std::size_t moved = 0;
+        table->for_each([&](Member &member) { moved += member.key.defrag(); });
+        return moved;
+    }
+}
@@ -0,0 +1,1032 @@
+#include "server.hpp"
+#include "blocking.hpp"
+#include "commands.hpp"
+#include "repl.hpp"
+#include "spsc_queue.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <charconv>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace tr
+{
+    namespace
+    {
+        constexpr int MAX_EVENTS = 256;
+        constexpr std::size_t QUEUE_SIZE = 4096;
+        // Requests a connection may have waiting on other shards before it
+        // stops executing, so a long pipeline cannot flood the queues.
+        constexpr std::size_t MAX_IN_FLIGHT = 256;
+
+        // How the parts of a request split across shards make its reply.
+        enum class Split : uint8_t
+        {
+            none,
+            sum,   // CMD_SPLIT_SUM: the counts added up
+            ok,    // CMD_SPLIT_OK: a single +OK
+            gather, // CMD_SPLIT_GATHER: the elements put back in key order
+            all     // CMD_ALL_SHARDS: merge_info() over every shard's reply
+        };
+
+        // A request whose reply is not complete yet. The client gets its
+        // replies in order, so once one is waiting every later reply of the
+        // connection waits behind it.
+        struct PendingReply
+        {
+            int awaiting = 0; // parts still out on other shards
+            ReplyBuffer out;
+            bool render = false;    // inline request: answer in REPL format
+            Split split = Split::none;
+            long long sum = 0;
+            std::string error;      // first error among the parts, if any
+            std::vector<std::size_t> order; // Split::gather: the shard of each key, in key order
+            std::vector<std::string> parts; // Split::gather and Split::all: each shard's reply, by shard
+        };
+
+        struct ShardConnection : Connection
+        {
+            std::deque<PendingReply> pending; // references stay valid across push_back/pop_front
+            uint64_t batch = 0;               // last loop iteration that queued it for reading
+            // Its BLPOP or BRPOP while the owner of the keys may hold it;
+            // later requests wait until it is answered.
+            PendingReply *blocking = nullptr;
+            std::size_t blocking_shard = 0;
+            // Stopped on MAX_IN_FLIGHT or its blocked command with requests
+            // or socket input left; the next reply back resumes it.
+            bool held = false;
+        };
+
+        // A command, or its reply, travelling between two shards. The same
+        // object goes there and back.
+        struct ShardMessage
+        {
+            std::size_t from = 0;
+            bool reply = false;
+            bool cancel = false; // the origin closed: answer its blocked command now
+            ShardConnection *origin = nullptr; // owned by `from`
+            PendingReply *slot = nullptr;
+            std::size_t to = 0; // the shard that runs it
+            std::vector<std::string> args;
+            ReplyBuffer out;
+        };
+
+        using MessageQueue = SpscQueue<std::unique_ptr<ShardMessage>>;
+
+        // A blocking command the owner of its keys holds until a push or
+        // its timeout answers it, whichever shard it came from.
+        struct ParkedCommand : Waiter
+        {
+            std::unique_ptr<ShardMessage> msg;
+        };
+
+        std::string contents(const ReplyBuffer &out)
+        {
+            std::string bytes;
+            bytes.reserve(out.size());
+            out.for_each_segment([&](std::string_view segment)
+                                 { bytes.append(segment); });
+            return bytes;
+        }
+
+        // Adds the reply of the part that ran on `shard` to `slot`.
+        void merge(PendingReply &slot, std::size_t shard, ReplyBuffer &&part)
+        {
+            if (slot.split == Split::none)
+            {
+                slot.out.append(std::move(part));
+                return;
+            }
+            std::string bytes = contents(part);
+            long long n = 0;
+            if (slot.split == Split::sum && bytes.size() > 3 && bytes[0] == ':' &&
+                std::from_chars(bytes.data() + 1, bytes.data() + bytes.size() - 2, n).ec == std::errc())
+            {
+                slot.sum += n;
+            }
+            else if ((slot.split == Split::gather && !bytes.empty() && bytes[0] == '*') || slot.split == Split::all)
+            {
+                slot.parts[shard] = std::move(bytes);
+            }
+            else if (!(slot.split == Split::ok && bytes == "+OK\r\n") && slot.error.empty())
+            {
+                slot.error = std::move(bytes);
+            }
+        }
+
+        // Split::gather: takes each key's element from its shard's array in
+        // turn. The parts are MGET replies, so every element is a bulk.
+        void gather(PendingReply &slot)
+        {
+            std::vector<std::size_t> cursor(slot.parts.size());
+            for (std::size_t shard = 0; shard < slot.parts.size(); ++shard)
+            {
+                cursor[shard] = slot.parts[shard].empty() ? 0 : slot.parts[shard].find("\r\n") + 2;
+            }
+            slot.out.array_header(slot.order.size());
+            for (std::size_t shard : slot.order)
+            {
+                std::string_view part = slot.parts[shard];
+                std::size_t &pos = cursor[shard];
+                std::size_t eol = part.find("\r\n", pos);
+                long long len = -1;
+                std::from_chars(part.data() + pos + 1, part.data() + eol, len);
+                pos = eol + 2;
+                if (len < 0)
+                {
+                    slot.out.null_bulk();
+                    continue;
+                }
+                slot.out.bulk(part.substr(pos, static_cast<std::size_t>(len)));
+                pos += static_cast<std::size_t>(len) + 2;
+            }
+        }
+
+        // The reply of a request split across shards, once every part is in.
+        void finish(PendingReply &slot)
+        {
+            if (!slot.error.empty())
+            {
+                slot.out.raw(slot.error);
+                return;
+            }
+            switch (slot.split)
+            {
+            case Split::sum:
+                slot.out.integer(slot.sum);
+                break;
+            case Split::ok:
+                slot.out.simple("OK");
+                break;
+            case Split::gather:
+                gather(slot);
+                break;
+            case Split::all:
+                merge_info(slot.parts, slot.out);
+                break;
+            case Split::none:
+                break;
+            }
+        }
+
+        // A client that hung up still gets the replies other shards owe it
+        // before the socket closes, unless it hung up blocked, as nothing
+        // should be popped for it then.
+        bool finished(const ShardConnection &conn)
+        {
+            return conn.failed || (conn.eof && (conn.pending.empty() || conn.blocking != nullptr));
+        }
+
+        class Shard
+        {
+        public:
+            Shard(std::size_t index, const ServerConfig &config, std::vector<std::unique_ptr<Shard>> &shards,
+                  std::atomic<bool> &stopping, int listen_fd)
+                : index(index), config(config), shards(shards), stopping(stopping), listen_fd(listen_fd)
+            {
+                for (std::size_t i = 0; i < static_cast<std::size_t>(config.shards); ++i)
+                {
+                    inbox.push_back(std::make_unique<MessageQueue>(QUEUE_SIZE));
+                }
+                outbox.resize(inbox.size());
+            }
+
+            ~Shard()
+            {
+                if (wake_fd >= 0)
+                {
+                    ::close(wake_fd);
+                }
+                ::close(listen_fd);
+            }
+
+            bool open()
+            {
+                wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (wake_fd < 0)
+                {
+                    std::cout << "eventfd() failed: " << std::strerror(errno) << "\n";
+                    return false;
+                }
+                return true;
+            }
+
+            // Interrupts the loop's epoll_wait, if it is in one.
+            void wake()
+            {
+                // Pairs with the fence in loop(): either this sees `sleeping`
+                // set, or the loop sees what was queued before calling wake().
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (sleeping.load(std::memory_order_relaxed))
+                {
+                    uint64_t one = 1;
+                    [[maybe_unused]] ssize_t n = ::write(wake_fd, &one, sizeof(one));
+                }
+            }
+
+            int run();
+
+        private:
+            void accept_all();
+            bool inbox_empty() const;
+            void drain_inbox();
+            void send(std::size_t to, std::unique_ptr<ShardMessage> msg);
+            void flush_outbox();
+            std::unique_ptr<ShardMessage> request(ShardConnection &conn, PendingReply &slot, std::span<const std::string_view> args);
+            void forward(ShardConnection &conn, PendingReply &slot, std::size_t to, std::span<const std::string_view> args);
+            void answer(std::unique_ptr<ShardMessage> msg);
+            void park(std::unique_ptr<ShardMessage> msg);
+            void cancel(ShardConnection *origin);
+            void wake_parked(std::chrono::steady_clock::time_point now);
+            bool execute(ShardConnection &conn);
+            bool route(ShardConnection &conn, const Request &req);
+            bool complete(ShardConnection &conn);
+            void queue_read(Connection *conn);
+            void destroy(ShardConnection *conn);
+            int loop();
+            void stop_all();
+
+            const std::size_t index;
+            const ServerConfig &config;
+            std::vector<std::unique_ptr<Shard>> &shards;
+            std::atomic<bool> &stopping;
+            const int listen_fd;
+            int epfd = -1;
+            int wake_fd = -1;
+            alignas(64) std::atomic<bool> sleeping{false};
+            // inbox[i] carries messages from shard i; outbox[i] holds those
+            // for shard i that did not fit in its queue yet.
+            std::vector<std::unique_ptr<MessageQueue>> inbox;
+            std::vector<std::deque<std::unique_ptr<ShardMessage>>> outbox;
+
+            std::unique_ptr<KVStore> db;
+            std::unique_ptr<BlockedClients> blocked;
+            // Blocked commands held here, by the connection waiting for each;
+            // a connection has at most one.
+            std::unordered_map<ShardConnection *, std::unique_ptr<ParkedCommand>> parked;
+            std::vector<ShardConnection *> unparked;
+            std::unordered_map<int, std::unique_ptr<ShardConnection>> conns;
+            // Closed while replies were still due; freed once they arrive.
+            std::unordered_map<ShardConnection *, std::unique_ptr<ShardConnection>> zombies;
+            std::vector<Connection *> readable;
+            std::vector<Connection *> writable;
+            std::vector<Connection *> closed;
+            std::vector<Connection *> backlog;
+            uint64_t iteration = 0;
+            std::vector<std::size_t> keys;
+            std::vector<std::size_t> key_shards;
+            std::vector<std::string_view> part;
+        };
+
+        char wake_tag; // epoll registration of the wake eventfd
+
+        void Shard::accept_all()
+        {
+            for (;;)
+            {
+                int client_fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (client_fd < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    {
+                        std::cout << "accept() failed: " << std::strerror(errno) << "\n";
+                    }
+                    return;
+                }
+                int nodelay = 1;
+                ::setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+                auto owned = std::make_unique<ShardConnection>();
+                init_connection(*owned, client_fd, config);
+                epoll_event cev{};
+                cev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                cev.data.ptr = static_cast<Connection *>(owned.get());
+                if (::epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &cev) < 0)
+                {
+                    std::cout << "epoll_ctl() failed: " << std::strerror(errno) << "\n";
+                    ::close(client_fd);
+                    continue;
+                }
+                conns.emplace(client_fd, std::move(owned));
+            }
+        }
+
+        bool Shard::inbox_empty() const
+        {
+            for (const auto &queue : inbox)
+            {
+                if (!queue->empty())
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void Shard::send(std::size_t to, std::unique_ptr<ShardMessage> msg)
+        {
+            if (outbox[to].empty() && shards[to]->inbox[index]->try_push(std::move(msg)))
+            {
+                shards[to]->wake();
+                return;
+            }
+            outbox[to].push_back(std::move(msg));
+        }
+
+        void Shard::flush_outbox()
+        {
+            for (std::size_t to = 0; to < outbox.size(); ++to)
+            {
+                std::deque<std::unique_ptr<ShardMessage>> &queued = outbox[to];
+                bool sent = false;
+                while (!queued.empty() && shards[to]->inbox[index]->try_push(std::move(queued.front())))
+                {
+                    queued.pop_front();
+                    sent = true;
+                }
+                if (sent)
+                {
+                    shards[to]->wake();
+                }
+            }
+        }
+
+        // A message asking for `args` to run for `slot` of `conn`.
+        std::unique_ptr<ShardMessage> Shard::request(ShardConnection &conn, PendingReply &slot, std::span<const std::string_view> args)
+        {
+            auto msg = std::make_unique<ShardMessage>();
+            msg->from = index;
+            msg->origin = &conn;
+            msg->slot = &slot;
+            msg->args.assign(args.begin(), args.end());
+            ++slot.awaiting;
+            return msg;
+        }
+
+        void Shard::forward(ShardConnection &conn, PendingReply &slot, std::size_t to, std::span<const std::string_view> args)
+        {
+            std::unique_ptr<ShardMessage> msg = request(conn, slot, args);
+            msg->to = to;
+            send(to, std::move(msg));
+        }
+
+        // Sends a command's reply back where it came from, this shard included.
+        void Shard::answer(std::unique_ptr<ShardMessage> msg)
+        {
+            msg->args.clear();
+            msg->reply = true;
+            std::size_t to = msg->from;
+            send(to, std::move(msg));
+        }
+
+        void Shard::park(std::unique_ptr<ShardMessage> msg)
+        {
+            auto command = std::make_unique<ParkedCommand>();
+            part.assign(msg->args.begin(), msg->args.end());
+            blocked->block(*command, part);
+            part.clear();
+            ShardConnection *origin = msg->origin;
+            command->msg = std::move(msg);
+            parked.emplace(origin, std::move(command));
+        }
+
+        // Answers the command parked for `origin` with a null array, if it is
+        // still here; otherwise its reply is already on the way.
+        void Shard::cancel(ShardConnection *origin)
+        {
+            auto it = parked.find(origin);
+            if (it == parked.end())
+            {
+                return;
+            }
+            blocked->unblock(*it->second);
+            it->second->msg->out.null_array();
+            answer(std::move(it->second->msg));
+            parked.erase(it);
+        }
+
+        // wake_blocked() for parked commands.
+        void Shard::wake_parked(std::chrono::steady_clock::time_point now)
+        {
+            blocked->serve([&](Waiter &w)
+                           {
+                ShardMessage &msg = *static_cast<ParkedCommand &>(w).msg;
+                part.assign(msg.args.begin(), msg.args.end());
+                bool served = dispatch_command(*db, part, msg.out);
+                part.clear();
+                if (served)
+                {
+                    unparked.push_back(msg.origin);
+                }
+                return served; });
+            blocked->expire(now, [&](Waiter &w)
+                            {
+                ShardMessage &msg = *static_cast<ParkedCommand &>(w).msg;
+                msg.out.null_array();
+                unparked.push_back(msg.origin); });
+            for (ShardConnection *origin : unparked)
+            {
+                auto it = parked.find(origin);
+                answer(std::move(it->second->msg));
+                parked.erase(it);
+            }
+            unparked.clear();
+        }
+
+        // Runs commands other shards sent here, and completes the requests
+        // of this shard's connections whose replies came back.
+        void Shard::drain_inbox()
+        {
+            std::unique_ptr<ShardMessage> msg;
+            for (std::size_t from = 0; from < inbox.size(); ++from)
+            {
+                while (inbox[from]->try_pop(msg))
+                {
+                    if (msg->cancel)
+                    {
+                        cancel(msg->origin);
+                        msg.reset();
+                        continue;
+                    }
+                    if (!msg->reply)
+                    {
+                        part.assign(msg->args.begin(), msg->args.end());
+                        bool served = dispatch_command(*db, part, msg->out);
+                        part.clear();
+                        if (served)
+                        {
+                            answer(std::move(msg));
+                        }
+                        else
+                        {
+                            park(std::move(msg));
+                        }
+                        continue;
+                    }
+                    ShardConnection &conn = *msg->origin;
+                    if (msg->slot == conn.blocking)
+                    {
+                        conn.blocking = nullptr;
+                    }
+                    merge(*msg->slot, msg->to, std::move(msg->out));
+                    --msg->slot->awaiting;
+                    msg.reset();
+                    if (complete(conn) && !conn.closing)
+                    {
+                        writable.push_back(&conn);
+                        if (conn.held && !conn.paused)
+                        {
+                            conn.held = false;
+                            queue_read(&conn);
+                        }
+                    }
+                }
+            }
+        }
+
+        // Moves every finished reply at the head of conn.pending to conn.out,
+        // and returns whether there were any. Frees a closed connection once
+        // nothing refers to it any more.
+        bool Shard::complete(ShardConnection &conn)
+        {
+            bool moved = false;
+            while (!conn.pending.empty() && conn.pending.front().awaiting == 0)
+            {
+                PendingReply &slot = conn.pending.front();
+                if (slot.split != Split::none)
+                {
+                    finish(slot);
+                }
+                if (slot.render)
+                {
+                    std::string result = render_reply(slot.out);
+                    if (!result.empty())
+                    {
+                        conn.out.raw(result);
+                        conn.out.raw("\n");
+                    }
+                }
+                else
+                {
+                    conn.out.append(std::move(slot.out));
+                }
+                conn.pending.pop_front();
+                moved = true;
+            }
+            if (conn.closing && conn.pending.empty())
+            {
+                zombies.erase(&conn);
+                return false;
+            }
+            return moved;
+        }
+
+        void Shard::queue_read(Connection *conn)
+        {
+            ShardConnection *owner = static_cast<ShardConnection *>(conn);
+            if (owner->batch != iteration)
+            {
+                owner->batch = iteration;
+                readable.push_back(conn);
+            }
+        }
+
+        // Runs a request here if every key it touches is local, or sends it,
+        // or its per-shard parts, to the owners. Returns false on EXIT.
+        bool Shard::route(ShardConnection &conn, const Request &req)
+        {
+            std::span<const std::string_view> args(conn.args.data() + req.first, req.argc);
+            const Command *cmd = lookup_command(args[0]);
+            keys.clear();
+            if (cmd != nullptr)
+            {
+                command_keys(*cmd, args, keys);
+            }
+            std::size_t count = shards.size();
+            std::size_t owner = index;
+            bool split = false;
+            bool blocking = !keys.empty() && (cmd->flags & CMD_BLOCKING);
+            for (std::size_t i = 0; i < keys.size(); ++i)
+            {
+                std::size_t shard = shard_of(args[keys[i]], count);
+                if (i == 0)
+                {
+                    owner = shard;
+                }
+                else if (shard != owner)
+                {
+                    split = true;
+                    break;
+                }
+            }
+            if (split && keys.back() + static_cast<std::size_t>(cmd->key_step) > args.size())
+            {
+                // A key without its value: left to the handler to report.
+                owner = index;
+                split = false;
+            }
+
+            if (cmd != nullptr && (cmd->flags & CMD_ALL_SHARDS) && count > 1)
+            {
+                PendingReply &slot = conn.pending.emplace_back();
+                slot.render = req.inline_cmd;
+                slot.split = Split::all;
+                slot.parts.resize(count);
+                for (std::size_t shard = 0; shard < count; ++shard)
+                {
+                    if (shard != index)
+                    {
+                        forward(conn, slot, shard, args);
+                        continue;
+                    }
+                    ReplyBuffer local;
+                    dispatch_command(*db, args, local);
+                    merge(slot, index, std::move(local));
+                }
+                return true;
+            }
+            if (owner == index && !split && !blocking)
+            {
+                if (conn.pending.empty())
+                {
+                    return execute_request(conn, *db, req, conn.out);
+                }
+                PendingReply &slot = conn.pending.emplace_back();
+                return execute_request(conn, *db, req, slot.out);
+            }
+
+            PendingReply &slot = conn.pending.emplace_back();
+            slot.render = req.inline_cmd;
+            if (!split && blocking)
+            {
+                // Held by the owner until served; later requests wait.
+                conn.blocking = &slot;
+                conn.blocking_shard = owner;
+                if (owner != index)
+                {
+                    forward(conn, slot, owner, args);
+                }
+                else if (dispatch_command(*db, args, slot.out))
+                {
+                    conn.blocking = nullptr;
+                }
+                else
+                {
+                    park(request(conn, slot, args));
+                }
+                return true;
+            }
+            if (!split)
+            {
+                forward(conn, slot, owner, args);
+                return true;
+            }
+            if (cmd->flags & CMD_SPLIT_SUM)
+            {
+                slot.split = Split::sum;
+            }
+            else if (cmd->flags & CMD_SPLIT_OK)
+            {
+                slot.split = Split::ok;
+            }
+            else if (cmd->flags & CMD_SPLIT_GATHER)
+            {
+                slot.split = Split::gather;
+            }
+            else
+            {
+                slot.out.error("Keys in request don't hash to the same shard", "CROSSSLOT");
+                return true;
+            }
+
+            // One sub-command per shard with that shard's keys, in order,
+            // each with the arguments that follow it up to the next key.
+            key_shards.clear();
+            for (std::size_t key : keys)
+            {
+                key_shards.push_back(shard_of(args[key], count));
+            }
+            if (slot.split == Split::gather)
+            {
+                slot.order = key_shards;
+                slot.parts.resize(count);
+            }
+            std::size_t step = static_cast<std::size_t>(cmd->key_step);
+            for (std::size_t shard = 0; shard < count; ++shard)
+            {
+                part.assign(1, args[0]);
+                for (std::size_t i = 0; i < keys.size(); ++i)
+                {
+                    if (key_shards[i] == shard)
+                    {
+                        part.insert(part.end(), args.begin() + keys[i], args.begin() + keys[i] + step);
+                    }
+                }
+                if (part.size() == 1)
+                {
+                    continue;
+                }
+                if (shard != index)
+                {
+                    forward(conn, slot, shard, part);
+                    continue;
+                }
+                ReplyBuffer local;
+                dispatch_command(*db, part, local);
+                merge(slot, index, std::move(local));
+            }
+            part.clear();
+            return true;
+        }
+
+        // execute_requests() for a sharded store.
+        bool Shard::execute(ShardConnection &conn)
+        {
+            bool keep = true;
+            std::size_t done = 0;
+            for (; done < conn.requests.size(); ++done)
+            {
+                if ((conn.limits.pause > 0 && conn.out.size() >= conn.limits.pause) || conn.pending.size() >= MAX_IN_FLIGHT ||
+                    conn.blocking != nullptr)
+                {
+                    conn.requests.erase(conn.requests.begin(), conn.requests.begin() + static_cast<std::ptrdiff_t>(done));
+                    return true;
+                }
+                if (!route(conn, conn.requests[done]))
+                {
+                    keep = false;
+                    break;
+                }
+            }
+            conn.requests.clear();
+            conn.args.clear();
+            conn.in.release_if_empty();
+            complete(conn);
+            return keep;
+        }
+
+        void Shard::destroy(ShardConnection *conn)
+        {
+            if (conn->blocking != nullptr)
+            {
+                // Its blocked command must not take an entry nobody will read.
+                if (conn->blocking_shard == index)
+                {
+                    cancel(conn);
+                }
+                else
+                {
+                    auto msg = std::make_unique<ShardMessage>();
+                    msg->from = index;
+                    msg->origin = conn;
+                    msg->cancel = true;
+                    send(conn->blocking_shard, std::move(msg));
+                }
+            }
+            int fd = conn->fd;
+            ::close(fd);
+            auto it = conns.find(fd);
+            if (!conn->pending.empty())
+            {
+                // Replies still refer to it.
+                zombies.emplace(conn, std::move(it->second));
+            }
+            conns.erase(it);
+        }
+
+        int Shard::run()
+        {
+            int rc = loop();
+            stop_all();
+            // Freed here, not with the Shard on the main thread: the store's
+            // slab strings and listpacks must go back to this thread's slabs.
+            blocked.reset();
+            db.reset();
+            return rc;
+        }
+
+        void Shard::stop_all()
+        {
+            stopping.store(true);
+            for (auto &shard : shards)
+            {
+                uint64_t one = 1;
+                [[maybe_unused]] ssize_t n = ::write(shard->wake_fd, &one, sizeof(one));
+            }
+        }
+
+        // run_server()'s loop, plus the queues to and from the other shards.
+        int Shard::loop()
+        {
+            // Created here so its slabs belong to this thread.
+            db = std::make_unique<KVStore>();
+            init_store(*db, config);
+            blocked = std::make_unique<BlockedClients>(*db);
+            epfd = ::epoll_create1(EPOLL_CLOEXEC);
+            if (epfd < 0)
+            {
+                std::cout << "epoll_create1() failed: " << std::strerror(errno) << "\n";
+                return 1;
+            }
+            epoll_event lev{};
+            lev.events = EPOLLIN | EPOLLET;
+            lev.data.ptr = nullptr;
+            epoll_event wev{};
+            wev.events = EPOLLIN | EPOLLET;
+            wev.data.ptr = &wake_tag;
+            if (::epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &lev) < 0 || ::epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &wev) < 0)
+            {
+                std::cout << "epoll_ctl() failed: " << std::strerror(errno) << "\n";
+                ::close(epfd);
+                return 1;
+            }
+
+            auto last_sweep = std::chrono::steady_clock::now();
+            auto next_cycle = last_sweep;
+            epoll_event events[MAX_EVENTS];
+            while (!stopping.load(std::memory_order_relaxed))
+            {
+                bool queued = false;
+                for (const auto &pending : outbox)
+                {
+                    queued = queued || !pending.empty();
+                }
+                int timeout = -1;
+                if (!backlog.empty() || queued)
+                {
+                    timeout = 0;
+                }
+                else
+                {
+                    auto wake = blocked->next_deadline();
+                    if (config.output.soft > 0)
+                    {
+                        wake = std::min(wake, last_sweep + std::chrono::seconds(1));
+                    }
+                    if (background_work(*db))
+                    {
+                        wake = std::min(wake, next_cycle);
+                    }
+                    if (wake != std::chrono::steady_clock::time_point::max())
+                    {
+                        auto wait = std::chrono::ceil<std::chrono::milliseconds>(wake - std::chrono::steady_clock::now());
+                        timeout = static_cast<int>(std::clamp<long long>(wait.count(), 0, INT_MAX));
+                    }
+                }
+                sleeping.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!inbox_empty())
+                {
+                    timeout = 0;
+                }
+                int ready = ::epoll_wait(epfd, events, MAX_EVENTS, timeout);
+                sleeping.store(false, std::memory_order_relaxed);
+                if (ready < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    std::cout << "epoll_wait() failed: " << std::strerror(errno) << "\n";
+                    break;
+                }
+                auto now = std::chrono::steady_clock::now();
+                db->set_clock(now);
+
+                ++iteration;
+                readable.clear();
+                writable.clear();
+                for (Connection *conn : backlog)
+                {
+                    queue_read(conn);
+                }
+                backlog.clear();
+                for (int i = 0; i < ready; ++i)
+                {
+                    void *tag = events[i].data.ptr;
+                    if (tag == nullptr)
+                    {
+                        accept_all();
+                        continue;
+                    }
+                    if (tag == &wake_tag)
+                    {
+                        uint64_t count;
+                        [[maybe_unused]] ssize_t n = ::read(wake_fd, &count, sizeof(count));
+                        continue;
+                    }
+                    Connection *conn = static_cast<Connection *>(tag);
+                    uint32_t ev = events[i].events;
+                    if (conn->paused)
+                    {
+                        writable.push_back(conn);
+                        continue;
+                    }
+                    if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    {
+                        if (conn->read_more)
+                        {
+                            continue;
+                        }
+                        queue_read(conn);
+                    }
+                    else if ((ev & EPOLLOUT) && !conn->out.empty())
+                    {
+                        writable.push_back(conn);
+                    }
+                }
+
+                drain_inbox();
+                for (Connection *conn : readable)
+                {
+                    if (!read_requests(*conn))
+                    {
+                        conn->failed = true;
+                    }
+                    if (!conn->failed && !execute(static_cast<ShardConnection &>(*conn)))
+                    {
+                        conn->eof = true;
+                    }
+                    if (!conn->failed && !conn->out.empty())
+                    {
+                        writable.push_back(conn);
+                    }
+                }
+                wake_parked(now);
+                flush_outbox();
+
+                for (Connection *conn : writable)
+                {
+                    if (conn->closing)
+                    {
+                        continue;
+                    }
+                    if (!conn->failed && !flush_output(*conn))
+                    {
+                        conn->failed = true;
+                    }
+                    bool was_paused = conn->paused;
+                    if (!conn->failed && !check_output_limits(*conn, conn->out.size(), now))
+                    {
+                        std::cout << "closing client: output buffer limit reached (" << conn->out.size() << " bytes)\n";
+                        conn->failed = true;
+                    }
+                    if (was_paused && !conn->paused && !conn->failed && !conn->read_more)
+                    {
+                        conn->read_more = true;
+                        backlog.push_back(conn);
+                    }
+                }
+
+                for (Connection *conn : readable)
+                {
+                    if (finished(static_cast<ShardConnection &>(*conn)) && !conn->closing)
+                    {
+                        conn->closing = true;
+                        closed.push_back(conn);
+                    }
+                }
+                for (Connection *conn : writable)
+                {
+                    if (finished(static_cast<ShardConnection &>(*conn)) && !conn->closing)
+                    {
+                        conn->closing = true;
+                        closed.push_back(conn);
+                    }
+                }
+                for (Connection *conn : readable)
+                {
+                    if ((conn->read_more || !conn->requests.empty()) && !conn->closing)
+                    {
+                        ShardConnection *owner = static_cast<ShardConnection *>(conn);
+                        bool waiting = owner->pending.size() >= MAX_IN_FLIGHT || owner->blocking != nullptr;
+                        owner->held = !conn->paused && waiting;
+                        conn->read_more = !conn->paused && !waiting;
+                        if (conn->read_more)
+                        {
+                            backlog.push_back(conn);
+                        }
+                    }
+                }
+                if (background_work(*db) && now >= next_cycle)
+                {
+                    next_cycle = background_cycle(*db, config, now);
+                }
+                if (config.output.soft > 0 && now - last_sweep >= std::chrono::seconds(1))
+                {
+                    last_sweep = now;
+                    for (auto &entry : conns)
+                    {
+                        Connection *conn = entry.second.get();
+                        if (conn->over_soft && !conn->closing && !check_output_limits(*conn, conn->out.size(), now))
+                        {
+                            std::cout << "closing client: output buffer over soft limit for " << conn->limits.soft_seconds << "s\n";
+                            conn->closing = true;
+                            closed.push_back(conn);
+                        }
+                    }
+                }
+                for (Connection *conn : closed)
+                {
+                    destroy(static_cast<ShardConnection *>(conn));
+                }
+                closed.clear();
+            }
+
+            for (auto &entry : conns)
+            {
+                ::close(entry.first);
+            }
+            ::close(epfd);
+            return 1;
+        }
+    }
+
+    int run_sharded_server(const ServerConfig &config)
+    {
+        std::atomic<bool> stopping{false};
+        std::vector<std::unique_ptr<Shard>> shards;
+        for (int i = 0; i < config.shards; ++i)
+        {
+            int listen_fd = open_listener(config);
+            if (listen_fd < 0)
+            {
+                return 1;
+            }
+            shards.push_back(std::make_unique<Shard>(static_cast<std::size_t>(i), config, shards, stopping, listen_fd));
+            if (!shards.back()->open())
+            {
+                return 1;
+            }
+        }
+
+        std::vector<std::thread> threads;
+        for (std::size_t i = 1; i < shards.size(); ++i)
+        {
+            threads.emplace_back([&shards, i]
+                                 { shards[i]->run(); });
+        }
+        int rc = shards[0]->run();
+        for (std::thread &t : threads)
+        {
+            t.join();
+        }
+        return rc;
+    }
+}
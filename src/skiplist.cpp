@@ -0,0 +1,285 @@
+#include "skiplist.hpp"
+#include <bit>
+#include <cstring>
+#include <new>
+
+namespace tr
+{
+    SkipList::SkipList()
+    {
+        header = make_node(MAX_LEVEL, 0, "");
+        for (int i = 0; i < MAX_LEVEL; ++i)
+        {
+            header->levels()[i] = {nullptr, 0};
+        }
+    }
+
+    SkipList::~SkipList()
+    {
+        Node *node = header->levels()[0].forward;
+        while (node != nullptr)
+        {
+            Node *next = node->levels()[0].forward;
+            free_node(node);
+            node = next;
+        }
+        free_node(header);
+    }
+
+    int SkipList::random_level()
+    {
+        // xorshift64; every two zero bits promote the node one level.
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        return 1 + std::countr_zero(seed | (uint64_t{1} << (2 * (MAX_LEVEL - 1)))) / 2;
+    }
+
+    SkipList::Node *SkipList::make_node(int height, double score, std::string_view member)
+    {
+        void *p = SlabAllocator::local().allocate(node_size(height));
+        Node *node = new (p) Node(score, member, height);
+        node_bytes += node_size(height) + node->member.heap();
+        return node;
+    }
+
+    void SkipList::free_node(Node *node)
+    {
+        int height = static_cast<int>(node->height);
+        node_bytes -= node_size(height) + node->member.heap();
+        node->~Node();
+        SlabAllocator::local().deallocate(node, node_size(height));
+    }
+
+    void SkipList::find_update(double score, std::string_view member, Node **update) const
+    {
+        Node *x = header;
+        for (int i = level - 1; i >= 0; --i)
+        {
+            while (x->levels()[i].forward != nullptr && before(x->levels()[i].forward, score, member))
+            {
+                x = x->levels()[i].forward;
+            }
+            update[i] = x;
+        }
+    }
+
+    void SkipList::insert(double score, std::string_view member)
+    {
+        Node *update[MAX_LEVEL];
+        std::size_t rank[MAX_LEVEL];
+        Node *x = header;
+        for (int i = level - 1; i >= 0; --i)
+        {
+            rank[i] = i == level - 1 ? 0 : rank[i + 1];
+            while (x->levels()[i].forward != nullptr && before(x->levels()[i].forward, score, member))
+            {
+                rank[i] += x->levels()[i].span;
+                x = x->levels()[i].forward;
+            }
+            update[i] = x;
+        }
+        int height = random_level();
+        for (; level < height; ++level)
+        {
+            rank[level] = 0;
+            update[level] = header;
+            header->levels()[level].span = length;
+        }
+        x = make_node(height, score, member);
+        for (int i = 0; i < height; ++i)
+        {
+            Level &prev = update[i]->levels()[i];
+            x->levels()[i].forward = prev.forward;
+            x->levels()[i].span = prev.span - (rank[0] - rank[i]);
+            prev.forward = x;
+            prev.span = rank[0] - rank[i] + 1;
+        }
+        for (int i = height; i < level; ++i)
+        {
+            ++update[i]->levels()[i].span;
+        }
+        x->backward = update[0] == header ? nullptr : update[0];
+        if (Node *next = x->levels()[0].forward)
+        {
+            next->backward = x;
+        }
+        else
+        {
+            tail = x;
+        }
+        ++length;
+    }
+
+    void SkipList::unlink(Node *node, Node **update)
+    {
+        for (int i = 0; i < level; ++i)
+        {
+            Level &prev = update[i]->levels()[i];
+            if (prev.forward == node)
+            {
+                prev.span += node->levels()[i].span - 1;
+                prev.forward = node->levels()[i].forward;
+            }
+            else
+            {
+                --prev.span;
+            }
+        }
+        if (Node *next = node->levels()[0].forward)
+        {
+            next->backward = node->backward;
+        }
+        else
+        {
+            tail = node->backward;
+        }
+        while (level > 1 && header->levels()[level - 1].forward == nullptr)
+        {
+            --level;
+        }
+        --length;
+    }
+
+    bool SkipList::erase(double score, std::string_view member)
+    {
+        Node *update[MAX_LEVEL];
+        find_update(score, member, update);
+        Node *x = update[0]->levels()[0].forward;
+        if (x == nullptr || x->score != score || x->member.view() != member)
+        {
+            return false;
+        }
+        unlink(x, update);
+        free_node(x);
+        return true;
+    }
+
+    void SkipList::update(double score, std::string_view member, double to)
+    {
+        Node *update[MAX_LEVEL];
+        find_update(score, member, update);
+        Node *x = update[0]->levels()[0].forward;
+        const Node *next = x->levels()[0].forward;
+        if ((x->backward == nullptr || x->backward->score < to) && (next == nullptr || next->score > to))
+        {
+            x->score = to;
+            return;
+        }
+        unlink(x, update);
+        // The new node copies the member before the old one goes.
+        insert(to, x->member.view());
+        free_node(x);
+    }
+
+    std::size_t SkipList::rank(double score, std::string_view member) const
+    {
+        std::size_t rank = 0;
+        const Node *x = header;
+        for (int i = level - 1; i >= 0; --i)
+        {
+            for (const Node *next = x->levels()[i].forward;
+                 next != nullptr && (next->score < score || (next->score == score && next->member.view() <= member));
+                 next = x->levels()[i].forward)
+            {
+                rank += x->levels()[i].span;
+                x = next;
+            }
+            if (x != header && x->member.view() == member)
+            {
+                break;
+            }
+        }
+        return rank - 1;
+    }
+
+    const SkipList::Node *SkipList::at(std::size_t index) const
+    {
+        std::size_t traversed = 0;
+        const Node *x = header;
+        for (int i = level - 1; i >= 0; --i)
+        {
+            while (x->levels()[i].forward != nullptr && traversed + x->levels()[i].span <= index + 1)
+            {
+                traversed += x->levels()[i].span;
+                x = x->levels()[i].forward;
+            }
+            if (traversed == index + 1)
+            {
+                break;
+            }
+        }
+        return x;
+    }
+
+    std::pair<std::size_t, std::size_t> SkipList::ranks_in(const ScoreRange &range) const
+    {
+        // Members below the range, then members up to its end.
+        std::size_t below = 0, through = 0;
+        const Node *x = header;
+        for (int i = level - 1; i >= 0; --i)
+        {
+            while (x->levels()[i].forward != nullptr && !range.above_min(x->levels()[i].forward->score))
+            {
+                below += x->levels()[i].span;
+                x = x->levels()[i].forward;
+            }
+        }
+        x = header;
+        for (int i = level - 1; i >= 0; --i)
+        {
+            while (x->levels()[i].forward != nullptr && range.below_max(x->levels()[i].forward->score))
+            {
+                through += x->levels()[i].span;
+                x = x->levels()[i].forward;
+            }
+        }
+        return {below, through > below ? through - below : 0};
+    }
+
+    std::size_t SkipList::defrag()
+    {
+        SlabAllocator &slab = SlabAllocator::local();
+        // The last node seen on each level, whose link points at the next.
+        Node *last[MAX_LEVEL];
+        for (Node *&node : last)
+        {
+            node = header;
+        }
+        std::size_t moved = 0;
+        for (Node *x = header->levels()[0].forward; x != nullptr;)
+        {
+            Node *next = x->levels()[0].forward;
+            int height = static_cast<int>(x->height);
+            moved += x->member.defrag();
+            if (slab.sparse(x))
+            {
+                auto *fresh = static_cast<Node *>(slab.allocate(node_size(height)));
+                new (fresh) Node(std::move(*x));
+                std::memcpy(fresh->levels(), x->levels(), static_cast<std::size_t>(height) * sizeof(Level));
+                x->~Node();
+                slab.deallocate(x, node_size(height));
+                for (int i = 0; i < height; ++i)
+                {
+                    last[i]->levels()[i].forward = fresh;
+                }
+                if (next != nullptr)
+                {
+                    next->backward = fresh;
+                }
+                else
+                {
+                    tail = fresh;
+                }
+                x = fresh;
+                ++moved;
+            }
+            for (int i = 0; i < height; ++i)
+            {
+                last[i] = x;
+            }
+            x = next;
+        }
+        return moved;
+    }
+}
@@ -0,0 +1,263 @@
+#include "slab.hpp"
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+
+namespace tr
+{
+    // Lives at the start of its page; the chunks follow. Chunks that were
+    // never handed out are carved off the end one at a time, so a fresh page
+    // costs resident memory only as it fills.
+    struct SlabAllocator::Page
+    {
+        Page *prev = nullptr;
+        Page *next = nullptr;
+        void *free = nullptr; // singly linked through the chunks themselves
+        uint32_t cls = 0;
+        uint32_t live = 0;
+        uint32_t carved = 0;
+        uint32_t capacity = 0;
+    };
+
+    namespace
+    {
+        constexpr std::size_t HEADER = 64;
+    }
+
+    SlabAllocator &SlabAllocator::local()
+    {
+        // Never destroyed: a store with static storage duration is torn down
+        // after the thread's thread_locals, and still frees into it.
+        thread_local SlabAllocator *allocator = new SlabAllocator();
+        return *allocator;
+    }
+
+    SlabAllocator::SlabAllocator()
+    {
+        for (std::size_t i = 0; i < CLASSES.count; ++i)
+        {
+            classes[i].size = CLASSES.sizes[i];
+        }
+    }
+
+    // Pages come from mappings of REGION_PAGES at a time, so even a large
+    // store needs few of them, and a released page is only emptied with
+    // MADV_DONTNEED: it leaves the resident set but stays reserved for reuse.
+    void *SlabAllocator::take_page()
+    {
+        if (!free_pages.empty())
+        {
+            void *page = free_pages.back();
+            free_pages.pop_back();
+            return page;
+        }
+        if (region_left == 0)
+        {
+            // Mapped one page over so the pages can be aligned to their size.
+            std::size_t span = (REGION_PAGES + 1) * PAGE_SIZE;
+            void *memory = ::mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED)
+            {
+                throw std::bad_alloc();
+            }
+            uintptr_t start = reinterpret_cast<uintptr_t>(memory);
+            uintptr_t first = (start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+            if (first > start)
+            {
+                ::munmap(memory, first - start);
+            }
+            uintptr_t end = first + REGION_PAGES * PAGE_SIZE;
+            if (start + span > end)
+            {
+                ::munmap(reinterpret_cast<void *>(end), start + span - end);
+            }
+            region_next = reinterpret_cast<char *>(first);
+            region_left = REGION_PAGES;
+        }
+        void *page = region_next;
+        region_next += PAGE_SIZE;
+        --region_left;
+        return page;
+    }
+
+    void SlabAllocator::give_back(void *page)
+    {
+        ::madvise(page, PAGE_SIZE, MADV_DONTNEED);
+        free_pages.push_back(page);
+    }
+
+    void SlabAllocator::unlink(SizeClass &cls, Page *page)
+    {
+        if (page->prev != nullptr)
+        {
+            page->prev->next = page->next;
+        }
+        else
+        {
+            cls.partial = page->next;
+        }
+        if (page->next != nullptr)
+        {
+            page->next->prev = page->prev;
+        }
+        page->prev = nullptr;
+        page->next = nullptr;
+    }
+
+    void *SlabAllocator::allocate(std::size_t n)
+    {
+        static_assert(sizeof(Page) <= HEADER);
+        totals.used += n;
+        if (n > MAX_CHUNK)
+        {
+            totals.allocated += n;
+            totals.reserved += n;
+            return ::operator new(n);
+        }
+        std::size_t index = class_of(n);
+        SizeClass &cls = classes[index];
+        totals.allocated += cls.size;
+
+        Page *page = cls.partial;
+        if (page == nullptr)
+        {
+            totals.reserved += PAGE_SIZE;
+            ++cls.pages;
+            page = new (take_page()) Page();
+            page->cls = static_cast<uint32_t>(index);
+            page->capacity = static_cast<uint32_t>((PAGE_SIZE - HEADER) / cls.size);
+            cls.partial = page;
+        }
+        else if (page->live == 0)
+        {
+            --cls.empty_pages;
+        }
+
+        void *chunk;
+        if (page->free != nullptr)
+        {
+            chunk = page->free;
+            std::memcpy(&page->free, chunk, sizeof(void *));
+        }
+        else
+        {
+            chunk = reinterpret_cast<char *>(page) + HEADER + std::size_t(page->carved++) * cls.size;
+        }
+        ++cls.live;
+        if (++page->live == page->capacity)
+        {
+            unlink(cls, page);
+        }
+        return chunk;
+    }
+
+    void SlabAllocator::deallocate(void *p, std::size_t n)
+    {
+        totals.used -= n;
+        if (n > MAX_CHUNK)
+        {
+            totals.allocated -= n;
+            totals.reserved -= n;
+            ::operator delete(p);
+            return;
+        }
+        Page *page = reinterpret_cast<Page *>(reinterpret_cast<uintptr_t>(p) & ~(PAGE_SIZE - 1));
+        SizeClass &cls = classes[page->cls];
+        totals.allocated -= cls.size;
+        --cls.live;
+
+        if (page->live-- == page->capacity)
+        {
+            page->next = cls.partial;
+            if (cls.partial != nullptr)
+            {
+                cls.partial->prev = page;
+            }
+            cls.partial = page;
+        }
+        std::memcpy(p, &page->free, sizeof(void *));
+        page->free = p;
+        if (page->live == 0 && ++cls.empty_pages > 1)
+        {
+            unlink(cls, page);
+            --cls.empty_pages;
+            --cls.pages;
+            totals.reserved -= PAGE_SIZE;
+            give_back(page);
+        }
+    }
+
+    bool SlabAllocator::sparse(const void *p) const
+    {
+        const Page *page = reinterpret_cast<const Page *>(reinterpret_cast<uintptr_t>(p) & ~(PAGE_SIZE - 1));
+        const SizeClass &cls = classes[page->cls];
+        return page->live < page->capacity && page->live * cls.pages <= cls.live && page != cls.partial;
+    }
+
+    bool SlabAllocator::fragmented() const
+    {
+        std::size_t idle = totals.reserved - totals.allocated;
+        return idle > DEFRAG_MIN_BYTES && idle * 10 > totals.reserved;
+    }
+
+    void SlabString::reassign(std::string_view s)
+    {
+        if (s.size() <= INLINE)
+        {
+            // Copied out first: `s` may point into this string.
+            char tmp[INLINE];
+            std::memcpy(tmp, s.data(), s.size());
+            release();
+            std::memcpy(bytes, tmp, s.size());
+            bytes[INLINE] = static_cast<char>(s.size());
+            return;
+        }
+        if (s.size() > UINT32_MAX)
+        {
+            throw std::length_error("SlabString is limited to 4 GB");
+        }
+        uint32_t n = static_cast<uint32_t>(s.size());
+        if (on_heap() && SlabAllocator::chunk_size(size()) == SlabAllocator::chunk_size(n))
+        {
+            // Overwrites of a similar size keep their chunk.
+            std::size_t old = size();
+            std::memmove(const_cast<char *>(data()), s.data(), n);
+            if (old != n)
+            {
+                SlabAllocator::local().resized(old, n);
+                std::memcpy(bytes + sizeof(char *), &n, sizeof(n));
+            }
+            return;
+        }
+        char *p = static_cast<char *>(SlabAllocator::local().allocate(n));
+        std::memcpy(p, s.data(), s.size());
+        release();
+        std::memcpy(bytes, &p, sizeof(p));
+        std::memcpy(bytes + sizeof(p), &n, sizeof(n));
+        bytes[INLINE] = static_cast<char>(HEAP);
+    }
+
+    bool SlabString::defrag()
+    {
+        std::size_t n = size();
+        if (!on_heap() || n > SlabAllocator::MAX_CHUNK || !SlabAllocator::local().sparse(data()))
+        {
+            return false;
+        }
+        SlabAllocator &slab = SlabAllocator::local();
+        char *p = static_cast<char *>(slab.allocate(n));
+        std::memcpy(p, data(), n);
+        slab.deallocate(const_cast<char *>(data()), n);
+        std::memcpy(bytes, &p, sizeof(p));
+        return true;
+    }
+
+    void SlabString::release()
+    {
+        if (on_heap())
+        {
+            SlabAllocator::local().deallocate(const_cast<char *>(data()), size());
+        }
+        bytes[INLINE] = 0;
+    }
+}
@@ -0,0 +1,633 @@
+#include "server.hpp"
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+
+#ifdef TINYREDIS_HAVE_URING
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+namespace tr
+{
+    namespace
+    {
+        constexpr unsigned RING_ENTRIES = 4096;
+        constexpr unsigned RECV_BUFFERS = 1024; // power of two, required by the buffer ring
+        constexpr unsigned RECV_BUFFER_SIZE = 16 * 1024;
+        constexpr uint16_t RECV_GROUP = 0;
+
+        enum Op : uint64_t
+        {
+            OP_ACCEPT = 1,
+            OP_RECV = 2,
+            OP_SEND = 3,
+            OP_CANCEL = 4,
+            OP_TIMER = 5
+        };
+
+        // user_data carries the operation in the low byte and the connection id
+        // above it, so completions for already-closed connections are dropped.
+        uint64_t tag(Op op, uint64_t id) { return (id << 8) | op; }
+
+        template <typename T>
+        T load_acquire(const T *p) { return std::atomic_ref<const T>(*p).load(std::memory_order_acquire); }
+
+        template <typename T>
+        void store_release(T *p, T v) { std::atomic_ref<T>(*p).store(v, std::memory_order_release); }
+
+        // Minimal io_uring wrapper over the raw syscalls, so the backend needs
+        // nothing beyond the kernel headers.
+        class Ring
+        {
+        public:
+            ~Ring()
+            {
+                if (bufs != nullptr)
+                {
+                    ::munmap(bufs, buf_ring_bytes);
+                }
+                if (sqes != nullptr)
+                {
+                    ::munmap(sqes, sqes_bytes);
+                }
+                if (cq_ptr != nullptr && cq_ptr != sq_ptr)
+                {
+                    ::munmap(cq_ptr, cq_bytes);
+                }
+                if (sq_ptr != nullptr)
+                {
+                    ::munmap(sq_ptr, sq_bytes);
+                }
+                if (fd >= 0)
+                {
+                    ::close(fd);
+                }
+            }
+
+            bool init(unsigned entries)
+            {
+                io_uring_params p{};
+                // Completions are only reaped from this thread, so the kernel can defer
+                // task work to io_uring_enter instead of interrupting us.
+                p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+                fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+                if (fd < 0 && errno == EINVAL)
+                {
+                    p = io_uring_params{};
+                    fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+                }
+                if (fd < 0)
+                {
+                    return false;
+                }
+
+                sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+                cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+                bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+                if (single)
+                {
+                    sq_bytes = cq_bytes = std::max(sq_bytes, cq_bytes);
+                }
+                sq_ptr = ::mmap(nullptr, sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+                if (sq_ptr == MAP_FAILED)
+                {
+                    sq_ptr = nullptr;
+                    return false;
+                }
+                cq_ptr = single ? sq_ptr : ::mmap(nullptr, cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+                if (cq_ptr == MAP_FAILED)
+                {
+                    cq_ptr = nullptr;
+                    return false;
+                }
+                sqes_bytes = p.sq_entries * sizeof(io_uring_sqe);
+                void *s = ::mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+                if (s == MAP_FAILED)
+                {
+                    return false;
+                }
+                sqes = static_cast<io_uring_sqe *>(s);
+
+                char *sq = static_cast<char *>(sq_ptr);
+                sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+                sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+                sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+                sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+                sq_entries = p.sq_entries;
+                char *cq = static_cast<char *>(cq_ptr);
+                cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+                cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+                cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+                cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+                local_tail = *sq_tail;
+                return true;
+            }
+
+            // Registers RECV_BUFFERS buffers the kernel picks from for receives.
+            bool setup_buffers()
+            {
+                buf_ring_bytes = RECV_BUFFERS * sizeof(io_uring_buf);
+                void *mem = ::mmap(nullptr, buf_ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (mem == MAP_FAILED)
+                {
+                    return false;
+                }
+                bufs = static_cast<io_uring_buf *>(mem);
+                io_uring_buf_reg reg{};
+                reg.ring_addr = reinterpret_cast<uint64_t>(mem);
+                reg.ring_entries = RECV_BUFFERS;
+                reg.bgid = RECV_GROUP;
+                if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+                {
+                    return false;
+                }
+                storage = std::make_unique<char[]>(static_cast<std::size_t>(RECV_BUFFERS) * RECV_BUFFER_SIZE);
+                for (unsigned i = 0; i < RECV_BUFFERS; ++i)
+                {
+                    stage_buffer(static_cast<uint16_t>(i));
+                }
+                publish_buffers();
+                return true;
+            }
+
+            char *buffer(uint16_t bid) { return storage.get() + static_cast<std::size_t>(bid) * RECV_BUFFER_SIZE; }
+
+            // Hands a consumed receive buffer back to the kernel; visible after publish_buffers().
+            void stage_buffer(uint16_t bid)
+            {
+                io_uring_buf &b = bufs[buf_tail & (RECV_BUFFERS - 1)];
+                b.addr = reinterpret_cast<uint64_t>(buffer(bid));
+                b.len = RECV_BUFFER_SIZE;
+                b.bid = bid;
+                ++buf_tail;
+            }
+
+            // The ring tail overlays the resv field of the first entry. The entries are
+            // indexed by hand because some kernel headers' flexible-array macro puts
+            // io_uring_buf_ring::bufs at offset 8 when compiled as C++.
+            void publish_buffers() { store_release(&bufs[0].resv, buf_tail); }
+
+            io_uring_sqe *next_sqe()
+            {
+                if (local_tail - load_acquire(sq_head) >= sq_entries)
+                {
+                    submit_and_wait(0); // full: push what we have before queueing more
+                }
+                unsigned idx = local_tail & sq_mask;
+                io_uring_sqe *sqe = &sqes[idx];
+                std::memset(sqe, 0, sizeof(*sqe));
+                sq_array[idx] = idx;
+                ++local_tail;
+                return sqe;
+            }
+
+            // One syscall both submits everything queued since the last call and
+            // waits for at least wait_nr completions.
+            int submit_and_wait(unsigned wait_nr)
+            {
+                unsigned to_submit = local_tail - *sq_tail;
+                store_release(sq_tail, local_tail);
+                unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+                if (to_submit == 0 && wait_nr == 0)
+                {
+                    return 0;
+                }
+                long rc = ::syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, flags, nullptr, 0);
+                return rc < 0 ? -errno : static_cast<int>(rc);
+            }
+
+            template <typename F>
+            void for_each_cqe(F &&fn)
+            {
+                unsigned head = *cq_head;
+                unsigned tail = load_acquire(cq_tail);
+                while (head != tail)
+                {
+                    fn(cqes[head & cq_mask]);
+                    ++head;
+                }
+                store_release(cq_head, head);
+            }
+
+        private:
+            int fd = -1;
+            void *sq_ptr = nullptr;
+            void *cq_ptr = nullptr;
+            std::size_t sq_bytes = 0;
+            std::size_t cq_bytes = 0;
+            std::size_t sqes_bytes = 0;
+            io_uring_sqe *sqes = nullptr;
+            unsigned *sq_head = nullptr;
+            unsigned *sq_tail = nullptr;
+            unsigned *sq_array = nullptr;
+            unsigned sq_mask = 0;
+            unsigned sq_entries = 0;
+            unsigned local_tail = 0;
+            unsigned *cq_head = nullptr;
+            unsigned *cq_tail = nullptr;
+            unsigned cq_mask = 0;
+            io_uring_cqe *cqes = nullptr;
+            io_uring_buf *bufs = nullptr;
+            std::size_t buf_ring_bytes = 0;
+            uint16_t buf_tail = 0;
+            std::unique_ptr<char[]> storage;
+        };
+
+        struct UringConnection : Connection
+        {
+            uint64_t id = 0;
+            ReplyBuffer sending; // replies owned by the in-flight send
+            iovec iov[ReplyBuffer::MAX_IOV];
+            msghdr msg{};
+            bool send_inflight = false;
+            bool recv_armed = false;
+            bool recv_cancelled = false; // cancel queued for the recv while paused
+            bool dirty = false; // has new input or output this batch
+        };
+
+        void arm_accept(Ring &ring, int listen_fd)
+        {
+            io_uring_sqe *sqe = ring.next_sqe();
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = listen_fd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            sqe->user_data = tag(OP_ACCEPT, 0);
+        }
+
+        void arm_recv(Ring &ring, UringConnection &uc)
+        {
+            io_uring_sqe *sqe = ring.next_sqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = uc.fd;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = RECV_GROUP;
+            sqe->user_data = tag(OP_RECV, uc.id);
+            uc.recv_armed = true;
+        }
+
+        // Stops the multishot recv of a paused connection; it completes with
+        // -ECANCELED and is re-armed once the output drains.
+        void cancel_recv(Ring &ring, UringConnection &uc)
+        {
+            io_uring_sqe *sqe = ring.next_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = tag(OP_RECV, uc.id);
+            sqe->user_data = tag(OP_CANCEL, uc.id);
+            uc.recv_cancelled = true;
+        }
+
+        void arm_timer(Ring &ring, const __kernel_timespec &ts)
+        {
+            io_uring_sqe *sqe = ring.next_sqe();
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = reinterpret_cast<uint64_t>(&ts);
+            sqe->len = 1;
+            sqe->user_data = tag(OP_TIMER, 0);
+        }
+
+        void queue_send(Ring &ring, UringConnection &uc)
+        {
+            uc.msg = msghdr{};
+            uc.msg.msg_iov = uc.iov;
+            uc.msg.msg_iovlen = static_cast<std::size_t>(uc.sending.gather(uc.iov, ReplyBuffer::MAX_IOV));
+            io_uring_sqe *sqe = ring.next_sqe();
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = uc.fd;
+            sqe->addr = reinterpret_cast<uint64_t>(&uc.msg);
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = tag(OP_SEND, uc.id);
+            uc.send_inflight = true;
+        }
+    }
+
+    int run_uring_server(const ServerConfig &config)
+    {
+        Ring ring;
+        if (!ring.init(RING_ENTRIES) || !ring.setup_buffers())
+        {
+            std::cout << "io_uring setup failed: " << std::strerror(errno) << "\n";
+            return 1;
+        }
+        if (config.io_threads > 1)
+        {
+            std::cout << "io_uring backend ignores --io-threads" << "\n";
+        }
+        int listen_fd = open_listener(config);
+        if (listen_fd < 0)
+        {
+            return 1;
+        }
+
+        KVStore db;
+        init_store(db, config);
+        BlockedClients blocked(db);
+        std::unordered_map<uint64_t, std::unique_ptr<UringConnection>> conns;
+        std::vector<UringConnection *> dirty;
+        std::vector<Connection *> woken;
+        uint64_t next_id = 1;
+
+        auto close_conn = [&](UringConnection &uc)
+        {
+            // shutdown() terminates the pending multishot recv so the kernel
+            // drops its file reference; late completions find no id and are ignored.
+            ::shutdown(uc.fd, SHUT_RDWR);
+            ::close(uc.fd);
+            uc.closing = true;
+        };
+        // Closes and frees a connection, unless a send is in flight: the
+        // kernel still reads its msghdr, iovecs and `sending`, and the send
+        // may not even be submitted yet, so closing the fd could let it reach
+        // a new client given the same number. The connection then stays
+        // behind with its socket shut down, which fails the send fast, and
+        // is freed when the send completes.
+        auto drop_conn = [&](UringConnection &uc)
+        {
+            if (uc.blocked())
+            {
+                blocked.unblock(uc);
+            }
+            if (uc.send_inflight)
+            {
+                ::shutdown(uc.fd, SHUT_RDWR);
+                uc.closing = true;
+                return;
+            }
+            close_conn(uc);
+            conns.erase(uc.id);
+        };
+        auto mark = [&](UringConnection &uc)
+        {
+            if (!uc.dirty)
+            {
+                uc.dirty = true;
+                dirty.push_back(&uc);
+            }
+        };
+
+        // Wakes the loop for background cycles while there is work for one,
+        // when the first blocked client times out, and once a second while a
+        // soft output limit is set, so clients that stopped reading are
+        // dropped even when nothing else happens.
+        __kernel_timespec tick{};
+        bool timer_armed = false;
+        auto timer_at = std::chrono::steady_clock::time_point::max();
+        auto last_sweep = std::chrono::steady_clock::now();
+        auto next_cycle = last_sweep;
+
+        arm_accept(ring, listen_fd);
+        while (true)
+        {
+            int rc = ring.submit_and_wait(1);
+            if (rc < 0 && rc != -EINTR && rc != -EAGAIN && rc != -EBUSY)
+            {
+                std::cout << "io_uring_enter() failed: " << std::strerror(-rc) << "\n";
+                break;
+            }
+            auto now = std::chrono::steady_clock::now();
+            db.set_clock(now);
+
+            bool returned_buffers = false;
+            ring.for_each_cqe([&](const io_uring_cqe &cqe)
+                              {
+                Op op = static_cast<Op>(cqe.user_data & 0xff);
+                uint64_t id = cqe.user_data >> 8;
+                bool has_buffer = (cqe.flags & IORING_CQE_F_BUFFER) != 0;
+                uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+                if (op == OP_CANCEL)
+                {
+                    return;
+                }
+                if (op == OP_TIMER)
+                {
+                    timer_armed = false;
+                    return;
+                }
+                if (op == OP_ACCEPT)
+                {
+                    if (cqe.res >= 0)
+                    {
+                        int nodelay = 1;
+                        ::setsockopt(cqe.res, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+                        auto uc = std::make_unique<UringConnection>();
+                        init_connection(*uc, cqe.res, config);
+                        uc->id = next_id++;
+                        arm_recv(ring, *uc);
+                        conns.emplace(uc->id, std::move(uc));
+                    }
+                    if (!more)
+                    {
+                        arm_accept(ring, listen_fd);
+                    }
+                    return;
+                }
+
+                auto it = conns.find(id);
+                UringConnection *uc = it == conns.end() ? nullptr : it->second.get();
+                if (op == OP_RECV)
+                {
+                    if (uc != nullptr && !uc->closing)
+                    {
+                        if (cqe.res > 0 && has_buffer)
+                        {
+                            if (!consume_input(*uc, ring.buffer(bid), static_cast<std::size_t>(cqe.res)))
+                            {
+                                uc->failed = true;
+                            }
+                            mark(*uc);
+                        }
+                        else if (cqe.res == 0)
+                        {
+                            uc->eof = true;
+                            mark(*uc);
+                        }
+                        else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+                        {
+                            uc->failed = true;
+                            mark(*uc);
+                        }
+                        if (!more)
+                        {
+                            // Ends on ENOBUFS or when the kernel stops the multishot; re-armed below.
+                            uc->recv_armed = false;
+                            uc->recv_cancelled = false;
+                            mark(*uc);
+                        }
+                    }
+                    if (has_buffer)
+                    {
+                        ring.stage_buffer(bid);
+                        returned_buffers = true;
+                    }
+                    return;
+                }
+
+                if (op == OP_SEND && uc != nullptr && uc->closing)
+                {
+                    uc->send_inflight = false;
+                    close_conn(*uc);
+                    conns.erase(it);
+                    return;
+                }
+                if (op == OP_SEND && uc != nullptr)
+                {
+                    uc->send_inflight = false;
+                    if (cqe.res < 0)
+                    {
+                        uc->failed = true;
+                    }
+                    else
+                    {
+                        uc->sending.consume(static_cast<std::size_t>(cqe.res));
+                    }
+                    mark(*uc);
+                } });
+            if (returned_buffers)
+            {
+                ring.publish_buffers();
+            }
+
+            if (background_work(db) && now >= next_cycle)
+            {
+                next_cycle = background_cycle(db, config, now);
+            }
+            if (config.output.soft > 0 && now - last_sweep >= std::chrono::seconds(1))
+            {
+                last_sweep = now;
+                for (auto &entry : conns)
+                {
+                    UringConnection &uc = *entry.second;
+                    if (!uc.closing && uc.over_soft && !check_output_limits(uc, uc.out.size() + uc.sending.size(), now))
+                    {
+                        std::cout << "closing client: output buffer over soft limit for " << uc.limits.soft_seconds << "s\n";
+                        uc.failed = true;
+                        mark(uc);
+                    }
+                }
+            }
+
+            // Clients that went away are not served; then whoever pushes or
+            // the clock woke runs with the batch, and again while the
+            // batch's own pushes wake more.
+            do
+            {
+                for (UringConnection *uc : dirty)
+                {
+                    if ((uc->failed || uc->eof) && uc->blocked())
+                    {
+                        blocked.unblock(*uc);
+                    }
+                }
+                wake_blocked(blocked, db, now, woken);
+                for (Connection *conn : woken)
+                {
+                    mark(static_cast<UringConnection &>(*conn));
+                }
+                woken.clear();
+
+                // Execute everything that arrived, then queue one send per connection;
+                // the sends go out with the next submit_and_wait.
+                for (UringConnection *uc : dirty)
+                {
+                    uc->dirty = false;
+                    Connection &conn = *uc;
+                    if (!conn.failed && !execute_requests(conn, db, &blocked))
+                    {
+                        conn.eof = true;
+                    }
+                    // Limits first: a client dropped now must not have a
+                    // send queued for it.
+                    if (!conn.failed && !check_output_limits(conn, conn.out.size() + uc->sending.size(), now))
+                    {
+                        std::cout << "closing client: output buffer limit reached (" << conn.out.size() + uc->sending.size() << " bytes)\n";
+                        conn.failed = true;
+                    }
+                    if (!conn.failed && !uc->send_inflight)
+                    {
+                        if (uc->sending.empty() && !conn.out.empty())
+                        {
+                            uc->sending.swap(conn.out);
+                        }
+                        if (!uc->sending.empty())
+                        {
+                            queue_send(ring, *uc);
+                        }
+                    }
+                    bool drained = !uc->send_inflight && uc->sending.empty();
+                    if (conn.failed || (conn.eof && drained))
+                    {
+                        drop_conn(*uc);
+                        continue;
+                    }
+                    if (conn.paused)
+                    {
+                        if (uc->recv_armed && !uc->recv_cancelled)
+                        {
+                            cancel_recv(ring, *uc);
+                        }
+                    }
+                    else if (!uc->recv_armed && !conn.eof)
+                    {
+                        arm_recv(ring, *uc);
+                    }
+                }
+                dirty.clear();
+            } while (db.has_ready_keys());
+
+            auto wake = blocked.next_deadline();
+            if (config.output.soft > 0)
+            {
+                wake = std::min(wake, last_sweep + std::chrono::seconds(1));
+            }
+            if (background_work(db))
+            {
+                wake = std::min(wake, next_cycle);
+            }
+            // A client blocking with a short timeout may need an earlier
+            // timer than the one in flight.
+            if (wake != std::chrono::steady_clock::time_point::max() && (!timer_armed || wake < timer_at))
+            {
+                auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(wake - std::chrono::steady_clock::now());
+                long long ns = std::max<long long>(wait.count(), 0);
+                tick.tv_sec = ns / 1000000000;
+                tick.tv_nsec = ns % 1000000000;
+                arm_timer(ring, tick);
+                timer_armed = true;
+                timer_at = wake;
+            }
+        }
+
+        for (auto &entry : conns)
+        {
+            close_conn(*entry.second);
+        }
+        ::close(listen_fd);
+        return 1;
+    }
+}
+#else
+namespace tr
+{
+    int run_uring_server(const ServerConfig &)
+    {
+        std::cout << "tinyredis_server was built without io_uring support" << "\n";
+        return 1;
+    }
+}
+#endif
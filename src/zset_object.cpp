@@ -0,0 +1,178 @@
+#include "zset_object.hpp"
+
+namespace tr
+{
+    std::optional<double> ZSetObject::score(std::string_view member)
+    {
+        if (index)
+        {
+            const Member *slot = index->scores.find(member);
+            return slot != nullptr ? std::optional(slot->score) : std::nullopt;
+        }
+        std::size_t pos = packed.find(member, 2);
+        return pos != packed.bytes() ? std::optional(packed_score(pos)) : std::nullopt;
+    }
+
+    bool ZSetObject::set(std::string_view member, double score, const Limits &limits)
+    {
+        if (!index)
+        {
+            std::size_t pos = packed.find(member, 2);
+            bool found = pos != packed.bytes();
+            if (member.size() <= limits.max_value && (found || size() < limits.max_entries))
+            {
+                if (found)
+                {
+                    if (packed_score(pos) == score)
+                    {
+                        return false;
+                    }
+                    packed.erase(pos, 2);
+                }
+                packed_insert(member, score);
+                return !found;
+            }
+            convert();
+        }
+        auto [slot, inserted] = index->scores.insert(member);
+        if (inserted)
+        {
+            slot->score = score;
+            index->order.insert(score, member);
+            table_strings += slot->key.heap();
+        }
+        else if (slot->score != score)
+        {
+            index->order.update(slot->score, member, score);
+            slot->score = score;
+        }
+        return inserted;
+    }
+
+    bool ZSetObject::remove(std::string_view member)
+    {
+        if (index)
+        {
+            Member *slot = index->scores.find(member);
+            if (slot == nullptr)
+            {
+                return false;
+            }
+            index->order.erase(slot->score, member);
+            table_strings -= slot->key.heap();
+            index->scores.erase(slot);
+            return true;
+        }
+        std::size_t pos = packed.find(member, 2);
+        if (pos == packed.bytes())
+        {
+            return false;
+        }
+        packed.erase(pos, 2);
+        return true;
+    }
+
+    std::optional<std::size_t> ZSetObject::rank(std::string_view member)
+    {
+        if (index)
+        {
+            const Member *slot = index->scores.find(member);
+            return slot != nullptr ? std::optional(index->order.rank(slot->score, member)) : std::nullopt;
+        }
+        std::size_t i = 0;
+        for (std::size_t pos = 0; pos < packed.bytes(); pos = packed.next(packed.next(pos)), ++i)
+        {
+            if (packed.get(pos) == member)
+            {
+                return i;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::pair<std::size_t, std::size_t> ZSetObject::ranks_in(const ScoreRange &range)
+    {
+        if (index)
+        {
+            return index->order.ranks_in(range);
+        }
+        std::size_t below = 0, n = 0;
+        for (std::size_t pos = 0; pos < packed.bytes(); pos = packed.next(packed.next(pos)))
+        {
+            double score = packed_score(pos);
+            if (!range.above_min(score))
+            {
+                ++below;
+            }
+            else if (range.below_max(score))
+            {
+                ++n;
+            }
+            else
+            {
+                break;
+            }
+        }
+        return {below, n};
+    }
+
+    std::size_t ZSetObject::pair_at(std::size_t i) const
+    {
+        std::size_t pos = 0;
+        for (; i > 0; --i)
+        {
+            pos = packed.next(packed.next(pos));
+        }
+        return pos;
+    }
+
+    void ZSetObject::packed_insert(std::string_view member, double score)
+    {
+        std::size_t pos = 0;
+        for (; pos < packed.bytes(); pos = packed.next(packed.next(pos)))
+        {
+            double s = packed_score(pos);
+            if (s > score || (s == score && packed.get(pos) > member))
+            {
+                break;
+            }
+        }
+        packed.insert(pos, member);
+        packed.insert(packed.next(pos), std::string_view(reinterpret_cast<const char *>(&score), sizeof(score)));
+    }
+
+    void ZSetObject::convert()
+    {
+        auto fresh = std::make_unique<Index>();
+        for (std::size_t pos = 0; pos < packed.bytes(); pos = packed.next(packed.next(pos)))
+        {
+            Member *slot = fresh->scores.insert(packed.get(pos)).first;
+            slot->score = packed_score(pos);
+            fresh->order.insert(slot->score, packed.get(pos));
+            table_strings += slot->key.heap();
+        }
+        index = std::move(fresh);
+        packed.clear();
+    }
+
+    std::size_t ZSetObject::heap() const
+    {
+        std::size_t bytes = sizeof(ZSetObject) + packed.heap();
+        if (index)
+        {
+            bytes += sizeof(Index) + index->scores.footprint() + table_strings + index->order.heap();
+        }
+        return bytes;
+    }
+
+    std::size_t ZSetObject::defrag()
+    {
+        if (!index)
+        {
+            return packed.defrag();
+        }
+        std::size_t moved = index->order.defrag();
+        index->scores.for_each([&](Member &member) { moved += member.key.defrag(); });
+        return moved;
+    }
+}
@@ -1,8 +1,38 @@
 #include <gtest/gtest.h>
 #include "kvstore.hpp"
 #include "repl.hpp"
+#include "commands.hpp"
+#include "buffer.hpp"
+#include "connection.hpp"
+#include "swiss_table.hpp"
+#include "slab.hpp"
+#include "concurrent_kvstore.hpp"
+#include "epoch.hpp"
+#include "spsc_queue.hpp"
+#include "listpack.hpp"
+#include "hash_object.hpp"
+#include "list_object.hpp"
+#include "intset.hpp"
+#include "set_object.hpp"
+#include "zset_object.hpp"
+#include "blocking.hpp"
+#include <algorithm>
+#include <cstring>
+#include <deque>
 #include <thread>
 #include <chrono>
+#include <climits>
+#include <map>
+#include <set>
+#include <random>
+#include <arpa/inet.h>
+#include <csignal>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 TEST(KVStore, SetGetDelBasics)
 {
@@ -23,6 +53,177 @@ TEST(KVStore, SetGetDelBasics)
     EXPECT_FALSE(store.del("nonexistent"));
 }
 
+struct TestSlot
+{
+    std::string key;
+    int value = 0;
+};
+
+TEST(SwissTable, GrowsFindsAndErases)
+{
+    tr::SwissTable<TestSlot> table;
+    EXPECT_EQ(table.find("missing"), nullptr);
+    for (int i = 0; i < 5000; ++i)
+    {
+        auto [slot, inserted] = table.insert("key:" + std::to_string(i));
+        ASSERT_TRUE(inserted);
+        slot->value = i;
+    }
+    EXPECT_EQ(table.size(), 5000u);
+    EXPECT_LE(table.size(), table.capacity() - table.capacity() / 8);
+    EXPECT_FALSE(table.insert("key:42").second);
+
+    for (int i = 0; i < 5000; i += 2)
+    {
+        EXPECT_TRUE(table.erase("key:" + std::to_string(i)));
+    }
+    EXPECT_FALSE(table.erase("key:0"));
+    EXPECT_EQ(table.size(), 2500u);
+    for (int i = 0; i < 5000; ++i)
+    {
+        TestSlot *slot = table.find("key:" + std::to_string(i));
+        if (i % 2 == 0)
+        {
+            EXPECT_EQ(slot, nullptr);
+        }
+        else
+        {
+            ASSERT_NE(slot, nullptr);
+            EXPECT_EQ(slot->value, i);
+        }
+    }
+}
+
+TEST(SwissTable, ChurnDoesNotKeepGrowing)
+{
+    tr::SwissTable<TestSlot> table;
+    for (int i = 0; i < 100; ++i)
+    {
+        table.insert("live:" + std::to_string(i));
+    }
+    std::size_t cap = table.capacity();
+    for (int i = 0; i < 100000; ++i)
+    {
+        std::string key = "tmp:" + std::to_string(i);
+        table.insert(key);
+        table.erase(key);
+    }
+    EXPECT_LE(table.capacity(), cap * 2); // tombstones are recycled, not accumulated
+    EXPECT_EQ(table.size(), 100u);
+    EXPECT_NE(table.find("live:99"), nullptr);
+}
+
+TEST(SwissTable, ResizesIncrementally)
+{
+    tr::SwissTable<TestSlot> table;
+    int n = 0;
+    while (!table.resizing() || table.capacity() < 4096)
+    {
+        table.insert("key:" + std::to_string(n)).first->value = n;
+        ++n;
+    }
+    std::size_t cap = table.capacity();
+    // Mid-resize every key is found, whichever arrays it sits in, and keys
+    // erased from the old arrays stay gone.
+    EXPECT_TRUE(table.erase("key:0"));
+    table.insert("fresh").first->value = -1;
+    EXPECT_EQ(table.size(), static_cast<std::size_t>(n));
+    for (int i = 1; i < n; ++i)
+    {
+        TestSlot *slot = table.find("key:" + std::to_string(i));
+        ASSERT_NE(slot, nullptr);
+        EXPECT_EQ(slot->value, i);
+    }
+    EXPECT_EQ(table.find("key:0"), nullptr);
+    EXPECT_FALSE(table.resizing()); // each find moved another few slots
+    EXPECT_EQ(table.capacity(), cap);
+
+    std::size_t visited = 0;
+    table.for_each([&](TestSlot &) { ++visited; });
+    EXPECT_EQ(visited, table.size());
+}
+
+TEST(Slab, StringsInlineOrInChunksAndPagesGoBack)
+{
+    tr::SlabAllocator &slab = tr::SlabAllocator::local();
+    tr::SlabAllocator::Stats before = slab.stats();
+    EXPECT_EQ(tr::SlabAllocator::chunk_size(1), 16u);
+    EXPECT_EQ(tr::SlabAllocator::chunk_size(100), 112u);
+    EXPECT_EQ(tr::SlabAllocator::chunk_size(tr::SlabAllocator::MAX_CHUNK), tr::SlabAllocator::MAX_CHUNK);
+    for (std::size_t n = 1; n <= tr::SlabAllocator::MAX_CHUNK; ++n)
+    {
+        std::size_t chunk = tr::SlabAllocator::chunk_size(n);
+        ASSERT_GE(chunk, n);
+        ASSERT_LE(chunk, n < 128 ? n + 15 : n + n / 4 + 16);
+    }
+
+    static_assert(sizeof(tr::SlabString) == 16);
+    tr::SlabString small("fifteen bytes!!");
+    EXPECT_EQ(small.view(), "fifteen bytes!!");
+    EXPECT_EQ(small.heap(), 0u);
+    tr::SlabString big(std::string(100, 'x'));
+    EXPECT_EQ(big.heap(), 112u);
+    tr::SlabString moved(std::move(big));
+    EXPECT_EQ(moved.view(), std::string(100, 'x'));
+    EXPECT_EQ(big.size(), 0u);
+    moved = std::string_view(moved).substr(10, 5); // from its own bytes
+    EXPECT_EQ(moved.view(), "xxxxx");
+    EXPECT_EQ(slab.stats().used, before.used);
+
+    // Filling and freeing many pages returns all but one spare per class.
+    std::vector<tr::SlabString> strings;
+    for (int i = 0; i < 50000; ++i)
+    {
+        strings.emplace_back(std::string(60, 'a' + i % 26));
+    }
+    EXPECT_EQ(slab.stats().used, before.used + 50000 * 60);
+    EXPECT_EQ(slab.stats().allocated, before.allocated + 50000 * 64);
+    EXPECT_GT(slab.stats().reserved, before.reserved + 50000 * 64);
+    EXPECT_EQ(strings[27].view(), std::string(60, 'b'));
+    strings.clear();
+    EXPECT_EQ(slab.stats().used, before.used);
+    EXPECT_LE(slab.stats().reserved, before.reserved + 2 * tr::SlabAllocator::PAGE_SIZE); // 64 and 112 bytes
+}
+
+TEST(Slab, DefragEmptiesSparsePages)
+{
+    tr::SlabAllocator &slab = tr::SlabAllocator::local();
+    tr::KVStore db;
+    auto key = [](int i) { return "key:" + std::to_string(i); };
+    for (int i = 0; i < 200000; ++i)
+    {
+        db.set(key(i), std::string(300, 'a' + i % 26));
+    }
+    std::vector<int> kept;
+    std::minstd_rand rng(7);
+    for (int i = 0; i < 200000; ++i)
+    {
+        if (rng() % 8 != 0)
+        {
+            db.del(key(i));
+        }
+        else
+        {
+            kept.push_back(i);
+        }
+    }
+    ASSERT_TRUE(slab.fragmented()); // every page keeps a few values
+    std::size_t before = slab.stats().reserved;
+    for (int pass = 0; pass < 10 && slab.fragmented(); ++pass)
+    {
+        while (db.defrag(std::chrono::milliseconds(10)))
+        {
+        }
+    }
+    EXPECT_FALSE(slab.fragmented());
+    EXPECT_LT(slab.stats().reserved, before / 2);
+    EXPECT_EQ(db.size(), kept.size());
+    for (int i : kept)
+    {
+        ASSERT_EQ(db.get(key(i)), std::string(300, 'a' + i % 26));
+    }
+}
+
 TEST(Repl, ParseLine_BasicWhitespace)
 {
     auto tokens = tr::parse_line("  SET  a  b  ");
@@ -73,9 +274,343 @@ TEST(ReplEval, DelCommand_WrongArgs)
     auto result1 = tr::eval_command(db, {"DEL"});
     EXPECT_EQ(result1, "(error) ERR wrong number of arguments for 'del'");
 
-    // Too many arguments
+    // DEL is variadic (arity -2 in the command table), as it is on the server
     auto result2 = tr::eval_command(db, {"DEL", "key1", "key2"});
-    EXPECT_EQ(result2, "(error) ERR wrong number of arguments for 'del'");
+    EXPECT_EQ(result2, "0");
+}
+
+TEST(ReplEval, RendersRepliesOfMoreSegmentsThanOneWritevTakes)
+{
+    // Every large bulk is its own segment, plus one for its CRLF.
+    tr::KVStore db;
+    std::vector<std::string> mget{"MGET"};
+    std::vector<std::string> rpush{"RPUSH", "list"};
+    std::string expected;
+    for (int i = 0; i < 2 * tr::ReplyBuffer::MAX_IOV; ++i)
+    {
+        std::string value(tr::ReplyBuffer::LARGE_BULK + 1000, static_cast<char>('a' + i % 26));
+        std::string key = "k" + std::to_string(i);
+        ASSERT_EQ(tr::eval_command(db, {"SET", key, value}), "OK");
+        mget.push_back(key);
+        rpush.push_back(value);
+        expected += (i > 0 ? "\n" : "") + std::to_string(i + 1) + ") " + value;
+    }
+    EXPECT_EQ(tr::eval_command(db, mget), expected);
+    tr::eval_command(db, rpush);
+    EXPECT_EQ(tr::eval_command(db, {"LRANGE", "list", "0", "-1"}), expected);
+}
+
+TEST(KVStore, IntegerValuesRoundTripAndCount)
+{
+    tr::KVStore db;
+    for (std::string v : {"10", "-5", "0", "9223372036854775807", "-9223372036854775808",
+                          "007", "+1", "-0", " 7", "9223372036854775808", "1.5", ""})
+    {
+        db.set("k", v);
+        EXPECT_EQ(db.get("k"), v);
+    }
+
+    db.set("counter", "41");
+    EXPECT_EQ(db.incrby("counter", 1), 42);
+    EXPECT_EQ(db.incrby("counter", -50), -8);
+    EXPECT_EQ(db.get("counter"), "-8");
+    EXPECT_EQ(db.incrby("fresh", 5), 5);
+    db.set("padded", "007"); // not how Redis spells an integer
+    EXPECT_FALSE(db.incrby("padded", 1).has_value());
+    db.set("max", "9223372036854775807");
+    EXPECT_FALSE(db.incrby("max", 1).has_value());
+
+    // A counter holds no heap at all, however long its digits.
+    tr::KVStore sizes;
+    sizes.set("a", "1");
+    std::size_t one = sizes.used_memory();
+    sizes.set("a", "-9223372036854775808");
+    EXPECT_EQ(sizes.used_memory(), one);
+    sizes.set("a", "x9223372036854775808");
+    EXPECT_GT(sizes.used_memory(), one);
+}
+
+TEST(KVStore, ReadsInPlaceAndTakesKeyViews)
+{
+    tr::KVStore db;
+    std::string buffer = "user:1 user:2 user:3";
+    std::string_view first = std::string_view(buffer).substr(0, 6);
+    db.set(first, std::string(100, 'x'));
+    db.set(std::string_view(buffer).substr(7, 6), "42");
+
+    const char *seen = nullptr;
+    EXPECT_TRUE(db.read("user:1", [&](std::string_view v)
+                        { seen = v.data(); EXPECT_EQ(v, std::string(100, 'x')); }));
+    EXPECT_TRUE(db.read(first, [&](std::string_view v) { EXPECT_EQ(v.data(), seen); })); // no copy
+    EXPECT_TRUE(db.read("user:2", [](std::string_view v) { EXPECT_EQ(v, "42"); }));
+    EXPECT_EQ(db.incrby("user:2", LLONG_MIN / 2 - 42), LLONG_MIN / 2);
+    EXPECT_EQ(db.incrby("user:2", LLONG_MIN / 2), LLONG_MIN); // the longest integer
+    EXPECT_TRUE(db.read("user:2", [](std::string_view v) { EXPECT_EQ(v, "-9223372036854775808"); }));
+    EXPECT_FALSE(db.read("user:3", [](std::string_view) { ADD_FAILURE(); }));
+
+    std::vector<std::string_view> keys = {"user:1", "user:2", "user:3", "user:1"};
+    EXPECT_EQ(db.exists(keys), 3);
+    EXPECT_TRUE(db.del(first));
+    EXPECT_EQ(db.exists({"user:1", "user:2"}), 1);
+}
+
+TEST(Listpack, WalksBothWaysAndShiftsOnInsertAndErase)
+{
+    tr::Listpack lp;
+    std::string big(300, 'x');
+    lp.push_back("b");
+    lp.push_back(big);
+    lp.insert(0, "a");
+    lp.push_back("");
+    EXPECT_EQ(lp.size(), 4u);
+    EXPECT_EQ(lp.bytes(), 3u + 310u + 3u + 2u);
+
+    std::vector<std::string> forward, backward;
+    for (std::size_t pos = 0; pos < lp.bytes(); pos = lp.next(pos))
+    {
+        forward.emplace_back(lp.get(pos));
+    }
+    for (std::size_t pos = lp.bytes(); pos > 0;)
+    {
+        pos = lp.prev(pos);
+        backward.emplace(backward.begin(), lp.get(pos));
+    }
+    EXPECT_EQ(forward, (std::vector<std::string>{"a", "b", big, ""}));
+    EXPECT_EQ(backward, forward);
+    EXPECT_EQ(lp.find(big), lp.next(lp.next(0)));
+    EXPECT_EQ(lp.find("b", 2), lp.bytes()); // only every other entry is compared
+
+    lp.replace(lp.next(0), big);
+    lp.replace(lp.next(lp.next(0)), "c");
+    EXPECT_EQ(lp.get(lp.next(0)), big);
+    EXPECT_EQ(lp.get(lp.last()), "");
+    lp.erase(0, 2);
+    EXPECT_EQ(lp.get(0), "c");
+    EXPECT_EQ(lp.size(), 2u);
+    lp.erase(0, 2);
+    EXPECT_TRUE(lp.empty());
+    EXPECT_EQ(lp.heap(), 0u);
+}
+
+TEST(HashObject, ConvertsToATablePastItsLimits)
+{
+    tr::HashObject::Limits limits{4, 8};
+    tr::HashObject small;
+    for (int i = 0; i < 4; ++i)
+    {
+        EXPECT_TRUE(small.set("f" + std::to_string(i), std::to_string(i), limits));
+    }
+    EXPECT_FALSE(small.set("f0", "zero", limits));
+    EXPECT_TRUE(small.is_packed());
+    EXPECT_EQ(small.get("f0"), "zero");
+    EXPECT_TRUE(small.set("f4", "4", limits)); // one field too many
+    EXPECT_FALSE(small.is_packed());
+    EXPECT_EQ(small.size(), 5u);
+    EXPECT_EQ(small.get("f0"), "zero");
+    EXPECT_TRUE(small.del("f0"));
+    EXPECT_FALSE(small.get("f0").has_value());
+
+    tr::HashObject wide;
+    wide.set("a", "1", limits);
+    wide.set("b", "a value longer than eight bytes", limits);
+    EXPECT_FALSE(wide.is_packed());
+    std::map<std::string, std::string> all;
+    wide.for_each([&](std::string_view f, std::string_view v) { all.emplace(f, v); });
+    EXPECT_EQ(all, (std::map<std::string, std::string>{{"a", "1"}, {"b", "a value longer than eight bytes"}}));
+
+    // A packed user object takes less than the std::string pairs alone of
+    // a node-based map, before its nodes and buckets.
+    tr::HashObject user;
+    for (int i = 0; i < 20; ++i)
+    {
+        user.set("field" + std::to_string(i), "value" + std::to_string(i), tr::HashObject::Limits{});
+    }
+    EXPECT_TRUE(user.is_packed());
+    EXPECT_LT(user.heap(), 20 * sizeof(std::pair<std::string, std::string>) / 2);
+}
+
+TEST(ListObject, SpreadsOverNodesAndMatchesADeque)
+{
+    // Four entries per node, so every operation crosses node boundaries.
+    tr::ListObject list;
+    std::deque<std::string> model;
+    for (int i = 0; i < 50; ++i)
+    {
+        list.push_back("b" + std::to_string(i), 4);
+        model.push_back("b" + std::to_string(i));
+        list.push_front("f" + std::to_string(i), 4);
+        model.push_front("f" + std::to_string(i));
+    }
+    ASSERT_EQ(list.size(), model.size());
+    for (std::size_t i = 0; i < model.size(); ++i)
+    {
+        EXPECT_EQ(list.at(i), model[i]);
+    }
+    std::vector<std::string> seen;
+    list.range(3, 10, [&](std::string_view v) { seen.emplace_back(v); });
+    EXPECT_EQ(seen, std::vector<std::string>(model.begin() + 3, model.begin() + 13));
+
+    list.pop_front([&](std::string_view v) { EXPECT_EQ(v, "f49"); });
+    list.pop_back([&](std::string_view v) { EXPECT_EQ(v, "b49"); });
+    model.pop_front();
+    model.pop_back();
+    list.trim(9, 70);
+    model.erase(model.begin(), model.begin() + 9);
+    model.resize(70);
+    ASSERT_EQ(list.size(), 70u);
+    for (std::size_t i = 0; i < model.size(); ++i)
+    {
+        EXPECT_EQ(list.at(i), model[i]);
+    }
+    while (list.size() > 0)
+    {
+        list.pop_back([](std::string_view) {});
+    }
+    EXPECT_EQ(list.heap(), tr::ListObject().heap());
+
+    EXPECT_EQ(tr::list_range(0, -1, 5), std::make_pair(std::size_t{0}, std::size_t{5}));
+    EXPECT_EQ(tr::list_range(-100, 1, 5), std::make_pair(std::size_t{0}, std::size_t{2}));
+    EXPECT_EQ(tr::list_range(3, 1, 5).second, 0u);
+    EXPECT_EQ(tr::list_range(0, -1, 0).second, 0u);
+}
+
+TEST(IntSet, WidensAndIntersectsLikeTheStandardLibrary)
+{
+    tr::IntSet ints;
+    EXPECT_TRUE(ints.insert(5));
+    EXPECT_TRUE(ints.insert(-3));
+    EXPECT_FALSE(ints.insert(5));
+    EXPECT_EQ(ints.width(), 2u);
+    EXPECT_TRUE(ints.insert(70000));
+    EXPECT_EQ(ints.width(), 4u);
+    EXPECT_TRUE(ints.insert(INT64_MIN));
+    EXPECT_EQ(ints.width(), 8u);
+    std::vector<int64_t> seen;
+    ints.for_each([&](int64_t n) { seen.push_back(n); });
+    EXPECT_EQ(seen, (std::vector<int64_t>{INT64_MIN, -3, 5, 70000}));
+    EXPECT_TRUE(ints.erase(-3));
+    EXPECT_FALSE(ints.erase(-3));
+    EXPECT_FALSE(ints.contains(int64_t{1} << 40));
+    EXPECT_TRUE(ints.contains(70000));
+
+    // Every strategy: SIMD merges at each width, scalar merges of mixed
+    // widths, and galloping past IntSet::GALLOP_RATIO.
+    std::minstd_rand rng(11);
+    auto random_set = [&](std::size_t n, int64_t range, int64_t offset)
+    {
+        std::set<int64_t> model;
+        while (model.size() < n)
+        {
+            model.insert(offset + static_cast<int64_t>(rng() % static_cast<uint64_t>(range)));
+        }
+        return model;
+    };
+    struct Case
+    {
+        std::size_t na, nb;
+        int64_t range_a, range_b, offset_b;
+    };
+    for (Case c : {Case{500, 700, 2000, 2000, 0}, Case{300, 300, 1000, 1000, 100000},
+                   Case{200, 300, 1 << 20, 1 << 20, int64_t{1} << 40}, Case{10, 5000, 20000, 20000, 0},
+                   Case{7, 0, 100, 1, 0}})
+    {
+        std::set<int64_t> ma = random_set(c.na, c.range_a, 0);
+        std::set<int64_t> mb = random_set(c.nb, c.range_b, c.offset_b);
+        tr::IntSet a, b;
+        for (int64_t n : ma)
+        {
+            a.insert(n);
+        }
+        for (int64_t n : mb)
+        {
+            b.insert(n);
+        }
+        std::vector<int64_t> expected, got;
+        std::set_intersection(ma.begin(), ma.end(), mb.begin(), mb.end(), std::back_inserter(expected));
+        tr::IntSet both = tr::IntSet::intersect(a, b);
+        both.for_each([&](int64_t n) { got.push_back(n); });
+        EXPECT_EQ(got, expected);
+        EXPECT_EQ(both.width(), std::min(a.width(), b.width()));
+    }
+    tr::IntSet narrow, wide;
+    for (int64_t n = 1; n <= 1000; ++n)
+    {
+        narrow.insert(n);
+        wide.insert(2 * n);
+    }
+    wide.insert(int64_t{1} << 40);
+    tr::IntSet evens = tr::IntSet::intersect(wide, narrow);
+    ASSERT_EQ(evens.size(), 500u);
+    EXPECT_EQ(evens.width(), 2u);
+    EXPECT_EQ(evens.at(0), 2);
+    EXPECT_EQ(evens.at(499), 1000);
+}
+
+TEST(ZSetObject, BothEncodingsMatchASortedModel)
+{
+    // One stays packed; the other is indexed from its first member, so its
+    // skiplist spans several levels.
+    tr::ZSetObject packed, indexed;
+    tr::ZSetObject::Limits roomy{.max_entries = 1000, .max_value = 64};
+    tr::ZSetObject::Limits none{.max_entries = 0, .max_value = 64};
+    std::map<std::string, double> scores;
+    std::set<std::pair<double, std::string>> model;
+    std::minstd_rand rng(5);
+    for (int step = 0; step < 3000; ++step)
+    {
+        std::string member = "m" + std::to_string(rng() % 400);
+        double score = static_cast<double>(rng() % 50) / 2; // plenty of ties
+        auto it = scores.find(member);
+        if (rng() % 4 == 0)
+        {
+            bool there = it != scores.end();
+            EXPECT_EQ(packed.remove(member), there);
+            EXPECT_EQ(indexed.remove(member), there);
+            if (there)
+            {
+                model.erase({it->second, member});
+                scores.erase(it);
+            }
+            continue;
+        }
+        bool fresh = it == scores.end();
+        EXPECT_EQ(packed.set(member, score, roomy), fresh);
+        EXPECT_EQ(indexed.set(member, score, none), fresh);
+        if (!fresh)
+        {
+            model.erase({it->second, member});
+        }
+        scores[member] = score;
+        model.insert({score, member});
+    }
+    EXPECT_TRUE(packed.is_packed());
+    EXPECT_FALSE(indexed.is_packed());
+    ASSERT_EQ(packed.size(), model.size());
+    ASSERT_EQ(indexed.size(), model.size());
+
+    std::vector<std::pair<double, std::string>> sorted(model.begin(), model.end());
+    for (tr::ZSetObject *zset : {&packed, &indexed})
+    {
+        for (std::size_t i = 0; i < sorted.size(); i += 7)
+        {
+            EXPECT_EQ(zset->rank(sorted[i].second), i);
+            EXPECT_EQ(zset->score(sorted[i].second), sorted[i].first);
+        }
+        EXPECT_EQ(zset->rank("absent"), std::nullopt);
+        std::vector<std::pair<double, std::string>> seen;
+        zset->range(10, 20, false, [&](std::string_view m, double s) { seen.emplace_back(s, m); });
+        EXPECT_EQ(seen, std::vector(sorted.begin() + 10, sorted.begin() + 30));
+        seen.clear();
+        zset->range(0, 5, true, [&](std::string_view m, double s) { seen.emplace_back(s, m); });
+        EXPECT_EQ(seen, std::vector(sorted.rbegin(), sorted.rbegin() + 5));
+
+        tr::ScoreRange range{.min = 3, .max = 10, .min_exclusive = true};
+        auto lower = std::upper_bound(sorted.begin(), sorted.end(), std::make_pair(3.0, std::string("\xff")));
+        auto upper = std::upper_bound(sorted.begin(), sorted.end(), std::make_pair(10.0, std::string("\xff")));
+        EXPECT_EQ(zset->ranks_in(range), std::make_pair(static_cast<std::size_t>(lower - sorted.begin()),
+                                                        static_cast<std::size_t>(upper - lower)));
+        EXPECT_EQ(zset->ranks_in({.min = 5, .max = 4}).second, 0u);
+    }
 }
 
 TEST(KVStoreExpiry, TTL_NoExpiryIsMinus1)
@@ -141,6 +676,90 @@ TEST(KVStoreExpiry, PurgeOnTouchViaGet)
     EXPECT_EQ(db.ttl("k"), -2);
 }
 
+TEST(KVStoreExpiry, ActiveExpireReclaimsUntouchedKeys)
+{
+    tr::KVStore db;
+    for (int i = 0; i < 5000; ++i)
+    {
+        std::string key = "session:" + std::to_string(i);
+        db.set(key, "v");
+        db.expire(key, 10);
+        db.set("live:" + std::to_string(i), "v");
+    }
+    EXPECT_EQ(db.volatile_keys(), 5000u);
+
+    // Nothing is due yet: one sample shows no stale keys and the cycle stops.
+    EXPECT_FALSE(db.active_expire(std::chrono::milliseconds(50)));
+    EXPECT_EQ(db.size(), 10000u);
+
+    // Pretend the deadline has passed; cycles run until all are reclaimed.
+    auto later = std::chrono::steady_clock::now() + std::chrono::seconds(11);
+    for (int cycles = 0; db.volatile_keys() > 0 && cycles < 1000; ++cycles)
+    {
+        db.active_expire(std::chrono::milliseconds(1), later);
+    }
+    EXPECT_EQ(db.volatile_keys(), 0u);
+    EXPECT_EQ(db.expired_keys(), 5000u);
+    EXPECT_EQ(db.size(), 5000u);
+    EXPECT_EQ(db.get("live:4999"), "v");
+
+    db.set("k", "v");
+    db.expire("k", 10);
+    db.set("k", "w"); // SET drops the deadline
+    EXPECT_EQ(db.volatile_keys(), 0u);
+}
+
+TEST(KVStoreExpiry, MillisecondDeadlinesFollowTheCachedClock)
+{
+    tr::KVStore db;
+    auto start = std::chrono::steady_clock::now();
+    db.set_clock(start);
+    db.set("k", "v");
+    EXPECT_TRUE(db.pexpire("k", 1500));
+    EXPECT_EQ(db.pttl("k"), 1500);
+    EXPECT_EQ(db.ttl("k"), 1);
+
+    // Time only moves when the clock is set again.
+    db.set_clock(start + std::chrono::milliseconds(1499));
+    EXPECT_EQ(db.pttl("k"), 1);
+    EXPECT_EQ(db.get("k"), "v");
+    db.set_clock(start + std::chrono::milliseconds(1500));
+    EXPECT_FALSE(db.get("k").has_value());
+    EXPECT_EQ(db.pttl("k"), -2);
+
+    db.set("k", "v");
+    db.expire("k", LLONG_MAX); // saturates rather than overflowing
+    EXPECT_GT(db.ttl("k"), 0);
+    db.set("gone", "v");
+    EXPECT_TRUE(db.expire("gone", LLONG_MIN)); // so does the negative side
+    EXPECT_EQ(db.pttl("gone"), -2);
+    EXPECT_TRUE(db.persist("k"));
+    EXPECT_FALSE(db.persist("k"));
+    EXPECT_EQ(db.pttl("k"), -1);
+
+    tr::SetOptions nx;
+    nx.when = tr::SetOptions::When::IfMissing;
+    nx.ttl_ms = 10;
+    EXPECT_FALSE(db.set("k", "w", nx));
+    EXPECT_TRUE(db.set("n", "w", nx));
+    EXPECT_EQ(db.pttl("n"), 10);
+
+    tr::SetOptions keep;
+    keep.when = tr::SetOptions::When::IfExists;
+    keep.keep_ttl = true;
+    EXPECT_TRUE(db.set("n", "x", keep));
+    EXPECT_FALSE(db.set("missing", "x", keep));
+    EXPECT_EQ(db.get("n"), "x");
+    EXPECT_EQ(db.pttl("n"), 10);
+
+    // An expired key not reclaimed yet has no TTL left to keep.
+    keep.when = tr::SetOptions::When::Always;
+    db.set_clock(start + std::chrono::milliseconds(2000));
+    EXPECT_TRUE(db.set("n", "y", keep));
+    EXPECT_EQ(db.get("n"), "y");
+    EXPECT_EQ(db.pttl("n"), -1);
+}
+
 // RESP array parsing tests
 
 TEST(RespParse, Ok_SimplePing)
@@ -306,3 +925,1414 @@ TEST(RespParse, Pipeline_TwoArrays)
     EXPECT_EQ(out2[1], "key");
     EXPECT_EQ(consumed2, second.size());
 }
+
+// Incremental RESP parser tests
+
+TEST(RespParser, ResumesAcrossByteAtATimeFeed)
+{
+    std::string frame = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n";
+    tr::RespParser parser;
+    std::vector<std::string_view> out;
+    std::size_t consumed = 0;
+    for (std::size_t n = 1; n < frame.size(); ++n)
+    {
+        ASSERT_EQ(parser.parse(std::string_view(frame).substr(0, n), consumed, out), tr::RespParseStatus::NeedMore);
+        EXPECT_TRUE(out.empty());
+    }
+    ASSERT_EQ(parser.parse(frame, consumed, out), tr::RespParseStatus::Ok);
+    EXPECT_EQ(consumed, frame.size());
+    ASSERT_EQ(out.size(), 3u);
+    EXPECT_EQ(out[2], "value");
+    // Views point into the caller's buffer rather than copies.
+    EXPECT_EQ(out[2].data(), frame.data() + frame.size() - 7);
+}
+
+TEST(RespParser, AppendsPipelinedFrames)
+{
+    std::string in = "*1\r\n$4\r\nPING\r\n*2\r\n$3\r\nGET\r\n$1\r\nk\r\n";
+    tr::RespParser parser;
+    std::vector<std::string_view> out;
+    std::size_t consumed = 0;
+    ASSERT_EQ(parser.parse(in, consumed, out), tr::RespParseStatus::Ok);
+    std::size_t second = 0;
+    ASSERT_EQ(parser.parse(std::string_view(in).substr(consumed), second, out), tr::RespParseStatus::Ok);
+    EXPECT_EQ(consumed + second, in.size());
+    ASSERT_EQ(out.size(), 3u);
+    EXPECT_EQ(out[0], "PING");
+    EXPECT_EQ(out[2], "k");
+}
+
+TEST(RespParser, RejectsOversizedAndMalformedLengths)
+{
+    tr::RespParser parser;
+    std::vector<std::string_view> out;
+    std::size_t consumed = 0;
+    EXPECT_EQ(parser.parse("*1\r\n$99999999999999999999\r\n", consumed, out), tr::RespParseStatus::Error);
+    EXPECT_EQ(parser.parse("*2\r\n$1\r\nab\r\n", consumed, out), tr::RespParseStatus::Error);
+    EXPECT_EQ(parser.parse("*1x\r\n", consumed, out), tr::RespParseStatus::Error);
+    EXPECT_TRUE(out.empty());
+}
+
+TEST(RespParser, ParseIntegerBounds)
+{
+    long long v = 0;
+    EXPECT_TRUE(tr::parse_integer("-9223372036854775808", v));
+    EXPECT_EQ(v, LLONG_MIN);
+    EXPECT_TRUE(tr::parse_integer("9223372036854775807", v));
+    EXPECT_EQ(v, LLONG_MAX);
+    EXPECT_FALSE(tr::parse_integer("9223372036854775808", v));
+    EXPECT_FALSE(tr::parse_integer("", v));
+    EXPECT_FALSE(tr::parse_integer("-", v));
+    EXPECT_FALSE(tr::parse_integer("12a", v));
+}
+
+// Reply buffer tests
+
+static std::string drain(tr::ReplyBuffer &out)
+{
+    std::string bytes;
+    iovec iov[tr::ReplyBuffer::MAX_IOV];
+    int n = out.gather(iov, tr::ReplyBuffer::MAX_IOV);
+    for (int i = 0; i < n; ++i)
+    {
+        bytes.append(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+    }
+    out.consume(bytes.size());
+    return bytes;
+}
+
+TEST(ReplyBuffer, EncodesReplyTypes)
+{
+    tr::ReplyBuffer out;
+    out.simple("OK");
+    out.error("boom");
+    out.integer(-42);
+    out.bulk(std::string_view("abc"));
+    out.null_bulk();
+    out.array_header(2);
+    EXPECT_EQ(drain(out), "+OK\r\n-ERR boom\r\n:-42\r\n$3\r\nabc\r\n$-1\r\n*2\r\n");
+    out.simple("OK");
+    out.integer(LLONG_MIN);
+    EXPECT_EQ(drain(out), "+OK\r\n:-9223372036854775808\r\n");
+    EXPECT_TRUE(out.empty());
+}
+
+TEST(ReplyBuffer, LargeBulkIsItsOwnSegmentAndResumesAfterPartialWrite)
+{
+    tr::ReplyBuffer out;
+    std::string big(tr::ReplyBuffer::LARGE_BULK, 'v');
+    const char *payload = big.data();
+    out.simple("A");
+    out.bulk(std::move(big));
+    out.simple("B");
+
+    iovec iov[tr::ReplyBuffer::MAX_IOV];
+    int n = out.gather(iov, tr::ReplyBuffer::MAX_IOV);
+    ASSERT_EQ(n, 3);
+    EXPECT_EQ(iov[1].iov_base, payload); // moved in, not copied
+
+    std::size_t total = out.size();
+    out.consume(10);
+    EXPECT_EQ(out.size(), total - 10);
+    std::string rest = drain(out);
+    EXPECT_EQ(rest.size(), total - 10);
+    EXPECT_EQ(rest.substr(rest.size() - 6), "\r\n+B\r\n");
+}
+
+TEST(ReplyBuffer, AppendCopiesSmallRepliesAndMovesLargeOnes)
+{
+    tr::ReplyBuffer out;
+    tr::ReplyBuffer other;
+    std::string big(tr::ReplyBuffer::LARGE_BULK, 'v');
+    const char *payload = big.data();
+    out.simple("A");
+    other.integer(7);
+    other.bulk(std::move(big));
+    out.append(std::move(other));
+    out.simple("B");
+    EXPECT_TRUE(other.empty());
+
+    iovec iov[tr::ReplyBuffer::MAX_IOV];
+    int n = out.gather(iov, tr::ReplyBuffer::MAX_IOV);
+    ASSERT_GE(n, 3);
+    EXPECT_EQ(iov[1].iov_base, payload);
+    std::string all = drain(out);
+    std::string head = "+A\r\n:7\r\n$" + std::to_string(tr::ReplyBuffer::LARGE_BULK) + "\r\n";
+    EXPECT_EQ(all.substr(0, head.size()), head);
+    EXPECT_EQ(all.substr(all.size() - 7), "v\r\n+B\r\n");
+}
+
+// Command table tests
+
+static void fill(tr::InputBuffer &in, std::string_view bytes)
+{
+    std::memcpy(in.write_ptr(), bytes.data(), bytes.size());
+    in.commit(bytes.size());
+}
+
+TEST(InputBuffer, CompactsOnlyWhenAllowedAndReturnsChunkToPool)
+{
+    tr::InputBuffer in;
+    in.reserve(1, true);
+    EXPECT_EQ(in.capacity(), tr::BufferPool::CHUNK_SIZE);
+    fill(in, std::string(in.writable() - 4, 'a') + "tail");
+    in.consume(in.unread().size() - 4);
+
+    const char *base = in.base();
+    in.reserve(8, true);
+    EXPECT_EQ(in.base(), base); // slid down in place
+    EXPECT_EQ(in.unread(), "tail");
+
+    fill(in, std::string(in.writable(), 'b'));
+    in.consume(4);
+    in.reserve(8, false); // the consumed bytes may still be referenced
+    EXPECT_NE(in.base(), base);
+    EXPECT_EQ(in.unread().substr(0, 2), "bb");
+
+    in.consume(in.unread().size());
+    in.release_if_empty();
+    EXPECT_EQ(in.base(), nullptr);
+    EXPECT_GT(tr::BufferPool::cached(), 0u);
+}
+
+TEST(InputBuffer, ChunksFreedOnOneThreadAreReusedOnAnother)
+{
+    // With I/O threads, chunks are read into on the I/O threads and freed
+    // on the one executing commands.
+    std::vector<char *> freed;
+    for (int i = 0; i < 256; ++i)
+    {
+        freed.push_back(tr::BufferPool::acquire());
+    }
+    for (char *chunk : freed)
+    {
+        tr::BufferPool::release(chunk);
+    }
+    std::size_t reused = 0;
+    std::thread reader([&]
+                       {
+        std::vector<char *> taken;
+        for (int i = 0; i < 256; ++i)
+        {
+            taken.push_back(tr::BufferPool::acquire());
+            reused += std::count(freed.begin(), freed.end(), taken.back());
+        }
+        for (char *chunk : taken)
+        {
+            tr::BufferPool::release(chunk);
+        } });
+    reader.join();
+    EXPECT_GT(reused, 0u);
+}
+
+TEST(InputBuffer, LargeReservationIsExactAndKeepsPendingBytes)
+{
+    tr::InputBuffer in;
+    in.reserve(1, true);
+    fill(in, "$100000\r\n");
+    in.consume(3);
+    in.reserve(100002, true);
+    EXPECT_EQ(in.unread(), "0000\r\n");
+    EXPECT_EQ(in.writable(), 100002u);
+
+    fill(in, std::string(100002, 'z'));
+    in.consume(in.unread().size() - 2);
+    in.reserve(16, true); // the two leftover bytes move back into a pooled chunk
+    EXPECT_EQ(in.capacity(), tr::BufferPool::CHUNK_SIZE);
+    EXPECT_EQ(in.unread(), "zz");
+}
+
+TEST(Commands, LookupIsCaseInsensitive)
+{
+    const tr::Command *get = tr::lookup_command("GeT");
+    ASSERT_NE(get, nullptr);
+    EXPECT_EQ(get->name, "get");
+    EXPECT_EQ(get->arity, 2);
+    EXPECT_TRUE(get->flags & tr::CMD_READONLY);
+    EXPECT_EQ(tr::lookup_command("INCRBY"), tr::lookup_command("incrby"));
+    EXPECT_EQ(tr::lookup_command("gett"), nullptr);
+    EXPECT_EQ(tr::lookup_command(""), nullptr);
+}
+
+TEST(Commands, KeySpecsFindTheKeysOfACommand)
+{
+    std::vector<std::size_t> keys;
+    std::vector<std::string_view> del = {"DEL", "a", "b", "c"};
+    tr::command_keys(*tr::lookup_command("del"), del, keys);
+    EXPECT_EQ(keys, (std::vector<std::size_t>{1, 2, 3}));
+
+    keys.clear();
+    std::vector<std::string_view> set = {"SET", "k", "v"};
+    tr::command_keys(*tr::lookup_command("set"), set, keys);
+    EXPECT_EQ(keys, (std::vector<std::size_t>{1}));
+
+    keys.clear();
+    std::vector<std::string_view> mset = {"MSET", "a", "1", "b", "2"};
+    tr::command_keys(*tr::lookup_command("mset"), mset, keys);
+    EXPECT_EQ(keys, (std::vector<std::size_t>{1, 3}));
+
+    keys.clear();
+    std::vector<std::string_view> ping = {"PING"};
+    std::vector<std::string_view> bad = {"GET"};
+    tr::command_keys(*tr::lookup_command("ping"), ping, keys);
+    tr::command_keys(*tr::lookup_command("get"), bad, keys);
+    EXPECT_TRUE(keys.empty());
+    EXPECT_TRUE(tr::lookup_command("exists")->flags & tr::CMD_SPLIT_SUM);
+    EXPECT_TRUE(tr::lookup_command("mget")->flags & tr::CMD_SPLIT_GATHER);
+    EXPECT_TRUE(tr::lookup_command("mset")->flags & tr::CMD_SPLIT_OK);
+    EXPECT_FALSE(tr::lookup_command("msetnx")->flags & (tr::CMD_SPLIT_OK | tr::CMD_SPLIT_GATHER));
+}
+
+TEST(Commands, ShardOfSpreadsKeysEvenly)
+{
+    std::size_t counts[4] = {};
+    for (int i = 0; i < 4000; ++i)
+    {
+        std::size_t shard = tr::shard_of("key:" + std::to_string(i), 4);
+        ASSERT_LT(shard, 4u);
+        ++counts[shard];
+    }
+    for (std::size_t count : counts)
+    {
+        EXPECT_GT(count, 800u);
+    }
+    EXPECT_EQ(tr::shard_of("anything", 1), 0u);
+}
+
+TEST(Commands, ShardOfPlacesKeysByHashTag)
+{
+    for (int i = 0; i < 100; ++i)
+    {
+        std::string tag = std::to_string(i);
+        EXPECT_EQ(tr::shard_of("{" + tag + "}a", 8), tr::shard_of(tag, 8));
+        EXPECT_EQ(tr::shard_of("x{" + tag + "}:b{c}", 8), tr::shard_of(tag, 8));
+    }
+    // An empty or unclosed tag does not count: the whole key is hashed.
+    std::size_t spread = 0;
+    for (int i = 0; i < 100; ++i)
+    {
+        spread += tr::shard_of("{}" + std::to_string(i), 8) != tr::shard_of("{}", 8);
+        spread += tr::shard_of("{" + std::to_string(i), 8) != tr::shard_of("{", 8);
+    }
+    EXPECT_GT(spread, 100u);
+}
+
+TEST(Commands, DispatchChecksArityAndWritesResp)
+{
+    tr::KVStore db;
+    tr::ReplyBuffer out;
+    std::vector<std::string_view> set = {"SET", "k", "v"};
+    std::vector<std::string_view> get = {"get", "k"};
+    std::vector<std::string_view> bad = {"TTL"};
+    std::vector<std::string_view> unknown = {"NOPE"};
+    tr::dispatch_command(db, set, out);
+    tr::dispatch_command(db, get, out);
+    tr::dispatch_command(db, bad, out);
+    tr::dispatch_command(db, unknown, out);
+    EXPECT_EQ(drain(out), "+OK\r\n$1\r\nv\r\n-ERR wrong number of arguments for 'ttl'\r\n-ERR unknown command 'nope'\r\n");
+}
+
+TEST(Commands, MgetMsetAndMsetnx)
+{
+    tr::KVStore db;
+    tr::ReplyBuffer out;
+    auto run = [&](std::vector<std::string_view> args)
+    {
+        tr::dispatch_command(db, args, out);
+        return drain(out);
+    };
+    // Enough pairs to span several prefetch batches and grow the table.
+    std::vector<std::string> storage;
+    for (int i = 0; i < 100; ++i)
+    {
+        storage.push_back("key:" + std::to_string(i));
+        storage.push_back(i % 2 ? std::to_string(i) : "value-" + std::to_string(i));
+    }
+    std::vector<std::string_view> mset = {"MSET"};
+    mset.insert(mset.end(), storage.begin(), storage.end());
+    EXPECT_EQ(run(mset), "+OK\r\n");
+    EXPECT_EQ(db.size(), 100u);
+    EXPECT_EQ(db.get("key:98"), "value-98");
+
+    std::vector<std::string_view> mget = {"MGET"};
+    std::string expected = "*101\r\n";
+    for (int i = 0; i < 100; ++i)
+    {
+        mget.push_back(storage[2 * i]);
+        std::string value = storage[2 * i + 1];
+        expected += "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+    }
+    db.expire("key:5", 0);
+    mget.push_back("missing");
+    expected.replace(expected.find("$1\r\n5\r\n"), 7, "$-1\r\n");
+    expected += "$-1\r\n";
+    EXPECT_EQ(run(mget), expected);
+
+    EXPECT_EQ(run({"MSET", "a", "1", "b"}), "-ERR wrong number of arguments for 'mset'\r\n");
+    EXPECT_EQ(run({"MSETNX", "x", "1", "key:7", "2"}), ":0\r\n");
+    EXPECT_FALSE(db.get("x").has_value());
+    EXPECT_EQ(run({"MSETNX", "x", "1", "y", "2", "x", "3"}), ":1\r\n");
+    EXPECT_EQ(run({"MGET", "x", "y"}), "*2\r\n$1\r\n3\r\n$1\r\n2\r\n");
+}
+
+TEST(Commands, HashCommandsAndWrongType)
+{
+    tr::KVStore db;
+    tr::ReplyBuffer out;
+    auto run = [&](std::vector<std::string_view> args)
+    {
+        tr::dispatch_command(db, args, out);
+        return drain(out);
+    };
+    EXPECT_EQ(run({"HSET", "user", "name", "ada", "visits", "1"}), ":2\r\n");
+    EXPECT_EQ(run({"HSET", "user", "name", "grace"}), ":0\r\n");
+    EXPECT_EQ(run({"HSET", "user", "name"}), "-ERR wrong number of arguments for 'hset'\r\n");
+    EXPECT_EQ(run({"HGET", "user", "name"}), "$5\r\ngrace\r\n");
+    EXPECT_EQ(run({"HGET", "user", "nope"}), "$-1\r\n");
+    EXPECT_EQ(run({"HMGET", "user", "visits", "nope"}), "*2\r\n$1\r\n1\r\n$-1\r\n");
+    EXPECT_EQ(run({"HMGET", "missing", "a"}), "*1\r\n$-1\r\n");
+    EXPECT_EQ(run({"HINCRBY", "user", "visits", "41"}), ":42\r\n");
+    EXPECT_EQ(run({"HINCRBY", "user", "name", "1"}), "-ERR hash value is not an integer or out of range\r\n");
+    EXPECT_EQ(run({"HLEN", "user"}), ":2\r\n");
+    EXPECT_EQ(run({"HGETALL", "user"}), "*4\r\n$4\r\nname\r\n$5\r\ngrace\r\n$6\r\nvisits\r\n$2\r\n42\r\n");
+
+    // Strings and hashes refuse each other's commands; SET, DEL and MGET
+    // take any type.
+    const char *wrongtype = "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n";
+    run({"SET", "s", "v"});
+    EXPECT_EQ(run({"GET", "user"}), wrongtype);
+    EXPECT_EQ(run({"INCRBY", "user", "1"}), wrongtype);
+    EXPECT_EQ(run({"HGET", "s", "f"}), wrongtype);
+    EXPECT_EQ(run({"HMGET", "s", "f"}), wrongtype);
+    EXPECT_EQ(run({"HGETALL", "s"}), wrongtype);
+    EXPECT_EQ(run({"HSET", "s", "f", "v"}), wrongtype);
+    EXPECT_EQ(run({"MGET", "user", "s"}), "*2\r\n$-1\r\n$1\r\nv\r\n");
+
+    std::size_t before = db.used_memory();
+    EXPECT_EQ(run({"HDEL", "user", "name", "nope"}), ":1\r\n");
+    EXPECT_LT(db.used_memory(), before);
+    EXPECT_EQ(run({"HDEL", "user", "visits"}), ":1\r\n");
+    EXPECT_EQ(run({"EXISTS", "user"}), ":0\r\n"); // the last field took the key with it
+    run({"HSET", "user", "a", "1"});
+    EXPECT_EQ(run({"SET", "user", "v"}), "+OK\r\n");
+    EXPECT_EQ(run({"GET", "user"}), "$1\r\nv\r\n");
+
+    // Past the limits the hash switches to a table and keeps its fields.
+    db.set_hash_limits(tr::HashObject::Limits{8, 64});
+    for (int i = 0; i < 100; ++i)
+    {
+        std::string field = "f" + std::to_string(i);
+        run({"HSET", "big", field, std::to_string(i)});
+    }
+    EXPECT_EQ(run({"HLEN", "big"}), ":100\r\n");
+    EXPECT_EQ(run({"HGET", "big", "f77"}), "$2\r\n77\r\n");
+    EXPECT_EQ(run({"DEL", "big"}), ":1\r\n");
+    // Every byte the hashes held has been given back.
+    tr::KVStore strings;
+    strings.set("s", "v");
+    strings.set("user", "v");
+    EXPECT_EQ(db.used_memory(), strings.used_memory());
+}
+
+TEST(Commands, ListCommandsAndWrongType)
+{
+    tr::KVStore db;
+    tr::ReplyBuffer out;
+    auto run = [&](std::vector<std::string_view> args)
+    {
+        tr::dispatch_command(db, args, out);
+        return drain(out);
+    };
+    EXPECT_EQ(run({"RPUSH", "q", "b", "c"}), ":2\r\n");
+    EXPECT_EQ(run({"LPUSH", "q", "a", "z"}), ":4\r\n");
+    EXPECT_EQ(run({"LRANGE", "q", "0", "-1"}), "*4\r\n$1\r\nz\r\n$1\r\na\r\n$1\r\nb\r\n$1\r\nc\r\n");
+    EXPECT_EQ(run({"LRANGE", "q", "-2", "100"}), "*2\r\n$1\r\nb\r\n$1\r\nc\r\n");
+    EXPECT_EQ(run({"LRANGE", "missing", "0", "-1"}), "*0\r\n");
+    EXPECT_EQ(run({"LINDEX", "q", "-1"}), "$1\r\nc\r\n");
+    EXPECT_EQ(run({"LINDEX", "q", "4"}), "$-1\r\n");
+    EXPECT_EQ(run({"LPOP", "q"}), "$1\r\nz\r\n");
+    EXPECT_EQ(run({"RPOP", "q", "2"}), "*2\r\n$1\r\nc\r\n$1\r\nb\r\n");
+    EXPECT_EQ(run({"RPOP", "missing", "2"}), "*-1\r\n");
+    EXPECT_EQ(run({"LPOP", "q", "-1"}), "-ERR value is out of range, must be positive\r\n");
+    EXPECT_EQ(run({"LLEN", "q"}), ":1\r\n");
+    EXPECT_EQ(run({"LPOP", "q"}), "$1\r\na\r\n");
+    EXPECT_EQ(run({"EXISTS", "q"}), ":0\r\n"); // the last entry took the key with it
+    EXPECT_EQ(run({"LPOP", "q"}), "$-1\r\n");
+
+    for (int i = 0; i < 10; ++i)
+    {
+        run({"RPUSH", "t", std::to_string(i)});
+    }
+    EXPECT_EQ(run({"LTRIM", "t", "2", "-3"}), "+OK\r\n");
+    EXPECT_EQ(run({"LRANGE", "t", "0", "-1"}),
+              "*6\r\n$1\r\n2\r\n$1\r\n3\r\n$1\r\n4\r\n$1\r\n5\r\n$1\r\n6\r\n$1\r\n7\r\n");
+    EXPECT_EQ(run({"LTRIM", "t", "5", "1"}), "+OK\r\n");
+    EXPECT_EQ(run({"EXISTS", "t"}), ":0\r\n");
+
+    // Without a server to block in, BLPOP answers as if it timed out.
+    EXPECT_EQ(run({"RPUSH", "q2", "x"}), ":1\r\n");
+    EXPECT_EQ(run({"BLPOP", "q1", "q2", "0"}), "*2\r\n$2\r\nq2\r\n$1\r\nx\r\n");
+    EXPECT_EQ(tr::eval_command(db, {"BRPOP", "q1", "q2", "0"}), "(nil)");
+    EXPECT_EQ(run({"BLPOP", "q1", "-1"}), "-ERR timeout is negative\r\n");
+    EXPECT_EQ(run({"BLPOP", "q1", "soon"}), "-ERR timeout is not a float or out of range\r\n");
+
+    const char *wrongtype = "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n";
+    run({"SET", "s", "v"});
+    run({"RPUSH", "l", "v"});
+    EXPECT_EQ(run({"LPUSH", "s", "v"}), wrongtype);
+    EXPECT_EQ(run({"LRANGE", "s", "0", "-1"}), wrongtype);
+    EXPECT_EQ(run({"BLPOP", "s", "0"}), wrongtype);
+    EXPECT_EQ(run({"GET", "l"}), wrongtype);
+    EXPECT_EQ(run({"HGET", "l", "f"}), wrongtype);
+    EXPECT_EQ(run({"DEL", "l"}), ":1\r\n");
+
+    // Every byte the lists held has been given back.
+    tr::KVStore strings;
+    strings.set("s", "v");
+    EXPECT_EQ(db.used_memory(), strings.used_memory());
+}
+
+TEST(Commands, SetCommandsAndWrongType)
+{
+    tr::KVStore db;
+    tr::ReplyBuffer out;
+    auto run = [&](std::vector<std::string_view> args)
+    {
+        tr::dispatch_command(db, args, out);
+        return drain(out);
+    };
+    // IntSets reply in ascending order.
+    EXPECT_EQ(run({"SADD", "a", "3", "1", "2", "3"}), ":3\r\n");
+    EXPECT_EQ(run({"SADD", "b", "2", "3", "4"}), ":3\r\n");
+    EXPECT_EQ(run({"SMEMBERS", "a"}), "*3\r\n$1\r\n1\r\n$1\r\n2\r\n$1\r\n3\r\n");
+    EXPECT_EQ(run({"SINTER", "a", "b"}), "*2\r\n$1\r\n2\r\n$1\r\n3\r\n");
+    EXPECT_EQ(run({"SINTER", "a", "b", "missing"}), "*0\r\n");
+    EXPECT_EQ(run({"SDIFF", "a", "b"}), "*1\r\n$1\r\n1\r\n");
+    EXPECT_EQ(run({"SUNION", "a", "b", "missing"}),
+              "*4\r\n$1\r\n1\r\n$1\r\n2\r\n$1\r\n3\r\n$1\r\n4\r\n");
+    EXPECT_EQ(run({"SISMEMBER", "a", "1"}), ":1\r\n");
+    EXPECT_EQ(run({"SISMEMBER", "a", "01"}), ":0\r\n");
+    EXPECT_EQ(run({"SREM", "a", "1", "9"}), ":1\r\n");
+    EXPECT_EQ(run({"SCARD", "a"}), ":2\r\n");
+
+    // A string member converts the set; results are compared as sets.
+    EXPECT_EQ(run({"SADD", "b", "x"}), ":1\r\n");
+    auto members = [&](std::string_view key)
+    {
+        std::set<std::string> all;
+        db.smembers(key, [&](std::string_view m) { all.emplace(m); });
+        return all;
+    };
+    EXPECT_EQ(run({"SINTERSTORE", "c", "b", "a"}), ":2\r\n");
+    EXPECT_EQ(members("c"), (std::set<std::string>{"2", "3"}));
+    EXPECT_EQ(run({"SUNIONSTORE", "c", "a", "b"}), ":4\r\n");
+    EXPECT_EQ(members("c"), (std::set<std::string>{"2", "3", "4", "x"}));
+    EXPECT_EQ(run({"SDIFFSTORE", "c", "c", "a"}), ":2\r\n"); // the destination may be a source
+    EXPECT_EQ(members("c"), (std::set<std::string>{"4", "x"}));
+    EXPECT_EQ(run({"SDIFFSTORE", "c", "a", "b"}), ":0\r\n");
+    EXPECT_EQ(run({"EXISTS", "c"}), ":0\r\n");
+    EXPECT_EQ(run({"SREM", "b", "2", "3", "4", "x"}), ":4\r\n");
+    EXPECT_EQ(run({"EXISTS", "b"}), ":0\r\n");
+
+    // Past set-max-intset-entries an all-integer set converts too.
+    db.set_set_limits({.max_intset_entries = 4});
+    EXPECT_EQ(run({"SADD", "n", "1", "2", "3", "4", "5"}), ":5\r\n");
+    EXPECT_EQ(members("n"), (std::set<std::string>{"1", "2", "3", "4", "5"}));
+    EXPECT_EQ(run({"SINTERSTORE", "c", "n", "a"}), ":2\r\n");
+    EXPECT_EQ(members("c"), (std::set<std::string>{"2", "3"}));
+
+    const char *wrongtype = "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n";
+    run({"SET", "s", "v"});
+    EXPECT_EQ(run({"SADD", "s", "v"}), wrongtype);
+    EXPECT_EQ(run({"SINTER", "a", "s"}), wrongtype);
+    EXPECT_EQ(run({"SUNIONSTORE", "a", "missing", "s"}), wrongtype);
+    EXPECT_EQ(run({"SCARD", "a"}), ":2\r\n");
+    EXPECT_EQ(run({"GET", "a"}), wrongtype);
+    EXPECT_EQ(run({"DEL", "a", "c", "n"}), ":3\r\n");
+
+    // Every byte the sets held has been given back.
+    tr::KVStore strings;
+    strings.set("s", "v");
+    EXPECT_EQ(db.used_memory(), strings.used_memory());
+}
+
+TEST(Commands, SortedSetCommandsAndWrongType)
+{
+    tr::KVStore db;
+    tr::ReplyBuffer out;
+    auto run = [&](std::vector<std::string_view> args)
+    {
+        tr::dispatch_command(db, args, out);
+        return drain(out);
+    };
+    EXPECT_EQ(run({"ZADD", "board", "10", "alice", "20", "bob", "15", "carol"}), ":3\r\n");
+    EXPECT_EQ(run({"ZADD", "board", "CH", "20", "bob", "25", "alice", "1.5", "dave"}), ":2\r\n");
+    EXPECT_EQ(run({"ZCARD", "board"}), ":4\r\n");
+    EXPECT_EQ(run({"ZSCORE", "board", "dave"}), "$3\r\n1.5\r\n");
+    EXPECT_EQ(run({"ZSCORE", "board", "nobody"}), "$-1\r\n");
+    EXPECT_EQ(run({"ZRANK", "board", "alice"}), ":3\r\n");
+    EXPECT_EQ(run({"ZREVRANK", "board", "alice"}), ":0\r\n");
+    EXPECT_EQ(run({"ZRANK", "board", "nobody"}), "$-1\r\n");
+    EXPECT_EQ(run({"ZRANGE", "board", "0", "1"}), "*2\r\n$4\r\ndave\r\n$5\r\ncarol\r\n");
+    EXPECT_EQ(run({"ZRANGE", "board", "0", "0", "REV", "WITHSCORES"}), "*2\r\n$5\r\nalice\r\n$2\r\n25\r\n");
+    EXPECT_EQ(run({"ZRANGEBYSCORE", "board", "(15", "+inf"}), "*2\r\n$3\r\nbob\r\n$5\r\nalice\r\n");
+    EXPECT_EQ(run({"ZRANGEBYSCORE", "board", "-inf", "inf", "LIMIT", "1", "2"}),
+              "*2\r\n$5\r\ncarol\r\n$3\r\nbob\r\n");
+    EXPECT_EQ(run({"ZRANGE", "board", "20", "(15", "BYSCORE", "REV"}), "*1\r\n$3\r\nbob\r\n");
+    EXPECT_EQ(run({"ZRANGE", "board", "0", "-1", "LIMIT", "0", "1"}),
+              "-ERR syntax error, LIMIT is only supported in combination with BYSCORE\r\n");
+    EXPECT_EQ(run({"ZRANGEBYSCORE", "board", "low", "high"}), "-ERR min or max is not a float\r\n");
+
+    EXPECT_EQ(run({"ZINCRBY", "board", "-5", "alice"}), "$2\r\n20\r\n");
+    EXPECT_EQ(run({"ZADD", "board", "XX", "INCR", "1", "nobody"}), "$-1\r\n");
+    EXPECT_EQ(run({"ZADD", "board", "GT", "5", "alice"}), ":0\r\n");
+    EXPECT_EQ(run({"ZSCORE", "board", "alice"}), "$2\r\n20\r\n");
+    EXPECT_EQ(run({"ZADD", "board", "NX", "XX", "1", "x"}), "-ERR XX and NX options at the same time are not compatible\r\n");
+    EXPECT_EQ(run({"ZADD", "board", "1", "x", "2"}), "-ERR syntax error\r\n");
+    EXPECT_EQ(run({"ZADD", "board", "nan", "x"}), "-ERR value is not a valid float\r\n");
+    EXPECT_EQ(run({"ZADD", "inf", "inf", "x"}), ":1\r\n");
+    EXPECT_EQ(run({"ZINCRBY", "inf", "-inf", "x"}), "-ERR resulting score is not a number (NaN)\r\n");
+    EXPECT_EQ(run({"ZSCORE", "inf", "x"}), "$3\r\ninf\r\n");
+
+    // Past zset-max-listpack-entries the same commands run on the index.
+    db.set_zset_limits({.max_entries = 2});
+    EXPECT_EQ(run({"ZADD", "big", "3", "c", "1", "a", "2", "b"}), ":3\r\n");
+    EXPECT_EQ(run({"ZRANGE", "big", "-2", "-1", "WITHSCORES"}), "*4\r\n$1\r\nb\r\n$1\r\n2\r\n$1\r\nc\r\n$1\r\n3\r\n");
+    EXPECT_EQ(run({"ZINCRBY", "big", "5", "a"}), "$1\r\n6\r\n");
+    EXPECT_EQ(run({"ZRANK", "big", "a"}), ":2\r\n");
+    EXPECT_EQ(run({"ZREM", "big", "a", "b", "zz"}), ":2\r\n");
+    EXPECT_EQ(run({"ZREM", "big", "c"}), ":1\r\n");
+    EXPECT_EQ(run({"EXISTS", "big"}), ":0\r\n");
+
+    const char *wrongtype = "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n";
+    run({"SET", "s", "v"});
+    EXPECT_EQ(run({"ZADD", "s", "1", "v"}), wrongtype);
+    EXPECT_EQ(run({"ZRANGE", "s", "0", "-1"}), wrongtype);
+    EXPECT_EQ(run({"GET", "board"}), wrongtype);
+    EXPECT_EQ(run({"DEL", "board", "inf"}), ":2\r\n");
+
+    // Every byte the sorted sets held has been given back.
+    tr::KVStore strings;
+    strings.set("s", "v");
+    EXPECT_EQ(db.used_memory(), strings.used_memory());
+}
+
+TEST(Commands, SetOptionsPexpireAndGetex)
+{
+    tr::KVStore db;
+    db.set_clock(std::chrono::steady_clock::now());
+    tr::ReplyBuffer out;
+    auto run = [&](std::vector<std::string_view> args)
+    {
+        tr::dispatch_command(db, args, out);
+        return drain(out);
+    };
+    EXPECT_EQ(run({"SET", "k", "v", "px", "2500", "NX"}), "+OK\r\n");
+    EXPECT_EQ(run({"PTTL", "k"}), ":2500\r\n");
+    EXPECT_EQ(run({"SET", "k", "w", "NX"}), "$-1\r\n");
+    EXPECT_EQ(run({"SET", "k", "w", "XX", "KEEPTTL"}), "+OK\r\n");
+    EXPECT_EQ(run({"TTL", "k"}), ":2\r\n");
+    EXPECT_EQ(run({"SET", "k", "w", "NX", "XX"}), "-ERR syntax error\r\n");
+    EXPECT_EQ(run({"SET", "k", "w", "EX", "1", "KEEPTTL"}), "-ERR syntax error\r\n");
+    EXPECT_EQ(run({"SET", "k", "w", "EX"}), "-ERR syntax error\r\n");
+    EXPECT_EQ(run({"SET", "k", "w", "EX", "0"}), "-ERR invalid expire time in 'set' command\r\n");
+    EXPECT_EQ(run({"SET", "k", "w", "EX", "9223372036854775807"}), "-ERR invalid expire time in 'set' command\r\n");
+
+    EXPECT_EQ(run({"GETEX", "k", "PERSIST"}), "$1\r\nw\r\n");
+    EXPECT_EQ(run({"PTTL", "k"}), ":-1\r\n");
+    EXPECT_EQ(run({"GETEX", "k", "EX", "7"}), "$1\r\nw\r\n");
+    EXPECT_EQ(run({"PTTL", "k"}), ":7000\r\n");
+    EXPECT_EQ(run({"GETEX", "k", "PX", "-1"}), "-ERR invalid expire time in 'getex' command\r\n");
+    EXPECT_EQ(run({"GETEX", "k", "KEEPTTL"}), "-ERR syntax error\r\n");
+    EXPECT_EQ(run({"GETEX", "missing", "EX", "7"}), "$-1\r\n");
+    EXPECT_EQ(run({"PEXPIRE", "k", "0"}), ":1\r\n");
+    EXPECT_EQ(run({"PTTL", "k"}), ":-2\r\n");
+}
+
+TEST(KVStoreEviction, AccountsBytesAndRefusesWritesUnderNoEviction)
+{
+    tr::KVStore db;
+    EXPECT_EQ(db.used_memory(), 0u);
+    db.set("small", "v");
+    std::size_t one = db.used_memory();
+    db.set("big", std::string(4096, 'x'));
+    EXPECT_GE(db.used_memory(), 2 * one + 4096);
+    db.del("big");
+    EXPECT_EQ(db.used_memory(), one);
+
+    db.set_maxmemory(one, tr::EvictionPolicy::NoEviction);
+    tr::ReplyBuffer out;
+    std::vector<std::string_view> set = {"SET", "k", "v"};
+    std::vector<std::string_view> get = {"GET", "small"};
+    tr::dispatch_command(db, set, out); // at the limit, not over it
+    tr::dispatch_command(db, set, out);
+    tr::dispatch_command(db, get, out);
+    EXPECT_EQ(drain(out), "+OK\r\n-OOM command not allowed when used memory > 'maxmemory'.\r\n$1\r\nv\r\n");
+    EXPECT_EQ(db.evicted_keys(), 0u);
+}
+
+TEST(Commands, InfoReportsMemoryAndKeyspace)
+{
+    tr::KVStore db;
+    db.set("k", std::string(1000, 'v'));
+    db.set("n", "42");
+    db.expire("n", 100);
+    tr::ReplyBuffer out;
+    std::vector<std::string_view> info = {"INFO"};
+    tr::dispatch_command(db, info, out);
+    std::string reply = drain(out);
+    EXPECT_NE(reply.find("used_memory:" + std::to_string(db.used_memory()) + "\r\n"), std::string::npos);
+    EXPECT_NE(reply.find("slab_used_bytes:"), std::string::npos);
+    EXPECT_NE(reply.find("maxmemory_policy:noeviction\r\n"), std::string::npos);
+    EXPECT_NE(reply.find("db0:keys=2,expires=1\r\n"), std::string::npos);
+
+    std::vector<std::string_view> stats = {"info", "Stats"};
+    tr::dispatch_command(db, stats, out);
+    reply = drain(out);
+    EXPECT_EQ(reply.find("# Memory"), std::string::npos);
+    EXPECT_NE(reply.find("# Stats\r\nexpired_keys:0\r\nevicted_keys:0\r\n"), std::string::npos);
+}
+
+TEST(Commands, MergeInfoAddsUpShards)
+{
+    tr::KVStore a;
+    tr::KVStore b;
+    a.set("k", std::string(1000, 'v'));
+    a.set("n", "42");
+    a.expire("n", 100);
+    b.set("m", "1");
+    std::vector<std::string_view> info = {"INFO"};
+    std::vector<std::string> replies;
+    for (tr::KVStore *db : {&a, &b})
+    {
+        tr::ReplyBuffer out;
+        tr::dispatch_command(*db, info, out);
+        replies.push_back(drain(out));
+    }
+    tr::ReplyBuffer out;
+    tr::merge_info(replies, out);
+    std::string reply = drain(out);
+    EXPECT_NE(reply.find("# Memory\r\nused_memory:" + std::to_string(a.used_memory() + b.used_memory()) + "\r\n"),
+              std::string::npos);
+    EXPECT_NE(reply.find("maxmemory_policy:noeviction\r\n"), std::string::npos);
+    EXPECT_NE(reply.find("\r\n\r\n# Keyspace\r\ndb0:keys=3,expires=1\r\n"), std::string::npos);
+    EXPECT_EQ(reply.substr(0, 1), "$");
+
+    replies[1] = "-ERR no\r\n";
+    tr::merge_info(replies, out);
+    EXPECT_EQ(drain(out), "-ERR no\r\n");
+}
+
+TEST(KVStoreEviction, PoliciesPickTheRightKeys)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto key = [](const char *prefix, int i) { return prefix + std::to_string(i); };
+
+    // allkeys-lru: keys read after the clock moved on survive the cold ones.
+    tr::KVStore lru;
+    lru.set_maxmemory(0, tr::EvictionPolicy::AllKeysLru);
+    for (int i = 0; i < 1000; ++i)
+    {
+        lru.set(key("cold:", i), "v");
+    }
+    lru.tick(start + std::chrono::seconds(100));
+    for (int i = 0; i < 1000; i += 10)
+    {
+        lru.get(key("cold:", i));
+    }
+    lru.set_maxmemory(lru.used_memory(), tr::EvictionPolicy::AllKeysLru);
+    for (int i = 0; i < 500; ++i)
+    {
+        lru.set(key("new:", i), "v");
+        ASSERT_TRUE(lru.evict());
+    }
+    EXPECT_EQ(lru.size(), 1000u);
+    int hot = 0;
+    for (int i = 0; i < 1000; i += 10)
+    {
+        hot += lru.exists({key("cold:", i)});
+    }
+    EXPECT_GE(hot, 95);
+
+    // allkeys-lfu: frequently read keys outlive keys read once.
+    tr::KVStore lfu;
+    lfu.set_maxmemory(0, tr::EvictionPolicy::AllKeysLfu);
+    for (int i = 0; i < 1000; ++i)
+    {
+        lfu.set(key("k:", i), "v");
+    }
+    for (int round = 0; round < 200; ++round)
+    {
+        for (int i = 0; i < 1000; i += 10)
+        {
+            lfu.get(key("k:", i));
+        }
+    }
+    lfu.set_maxmemory(lfu.used_memory(), tr::EvictionPolicy::AllKeysLfu);
+    for (int i = 0; i < 500; ++i)
+    {
+        lfu.set(key("new:", i), "v");
+        ASSERT_TRUE(lfu.evict());
+    }
+    int frequent = 0;
+    for (int i = 0; i < 1000; i += 10)
+    {
+        frequent += lfu.exists({key("k:", i)});
+    }
+    EXPECT_GE(frequent, 95);
+
+    // volatile-ttl: only keys with a deadline go, the soonest first; with
+    // none left, writes are refused.
+    tr::KVStore ttl;
+    ttl.set("persistent", "v");
+    ttl.set("later", "v");
+    ttl.expire("later", 1000);
+    ttl.set("sooner", "v");
+    ttl.expire("sooner", 10);
+    ttl.set_maxmemory(ttl.used_memory(), tr::EvictionPolicy::VolatileTtl);
+    ttl.set("new", "v");
+    EXPECT_TRUE(ttl.evict());
+    EXPECT_EQ(ttl.exists({"sooner"}), 0);
+    EXPECT_EQ(ttl.exists({"later"}), 1);
+    ttl.set("newer", "v");
+    EXPECT_TRUE(ttl.evict());
+    ttl.set("newest", "v");
+    EXPECT_FALSE(ttl.evict());
+    EXPECT_EQ(ttl.exists({"persistent", "new", "newer", "newest"}), 4);
+    EXPECT_EQ(ttl.evicted_keys(), 2u);
+}
+
+TEST(Server, OutputLimitsPauseSoftAndHard)
+{
+    tr::Connection conn;
+    conn.limits = tr::OutputLimits{100, 50, 10, 40};
+    auto t0 = std::chrono::steady_clock::now();
+
+    EXPECT_TRUE(tr::check_output_limits(conn, 45, t0));
+    EXPECT_TRUE(conn.paused);
+    EXPECT_TRUE(tr::check_output_limits(conn, 20, t0));
+    EXPECT_TRUE(conn.paused); // stays paused until fully drained
+    EXPECT_TRUE(tr::check_output_limits(conn, 0, t0));
+    EXPECT_FALSE(conn.paused);
+
+    EXPECT_TRUE(tr::check_output_limits(conn, 60, t0));
+    EXPECT_TRUE(tr::check_output_limits(conn, 60, t0 + std::chrono::seconds(9)));
+    EXPECT_FALSE(tr::check_output_limits(conn, 60, t0 + std::chrono::seconds(10)));
+
+    tr::Connection other;
+    other.limits = conn.limits;
+    EXPECT_FALSE(tr::check_output_limits(other, 101, t0));
+}
+
+TEST(Server, ExecuteStopsAtPauseThresholdAndKeepsTheRest)
+{
+    tr::KVStore db;
+    tr::Connection conn;
+    conn.limits.pause = 10;
+    std::string ping = "*1\r\n$4\r\nPING\r\n";
+    ASSERT_TRUE(tr::consume_input(conn, (ping + ping + ping).data(), ping.size() * 3));
+    ASSERT_EQ(conn.requests.size(), 3u);
+
+    EXPECT_TRUE(tr::execute_requests(conn, db));
+    EXPECT_EQ(drain(conn.out), "+PONG\r\n+PONG\r\n");
+    ASSERT_EQ(conn.requests.size(), 1u);
+
+    EXPECT_TRUE(tr::execute_requests(conn, db));
+    EXPECT_EQ(drain(conn.out), "+PONG\r\n");
+    EXPECT_TRUE(conn.requests.empty());
+    EXPECT_EQ(conn.in.base(), nullptr);
+}
+
+TEST(Server, BlockedRequestIsServedByAPushOrTimesOut)
+{
+    tr::KVStore db;
+    tr::BlockedClients blocked(db);
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<tr::Connection *> woken;
+
+    tr::Connection conn;
+    std::string blpop = "*3\r\n$5\r\nBLPOP\r\n$1\r\nq\r\n$1\r\n0\r\n";
+    std::string ping = "*1\r\n$4\r\nPING\r\n";
+    ASSERT_TRUE(tr::consume_input(conn, (blpop + ping).data(), blpop.size() + ping.size()));
+    EXPECT_TRUE(tr::execute_requests(conn, db, &blocked));
+    EXPECT_TRUE(conn.blocked());
+    EXPECT_TRUE(conn.out.empty());
+    ASSERT_EQ(conn.requests.size(), 2u); // the PING waits behind it
+
+    // A push to another key wakes nobody; one to q serves the client.
+    std::vector<std::string_view> other = {"other"};
+    db.rpush("w", other);
+    tr::wake_blocked(blocked, db, t0, woken);
+    EXPECT_TRUE(woken.empty());
+    std::vector<std::string_view> values = {"job1", "job2"};
+    db.rpush("q", values);
+    tr::wake_blocked(blocked, db, t0, woken);
+    ASSERT_EQ(woken.size(), 1u);
+    EXPECT_FALSE(conn.blocked());
+    EXPECT_TRUE(blocked.empty());
+    EXPECT_TRUE(tr::execute_requests(conn, db, &blocked));
+    EXPECT_EQ(drain(conn.out), "*2\r\n$1\r\nq\r\n$4\r\njob1\r\n+PONG\r\n");
+    EXPECT_EQ(db.llen("q"), 1u);
+
+    // With a timeout it gives up with a null array once the time has come.
+    woken.clear();
+    db.del("q");
+    tr::Connection late;
+    std::string brpop = "*3\r\n$5\r\nBRPOP\r\n$1\r\nq\r\n$3\r\n0.5\r\n";
+    ASSERT_TRUE(tr::consume_input(late, brpop.data(), brpop.size()));
+    EXPECT_TRUE(tr::execute_requests(late, db, &blocked));
+    ASSERT_TRUE(late.blocked());
+    EXPECT_LE(blocked.next_deadline(), std::chrono::steady_clock::now() + std::chrono::milliseconds(500));
+    tr::wake_blocked(blocked, db, t0, woken);
+    EXPECT_TRUE(woken.empty());
+    tr::wake_blocked(blocked, db, blocked.next_deadline(), woken);
+    ASSERT_EQ(woken.size(), 1u);
+    EXPECT_EQ(drain(late.out), "*-1\r\n");
+    EXPECT_TRUE(late.requests.empty());
+    EXPECT_TRUE(blocked.empty());
+
+    // A client that goes away is forgotten; the entry stays for the next.
+    tr::Connection gone;
+    ASSERT_TRUE(tr::consume_input(gone, blpop.data(), blpop.size()));
+    EXPECT_TRUE(tr::execute_requests(gone, db, &blocked));
+    blocked.unblock(gone);
+    db.rpush("q", values);
+    woken.clear();
+    tr::wake_blocked(blocked, db, t0, woken);
+    EXPECT_TRUE(woken.empty());
+    EXPECT_EQ(db.llen("q"), 2u);
+}
+
+TEST(SpscQueue, BoundedAndInOrderAcrossThreads)
+{
+    tr::SpscQueue<std::unique_ptr<int>> queue(4);
+    for (int i = 0; i < 4; ++i)
+    {
+        EXPECT_TRUE(queue.try_push(std::make_unique<int>(i)));
+    }
+    auto extra = std::make_unique<int>(4);
+    EXPECT_FALSE(queue.try_push(std::move(extra)));
+    EXPECT_NE(extra, nullptr); // left alone when full
+    std::unique_ptr<int> got;
+    for (int i = 0; i < 4; ++i)
+    {
+        ASSERT_TRUE(queue.try_pop(got));
+        EXPECT_EQ(*got, i);
+    }
+    EXPECT_FALSE(queue.try_pop(got));
+    EXPECT_TRUE(queue.empty());
+
+    constexpr int N = 100000;
+    std::thread producer([&]
+                         {
+        for (int i = 0; i < N; ++i)
+        {
+            auto value = std::make_unique<int>(i);
+            while (!queue.try_push(std::move(value)))
+            {
+                std::this_thread::yield();
+            }
+        } });
+    for (int i = 0; i < N; ++i)
+    {
+        while (!queue.try_pop(got))
+        {
+            std::this_thread::yield();
+        }
+        ASSERT_EQ(*got, i);
+    }
+    producer.join();
+}
+
+static std::atomic<int> reclaimed{0};
+
+TEST(Epoch, RetiredObjectsOutliveEveryReaderPinnedBeforeThem)
+{
+    reclaimed = 0;
+    auto count = [](void *)
+    { reclaimed.fetch_add(1); };
+    std::atomic<bool> pinned{false};
+    std::atomic<bool> release{false};
+    std::thread reader([&]
+                       {
+        tr::Epoch::Guard guard;
+        pinned = true;
+        while (!release)
+        {
+            std::this_thread::yield();
+        } });
+    while (!pinned)
+    {
+        std::this_thread::yield();
+    }
+    int before = reclaimed;
+    tr::Epoch::retire(nullptr, count);
+    for (int i = 0; i < 8; ++i)
+    {
+        tr::Epoch::collect();
+    }
+    EXPECT_EQ(reclaimed, before); // the reader may still hold it
+
+    release = true;
+    reader.join();
+    for (int i = 0; i < 8; ++i)
+    {
+        tr::Epoch::collect();
+    }
+    EXPECT_EQ(reclaimed, before + 1);
+}
+
+TEST(ConcurrentKVStore, MatchesKVStoreSemantics)
+{
+    tr::ConcurrentKVStore store;
+    store.set("k", "v");
+    EXPECT_EQ(store.get("k"), "v");
+    EXPECT_EQ(store.get("missing"), std::nullopt);
+    EXPECT_EQ(store.ttl("k"), -1);
+    EXPECT_EQ(store.ttl("missing"), -2);
+    EXPECT_TRUE(store.expire("k", 100));
+    EXPECT_GE(store.ttl("k"), 99);
+    EXPECT_EQ(store.incrby("k", 1), std::nullopt);
+    EXPECT_EQ(store.incrby("n", 5), 5);
+    EXPECT_EQ(store.incrby("n", -7), -2);
+    EXPECT_EQ(store.incrby("n", LLONG_MIN), std::nullopt);
+    store.set("padded", "007");
+    EXPECT_EQ(store.incrby("padded", 1), std::nullopt);
+    EXPECT_EQ(store.exists({"k", "n", "missing", "k"}), 3);
+    EXPECT_TRUE(store.del("k"));
+    EXPECT_FALSE(store.del("k"));
+    EXPECT_TRUE(store.expire("n", 0)); // deletes
+    EXPECT_EQ(store.get("n"), std::nullopt);
+
+    for (int i = 0; i < 10000; ++i)
+    {
+        store.set("key:" + std::to_string(i), std::to_string(i));
+    }
+    EXPECT_EQ(store.size(), 10001u);
+    for (int i = 0; i < 10000; i += 97)
+    {
+        EXPECT_EQ(store.get("key:" + std::to_string(i)), std::to_string(i));
+    }
+    EXPECT_EQ(store.purge_expired(), 0u);
+}
+
+TEST(ConcurrentKVStore, ReadersSeeWholeValuesWhileWritersRun)
+{
+    tr::ConcurrentKVStore store;
+    constexpr int KEYS = 512;
+    for (int i = 0; i < KEYS; ++i)
+    {
+        store.set("k" + std::to_string(i), std::string(8, 'a'));
+    }
+    std::atomic<bool> done{false};
+    std::atomic<int> torn{0};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; ++r)
+    {
+        readers.emplace_back([&, r]
+                             {
+            std::minstd_rand rng(static_cast<unsigned>(r));
+            while (!done)
+            {
+                std::string key = "k" + std::to_string(rng() % KEYS);
+                bool found = store.read(key, [&](std::string_view v)
+                                        {
+                    // Every value is one letter repeated.
+                    if (v.empty() || v.find_first_not_of(v[0]) != std::string_view::npos)
+                    {
+                        ++torn;
+                    } });
+                if (!found)
+                {
+                    ++torn;
+                }
+            } });
+    }
+    std::minstd_rand rng(42);
+    for (int i = 0; i < 100000; ++i)
+    {
+        char letter = static_cast<char>('a' + i % 26);
+        std::size_t len = 8 + rng() % 64;
+        store.set("k" + std::to_string(rng() % KEYS), std::string(len, letter));
+        if (i % 1000 == 0)
+        {
+            // New keys make the stripes grow under the readers.
+            store.set("extra" + std::to_string(i), "x");
+        }
+    }
+    done = true;
+    for (std::thread &t : readers)
+    {
+        t.join();
+    }
+    EXPECT_EQ(torn, 0);
+    EXPECT_EQ(store.size(), static_cast<std::size_t>(KEYS) + 100);
+}
+
+// Loopback server tests: each runs tinyredis_server in a child process on a
+// free port, so a crash or sanitizer abort there shows up as a dropped
+// connection.
+
+static uint16_t free_port()
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    ::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    ::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len);
+    ::close(fd);
+    return ntohs(addr.sin_port);
+}
+
+class ServerProcess
+{
+public:
+    explicit ServerProcess(std::vector<std::string> flags) : port(free_port())
+    {
+        flags.insert(flags.begin(), {TINYREDIS_SERVER, "--port", std::to_string(port)});
+        std::vector<char *> argv;
+        for (std::string &flag : flags)
+        {
+            argv.push_back(flag.data());
+        }
+        argv.push_back(nullptr);
+        pid = ::fork();
+        if (pid == 0)
+        {
+            // Keep the server's chatter out of the test log.
+            int null = ::open("/dev/null", O_WRONLY);
+            ::dup2(null, STDOUT_FILENO);
+            ::execv(argv[0], argv.data());
+            ::_exit(127);
+        }
+    }
+
+    ~ServerProcess()
+    {
+        ::kill(pid, SIGKILL);
+        ::waitpid(pid, nullptr, 0);
+    }
+
+    bool running() { return ::waitpid(pid, nullptr, WNOHANG) == 0; }
+
+    // A connected socket, or -1 once the server has given up starting.
+    int connect()
+    {
+        while (running())
+        {
+            int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0)
+            {
+                // A reply shorter than expected fails the test, not hangs it.
+                timeval timeout{10, 0};
+                ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                return fd;
+            }
+            ::close(fd);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return -1;
+    }
+
+private:
+    uint16_t port;
+    pid_t pid = -1;
+};
+
+static std::string resp_command(std::initializer_list<std::string_view> args)
+{
+    std::string out = "*" + std::to_string(args.size()) + "\r\n";
+    for (std::string_view a : args)
+    {
+        out += "$" + std::to_string(a.size()) + "\r\n";
+        out += a;
+        out += "\r\n";
+    }
+    return out;
+}
+
+static bool send_all(int fd, std::string_view bytes)
+{
+    while (!bytes.empty())
+    {
+        ssize_t n = ::send(fd, bytes.data(), bytes.size(), MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            return false;
+        }
+        bytes.remove_prefix(static_cast<std::size_t>(n));
+    }
+    return true;
+}
+
+// Reads exactly `n` bytes, or fewer if the connection ends first.
+static std::string receive(int fd, std::size_t n)
+{
+    std::string bytes(n, '\0');
+    std::size_t got = 0;
+    while (got < n)
+    {
+        ssize_t r = ::read(fd, bytes.data() + got, n - got);
+        if (r <= 0)
+        {
+            break;
+        }
+        got += static_cast<std::size_t>(r);
+    }
+    bytes.resize(got);
+    return bytes;
+}
+
+// Several clients at once pipeline commands whose replies run to many more
+// segments than one writev takes, and must get every byte back in order,
+// while the server reads, flushes and pauses them on whatever threads or
+// backend it is configured with. An inline request renders such a reply.
+static void serve_pipelined_large_replies(std::vector<std::string> flags)
+{
+    constexpr int ELEMENTS = 2 * tr::ReplyBuffer::MAX_IOV;
+    constexpr int CLIENTS = 8;
+    constexpr int ROUNDS = 6;
+    ServerProcess server(std::move(flags));
+    int setup = server.connect();
+    if (setup < 0)
+    {
+        GTEST_SKIP() << "server did not start (io_uring unavailable?)";
+    }
+    std::string push = "*" + std::to_string(ELEMENTS + 2) + "\r\n$5\r\nRPUSH\r\n$3\r\nbig\r\n";
+    std::string lrange_reply = "*" + std::to_string(ELEMENTS) + "\r\n";
+    std::string rendered;
+    for (int i = 0; i < ELEMENTS; ++i)
+    {
+        std::string bulk = "$" + std::to_string(tr::ReplyBuffer::LARGE_BULK + 100) + "\r\n" +
+                           std::string(tr::ReplyBuffer::LARGE_BULK + 100, static_cast<char>('a' + i % 26)) + "\r\n";
+        push += bulk;
+        lrange_reply += bulk;
+        rendered += (i > 0 ? "\n" : "") + std::to_string(i + 1) + ") " +
+                    std::string(tr::ReplyBuffer::LARGE_BULK + 100, static_cast<char>('a' + i % 26));
+    }
+    std::string pushed = ":" + std::to_string(ELEMENTS) + "\r\n";
+    ASSERT_TRUE(send_all(setup, push));
+    ASSERT_EQ(receive(setup, pushed.size()), pushed);
+
+    std::atomic<int> mismatches{0};
+    std::vector<std::thread> clients;
+    for (int c = 0; c < CLIENTS; ++c)
+    {
+        clients.emplace_back([&, c]
+                             {
+            int fd = server.connect();
+            std::string key = "own" + std::to_string(c);
+            std::string value(200, static_cast<char>('A' + c));
+            std::string round = resp_command({"LRANGE", "big", "0", "-1"});
+            std::string expected = lrange_reply;
+            // More requests than one input chunk holds, so reads stop with
+            // input left over while earlier replies are still unsent.
+            for (int i = 0; i < 1000; ++i)
+            {
+                round += resp_command({"GET", key});
+                expected += "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+            }
+            round += resp_command({"PING"});
+            expected += "+PONG\r\n";
+            if (fd < 0 || !send_all(fd, resp_command({"SET", key, value})) || receive(fd, 5) != "+OK\r\n")
+            {
+                ++mismatches;
+                return;
+            }
+            // All rounds go out at once and are read back slowly, so the
+            // server keeps meeting a full socket.
+            std::thread sender([&]
+                               {
+                for (int r = 0; r < ROUNDS && send_all(fd, round); ++r)
+                {
+                } });
+            for (int r = 0; r < ROUNDS; ++r)
+            {
+                std::string got;
+                while (got.size() < expected.size())
+                {
+                    std::string part = receive(fd, std::min<std::size_t>(64 * 1024, expected.size() - got.size()));
+                    if (part.empty())
+                    {
+                        break;
+                    }
+                    got += part;
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                }
+                if (got != expected)
+                {
+                    ++mismatches;
+                    ::shutdown(fd, SHUT_RDWR);
+                    break;
+                }
+            }
+            sender.join();
+            ::close(fd); });
+    }
+    std::string inline_expected = rendered + "\n+PONG\r\n";
+    EXPECT_TRUE(send_all(setup, "LRANGE big 0 -1\r\n" + resp_command({"PING"})));
+    EXPECT_EQ(receive(setup, inline_expected.size()), inline_expected);
+    for (std::thread &t : clients)
+    {
+        t.join();
+    }
+    EXPECT_EQ(mismatches, 0);
+    ::close(setup);
+    EXPECT_TRUE(server.running());
+}
+
+// A client that never reads is dropped at the hard output limit, mid-send,
+// and the server carries on serving everyone else.
+static void drop_client_over_output_limit(std::vector<std::string> flags)
+{
+    // A hard limit below the 1 MB pause threshold, so the client is dropped
+    // rather than paused.
+    flags.insert(flags.end(), {"--client-output-buffer-limit", "262144 0 0"});
+    ServerProcess server(std::move(flags));
+    int fd = server.connect();
+    if (fd < 0)
+    {
+        GTEST_SKIP() << "server did not start (io_uring unavailable?)";
+    }
+    // Requests trickle in while the client reads nothing, so once the
+    // socket is full a send is still in flight when the limit is crossed.
+    // Without NODELAY the small GETs would be batched behind delayed ACKs.
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    std::string value(100 * 1024, 'x');
+    ASSERT_TRUE(send_all(fd, resp_command({"SET", "big", value})));
+    ASSERT_EQ(receive(fd, 5), "+OK\r\n");
+    std::string get = resp_command({"GET", "big"});
+    int sent = 0;
+    for (; sent < 1000 && send_all(fd, get); ++sent)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    std::string drained = receive(fd, sent * (value.size() + 16));
+    EXPECT_LT(drained.size(), sent * value.size());
+    ::close(fd);
+
+    int other = server.connect();
+    ASSERT_GE(other, 0);
+    EXPECT_TRUE(send_all(other, resp_command({"PING"})));
+    EXPECT_EQ(receive(other, 7), "+PONG\r\n");
+    ::close(other);
+    EXPECT_TRUE(server.running());
+}
+
+// Keys sharing a {hash tag} land on one shard, so multi-key commands over
+// them work with --shards.
+TEST(Loopback, ShardsRunMultiKeyCommandsOnHashTaggedKeys)
+{
+    ServerProcess server({"--shards", "4"});
+    int fd = server.connect();
+    ASSERT_GE(fd, 0);
+    ASSERT_TRUE(send_all(fd, resp_command({"MSETNX", "{u}a", "1", "{u}b", "2", "{u}c", "3", "{u}d", "4", "{u}e", "5",
+                                           "{u}f", "6", "{u}g", "7", "{u}h", "8"})));
+    EXPECT_EQ(receive(fd, 4), ":1\r\n");
+
+    ASSERT_TRUE(send_all(fd, resp_command({"DEL", "{u}a", "{u}b"}) + resp_command({"SADD", "{u}a", "x", "y"}) +
+                                 resp_command({"SADD", "{u}b", "y", "z"}) + resp_command({"SINTER", "{u}a", "{u}b"})));
+    std::string expected = ":2\r\n:2\r\n:2\r\n*1\r\n$1\r\ny\r\n";
+    EXPECT_EQ(receive(fd, expected.size()), expected);
+    ::close(fd);
+}
+
+// MGET and MSET over keys on every shard are split per shard; MGET's values
+// come back in the order of its keys. MSETNX must stay atomic, so it is not.
+TEST(Loopback, ShardsSplitMgetAndMsetAcrossShards)
+{
+    ServerProcess server({"--shards", "4"});
+    int fd = server.connect();
+    ASSERT_GE(fd, 0);
+    auto command = [](const std::vector<std::string> &args)
+    {
+        std::string out = "*" + std::to_string(args.size()) + "\r\n";
+        for (const std::string &a : args)
+        {
+            out += "$" + std::to_string(a.size()) + "\r\n" + a + "\r\n";
+        }
+        return out;
+    };
+    std::vector<std::string> mset = {"MSET"};
+    std::vector<std::string> mget = {"MGET"};
+    std::string expected;
+    for (int i = 0; i < 50; ++i)
+    {
+        std::string key = "key:" + std::to_string(i);
+        std::string value = i == 7 ? std::string(tr::ReplyBuffer::LARGE_BULK + 10, 'v') : "value:" + std::to_string(i);
+        mset.insert(mset.end(), {key, value});
+        mget.insert(mget.end(), {key, "missing:" + std::to_string(i)});
+        expected += "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n$-1\r\n";
+    }
+    expected = "*100\r\n" + expected;
+
+    ASSERT_TRUE(send_all(fd, command(mset) + command(mget) + command({"MSETNX", "key:1", "x", "key:2", "y"}) +
+                                 command({"MGET", "key:3", "key:4"}) + "MGET key:5 key:6\r\n"));
+    EXPECT_EQ(receive(fd, 5), "+OK\r\n");
+    EXPECT_EQ(receive(fd, expected.size()), expected);
+    std::string crossslot = "-CROSSSLOT Keys in request don't hash to the same shard\r\n";
+    std::string small = "*2\r\n$7\r\nvalue:3\r\n$7\r\nvalue:4\r\n";
+    std::string rendered = "1) value:5\n2) value:6\n";
+    EXPECT_EQ(receive(fd, crossslot.size() + small.size() + rendered.size()), crossslot + small + rendered);
+    ::close(fd);
+}
+
+// INFO describes the whole server, whichever shard the connection is on.
+TEST(Loopback, ShardsAnswerInfoForEveryShard)
+{
+    ServerProcess server({"--shards", "4"});
+    int fd = server.connect();
+    ASSERT_GE(fd, 0);
+    std::string mset = "*41\r\n$4\r\nMSET\r\n";
+    for (int i = 0; i < 20; ++i)
+    {
+        std::string key = "key:" + std::to_string(i);
+        mset += "$" + std::to_string(key.size()) + "\r\n" + key + "\r\n$1\r\nv\r\n";
+    }
+    ASSERT_TRUE(send_all(fd, mset));
+    ASSERT_EQ(receive(fd, 5), "+OK\r\n");
+    ::close(fd);
+
+    std::string expected = "# Keyspace\r\ndb0:keys=20,expires=0\r\n";
+    expected = "$" + std::to_string(expected.size()) + "\r\n" + expected + "\r\n";
+    for (int i = 0; i < 8; ++i)
+    {
+        int other = server.connect();
+        ASSERT_GE(other, 0);
+        ASSERT_TRUE(send_all(other, resp_command({"INFO", "keyspace"})));
+        EXPECT_EQ(receive(other, expected.size()), expected);
+        ::close(other);
+    }
+}
+
+TEST(Loopback, IoThreadsServePipelinedLargeReplies)
+{
+    serve_pipelined_large_replies({"--io-threads", "4"});
+}
+
+TEST(Loopback, UringServesPipelinedLargeReplies)
+{
+    serve_pipelined_large_replies({"--backend", "uring"});
+}
+
+TEST(Loopback, ShardsServePipelinedLargeReplies)
+{
+    serve_pipelined_large_replies({"--shards", "2"});
+}
+
+TEST(Loopback, IoThreadsDropAClientOverTheOutputLimit)
+{
+    drop_client_over_output_limit({"--io-threads", "4"});
+}
+
+TEST(Loopback, UringDropsAClientOverTheOutputLimitMidSend)
+{
+    drop_client_over_output_limit({"--backend", "uring"});
+}